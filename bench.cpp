@@ -0,0 +1,306 @@
+// Microbenchmarks of the server's hot paths, one layer at a time, on Google
+// Benchmark: cache segment get/put/evict by thread count and hit ratio,
+// JSON versus raw reply building and body unwrapping, value compression,
+// and PGStore statements against a local Postgres. `make bench` runs them
+// and writes bench-<commit>.json for comparing two commits.
+//
+// The PGStore benchmarks connect with $KV_BENCH_PG (a libpq conninfo
+// string), else the PG* environment variables, and are skipped when that
+// fails. They upsert and delete rows whose keys start with "__bench:" in
+// kv_store, and remove them on exit.
+
+#include <benchmark/benchmark.h>
+
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "clock_cache.h"
+#include "compact_cache.h"
+#include "json.hpp"
+#include "lru_cache.h"
+#include "pg_store.h"
+#include "value_codec.h"
+
+using json = nlohmann::json;
+
+static constexpr size_t kCacheKeys = 10000;
+
+static std::string bench_key(size_t i) { return "key-" + std::to_string(i); }
+
+// Printable, with the occasional character JSON has to escape
+static std::string bench_value(size_t n, uint64_t seed) {
+    static const char kChars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 \"\\/";
+    std::mt19937_64 rng(seed);
+    std::string v(n, 'x');
+    for (auto &c : v) c = kChars[rng() % (sizeof(kChars) - 1)];
+    return v;
+}
+
+// ---- cache segments ----
+//
+// One shared segment per run, built by Setup before the threads start. Keys
+// are drawn uniformly from kCacheKeys * 100 / hit_pct names, of which the
+// first kCacheKeys are cached, so about hit_pct% of gets hit.
+
+static std::unique_ptr<CacheShard> g_cache;
+static std::vector<std::string> g_cache_names;
+
+template <class Cache>
+static void fill_cache(size_t hit_pct) {
+    g_cache.reset(new Cache(kCacheKeys));
+    g_cache_names.clear();
+    for (size_t i = 0; i < kCacheKeys * 100 / hit_pct; i++) g_cache_names.push_back(bench_key(i));
+    CacheValue v = make_cache_value(bench_value(100, 1));
+    for (size_t i = 0; i < kCacheKeys; i++) g_cache->put(g_cache_names[i], v, 0);
+}
+
+// Arg: hit_pct
+template <class Cache>
+static void cache_setup(const benchmark::State &state) { fill_cache<Cache>(static_cast<size_t>(state.range(0))); }
+
+template <class Cache>
+static void cache_setup_full(const benchmark::State &) { fill_cache<Cache>(100); }
+
+static void cache_teardown(const benchmark::State &) {
+    g_cache.reset();
+    g_cache_names.clear();
+}
+
+template <class Cache>
+static void BM_CacheGet(benchmark::State &state) {
+    std::mt19937_64 rng(state.thread_index() + 1);
+    std::uniform_int_distribution<size_t> dist(0, g_cache_names.size() - 1);
+    CacheValue val;
+    int64_t hits = 0;
+    for (auto _ : state) {
+        hits += g_cache->get(g_cache_names[dist(rng)], val);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["hit_ratio"] = benchmark::Counter(static_cast<double>(hits) / state.iterations(),
+                                                     benchmark::Counter::kAvgThreads);
+}
+
+// Overwrites of cached keys: no eviction
+template <class Cache>
+static void BM_CachePut(benchmark::State &state) {
+    std::mt19937_64 rng(state.thread_index() + 1);
+    std::uniform_int_distribution<size_t> dist(0, kCacheKeys - 1);
+    CacheValue v = make_cache_value(bench_value(100, 2));
+    for (auto _ : state) {
+        g_cache->put(g_cache_names[dist(rng)], v, 0);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Inserts of new keys into a full segment: every put evicts one entry
+template <class Cache>
+static void BM_CacheEvict(benchmark::State &state) {
+    std::string key = "evict-" + std::to_string(state.thread_index()) + "-";
+    size_t prefix = key.size();
+    CacheValue v = make_cache_value(bench_value(100, 3));
+    uint64_t n = 0;
+    for (auto _ : state) {
+        key.resize(prefix);
+        key += std::to_string(n++);
+        g_cache->put(key, v, 0);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void cache_threads(benchmark::internal::Benchmark *b) {
+    b->Threads(1)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+}
+
+BENCHMARK_TEMPLATE(BM_CacheGet, LRUCache)->ArgName("hit_pct")->Arg(100)->Arg(90)->Arg(50)
+    ->Setup(cache_setup<LRUCache>)->Teardown(cache_teardown)->Apply(cache_threads);
+BENCHMARK_TEMPLATE(BM_CachePut, LRUCache)
+    ->Setup(cache_setup_full<LRUCache>)->Teardown(cache_teardown)->Apply(cache_threads);
+BENCHMARK_TEMPLATE(BM_CacheEvict, LRUCache)
+    ->Setup(cache_setup_full<LRUCache>)->Teardown(cache_teardown)->Apply(cache_threads);
+// the other policies, hits only, for comparison with LRU
+BENCHMARK_TEMPLATE(BM_CacheGet, ClockCache)->ArgName("hit_pct")->Arg(100)
+    ->Setup(cache_setup<ClockCache>)->Teardown(cache_teardown)->Apply(cache_threads);
+BENCHMARK_TEMPLATE(BM_CacheGet, CompactLRUCache)->ArgName("hit_pct")->Arg(100)
+    ->Setup(cache_setup<CompactLRUCache>)->Teardown(cache_teardown)->Apply(cache_threads);
+
+// ---- reply building and body parsing ----
+//
+// What a GET hit costs to turn into a response in each mode, and what a PUT
+// body costs to turn into the stored value. Range: value size in bytes.
+
+static void BM_ReplyJson(benchmark::State &state) {
+    CacheValue val = make_cache_value(bench_value(state.range(0), 4));
+    for (auto _ : state) {
+        httplib::Response res;
+        json j;
+        j["status"] = "ok";
+        j["value"] = *val;
+        res.set_content(j.dump() + "\n", "application/json");
+        benchmark::DoNotOptimize(res.body.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+// Includes pulling the bytes through the content provider, as httplib does
+// when it writes the response
+static void BM_ReplyRaw(benchmark::State &state) {
+    CacheValue val = make_cache_value(bench_value(state.range(0), 4));
+    std::string out;
+    out.reserve(state.range(0));
+    httplib::DataSink sink;
+    sink.write = [&out](const char *d, size_t n) { out.append(d, n); return true; };
+    for (auto _ : state) {
+        httplib::Response res;
+        send_raw(res, val);
+        out.clear();
+        // httplib's own writer reads these (nominally private) members
+        res.content_provider_(0, res.content_length_, sink);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+static void BM_BodyJson(benchmark::State &state) {
+    std::string body = json{{"value", bench_value(state.range(0), 5)}}.dump();
+    for (auto _ : state) {
+        std::string value;
+        json ttl;
+        benchmark::DoNotOptimize(unwrap_json_value(body, value, ttl));
+        benchmark::DoNotOptimize(value.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+// A raw body is stored as sent: one copy into the cache's value buffer
+static void BM_BodyRaw(benchmark::State &state) {
+    std::string body = bench_value(state.range(0), 5);
+    for (auto _ : state) {
+        CacheValue v = make_cache_value(body);
+        benchmark::DoNotOptimize(v.get());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_ReplyJson)->ArgName("bytes")->Arg(16)->Arg(256)->Arg(4096)->Arg(65536);
+BENCHMARK(BM_ReplyRaw)->ArgName("bytes")->Arg(16)->Arg(256)->Arg(4096)->Arg(65536);
+BENCHMARK(BM_BodyJson)->ArgName("bytes")->Arg(16)->Arg(256)->Arg(4096)->Arg(65536);
+BENCHMARK(BM_BodyRaw)->ArgName("bytes")->Arg(16)->Arg(256)->Arg(4096)->Arg(65536);
+
+// ---- value compression ----
+//
+// The stored-form envelope at zlib level 1. bench_value draws from 66
+// characters, so it compresses to about 3/4, like text. Range: value size.
+
+static void BM_Compress(benchmark::State &state) {
+    ValueCompressor codec(1);
+    std::string value = bench_value(state.range(0), 8);
+    std::string out;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(codec.encode(value, out));
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    state.counters["ratio"] = static_cast<double>(out.size()) / value.size();
+}
+
+static void BM_Decompress(benchmark::State &state) {
+    ValueCompressor codec(1);
+    std::string value = bench_value(state.range(0), 8);
+    std::string stored, tmp;
+    codec.encode(value, stored);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(codec.plain(stored, tmp)->data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_Compress)->ArgName("bytes")->Arg(4096)->Arg(65536)->Arg(4 << 20);
+BENCHMARK(BM_Decompress)->ArgName("bytes")->Arg(4096)->Arg(65536)->Arg(4 << 20);
+
+// ---- PGStore ----
+
+static constexpr size_t kStoreKeys = 1000;
+static constexpr size_t kStoreBatch = 100;
+
+static std::string store_key(size_t i) { return "__bench:" + std::to_string(i); }
+
+// Connected once, on first use, with kStoreKeys rows in place; the rows are
+// deleted when the program exits
+class BenchStore {
+public:
+    static PGStore* get() {
+        static BenchStore s;
+        return s.ok_ ? &s.db_ : nullptr;
+    }
+
+private:
+    BenchStore() {
+        db_.set_pool_size(8);
+        const char *conninfo = std::getenv("KV_BENCH_PG");
+        ok_ = (conninfo ? db_.connect(conninfo) : db_.connect_from_env()) && db_.ensure_table();
+        std::string v = bench_value(100, 6);
+        for (size_t i = 0; ok_ && i < kStoreKeys; i++) ok_ = db_.put(store_key(i), v);
+    }
+    ~BenchStore() {
+        if (!ok_) return;
+        std::vector<std::string> keys;
+        for (size_t i = 0; i < kStoreKeys; i++) keys.push_back(store_key(i));
+        db_.write_batch({}, keys);
+    }
+
+    PGStore db_;
+    bool ok_ = false;
+};
+
+static PGStore* store_or_skip(benchmark::State &state) {
+    PGStore *db = BenchStore::get();
+    if (!db) state.SkipWithError("no Postgres (set KV_BENCH_PG to a conninfo string)");
+    return db;
+}
+
+static void BM_StoreGet(benchmark::State &state) {
+    PGStore *db = store_or_skip(state);
+    if (!db) return;
+    std::mt19937_64 rng(state.thread_index() + 1);
+    std::uniform_int_distribution<size_t> dist(0, kStoreKeys - 1);
+    std::string value;
+    for (auto _ : state) {
+        if (!db->get(store_key(dist(rng)), value)) { state.SkipWithError("get failed"); break; }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_StorePut(benchmark::State &state) {
+    PGStore *db = store_or_skip(state);
+    if (!db) return;
+    std::mt19937_64 rng(state.thread_index() + 1);
+    std::uniform_int_distribution<size_t> dist(0, kStoreKeys - 1);
+    std::string value = bench_value(state.range(0), 7);
+    for (auto _ : state) {
+        if (!db->put(store_key(dist(rng)), value)) { state.SkipWithError("put failed"); break; }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// One SELECT ... = ANY for kStoreBatch keys; items are keys
+static void BM_StoreGetMany(benchmark::State &state) {
+    PGStore *db = store_or_skip(state);
+    if (!db) return;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < kStoreBatch; i++) keys.push_back(store_key(i * (kStoreKeys / kStoreBatch)));
+    std::unordered_map<std::string, std::string> out;
+    for (auto _ : state) {
+        out.clear();
+        if (!db->get_many(keys, out)) { state.SkipWithError("get_many failed"); break; }
+    }
+    state.SetItemsProcessed(state.iterations() * kStoreBatch);
+}
+
+BENCHMARK(BM_StoreGet)->Threads(1)->Threads(4)->UseRealTime();
+BENCHMARK(BM_StorePut)->ArgName("bytes")->Arg(100)->Arg(4096)->UseRealTime();
+BENCHMARK(BM_StoreGetMany)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,76 @@
+// Cache hit-path microbenchmark: exact LRU vs CLOCK vs compact LRU, single
+// shard, so the numbers show the cost of the lock and lookup each policy
+// pays on a hit.
+// Command format: ./bench_cache [keys] [seconds_per_run]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "clock_cache.h"
+#include "compact_cache.h"
+#include "lru_cache.h"
+
+using namespace std::chrono;
+
+// Run `threads` readers over a prefilled cache for `secs`; returns hits/s
+static double run_hits(CacheShard &cache, size_t keys, int threads, double secs) {
+    std::vector<std::string> names;
+    names.reserve(keys);
+    for (size_t i = 0; i < keys; i++) {
+        names.push_back("popular-" + std::to_string(i));
+        cache.put(names.back(), "v" + std::to_string(i));
+    }
+
+    std::atomic<bool> go{false}, stop{false};
+    std::atomic<uint64_t> total{0};
+    std::vector<std::thread> th;
+    for (int t = 0; t < threads; t++) {
+        th.emplace_back([&, t]{
+            std::mt19937_64 rng(t + 1234);
+            std::uniform_int_distribution<size_t> dist(0, keys - 1);
+            CacheValue val;
+            uint64_t n = 0;
+            while (!go.load(std::memory_order_acquire)) std::this_thread::yield();
+            while (!stop.load(std::memory_order_relaxed)) {
+                // batch the stop check so it doesn't dominate tiny lookups
+                for (int i = 0; i < 64; i++) n += cache.get(names[dist(rng)], val);
+            }
+            total.fetch_add(n, std::memory_order_relaxed);
+        });
+    }
+    auto t0 = steady_clock::now();
+    go.store(true, std::memory_order_release);
+    std::this_thread::sleep_for(duration<double>(secs));
+    stop.store(true);
+    for (auto &t : th) t.join();
+    double elapsed = duration<double>(steady_clock::now() - t0).count();
+    return (double)total.load() / elapsed;
+}
+
+int main(int argc, char **argv) {
+    size_t keys = argc >= 2 ? std::stoul(argv[1]) : 100;   // matches loadgen get_popular
+    double secs = argc >= 3 ? std::stod(argv[2]) : 1.0;
+
+    std::printf("%-8s %8s %14s\n", "policy", "threads", "hits_per_sec");
+    for (int threads : {1, 8, 32}) {
+        {
+            LRUCache c(keys);
+            std::printf("%-8s %8d %14.0f\n", "lru", threads, run_hits(c, keys, threads, secs));
+        }
+        {
+            ClockCache c(keys);
+            std::printf("%-8s %8d %14.0f\n", "clock", threads, run_hits(c, keys, threads, secs));
+        }
+        {
+            CompactLRUCache c(keys);
+            std::printf("%-8s %8d %14.0f\n", "compact", threads, run_hits(c, keys, threads, secs));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "request_trace.h"
+
+// What a cache capacity counts
+enum class CapacityMode { ENTRIES, BYTES };
+
+// Cached values are immutable, refcounted buffers. A hit hands out a second
+// reference in O(1) under the segment lock and the caller reads the bytes
+// after releasing it; a value replaced or evicted while a response is still
+// sending it stays alive until that reference is dropped.
+using CacheValue = std::shared_ptr<const std::string>;
+
+// Memory behind one CacheValue besides the bytes: the string header plus the
+// make_shared control block (vtable pointer and two counts)
+constexpr size_t kCacheValueOverhead = sizeof(std::string) + 2 * sizeof(void*);
+
+inline CacheValue make_cache_value(std::string value) {
+    return std::make_shared<const std::string>(std::move(value));
+}
+
+// Expiry deadlines are milliseconds on the steady clock; 0 means never
+inline uint64_t cache_clock_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+inline bool cache_expired(uint64_t expires_at_ms, uint64_t now_ms) noexcept {
+    return expires_at_ms != 0 && expires_at_ms <= now_ms;
+}
+
+// Interface of one cache segment. ShardedCache owns a set of these and picks
+// the concrete eviction policy at startup.
+//
+// Every segment tracks the approximate memory charged to its entries (key and
+// value bytes plus per-entry node/index overhead). In BYTES mode capacity() is
+// a budget on that figure and put() evicts until the segment is back under it;
+// an entry larger than the whole budget is not cached at all.
+//
+// An entry may carry an expiry deadline. get() never returns an expired
+// entry; it is reclaimed there when the lookup holds the exclusive lock, by
+// expire() (a bounded sweep step, run from a background thread) or when
+// eviction reaches it. Reclaimed expired entries count as expirations, not
+// evictions.
+class CacheShard {
+public:
+    virtual ~CacheShard() = default;
+
+    virtual bool get(const std::string &key, CacheValue &value) = 0;
+    virtual void put(const std::string &key, CacheValue value, uint64_t expires_at_ms) = 0;
+    // put() only if the key has no live entry; false (and no change) if it has
+    virtual bool put_if_absent(const std::string &key, CacheValue value, uint64_t expires_at_ms) = 0;
+    virtual void erase(const std::string &key) = 0;
+    virtual void clear() = 0;
+
+    // Examine up to `max_scan` entries from where the previous call stopped
+    // (wrapping around) and remove the expired ones; returns how many
+    virtual size_t expire(uint64_t now_ms, size_t max_scan) = 0;
+
+    // Append up to `max` entries, hottest first (recency order, or
+    // referenced before unreferenced for CLOCK), skipping expired ones. Values are shared handles,
+    // so this copies only the keys. Used to dump the working set.
+    virtual void hot_entries(size_t max, std::vector<std::pair<std::string, CacheValue>> &out) const = 0;
+
+    virtual size_t size() const = 0;
+    virtual size_t capacity() const noexcept = 0;
+    virtual uint64_t hits() const noexcept = 0;
+    virtual uint64_t misses() const noexcept = 0;
+
+    // memory accounting
+    virtual uint64_t bytes() const noexcept = 0;
+    virtual uint64_t peak_bytes() const noexcept = 0;
+    virtual uint64_t evictions() const noexcept = 0;
+    virtual uint64_t expirations() const noexcept = 0;
+
+    // Copying conveniences for callers that want a plain string
+    bool get(const std::string &key, std::string &value) {
+        CacheValue v;
+        if (!get(key, v)) return false;
+        value = *v;
+        return true;
+    }
+    void put(const std::string &key, CacheValue value) { put(key, std::move(value), 0); }
+    void put(const std::string &key, const std::string &value) { put(key, make_cache_value(value), 0); }
+};
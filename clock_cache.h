@@ -0,0 +1,285 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cache_shard.h"
+
+// CLOCK (second-chance) approximation of LRU. A hit only sets the slot's
+// reference bit, so get() runs under a shared lock and concurrent readers of
+// hot keys don't serialize. Ordering work happens only when put() needs a
+// victim: the hand sweeps slots, clearing set bits and evicting the first
+// slot whose bit was already clear.
+class ClockCache : public CacheShard {
+public:
+    explicit ClockCache(size_t capacity = 1000, CapacityMode mode = CapacityMode::ENTRIES)
+        : capacity_(capacity), mode_(mode), hand_(0), hit_count_(0), miss_count_(0),
+          bytes_(0), peak_bytes_(0), evictions_(0), expirations_(0), sweep_(0) {}
+
+    // Non-copyable
+    ClockCache(const ClockCache&) = delete;
+    ClockCache& operator=(const ClockCache&) = delete;
+
+    // deque slot (key string, value handle, deadline, flags) and the shared value
+    // buffer, plus the unordered_map node (next link, duplicate key, slot
+    // index, cached hash) and its bucket slot
+    static constexpr size_t kEntryOverhead = sizeof(std::string) + sizeof(CacheValue) + sizeof(uint64_t) + sizeof(void*)
+                                           + kCacheValueOverhead
+                                           + sizeof(void*) + sizeof(std::string) + sizeof(size_t) + sizeof(size_t)
+                                           + sizeof(void*);
+
+    // Bytes charged for one entry; the key is stored twice (slot and map)
+    static size_t entry_bytes(const std::string &key, const std::string &value) noexcept {
+        return 2 * key.size() + value.size() + kEntryOverhead;
+    }
+
+    using CacheShard::get;
+    using CacheShard::put;
+
+    // Copying the handle bumps the value's refcount, so readers of one hot
+    // key still share that cache line, but no longer copy the bytes. An
+    // expired entry is a miss here but stays until the sweep, eviction or a
+    // put reclaims it, so lookups never take the exclusive lock.
+    bool get(const std::string &key, CacheValue &value) override {
+        TracedLock<std::shared_lock<std::shared_mutex>> lk(mtx_);
+        auto it = map_.find(key);
+        if (it == map_.end()) {
+            miss_count_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        Slot &s = slots_[it->second];
+        if (s.expires_at && cache_expired(s.expires_at, cache_clock_ms())) {
+            miss_count_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        // Avoid dirtying the cache line when the bit is already set
+        if (!s.ref.load(std::memory_order_relaxed)) s.ref.store(true, std::memory_order_relaxed);
+        value = s.value;
+        hit_count_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Put or update
+    void put(const std::string &key, CacheValue value, uint64_t expires_at_ms) override {
+        TracedLock<std::unique_lock<std::shared_mutex>> lk(mtx_);
+        put_locked(key, std::move(value), expires_at_ms);
+    }
+
+    bool put_if_absent(const std::string &key, CacheValue value, uint64_t expires_at_ms) override {
+        TracedLock<std::unique_lock<std::shared_mutex>> lk(mtx_);
+        auto it = map_.find(key);
+        if (it != map_.end()) {
+            const Slot &s = slots_[it->second];
+            if (!(s.expires_at && cache_expired(s.expires_at, cache_clock_ms()))) return false;
+        }
+        put_locked(key, std::move(value), expires_at_ms);
+        return true;
+    }
+
+    // Erase key if present
+    void erase(const std::string &key) override {
+        TracedLock<std::unique_lock<std::shared_mutex>> lk(mtx_);
+        auto it = map_.find(key);
+        if (it == map_.end()) return;
+        release_slot_locked(it->second);
+        map_.erase(it);
+    }
+
+    // Clear all entries
+    void clear() override {
+        std::unique_lock<std::shared_mutex> lk(mtx_);
+        slots_.clear();
+        free_.clear();
+        map_.clear();
+        hand_ = 0;
+        hit_count_.store(0, std::memory_order_relaxed);
+        miss_count_.store(0, std::memory_order_relaxed);
+        bytes_.store(0, std::memory_order_relaxed);
+    }
+
+    // Steps a cursor of its own through the slots, independent of the hand
+    size_t expire(uint64_t now_ms, size_t max_scan) override {
+        std::unique_lock<std::shared_mutex> lk(mtx_);
+        size_t removed = 0;
+        for (size_t i = 0; i < max_scan && i < slots_.size(); i++) {
+            size_t idx = sweep_++ % slots_.size();
+            Slot &s = slots_[idx];
+            if (!s.used || !cache_expired(s.expires_at, now_ms)) continue;
+            map_.erase(s.key);
+            release_slot_locked(idx);
+            removed++;
+        }
+        expirations_.fetch_add(removed, std::memory_order_relaxed);
+        return removed;
+    }
+
+    // Slots hit since the hand last passed them first, then the rest
+    void hot_entries(size_t max, std::vector<std::pair<std::string, CacheValue>> &out) const override {
+        std::shared_lock<std::shared_mutex> lk(mtx_);
+        uint64_t now = cache_clock_ms();
+        for (int pass = 0; pass < 2; pass++) {
+            for (const Slot &s : slots_) {
+                if (max == 0) return;
+                if (!s.used || s.ref.load(std::memory_order_relaxed) != (pass == 0)) continue;
+                if (cache_expired(s.expires_at, now)) continue;
+                out.emplace_back(s.key, s.value);
+                max--;
+            }
+        }
+    }
+
+    // Current #elements
+    size_t size() const override {
+        std::shared_lock<std::shared_mutex> lk(mtx_);
+        return map_.size();
+    }
+
+    // Entry count or byte budget, depending on mode()
+    size_t capacity() const noexcept override {
+        return capacity_;
+    }
+    CapacityMode mode() const noexcept { return mode_; }
+
+    // hit/miss counters
+    uint64_t hits() const noexcept override { return hit_count_.load(std::memory_order_relaxed); }
+    uint64_t misses() const noexcept override { return miss_count_.load(std::memory_order_relaxed); }
+
+    // memory accounting
+    uint64_t bytes() const noexcept override { return bytes_.load(std::memory_order_relaxed); }
+    uint64_t peak_bytes() const noexcept override { return peak_bytes_.load(std::memory_order_relaxed); }
+    uint64_t evictions() const noexcept override { return evictions_.load(std::memory_order_relaxed); }
+    uint64_t expirations() const noexcept override { return expirations_.load(std::memory_order_relaxed); }
+
+private:
+    struct Slot {
+        std::string key;
+        CacheValue value;
+        uint64_t expires_at = 0;    // 0 = never
+        bool used = false;
+        std::atomic<bool> ref{false};
+    };
+
+    size_t capacity_;
+    CapacityMode mode_;
+    // deque: slots never move, so the atomics inside stay put as it grows
+    std::deque<Slot> slots_;
+    std::vector<size_t> free_;
+    std::unordered_map<std::string, size_t> map_;
+    size_t hand_;
+    mutable std::shared_mutex mtx_;
+
+    std::atomic<uint64_t> hit_count_;
+    std::atomic<uint64_t> miss_count_;
+
+    // written under the exclusive lock, atomic so metrics can read freely
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> peak_bytes_;
+    std::atomic<uint64_t> evictions_;
+    std::atomic<uint64_t> expirations_;
+    size_t sweep_;
+
+    void put_locked(const std::string &key, CacheValue value, uint64_t expires_at_ms) {
+        size_t charge = entry_bytes(key, *value);
+        auto it = map_.find(key);
+        bool referenced = false;
+        if (it != map_.end()) {
+            Slot &s = slots_[it->second];
+            if (mode_ == CapacityMode::ENTRIES || charge <= entry_bytes(key, *s.value)) {
+                // fits where it already is: update in place
+                sub_bytes(entry_bytes(key, *s.value));
+                s.value = std::move(value);
+                s.expires_at = expires_at_ms;
+                add_bytes(charge);
+                s.ref.store(true, std::memory_order_relaxed);
+                return;
+            }
+            // growing in BYTES mode: re-insert below so the sweep can't pick
+            // the entry being updated as its own victim
+            release_slot_locked(it->second);
+            map_.erase(it);
+            referenced = true;
+        }
+
+        // Too big to ever fit
+        if (capacity_ == 0 || (mode_ == CapacityMode::BYTES && charge > capacity_)) return;
+
+        while (!map_.empty() && !fits_locked(charge)) evict_locked();
+
+        size_t idx;
+        if (!free_.empty()) {
+            idx = free_.back();
+            free_.pop_back();
+        } else {
+            idx = slots_.size();
+            slots_.emplace_back();
+        }
+
+        Slot &s = slots_[idx];
+        s.key = key;
+        s.value = std::move(value);
+        s.expires_at = expires_at_ms;
+        s.used = true;
+        // New entries start unreferenced: they must be hit once to survive
+        // a full sweep, which keeps one-off scans from flushing the hot set
+        s.ref.store(referenced, std::memory_order_relaxed);
+        map_[key] = idx;
+        add_bytes(charge);
+    }
+
+    bool fits_locked(size_t charge) const {
+        if (mode_ == CapacityMode::BYTES) return bytes_.load(std::memory_order_relaxed) + charge <= capacity_;
+        return map_.size() < capacity_;
+    }
+
+    void add_bytes(size_t n) {
+        uint64_t b = bytes_.load(std::memory_order_relaxed) + n;
+        bytes_.store(b, std::memory_order_relaxed);
+        if (b > peak_bytes_.load(std::memory_order_relaxed)) peak_bytes_.store(b, std::memory_order_relaxed);
+    }
+    void sub_bytes(size_t n) {
+        bytes_.store(bytes_.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+    }
+
+    // Sweep from the hand and evict one entry, returning its slot to free_.
+    // Terminates within two passes: the first clears every reference bit.
+    // An expired slot is taken whatever its bit and counts as an expiration.
+    void evict_locked() {
+        uint64_t now = cache_clock_ms();
+        for (;;) {
+            size_t idx = hand_;
+            hand_ = (hand_ + 1) % slots_.size();
+            Slot &s = slots_[idx];
+            if (!s.used) continue;
+            if (cache_expired(s.expires_at, now)) {
+                map_.erase(s.key);
+                release_slot_locked(idx);
+                expirations_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            if (s.ref.load(std::memory_order_relaxed)) {
+                s.ref.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            map_.erase(s.key);
+            release_slot_locked(idx);
+            evictions_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    }
+
+    void release_slot_locked(size_t idx) {
+        Slot &s = slots_[idx];
+        sub_bytes(entry_bytes(s.key, *s.value));
+        s.used = false;
+        s.key.clear();
+        s.value.reset();
+        s.expires_at = 0;
+        free_.push_back(idx);
+    }
+};
@@ -0,0 +1,369 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "histogram.h"
+#include "httplib.h"
+#include "json.hpp"
+
+// Several servers over the same kv_store, each caching one partition of the
+// keyspace. Every node is given the same node list; each puts every node on
+// a consistent-hash ring at `vnodes` points, so they agree on a key's
+// owner without talking to each other, and adding or removing a node moves
+// only about 1/N of the keys. A request for a key another node owns is either
+// forwarded to it over a pooled keep-alive connection or answered with a
+// redirect. Forwarded requests carry kForwardedHeader and are always served
+// where they land, so nodes with differing lists can't bounce a request
+// between them.
+//
+// A forward holds the worker that sent it until the owner replies, and the
+// owner needs a free worker of its own to reply. If every worker on two
+// nodes were forwarding to the other, both would stall until the timeout.
+// Forwards in flight from a node are therefore capped (max_forwards) below
+// its worker count, and the excess is shed; the workers left over can
+// always serve the requests forwarded in.
+
+// FNV-1a with a 64-bit finalizer: stable across builds and processes
+inline uint64_t ring_hash(const char *p, size_t n) noexcept {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < n; i++) { h ^= static_cast<unsigned char>(p[i]); h *= 1099511628211ULL; }
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+class HashRing {
+public:
+    HashRing(const std::vector<std::string> &nodes, size_t vnodes) {
+        for (uint32_t n = 0; n < nodes.size(); n++) {
+            for (size_t v = 0; v < vnodes; v++) {
+                std::string label = nodes[n] + "#" + std::to_string(v);
+                points_.push_back(Point{ring_hash(label.data(), label.size()), n});
+            }
+        }
+        std::sort(points_.begin(), points_.end(), [](const Point &a, const Point &b){ return a.hash < b.hash; });
+    }
+
+    // The first point clockwise from the key's hash
+    size_t owner(const std::string &key) const noexcept {
+        uint64_t h = ring_hash(key.data(), key.size());
+        auto it = std::lower_bound(points_.begin(), points_.end(), h,
+                                   [](const Point &p, uint64_t v){ return p.hash < v; });
+        return (it == points_.end() ? points_.front() : *it).node;
+    }
+
+    // Share of the hash space each node owns
+    std::vector<double> shares(size_t nodes) const {
+        std::vector<double> out(nodes, 0.0);
+        for (size_t i = 0; i < points_.size(); i++) {
+            // arc from the previous point, wrapping at zero (unsigned arithmetic)
+            uint64_t prev = points_[i ? i - 1 : points_.size() - 1].hash;
+            out[points_[i].node] += static_cast<double>(points_[i].hash - prev) / 18446744073709551616.0;
+        }
+        return out;
+    }
+
+private:
+    struct Point {
+        uint64_t hash;
+        uint32_t node;
+    };
+    std::vector<Point> points_;
+};
+
+// One other node: a pool of keep-alive clients. httplib::Client serializes
+// its requests, so each in-flight forward checks one out; up to max_idle
+// are kept open between requests.
+class ClusterPeer {
+public:
+    ClusterPeer(std::string addr, std::string host, int port, int timeout_ms, size_t max_idle)
+        : addr_(std::move(addr)), host_(std::move(host)), port_(port), timeout_ms_(timeout_ms),
+          max_idle_(max_idle), forwarded_(0), failures_(0), opened_(0) {}
+
+    // Non-copyable
+    ClusterPeer(const ClusterPeer&) = delete;
+    ClusterPeer& operator=(const ClusterPeer&) = delete;
+
+    // False with `err` set on a transport error; any HTTP status is a reply
+    bool send(httplib::Request &req, httplib::Response &res, std::string &err) {
+        std::unique_ptr<httplib::Client> c = acquire();
+        auto t0 = std::chrono::steady_clock::now();
+        httplib::Error e = httplib::Error::Success;
+        bool ok = c->send(req, res, e);
+        latency_.record_since(t0);
+        if (!ok) {
+            failures_.fetch_add(1, std::memory_order_relaxed);
+            err = httplib::to_string(e);
+            return false;   // the client and its socket are dropped
+        }
+        forwarded_.fetch_add(1, std::memory_order_relaxed);
+        release(std::move(c));
+        return true;
+    }
+
+    const std::string& addr() const noexcept { return addr_; }
+    uint64_t forwarded() const noexcept { return forwarded_.load(std::memory_order_relaxed); }
+    uint64_t failures() const noexcept { return failures_.load(std::memory_order_relaxed); }
+    uint64_t connections_opened() const noexcept { return opened_.load(std::memory_order_relaxed); }
+    size_t idle_connections() const {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return idle_.size();
+    }
+    const LatencyHistogram& latency() const noexcept { return latency_; }
+
+private:
+    std::unique_ptr<httplib::Client> acquire() {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            if (!idle_.empty()) {
+                std::unique_ptr<httplib::Client> c = std::move(idle_.back());
+                idle_.pop_back();
+                return c;
+            }
+        }
+        std::unique_ptr<httplib::Client> c(new httplib::Client(host_, port_));
+        c->set_keep_alive(true);
+        c->set_tcp_nodelay(true);
+        // targets are forwarded exactly as they arrived
+        c->set_path_encode(false);
+        c->set_connection_timeout(std::chrono::milliseconds(timeout_ms_));
+        c->set_read_timeout(std::chrono::milliseconds(timeout_ms_));
+        c->set_write_timeout(std::chrono::milliseconds(timeout_ms_));
+        opened_.fetch_add(1, std::memory_order_relaxed);
+        return c;
+    }
+
+    void release(std::unique_ptr<httplib::Client> c) {
+        std::lock_guard<std::mutex> lk(mtx_);
+        if (idle_.size() < max_idle_) idle_.push_back(std::move(c));
+    }
+
+    std::string addr_;
+    std::string host_;
+    int port_;
+    int timeout_ms_;
+    size_t max_idle_;
+    mutable std::mutex mtx_;
+    std::vector<std::unique_ptr<httplib::Client>> idle_;
+    std::atomic<uint64_t> forwarded_;
+    std::atomic<uint64_t> failures_;
+    std::atomic<uint64_t> opened_;
+    LatencyHistogram latency_;
+};
+
+class Cluster {
+public:
+    static constexpr const char *kForwardedHeader = "X-KV-Forwarded-By";
+
+    struct Options {
+        size_t vnodes = 160;        // ring points per node
+        bool redirect = false;      // 307 to the owner instead of forwarding
+        int timeout_ms = 1000;      // connect/read/write timeout towards peers
+        size_t max_idle = 64;       // kept-open connections per peer
+        size_t max_forwards = 0;    // in flight from this node, all peers; 0 => no cap
+    };
+
+    enum class Forward { OK, UNREACHABLE, BUSY };
+
+    // "host:port" with a non-empty host and a port in 1..65535
+    static bool parse_addr(const std::string &addr, std::string &host, int &port) {
+        size_t c = addr.rfind(':');
+        if (c == std::string::npos || c == 0 || c + 1 == addr.size()) return false;
+        host = addr.substr(0, c);
+        char *end = nullptr;
+        long p = std::strtol(addr.c_str() + c + 1, &end, 10);
+        if (*end != '\0' || p < 1 || p > 65535) return false;
+        port = static_cast<int>(p);
+        return true;
+    }
+
+    // `nodes` are host:port addresses (parse_addr() must accept each, no
+    // duplicates) and nodes[self] is this server
+    Cluster(const std::vector<std::string> &nodes, size_t self, const Options &opt)
+        : nodes_(nodes), self_(self), opt_(opt), ring_(nodes, opt.vnodes ? opt.vnodes : 1),
+          redirects_(0), received_(0), forwarding_(0), shed_(0) {
+        for (size_t i = 0; i < nodes.size(); i++) {
+            std::string host;
+            int port = 0;
+            parse_addr(nodes[i], host, port);
+            peers_.emplace_back(i == self ? nullptr : new ClusterPeer(nodes[i], host, port, opt.timeout_ms, opt.max_idle));
+        }
+    }
+
+    // Non-copyable
+    Cluster(const Cluster&) = delete;
+    Cluster& operator=(const Cluster&) = delete;
+
+    size_t size() const noexcept { return nodes_.size(); }
+    size_t self() const noexcept { return self_; }
+    const std::string& addr(size_t node) const { return nodes_[node]; }
+    size_t owner(const std::string &key) const noexcept { return ring_.owner(key); }
+    bool owns(const std::string &key) const noexcept { return owner(key) == self_; }
+    std::vector<double> ring_shares() const { return ring_.shares(nodes_.size()); }
+    const Options& options() const noexcept { return opt_; }
+
+    // A request another node forwarded here, to be served locally whoever
+    // owns its keys
+    bool forwarded(const httplib::Request &req) {
+        if (!req.has_header(kForwardedHeader)) return false;
+        received_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // The node that should answer a request for `key`
+    size_t route(const std::string &key, const httplib::Request &req) {
+        return forwarded(req) ? self_ : owner(key);
+    }
+
+    void redirect(size_t node, const httplib::Request &req, httplib::Response &res) {
+        redirects_.fetch_add(1, std::memory_order_relaxed);
+        res.status = 307;
+        res.set_header("Location", "http://" + nodes_[node] + req.target);
+    }
+
+    // Send `req` (with `body` in place of its own) to `node` and copy its
+    // reply into `res`. UNREACHABLE with `err` set if the node could not be
+    // reached, BUSY (nothing sent) if max_forwards are already in flight.
+    Forward forward(size_t node, const httplib::Request &req, const std::string &body, httplib::Response &res,
+                    std::string &err) {
+        if (opt_.max_forwards && forwarding_.fetch_add(1, std::memory_order_relaxed) >= opt_.max_forwards) {
+            forwarding_.fetch_sub(1, std::memory_order_relaxed);
+            shed_.fetch_add(1, std::memory_order_relaxed);
+            err = "too many forwards in flight";
+            return Forward::BUSY;
+        }
+        Forward f = send_to(node, req, body, res, err);
+        if (opt_.max_forwards) forwarding_.fetch_sub(1, std::memory_order_relaxed);
+        return f;
+    }
+
+    // null for self()
+    const ClusterPeer* peer(size_t node) const { return peers_[node].get(); }
+    uint64_t redirects() const noexcept { return redirects_.load(std::memory_order_relaxed); }
+    uint64_t received() const noexcept { return received_.load(std::memory_order_relaxed); }
+    size_t forwarding() const noexcept { return forwarding_.load(std::memory_order_relaxed); }
+    uint64_t shed() const noexcept { return shed_.load(std::memory_order_relaxed); }
+
+private:
+    std::vector<std::string> nodes_;
+    size_t self_;
+    Options opt_;
+    HashRing ring_;
+    std::vector<std::unique_ptr<ClusterPeer>> peers_;
+    std::atomic<uint64_t> redirects_;
+    std::atomic<uint64_t> received_;
+    std::atomic<size_t> forwarding_;
+    std::atomic<uint64_t> shed_;
+
+    Forward send_to(size_t node, const httplib::Request &req, const std::string &body, httplib::Response &res,
+                    std::string &err) {
+        httplib::Request out;
+        out.method = req.method;
+        out.path = req.target;
+        out.body = body;
+        for (const char *h : {"Content-Type", "Accept", "X-Cache-TTL"})
+            if (req.has_header(h)) out.set_header(h, req.get_header_value(h));
+        out.set_header(kForwardedHeader, nodes_[self_]);
+
+        httplib::Response reply;
+        if (!peers_[node]->send(out, reply, err)) return Forward::UNREACHABLE;
+        res.status = reply.status;
+        res.body = std::move(reply.body);
+        for (auto &h : reply.headers) {
+            bool hop = false;
+            for (const char *skip : {"Content-Length", "Connection", "Keep-Alive", "Transfer-Encoding"})
+                hop = hop || httplib::detail::case_ignore::equal(h.first, skip);
+            if (!hop) res.headers.emplace(h.first, h.second);
+        }
+        return Forward::OK;
+    }
+};
+
+// The remote parts of a batch request. Each part goes to its owner on its
+// own thread, so the parts and the local keys are processed concurrently;
+// gather() waits for them and merges the per-key results.
+class BatchScatter {
+public:
+    BatchScatter(Cluster &cluster, const httplib::Request &req) : cluster_(cluster), req_(req) {}
+
+    // Parts not gathered yet are still waited for
+    ~BatchScatter() {
+        for (auto &p : parts_) if (p.reply.valid()) p.reply.wait();
+    }
+
+    BatchScatter(const BatchScatter&) = delete;
+    BatchScatter& operator=(const BatchScatter&) = delete;
+
+    void send(size_t node, std::vector<std::string> keys, std::string body) {
+        Part p;
+        p.node = node;
+        p.keys = std::move(keys);
+        p.reply = std::async(std::launch::async, [this, node, body = std::move(body)]{
+            Reply r;
+            r.sent = cluster_.forward(node, req_, body, r.res, r.err);
+            return r;
+        });
+        parts_.push_back(std::move(p));
+    }
+
+    size_t keys() const noexcept {
+        size_t n = 0;
+        for (auto &p : parts_) n += p.keys.size();
+        return n;
+    }
+
+    // Adds each remote key's result (the owner's, or an error) to `results`.
+    // Returns how many of them are errors.
+    size_t gather(nlohmann::json &results) {
+        size_t failed = 0;
+        for (auto &p : parts_) {
+            Reply r = p.reply.get();
+            bool ok = r.sent == Cluster::Forward::OK;
+            nlohmann::json body = ok ? nlohmann::json::parse(r.res.body, nullptr, false) : nlohmann::json();
+            const nlohmann::json *sub = body.is_object() && body.contains("results") && body["results"].is_object()
+                                        ? &body["results"] : nullptr;
+            std::string why = r.sent == Cluster::Forward::BUSY ? "node " + cluster_.addr(p.node) + " not tried: " + r.err
+                            : !ok ? "node " + cluster_.addr(p.node) + " unreachable: " + r.err
+                                  : "no result from node " + cluster_.addr(p.node);
+            for (auto &key : p.keys) {
+                auto it = sub ? sub->find(key) : nlohmann::json::const_iterator();
+                if (sub && it != sub->end()) {
+                    results[key] = *it;
+                    if (it->is_object() && it->value("status", "") == "error") failed++;
+                } else {
+                    results[key] = {{"status", "error"}, {"error", why}};
+                    failed++;
+                }
+            }
+        }
+        parts_.clear();
+        return failed;
+    }
+
+private:
+    struct Reply {
+        Cluster::Forward sent = Cluster::Forward::UNREACHABLE;
+        httplib::Response res;
+        std::string err;
+    };
+    struct Part {
+        size_t node;
+        std::vector<std::string> keys;
+        std::future<Reply> reply;
+    };
+
+    Cluster &cluster_;
+    const httplib::Request &req_;
+    std::vector<Part> parts_;
+};
@@ -0,0 +1,419 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "cache_shard.h"
+
+// Exact LRU with flat storage. Instead of a std::list node, two std::strings
+// and an unordered_map node per entry, it keeps:
+//   - an open-addressing index of {hash tag, entry id} (8 bytes per slot,
+//     linear probing, backward-shift deletion so there are no tombstones),
+//   - a dense vector of fixed-size entry records with an intrusive,
+//     index-based recency list and the shared value handle,
+//   - key bytes in blocks carved from per-size-class slabs (oversized keys
+//     get their own allocation).
+// A hit costs one index probe, one entry record and one key block, and an
+// insert does no heap allocation of its own once the slabs are warm (the
+// value buffer is built by the caller).
+//
+// Slab memory is recycled through per-class free lists, not returned to the
+// OS; bytes() charges each entry for its block, not for idle slab space.
+class CompactLRUCache : public CacheShard {
+public:
+    explicit CompactLRUCache(size_t capacity = 1000, CapacityMode mode = CapacityMode::ENTRIES)
+        : capacity_(capacity), mode_(mode), count_(0), head_(kNil), tail_(kNil), free_entry_(kNil),
+          hit_count_(0), miss_count_(0), bytes_(0), peak_bytes_(0), evictions_(0), expirations_(0), sweep_(0) {
+        resize_index(16);
+    }
+
+    ~CompactLRUCache() override { release_all(); }
+
+    // Non-copyable
+    CompactLRUCache(const CompactLRUCache&) = delete;
+    CompactLRUCache& operator=(const CompactLRUCache&) = delete;
+
+    // entry record, ~2 index slots at the maximum load factor and the shared
+    // value buffer
+    static constexpr size_t kEntryOverhead = 56 + 2 * 8 + kCacheValueOverhead;
+
+    // Bytes charged for one entry: its key block (rounded up to the size
+    // class), the value bytes, and record/index/buffer overhead
+    static size_t entry_bytes(const std::string &key, const std::string &value) noexcept {
+        return block_size(key.size()) + value.size() + kEntryOverhead;
+    }
+
+    using CacheShard::get;
+    using CacheShard::put;
+
+    bool get(const std::string &key, CacheValue &value) override {
+        TracedLock<std::lock_guard<std::mutex>> lk(mtx_);
+        uint64_t h = hash_key(key);
+        uint32_t id = find_locked(key, h);
+        if (id == kNil) {
+            miss_count_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (entries_[id].expires_at && cache_expired(entries_[id].expires_at, cache_clock_ms())) {
+            remove_locked(id);
+            expirations_.fetch_add(1, std::memory_order_relaxed);
+            miss_count_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        move_to_front(id);
+        value = entries_[id].value;
+        hit_count_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Put or update
+    void put(const std::string &key, CacheValue value, uint64_t expires_at_ms) override {
+        TracedLock<std::lock_guard<std::mutex>> lk(mtx_);
+        put_locked(key, std::move(value), expires_at_ms);
+    }
+
+    bool put_if_absent(const std::string &key, CacheValue value, uint64_t expires_at_ms) override {
+        TracedLock<std::lock_guard<std::mutex>> lk(mtx_);
+        uint32_t id = find_locked(key, hash_key(key));
+        if (id != kNil && !(entries_[id].expires_at && cache_expired(entries_[id].expires_at, cache_clock_ms()))) return false;
+        put_locked(key, std::move(value), expires_at_ms);
+        return true;
+    }
+
+    // Erase key if present
+    void erase(const std::string &key) override {
+        TracedLock<std::lock_guard<std::mutex>> lk(mtx_);
+        uint32_t id = find_locked(key, hash_key(key));
+        if (id != kNil) remove_locked(id);
+    }
+
+    // Clear all entries
+    void clear() override {
+        std::lock_guard<std::mutex> lk(mtx_);
+        release_all();
+        entries_.clear();
+        for (auto &c : classes_) { c.slabs.clear(); c.free.clear(); c.bump = 0; }
+        count_ = 0;
+        head_ = tail_ = free_entry_ = kNil;
+        resize_index(16);
+        hit_count_.store(0, std::memory_order_relaxed);
+        miss_count_.store(0, std::memory_order_relaxed);
+        bytes_.store(0, std::memory_order_relaxed);
+        sweep_ = 0;
+    }
+
+    // Steps through the record array; free records have no key block
+    size_t expire(uint64_t now_ms, size_t max_scan) override {
+        std::lock_guard<std::mutex> lk(mtx_);
+        size_t removed = 0;
+        for (size_t i = 0; i < max_scan && i < entries_.size(); i++) {
+            uint32_t id = static_cast<uint32_t>(sweep_++ % entries_.size());
+            const Entry &e = entries_[id];
+            if (!e.data || !cache_expired(e.expires_at, now_ms)) continue;
+            remove_locked(id);
+            removed++;
+        }
+        expirations_.fetch_add(removed, std::memory_order_relaxed);
+        return removed;
+    }
+
+    // Most recently used first
+    void hot_entries(size_t max, std::vector<std::pair<std::string, CacheValue>> &out) const override {
+        std::lock_guard<std::mutex> lk(mtx_);
+        uint64_t now = cache_clock_ms();
+        for (uint32_t id = head_; id != kNil && max > 0; id = entries_[id].next) {
+            const Entry &e = entries_[id];
+            if (cache_expired(e.expires_at, now)) continue;
+            out.emplace_back(std::string(e.data, e.klen), e.value);
+            max--;
+        }
+    }
+
+    // Current #elements
+    size_t size() const override {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return count_;
+    }
+
+    // Entry count or byte budget, depending on mode()
+    size_t capacity() const noexcept override {
+        return capacity_;
+    }
+    CapacityMode mode() const noexcept { return mode_; }
+
+    // hit/miss counters
+    uint64_t hits() const noexcept override { return hit_count_.load(std::memory_order_relaxed); }
+    uint64_t misses() const noexcept override { return miss_count_.load(std::memory_order_relaxed); }
+
+    // memory accounting
+    uint64_t bytes() const noexcept override { return bytes_.load(std::memory_order_relaxed); }
+    uint64_t peak_bytes() const noexcept override { return peak_bytes_.load(std::memory_order_relaxed); }
+    uint64_t evictions() const noexcept override { return evictions_.load(std::memory_order_relaxed); }
+    uint64_t expirations() const noexcept override { return expirations_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr uint32_t kNil = UINT32_MAX;
+    static constexpr size_t kMinBlock = 32;
+    static constexpr size_t kMaxSlabBlock = 16 * 1024;   // larger keys are allocated individually
+    static constexpr size_t kSlabBytes = 64 * 1024;
+    static constexpr size_t kNumClasses = 10;            // 32B .. 16KB, powers of two
+
+    struct Entry {
+        char *data;        // key bytes; nullptr while the record is free
+        uint64_t hash;
+        CacheValue value;
+        uint64_t expires_at;   // 0 = never
+        uint32_t klen;
+        uint32_t prev;     // towards MRU; also the free-list link when unused
+        uint32_t next;     // towards LRU
+    };
+    static_assert(sizeof(Entry) <= 56, "kEntryOverhead assumes a 56-byte record");
+
+    // Index slot: upper hash bits as a cheap filter, plus the entry id
+    struct Slot {
+        uint32_t tag;
+        uint32_t id;       // kNil when empty
+    };
+
+    struct SizeClass {
+        std::vector<std::unique_ptr<char[]>> slabs;
+        std::vector<char*> free;
+        size_t bump = 0;   // next unused offset in slabs.back()
+    };
+
+    size_t capacity_;
+    CapacityMode mode_;
+    size_t count_;
+    std::vector<Slot> index_;
+    size_t index_mask_;
+    std::vector<Entry> entries_;
+    uint32_t head_, tail_, free_entry_;
+    SizeClass classes_[kNumClasses];
+    mutable std::mutex mtx_;
+
+    std::atomic<uint64_t> hit_count_;
+    std::atomic<uint64_t> miss_count_;
+
+    // written under mtx_, atomic so metrics can read without locking
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> peak_bytes_;
+    std::atomic<uint64_t> evictions_;
+    std::atomic<uint64_t> expirations_;
+    size_t sweep_;
+
+    static uint64_t hash_key(const std::string &key) {
+        return std::hash<std::string_view>{}(std::string_view(key));
+    }
+    size_t home_slot(uint64_t h) const {
+        // Fibonacci hashing spreads weakly mixed low bits across the table
+        return (size_t)((h * 0x9E3779B97F4A7C15ULL) >> 32) & index_mask_;
+    }
+    static uint32_t tag_of(uint64_t h) { return (uint32_t)(h >> 32); }
+
+    static size_t size_class(size_t n) {
+        size_t c = 0, b = kMinBlock;
+        while (b < n) { b <<= 1; c++; }
+        return c;
+    }
+    static size_t block_size(size_t n) {
+        if (n > kMaxSlabBlock) return n;
+        return kMinBlock << size_class(n);
+    }
+
+    static size_t charge_of(const Entry &e) {
+        return block_size(e.klen) + e.value->size() + kEntryOverhead;
+    }
+
+    void put_locked(const std::string &key, CacheValue value, uint64_t expires_at_ms) {
+        uint64_t h = hash_key(key);
+        size_t charge = entry_bytes(key, *value);
+        uint32_t id = find_locked(key, h);
+
+        // Too big to ever fit: make sure no stale copy survives either
+        if (capacity_ == 0 || (mode_ == CapacityMode::BYTES && charge > capacity_)) {
+            if (id != kNil) remove_locked(id);
+            return;
+        }
+
+        if (id != kNil) {
+            // the key block stays; only the value handle is swapped
+            Entry &e = entries_[id];
+            sub_bytes(charge_of(e));
+            e.value = std::move(value);
+            e.expires_at = expires_at_ms;
+            add_bytes(charge);
+            move_to_front(id);
+            // the front entry fits on its own, so this never evicts it
+            while (mode_ == CapacityMode::BYTES && bytes_.load(std::memory_order_relaxed) > capacity_) remove_locked(tail_, true);
+            return;
+        }
+
+        // Evict from the tail until the new entry fits
+        while (count_ > 0 && !fits_locked(charge)) remove_locked(tail_, true);
+
+        // grow first: rehashing walks the recency list, which must not yet
+        // contain the new entry
+        if ((count_ + 1) * 4 > index_.size() * 3) resize_index(index_.size() * 2);
+
+        id = alloc_entry();
+        Entry &e = entries_[id];
+        e.hash = h;
+        e.klen = static_cast<uint32_t>(key.size());
+        e.data = alloc_block(key.size());
+        std::memcpy(e.data, key.data(), key.size());
+        e.value = std::move(value);
+        e.expires_at = expires_at_ms;
+        link_front(id);
+        insert_index(id, h);
+        count_++;
+        add_bytes(charge);
+    }
+
+    bool fits_locked(size_t charge) const {
+        if (mode_ == CapacityMode::BYTES) return bytes_.load(std::memory_order_relaxed) + charge <= capacity_;
+        return count_ < capacity_;
+    }
+
+    void add_bytes(size_t n) {
+        uint64_t b = bytes_.load(std::memory_order_relaxed) + n;
+        bytes_.store(b, std::memory_order_relaxed);
+        if (b > peak_bytes_.load(std::memory_order_relaxed)) peak_bytes_.store(b, std::memory_order_relaxed);
+    }
+    void sub_bytes(size_t n) {
+        bytes_.store(bytes_.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+    }
+
+    // --- block allocation ---
+
+    char* alloc_block(size_t n) {
+        if (n > kMaxSlabBlock) return new char[n];
+        SizeClass &c = classes_[size_class(n)];
+        if (!c.free.empty()) {
+            char *p = c.free.back();
+            c.free.pop_back();
+            return p;
+        }
+        size_t bs = block_size(n);
+        if (c.slabs.empty() || c.bump + bs > kSlabBytes) {
+            c.slabs.emplace_back(new char[kSlabBytes]);
+            c.bump = 0;
+        }
+        char *p = c.slabs.back().get() + c.bump;
+        c.bump += bs;
+        return p;
+    }
+
+    void free_block(char *p, size_t n) {
+        if (n > kMaxSlabBlock) { delete[] p; return; }
+        classes_[size_class(n)].free.push_back(p);
+    }
+
+    // Free oversized blocks; slab blocks go away with their slabs
+    void release_all() {
+        for (uint32_t id = head_; id != kNil; id = entries_[id].next) {
+            const Entry &e = entries_[id];
+            if (e.klen > kMaxSlabBlock) delete[] e.data;
+        }
+    }
+
+    // --- entry records and recency list ---
+
+    uint32_t alloc_entry() {
+        if (free_entry_ != kNil) {
+            uint32_t id = free_entry_;
+            free_entry_ = entries_[id].prev;
+            return id;
+        }
+        entries_.push_back(Entry{});
+        return static_cast<uint32_t>(entries_.size() - 1);
+    }
+
+    void link_front(uint32_t id) {
+        Entry &e = entries_[id];
+        e.prev = kNil;
+        e.next = head_;
+        if (head_ != kNil) entries_[head_].prev = id;
+        head_ = id;
+        if (tail_ == kNil) tail_ = id;
+    }
+
+    void unlink(uint32_t id) {
+        Entry &e = entries_[id];
+        if (e.prev != kNil) entries_[e.prev].next = e.next; else head_ = e.next;
+        if (e.next != kNil) entries_[e.next].prev = e.prev; else tail_ = e.prev;
+    }
+
+    void move_to_front(uint32_t id) {
+        if (head_ == id) return;
+        unlink(id);
+        link_front(id);
+    }
+
+    // An evicted entry that had already expired counts as an expiration
+    void remove_locked(uint32_t id, bool evicted = false) {
+        Entry &e = entries_[id];
+        if (evicted && e.expires_at && cache_expired(e.expires_at, cache_clock_ms())) {
+            evicted = false;
+            expirations_.fetch_add(1, std::memory_order_relaxed);
+        }
+        erase_index(id, e.hash);
+        unlink(id);
+        sub_bytes(charge_of(e));
+        free_block(e.data, e.klen);
+        e.data = nullptr;
+        e.value.reset();
+        e.prev = free_entry_;
+        free_entry_ = id;
+        count_--;
+        if (evicted) evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // --- open-addressing index ---
+
+    uint32_t find_locked(const std::string &key, uint64_t h) const {
+        uint32_t tag = tag_of(h);
+        for (size_t i = home_slot(h);; i = (i + 1) & index_mask_) {
+            const Slot &s = index_[i];
+            if (s.id == kNil) return kNil;
+            if (s.tag != tag) continue;
+            const Entry &e = entries_[s.id];
+            if (e.hash == h && e.klen == key.size() && std::memcmp(e.data, key.data(), key.size()) == 0) return s.id;
+        }
+    }
+
+    void insert_index(uint32_t id, uint64_t h) {
+        size_t i = home_slot(h);
+        while (index_[i].id != kNil) i = (i + 1) & index_mask_;
+        index_[i] = Slot{tag_of(h), id};
+    }
+
+    // Backward-shift deletion: pull later members of the probe run into the
+    // hole so lookups never need tombstones
+    void erase_index(uint32_t id, uint64_t h) {
+        size_t i = home_slot(h);
+        while (index_[i].id != id) i = (i + 1) & index_mask_;
+        for (size_t j = (i + 1) & index_mask_;; j = (j + 1) & index_mask_) {
+            if (index_[j].id == kNil) break;
+            size_t home = home_slot(entries_[index_[j].id].hash);
+            // move j into the hole unless its home lies cyclically in (i, j]
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (stays) continue;
+            index_[i] = index_[j];
+            i = j;
+        }
+        index_[i] = Slot{0, kNil};
+    }
+
+    void resize_index(size_t n) {
+        index_.assign(n, Slot{0, kNil});
+        index_mask_ = n - 1;
+        for (uint32_t id = head_; id != kNil; id = entries_[id].next) insert_index(id, entries_[id].hash);
+    }
+};
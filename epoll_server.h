@@ -0,0 +1,526 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "httplib.h"
+#include "logger.h"
+#include "worker_pool.h"
+
+// Event-driven HTTP/1.1 front end, an alternative to httplib's
+// thread-per-connection server. One edge-triggered epoll loop per core, each
+// with its own SO_REUSEPORT listening socket, owns the sockets the kernel
+// hands it and parses requests itself. The minimal subset is supported:
+// Content-Length bodies (no chunked uploads), keep-alive and pipelining, no
+// TLS.
+//
+// Loops never run handlers. A parsed request goes to the shared WorkerPool
+// and the serialized response comes back through the loop's eventfd. A
+// worker is therefore busy only while a request is being handled, not for
+// the life of an idle keep-alive connection. Handlers keep the httplib
+// signature, so both engines serve the same routes.
+class EpollServer {
+public:
+    using Handler = httplib::Server::Handler;
+
+    struct Options {
+        int loops = 0;                      // 0 => one per core
+        size_t keep_alive_max = 100;        // requests per connection
+        int keep_alive_timeout_s = 5;       // idle connections are closed after this
+        size_t max_header_bytes = 64 * 1024;
+        size_t max_body_bytes = 64 * 1024 * 1024;
+    };
+
+    explicit EpollServer(const Options &opt)
+        : opt_(opt), workers_(nullptr), stop_(false),
+          open_(0), accepted_(0), requests_(0), bad_requests_(0), overloaded_(0) {
+        if (opt_.loops <= 0) opt_.loops = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    ~EpollServer() {
+        stop();
+        for (auto &l : loops_) {
+            for (auto &kv : l->conns) ::close(kv.first);
+            if (l->lfd >= 0) ::close(l->lfd);
+            if (l->efd >= 0) ::close(l->efd);
+            if (l->ep >= 0) ::close(l->ep);
+        }
+    }
+
+    // Non-copyable
+    EpollServer(const EpollServer&) = delete;
+    EpollServer& operator=(const EpollServer&) = delete;
+
+    // Routes are matched in registration order against the decoded path,
+    // first full match wins (as in httplib)
+    void route(const std::string &method, const std::string &pattern, Handler h) {
+        routes_.push_back(Route{method, std::regex(pattern), std::move(h)});
+    }
+
+    // Answers requests that the worker pool sheds
+    void set_overload_handler(Handler h) { overload_ = std::move(h); }
+
+    // Runs on the worker thread before each request is dispatched or shed
+    void set_pre_dispatch(std::function<void()> f) { pre_dispatch_ = std::move(f); }
+
+    // Bind one listening socket per loop and start the loops. Handlers run on
+    // `workers`, which must outlive the server's loops (stop() first).
+    bool listen(const std::string &host, int port, WorkerPool &workers) {
+        workers_ = &workers;
+        sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(port));
+        if (::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+            LOG_ERROR("EPOLL bad listen address " << host);
+            return false;
+        }
+        for (int i = 0; i < opt_.loops; i++) {
+            std::unique_ptr<Loop> l(new Loop());
+            l->lfd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            int one = 1;
+            if (l->lfd < 0
+                || ::setsockopt(l->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+                || ::setsockopt(l->lfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0
+                || ::bind(l->lfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+                || ::listen(l->lfd, SOMAXCONN) != 0) {
+                LOG_ERROR("EPOLL cannot listen on " << host << ":" << port << ": " << std::strerror(errno));
+                if (l->lfd >= 0) ::close(l->lfd);
+                return false;
+            }
+            l->ep = ::epoll_create1(EPOLL_CLOEXEC);
+            l->efd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (l->ep < 0 || l->efd < 0) {
+                LOG_ERROR("EPOLL cannot create epoll/eventfd: " << std::strerror(errno));
+                return false;
+            }
+            add_fd(*l, l->lfd, EPOLLIN | EPOLLET);
+            add_fd(*l, l->efd, EPOLLIN | EPOLLET);
+            loops_.push_back(std::move(l));
+        }
+        for (auto &l : loops_) {
+            Loop *lp = l.get();
+            lp->th = std::thread([this, lp]{ run(*lp); });
+        }
+        return true;
+    }
+
+    // Stop and join the loops; open connections are closed by the destructor
+    void stop() {
+        if (stop_.exchange(true)) return;
+        for (auto &l : loops_) {
+            uint64_t one = 1;
+            if (l->efd >= 0 && ::write(l->efd, &one, sizeof(one)) < 0) {}
+            if (l->th.joinable()) l->th.join();
+        }
+    }
+
+    // Statistics (for metrics)
+    int loop_count() const noexcept { return opt_.loops; }
+    uint64_t connections_open() const noexcept { return open_.load(std::memory_order_relaxed); }
+    uint64_t connections_accepted() const noexcept { return accepted_.load(std::memory_order_relaxed); }
+    uint64_t requests() const noexcept { return requests_.load(std::memory_order_relaxed); }
+    uint64_t bad_requests() const noexcept { return bad_requests_.load(std::memory_order_relaxed); }
+    // requests answered by the loop itself because the pool refused them
+    uint64_t overloaded() const noexcept { return overloaded_.load(std::memory_order_relaxed); }
+
+private:
+    struct Route {
+        std::string method;
+        std::regex pattern;
+        Handler handler;
+    };
+
+    struct Conn {
+        int fd;
+        uint64_t gen;                   // tells a reused fd from the old connection
+        std::string in;
+        std::string out;
+        size_t out_off = 0;
+        bool busy = false;              // a request is with the workers
+        bool close_after = false;       // close once `out` is written
+        bool peer_closed = false;
+        size_t served = 0;
+        std::chrono::steady_clock::time_point last_active;
+    };
+
+    // A finished response on its way back to the owning loop
+    struct Done {
+        int fd;
+        uint64_t gen;
+        std::string out;
+        bool close;
+    };
+
+    struct Loop {
+        int ep = -1, lfd = -1, efd = -1;
+        std::thread th;
+        std::unordered_map<int, std::unique_ptr<Conn>> conns;   // loop thread only
+        uint64_t next_gen = 1;
+        std::mutex done_mtx;
+        std::vector<Done> done;
+    };
+
+    enum class Parse { NEED_MORE, READY, BAD };
+
+    Options opt_;
+    WorkerPool *workers_;
+    std::vector<Route> routes_;
+    Handler overload_;
+    std::function<void()> pre_dispatch_;
+    std::vector<std::unique_ptr<Loop>> loops_;
+    std::atomic<bool> stop_;
+
+    std::atomic<uint64_t> open_;
+    std::atomic<uint64_t> accepted_;
+    std::atomic<uint64_t> requests_;
+    std::atomic<uint64_t> bad_requests_;
+    std::atomic<uint64_t> overloaded_;
+
+    static void add_fd(Loop &l, int fd, uint32_t events) {
+        epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        ::epoll_ctl(l.ep, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    void run(Loop &l) {
+        epoll_event evs[256];
+        auto last_sweep = std::chrono::steady_clock::now();
+        while (!stop_.load(std::memory_order_relaxed)) {
+            int n = ::epoll_wait(l.ep, evs, 256, 100);
+            for (int i = 0; i < n; i++) {
+                int fd = evs[i].data.fd;
+                if (fd == l.lfd) { accept_all(l); continue; }
+                if (fd == l.efd) { complete_all(l); continue; }
+                auto it = l.conns.find(fd);
+                if (it == l.conns.end()) continue;
+                Conn &c = *it->second;
+                if (evs[i].events & EPOLLERR) { close_conn(l, c); continue; }
+                if ((evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !read_all(c)) { close_conn(l, c); continue; }
+                process(l, c);
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_sweep >= std::chrono::seconds(1)) {
+                sweep_idle(l, now);
+                last_sweep = now;
+            }
+        }
+    }
+
+    void accept_all(Loop &l) {
+        for (;;) {
+            int fd = ::accept4(l.lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) LOG_WARN("EPOLL accept failed: " << std::strerror(errno));
+                return;
+            }
+            int one = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            std::unique_ptr<Conn> c(new Conn());
+            c->fd = fd;
+            c->gen = l.next_gen++;
+            c->last_active = std::chrono::steady_clock::now();
+            l.conns[fd] = std::move(c);
+            add_fd(l, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+            accepted_.fetch_add(1, std::memory_order_relaxed);
+            open_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Read until EAGAIN (edge-triggered); false on a socket error, or when
+    // more is buffered than the largest request plus the head of the next.
+    // parse() only enforces the limits on the request in front, and while
+    // that one is with the workers a pipelining client could otherwise grow
+    // `in` without bound.
+    bool read_all(Conn &c) {
+        char buf[64 * 1024];
+        for (;;) {
+            ssize_t r = ::read(c.fd, buf, sizeof(buf));
+            if (r > 0) {
+                c.in.append(buf, static_cast<size_t>(r));
+                c.last_active = std::chrono::steady_clock::now();
+                if (c.in.size() > 2 * opt_.max_header_bytes + opt_.max_body_bytes) return false;
+                continue;
+            }
+            if (r == 0) { c.peer_closed = true; return true; }
+            if (errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+
+    // Write as much of `out` as the socket takes; false on a socket error
+    static bool flush(Conn &c) {
+        while (c.out_off < c.out.size()) {
+            ssize_t w = ::send(c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL);
+            if (w > 0) { c.out_off += static_cast<size_t>(w); continue; }
+            if (w < 0 && errno == EINTR) continue;
+            if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            return false;
+        }
+        c.out.clear();
+        c.out_off = 0;
+        return true;
+    }
+
+    void close_conn(Loop &l, Conn &c) {
+        int fd = c.fd;
+        ::epoll_ctl(l.ep, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        l.conns.erase(fd);       // destroys c
+        open_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Advance one connection: finish pending output, then start the next
+    // buffered request. May close (and free) the connection.
+    void process(Loop &l, Conn &c) {
+        if (!flush(c)) { close_conn(l, c); return; }
+        if (!c.out.empty()) return;              // wait for EPOLLOUT
+        if (c.close_after) { close_conn(l, c); return; }
+        if (c.busy) return;
+
+        httplib::Request req;
+        int status = 400;
+        Parse p = c.in.empty() ? Parse::NEED_MORE : parse(c, req, status);
+        if (p == Parse::NEED_MORE) {
+            if (c.peer_closed) close_conn(l, c);
+            return;
+        }
+        if (p == Parse::BAD) {
+            bad_requests_.fetch_add(1, std::memory_order_relaxed);
+            httplib::Response res;
+            res.status = status;
+            c.out = serialize(res, true);
+            c.close_after = true;
+            process(l, c);
+            return;
+        }
+
+        requests_.fetch_add(1, std::memory_order_relaxed);
+        c.served++;
+        std::string conn_hdr = req.get_header_value("Connection");
+        bool close = c.served >= opt_.keep_alive_max || c.peer_closed
+                     || strcase_eq(conn_hdr, "close")
+                     || (req.version == "HTTP/1.0" && !strcase_eq(conn_hdr, "keep-alive"));
+        c.busy = true;
+
+        Loop *lp = &l;
+        int fd = c.fd;
+        uint64_t gen = c.gen;
+        auto job = std::make_shared<httplib::Request>(std::move(req));
+        bool queued = workers_->enqueue([this, lp, fd, gen, job, close]{
+            httplib::Response res;
+            if (pre_dispatch_) pre_dispatch_();
+            if (WorkerPool::shedding() && overload_) overload_(*job, res);
+            else dispatch(*job, res);
+            post(*lp, Done{fd, gen, serialize(res, close), close});
+        });
+        if (!queued) {
+            // not even the shedder took it: answer 503 from the loop
+            overloaded_.fetch_add(1, std::memory_order_relaxed);
+            httplib::Response res;
+            if (overload_) overload_(*job, res);
+            else res.status = 503;
+            c.busy = false;
+            c.out = serialize(res, true);
+            c.close_after = true;
+            process(l, c);
+        }
+    }
+
+    // Runs on a worker
+    void dispatch(httplib::Request &req, httplib::Response &res) {
+        bool path_known = false;
+        for (auto &r : routes_) {
+            if (!std::regex_match(req.path, req.matches, r.pattern)) continue;
+            path_known = true;
+            if (r.method != req.method) continue;
+            r.handler(req, res);
+            if (res.status == -1) res.status = 200;
+            return;
+        }
+        res.status = path_known ? 405 : 404;
+    }
+
+    void post(Loop &l, Done d) {
+        {
+            std::lock_guard<std::mutex> lk(l.done_mtx);
+            l.done.push_back(std::move(d));
+        }
+        uint64_t one = 1;
+        if (::write(l.efd, &one, sizeof(one)) < 0) {}
+    }
+
+    void complete_all(Loop &l) {
+        uint64_t v;
+        while (::read(l.efd, &v, sizeof(v)) > 0) {}
+        std::vector<Done> done;
+        {
+            std::lock_guard<std::mutex> lk(l.done_mtx);
+            done.swap(l.done);
+        }
+        for (auto &d : done) {
+            auto it = l.conns.find(d.fd);
+            // the connection closed while its request was being handled
+            if (it == l.conns.end() || it->second->gen != d.gen) continue;
+            Conn &c = *it->second;
+            c.busy = false;
+            c.out = std::move(d.out);
+            c.out_off = 0;
+            c.close_after = d.close;
+            c.last_active = std::chrono::steady_clock::now();
+            process(l, c);
+        }
+    }
+
+    void sweep_idle(Loop &l, std::chrono::steady_clock::time_point now) {
+        auto limit = std::chrono::seconds(opt_.keep_alive_timeout_s);
+        std::vector<int> idle;
+        for (auto &kv : l.conns) {
+            const Conn &c = *kv.second;
+            if (!c.busy && c.out.empty() && now - c.last_active > limit) idle.push_back(kv.first);
+        }
+        for (int fd : idle) close_conn(l, *l.conns[fd]);
+    }
+
+    static bool strcase_eq(const std::string &a, const char *b) {
+        size_t n = std::strlen(b);
+        if (a.size() != n) return false;
+        for (size_t i = 0; i < n; i++) {
+            if (std::tolower(static_cast<unsigned char>(a[i])) != std::tolower(static_cast<unsigned char>(b[i]))) return false;
+        }
+        return true;
+    }
+
+    // Parse one request from the front of c.in; on READY it is consumed
+    Parse parse(Conn &c, httplib::Request &req, int &status) {
+        size_t hdr_end = c.in.find("\r\n\r\n");
+        if (hdr_end == std::string::npos) {
+            if (c.in.size() > opt_.max_header_bytes) { status = 431; return Parse::BAD; }
+            return Parse::NEED_MORE;
+        }
+        if (hdr_end > opt_.max_header_bytes) { status = 431; return Parse::BAD; }
+
+        size_t le = c.in.find("\r\n");
+        size_t sp1 = c.in.find(' ');
+        size_t sp2 = c.in.rfind(' ', le);
+        if (sp1 == std::string::npos || sp1 >= le || sp2 == sp1) return Parse::BAD;
+        req.method = c.in.substr(0, sp1);
+        req.target = c.in.substr(sp1 + 1, sp2 - sp1 - 1);
+        req.version = c.in.substr(sp2 + 1, le - sp2 - 1);
+        if (req.version != "HTTP/1.1" && req.version != "HTTP/1.0") { status = 505; return Parse::BAD; }
+
+        for (size_t pos = le + 2; pos < hdr_end;) {
+            size_t e = c.in.find("\r\n", pos);
+            size_t colon = c.in.find(':', pos);
+            if (colon == std::string::npos || colon > e) return Parse::BAD;
+            size_t vb = c.in.find_first_not_of(" \t", colon + 1);
+            size_t ve = c.in.find_last_not_of(" \t", e - 1);
+            std::string value = (vb == std::string::npos || vb >= e || ve < vb) ? std::string() : c.in.substr(vb, ve - vb + 1);
+            req.headers.emplace(c.in.substr(pos, colon - pos), std::move(value));
+            pos = e + 2;
+        }
+
+        std::string te = req.get_header_value("Transfer-Encoding");
+        if (!te.empty() && !strcase_eq(te, "identity")) { status = 501; return Parse::BAD; }
+        size_t clen = 0;
+        if (req.has_header("Content-Length")) {
+            const std::string cl = req.get_header_value("Content-Length");
+            char *end = nullptr;
+            unsigned long long v = std::strtoull(cl.c_str(), &end, 10);
+            if (cl.empty() || *end != '\0') return Parse::BAD;
+            if (v > opt_.max_body_bytes) { status = 413; return Parse::BAD; }
+            clen = static_cast<size_t>(v);
+        }
+        size_t total = hdr_end + 4 + clen;
+        if (c.in.size() < total) return Parse::NEED_MORE;
+        req.body.assign(c.in, hdr_end + 4, clen);
+        c.in.erase(0, total);
+
+        std::string target = req.target.substr(0, req.target.find('#'));
+        size_t q = target.find('?');
+        req.path = httplib::decode_path_component(target.substr(0, q));
+        if (q != std::string::npos) httplib::detail::parse_query_text(target.substr(q + 1), req.params);
+        return Parse::READY;
+    }
+
+    // Status line, headers and body. A content provider (raw GETs) is drained
+    // into the buffer; its source buffer is shared, so that's the only copy.
+    // A chunked one (inflating a compressed value) is drained until done and
+    // sent with a Content-Length like the rest; if it fails the reply is a 500.
+    static std::string serialize(httplib::Response &res, bool close) {
+        if (res.status == -1) res.status = 200;
+        std::string body;
+        const std::string *bp = &res.body;
+        if (res.content_provider_) {
+            body.reserve(res.content_length_);
+            bool done = false;
+            httplib::DataSink sink;
+            sink.write = [&body](const char *d, size_t n) { body.append(d, n); return true; };
+            sink.is_writable = []{ return true; };
+            sink.done = [&done]{ done = true; };
+            size_t off = 0;
+            if (res.is_chunked_content_provider_) {
+                while (!done) {
+                    size_t before = body.size();
+                    if (!res.content_provider_(off, 0, sink)) {
+                        body.clear();
+                        res.status = 500;
+                        res.headers.erase("Content-Type");
+                        res.headers.erase("Content-Encoding");
+                        break;
+                    }
+                    off += body.size() - before;
+                }
+            }
+            while (off < res.content_length_) {
+                size_t before = body.size();
+                if (!res.content_provider_(off, res.content_length_ - off, sink) || body.size() == before) break;
+                off += body.size() - before;
+            }
+            bp = &body;
+        }
+        std::string out;
+        out.reserve(128 + bp->size());
+        out += "HTTP/1.1 ";
+        out += std::to_string(res.status);
+        out += ' ';
+        out += httplib::status_message(res.status);
+        out += "\r\n";
+        for (auto &h : res.headers) {
+            if (strcase_eq(h.first, "Content-Length") || strcase_eq(h.first, "Connection")) continue;
+            out += h.first;
+            out += ": ";
+            out += h.second;
+            out += "\r\n";
+        }
+        out += "Content-Length: ";
+        out += std::to_string(bp->size());
+        out += close ? "\r\nConnection: close\r\n\r\n" : "\r\nConnection: keep-alive\r\n\r\n";
+        out += *bp;
+        return out;
+    }
+};
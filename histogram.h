@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Lock-free log-linear latency histogram (HDR style), shared by the server and
+// loadgen. Values are nanoseconds. Each power of two is split into 32 linear
+// sub-buckets, so a reported percentile is within ~3% of the true value, from
+// 1 ns up to ~2^44 ns (about 4.9 hours; larger values land in the last bucket).
+// record() is one relaxed fetch_add on the bucket plus the count, sum and max
+// updates; readers scan the buckets without stopping writers, so a snapshot
+// taken under load may be off by the few samples recorded meanwhile.
+class LatencyHistogram {
+public:
+    static constexpr int kSubBits = 5;
+    static constexpr uint64_t kSub = 1ULL << kSubBits;       // sub-buckets per power of two
+    static constexpr int kMaxExp = 44;
+    static constexpr size_t kBuckets = (size_t)(kMaxExp - kSubBits + 1) * kSub + kSub;
+
+    LatencyHistogram() { reset(); }
+
+    // Non-copyable (atomics)
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    void record(uint64_t ns) noexcept {
+        buckets_[index_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t prev = max_.load(std::memory_order_relaxed);
+        while (ns > prev && !max_.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
+    }
+
+    void record_since(const std::chrono::steady_clock::time_point &t0) noexcept {
+        auto d = std::chrono::steady_clock::now() - t0;
+        record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+    }
+
+    // Add every sample of `o` into this histogram
+    void merge(const LatencyHistogram &o) noexcept {
+        for (size_t i = 0; i < kBuckets; i++) {
+            uint64_t n = o.buckets_[i].load(std::memory_order_relaxed);
+            if (n) buckets_[i].fetch_add(n, std::memory_order_relaxed);
+        }
+        count_.fetch_add(o.count(), std::memory_order_relaxed);
+        sum_.fetch_add(o.sum_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t m = o.max(), prev = max_.load(std::memory_order_relaxed);
+        while (m > prev && !max_.compare_exchange_weak(prev, m, std::memory_order_relaxed)) {}
+    }
+
+    void reset() noexcept {
+        for (auto &b : buckets_) b.store(0, std::memory_order_relaxed);
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const noexcept { return count_.load(std::memory_order_relaxed); }
+    uint64_t max() const noexcept { return max_.load(std::memory_order_relaxed); }
+    uint64_t sum() const noexcept { return sum_.load(std::memory_order_relaxed); }
+    double mean() const noexcept {
+        uint64_t n = count();
+        return n ? (double)sum_.load(std::memory_order_relaxed) / (double)n : 0.0;
+    }
+
+    // Value at quantile q in [0, 1], in ns: the upper edge of the bucket that
+    // holds the q-th sample, capped at the recorded max
+    uint64_t percentile(double q) const noexcept {
+        uint64_t total = 0;
+        for (auto &b : buckets_) total += b.load(std::memory_order_relaxed);
+        if (total == 0) return 0;
+        uint64_t rank = (uint64_t)(q * (double)total + 0.5);
+        if (rank < 1) rank = 1;
+        if (rank > total) rank = total;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBuckets; i++) {
+            seen += buckets_[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                uint64_t v = upper_edge(i);
+                uint64_t m = max();
+                return (m && v > m) ? m : v;
+            }
+        }
+        return max();
+    }
+
+    double percentile_ms(double q) const noexcept { return (double)percentile(q) / 1e6; }
+
+private:
+    std::atomic<uint64_t> buckets_[kBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+
+    // Values below kSub map 1:1; above, bucket = (exponent group, top kSubBits
+    // bits below the leading one)
+    static size_t index_of(uint64_t v) noexcept {
+        if (v < kSub) return (size_t)v;
+        int exp = 63 - __builtin_clzll(v);                 // position of the leading one
+        if (exp > kMaxExp) return kBuckets - 1;
+        uint64_t sub = (v >> (exp - kSubBits)) & (kSub - 1);
+        return (size_t)(exp - kSubBits + 1) * kSub + (size_t)sub;
+    }
+
+    static uint64_t upper_edge(size_t i) noexcept {
+        if (i < kSub) return i;
+        int exp = (int)(i / kSub) + kSubBits - 1;
+        uint64_t sub = i % kSub;
+        uint64_t lo = (1ULL << exp) | (sub << (exp - kSubBits));
+        return lo + (1ULL << (exp - kSubBits)) - 1;
+    }
+};
+
+// Records the lifetime of the enclosing scope into a histogram
+class ScopedLatency {
+public:
+    explicit ScopedLatency(LatencyHistogram &h) : h_(h), t0_(std::chrono::steady_clock::now()) {}
+    ~ScopedLatency() { h_.record_since(t0_); }
+
+    ScopedLatency(const ScopedLatency&) = delete;
+    ScopedLatency& operator=(const ScopedLatency&) = delete;
+
+private:
+    LatencyHistogram &h_;
+    std::chrono::steady_clock::time_point t0_;
+};
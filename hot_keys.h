@@ -0,0 +1,58 @@
+#pragma once
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Saved working set: the cache's hottest keys, hottest first, so a restarted
+// server can reload them before taking traffic. Text header line, then one
+// "<length> <key bytes>\n" record per key (keys may hold any byte).
+namespace hot_keys {
+
+static constexpr const char* kHeader = "kv-hot-keys 1";
+
+// Write atomically (temp file, fsync'd, then renamed) so a crash mid-dump,
+// or just after, keeps a complete list
+inline bool save(const std::string &path, const std::vector<std::string> &keys) {
+    const std::string tmp = path + ".tmp";
+    FILE *f = std::fopen(tmp.c_str(), "wb");
+    if (!f) return false;
+    bool ok = std::fprintf(f, "%s\n", kHeader) > 0;
+    for (size_t i = 0; ok && i < keys.size(); i++) {
+        const std::string &k = keys[i];
+        ok = std::fprintf(f, "%zu ", k.size()) > 0
+             && std::fwrite(k.data(), 1, k.size(), f) == k.size()
+             && std::fputc('\n', f) != EOF;
+    }
+    ok = ok && std::fflush(f) == 0 && ::fsync(fileno(f)) == 0;
+    if (std::fclose(f) != 0) ok = false;
+    if (ok && std::rename(tmp.c_str(), path.c_str()) == 0) return true;
+    std::remove(tmp.c_str());
+    return false;
+}
+
+// Read up to `max` keys (0 = all). False if the file is missing or not a
+// hot-key list; a truncated tail just ends the list.
+inline bool load(const std::string &path, size_t max, std::vector<std::string> &keys) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) return false;
+    std::streamoff size = in.tellg();
+    in.seekg(0);
+    std::string line;
+    if (!std::getline(in, line) || line != kHeader) return false;
+    while (max == 0 || keys.size() < max) {
+        size_t len;
+        if (!(in >> len) || in.get() != ' ') break;
+        // a length past the end of the file is corruption: stop, don't allocate it
+        if (len > static_cast<size_t>(size - in.tellg())) break;
+        std::string k(len, '\0');
+        if (!in.read(&k[0], static_cast<std::streamsize>(len)) || in.get() != '\n') break;
+        keys.push_back(std::move(k));
+    }
+    return true;
+}
+
+} // namespace hot_keys
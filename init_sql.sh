@@ -4,6 +4,8 @@
 psql <<'SQL'
 CREATE TABLE IF NOT EXISTS kv_store (
   key TEXT PRIMARY KEY,
-  value BYTEA
+  value BYTEA,
+  updated_at TIMESTAMPTZ NOT NULL DEFAULT now()
 );
+ALTER TABLE kv_store ADD COLUMN IF NOT EXISTS updated_at TIMESTAMPTZ NOT NULL DEFAULT now();
 SQL
@@ -0,0 +1,230 @@
+#pragma once
+
+#include <libpq-fe.h>
+#include <poll.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "logger.h"
+#include "negative_cache.h"
+#include "sharded_cache.h"
+
+// Keeps the cache coherent with writes other servers (or anything else) make
+// to kv_store. PGStore::ensure_notify_trigger() has every committed write
+// NOTIFY kChannel with its key. A dedicated connection LISTENs, drains what
+// has arrived in batches of up to max_batch keys, and erases them from the
+// cache and the negative cache. Notifications from this server's own
+// connections are skipped, since its writes already updated the cache. An
+// empty payload, or a lost connection (notifications may have been missed),
+// clears everything.
+//
+// A cache fill that raced with an invalidation must not put the old value
+// back. Fills take a ticket() before reading Postgres, and after caching
+// what they read check stale(); if it is true they erase the entry. Every
+// applied batch gets the next sequence number and stamps it on the stripes
+// of its keys before erasing them. A value read before the write was
+// committed was read under an older ticket, so either the erase comes after
+// the fill or the fill sees the stamp.
+class CacheInvalidator {
+public:
+    static constexpr const char *kChannel = "kv_invalidate";
+
+    // `own_pids` lists the server's own backends; it is re-read every second
+    CacheInvalidator(std::string conninfo, ShardedCache &cache, NegativeCache *negative,
+                     std::function<std::vector<int>()> own_pids, size_t max_batch)
+        : conninfo_(std::move(conninfo)), cache_(cache), negative_(negative), own_pids_fn_(std::move(own_pids)),
+          max_batch_(max_batch ? max_batch : 1), pg_(nullptr), stop_(false), connected_(false), seq_(0),
+          notifications_(0), own_skipped_(0), keys_invalidated_(0), batches_(0), max_batch_seen_(0),
+          flushes_(0), reconnects_(0) {
+        for (auto &s : stripe_seq_) s.store(0, std::memory_order_relaxed);
+    }
+
+    ~CacheInvalidator() { stop(); }
+
+    // Non-copyable
+    CacheInvalidator(const CacheInvalidator&) = delete;
+    CacheInvalidator& operator=(const CacheInvalidator&) = delete;
+
+    // Called with each invalidated key before it is erased, or with nullptr
+    // before a full flush. Set before start().
+    void set_on_invalidate(std::function<void(const std::string*)> fn) { on_invalidate_ = std::move(fn); }
+
+    // Connect, LISTEN and start the listener thread. False (with `err`) if
+    // the first connection fails; later failures are retried.
+    bool start(std::string &err) {
+        if (!listen(err)) return false;
+        th_ = std::thread([this]{ run(); });
+        return true;
+    }
+
+    void stop() {
+        if (stop_.exchange(true)) return;
+        if (th_.joinable()) th_.join();
+        if (pg_) PQfinish(pg_);
+        pg_ = nullptr;
+    }
+
+    // Before the Postgres read whose result will be cached
+    uint64_t ticket() const noexcept { return seq_.load(std::memory_order_seq_cst); }
+
+    // After caching it: true if `key` was invalidated since `ticket`
+    bool stale(const std::string &key, uint64_t ticket) const noexcept {
+        return stripe_for(key).load(std::memory_order_seq_cst) > ticket;
+    }
+
+    bool connected() const noexcept { return connected_.load(std::memory_order_relaxed); }
+    uint64_t notifications() const noexcept { return notifications_.load(std::memory_order_relaxed); }
+    uint64_t own_skipped() const noexcept { return own_skipped_.load(std::memory_order_relaxed); }
+    uint64_t keys_invalidated() const noexcept { return keys_invalidated_.load(std::memory_order_relaxed); }
+    uint64_t batches() const noexcept { return batches_.load(std::memory_order_relaxed); }
+    uint64_t max_batch_seen() const noexcept { return max_batch_seen_.load(std::memory_order_relaxed); }
+    uint64_t flushes() const noexcept { return flushes_.load(std::memory_order_relaxed); }
+    uint64_t reconnects() const noexcept { return reconnects_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t kStripes = 1024;
+    static constexpr int kPollMs = 100;
+    static constexpr int kRetryMs = 1000;
+
+    std::string conninfo_;
+    ShardedCache &cache_;
+    NegativeCache *negative_;
+    std::function<std::vector<int>()> own_pids_fn_;
+    std::function<void(const std::string*)> on_invalidate_;
+    size_t max_batch_;
+    PGconn *pg_;                 // listener thread only, after start()
+    std::thread th_;
+    std::atomic<bool> stop_;
+    std::atomic<bool> connected_;
+    std::atomic<uint64_t> seq_;
+    std::atomic<uint64_t> stripe_seq_[kStripes];
+    std::vector<int> own_pids_;
+
+    std::atomic<uint64_t> notifications_;
+    std::atomic<uint64_t> own_skipped_;
+    std::atomic<uint64_t> keys_invalidated_;
+    std::atomic<uint64_t> batches_;
+    std::atomic<uint64_t> max_batch_seen_;
+    std::atomic<uint64_t> flushes_;
+    std::atomic<uint64_t> reconnects_;
+
+    const std::atomic<uint64_t>& stripe_for(const std::string &key) const {
+        return stripe_seq_[std::hash<std::string>{}(key) % kStripes];
+    }
+    std::atomic<uint64_t>& stripe_for(const std::string &key) {
+        return stripe_seq_[std::hash<std::string>{}(key) % kStripes];
+    }
+
+    bool listen(std::string &err) {
+        if (pg_) PQfinish(pg_);
+        pg_ = PQconnectdb(conninfo_.c_str());
+        PGresult *r = nullptr;
+        if (PQstatus(pg_) == CONNECTION_OK) r = PQexec(pg_, (std::string("LISTEN ") + kChannel).c_str());
+        bool ok = r && PQresultStatus(r) == PGRES_COMMAND_OK;
+        if (!ok) err = r ? PQresultErrorMessage(r) : PQerrorMessage(pg_);
+        if (r) PQclear(r);
+        if (!ok) {
+            PQfinish(pg_);
+            pg_ = nullptr;
+            return false;
+        }
+        connected_.store(true, std::memory_order_relaxed);
+        return true;
+    }
+
+    void run() {
+        auto pids_at = std::chrono::steady_clock::time_point();
+        std::unordered_set<std::string> batch;
+        while (!stop_.load(std::memory_order_relaxed)) {
+            if (!pg_) {
+                std::string err;
+                if (!listen(err)) {
+                    LOG_WARN("INVALIDATION LISTEN FAILED err=\"" << err << "\"");
+                    for (int i = 0; i < kRetryMs / kPollMs && !stop_.load(std::memory_order_relaxed); i++)
+                        std::this_thread::sleep_for(std::chrono::milliseconds(kPollMs));
+                    continue;
+                }
+                reconnects_.fetch_add(1, std::memory_order_relaxed);
+                LOG_INFO("INVALIDATION LISTENER RECONNECTED, cache cleared");
+                flush();
+            }
+            auto now = std::chrono::steady_clock::now();
+            if (now - pids_at >= std::chrono::seconds(1)) {
+                own_pids_ = own_pids_fn_();
+                std::sort(own_pids_.begin(), own_pids_.end());
+                pids_at = now;
+            }
+
+            pollfd pfd{PQsocket(pg_), POLLIN, 0};
+            if (::poll(&pfd, 1, kPollMs) < 0 && errno != EINTR) {
+                lost("poll failed");
+                continue;
+            }
+            if (!PQconsumeInput(pg_)) {
+                lost(PQerrorMessage(pg_));
+                continue;
+            }
+            bool all = false;
+            for (;;) {
+                PGnotify *n = PQnotifies(pg_);
+                if (!n) break;
+                notifications_.fetch_add(1, std::memory_order_relaxed);
+                if (std::binary_search(own_pids_.begin(), own_pids_.end(), n->be_pid)) {
+                    own_skipped_.fetch_add(1, std::memory_order_relaxed);
+                } else if (!n->extra[0]) {
+                    all = true;
+                } else {
+                    batch.insert(n->extra);
+                }
+                PQfreemem(n);
+                if (batch.size() >= max_batch_) apply(batch);
+            }
+            if (all) flush();
+            else if (!batch.empty()) apply(batch);
+            batch.clear();
+        }
+    }
+
+    // Connection trouble: drop it and clear the cache once reconnected
+    void lost(const char *why) {
+        LOG_WARN("INVALIDATION LISTENER LOST CONNECTION err=\"" << why << "\"");
+        connected_.store(false, std::memory_order_relaxed);
+        PQfinish(pg_);
+        pg_ = nullptr;
+    }
+
+    void apply(std::unordered_set<std::string> &keys) {
+        uint64_t s = seq_.fetch_add(1, std::memory_order_seq_cst) + 1;
+        for (auto &key : keys) {
+            stripe_for(key).store(s, std::memory_order_seq_cst);
+            if (on_invalidate_) on_invalidate_(&key);
+            cache_.erase(key);
+            if (negative_) negative_->invalidate(key);
+        }
+        uint64_t n = keys.size();
+        keys_invalidated_.fetch_add(n, std::memory_order_relaxed);
+        batches_.fetch_add(1, std::memory_order_relaxed);
+        if (n > max_batch_seen_.load(std::memory_order_relaxed)) max_batch_seen_.store(n, std::memory_order_relaxed);
+        LOG_DEBUG("INVALIDATED keys=" << n);
+        keys.clear();
+    }
+
+    void flush() {
+        uint64_t s = seq_.fetch_add(1, std::memory_order_seq_cst) + 1;
+        for (auto &st : stripe_seq_) st.store(s, std::memory_order_seq_cst);
+        if (on_invalidate_) on_invalidate_(nullptr);
+        cache_.clear();
+        if (negative_) negative_->clear();
+        flushes_.fetch_add(1, std::memory_order_relaxed);
+    }
+};
@@ -1,179 +1,873 @@
-// Command format: ./loadgen_new <ip> <port> <clients> <duration> <workload>
-
-#include "httplib.h"
-#include "json.hpp"
-#include <atomic>
-#include <chrono>
-#include <csignal>
-#include <iostream>
-#include <mutex>
-#include <random>
-#include <string>
-#include <thread>
-#include <vector>
-#include <fstream>
-#include <filesystem>
-
-using json = nlohmann::json;
-using namespace std::chrono;
-
-// Shared Counters
-static std::atomic<bool> stop_flag{false};
-static std::atomic<uint64_t> global_seq{0};
-static std::atomic<uint64_t> total_success{0};
-static std::atomic<uint64_t> total_errors{0};
-static std::atomic<uint64_t> total_requests{0};
-static std::atomic<uint64_t> total_latency_ns{0};
-
-// CTRL+C
-void signal_handler(int){ stop_flag.store(true);} 
-
-struct WorkArgs{
-    int tid;
-    httplib::Client* cli;
-    steady_clock::time_point end;    // end time
-    uint64_t keyspace;
-    uint64_t popular_size;
-    int retries;
-};
-
-// Helper: key generation
-static std::string key_thread(int tid, uint64_t seq, uint64_t ks){
-    uint64_t v = (uint64_t)tid * 1000003ULL + seq;
-    v %= ks;
-    return "t"+std::to_string(tid)+"-k"+std::to_string(v);
-}
-static std::string key_global(){ return "g"+std::to_string(global_seq.fetch_add(1)); }
-
-// latency measure & exponential backoff wait
-static bool attempt_op(httplib::Client* cli, const std::string& type, const std::string& path, const std::string& body, int retries, uint64_t &lat_ns){
-    for(int a=0;a<=retries;a++){
-        auto t0=steady_clock::now();
-        httplib::Result res;
-        if(type=="GET") res=cli->Get(path.c_str());
-        else if(type=="PUT") res=cli->Put(path.c_str(),body,"application/json");
-        else if(type=="DELETE") res=cli->Delete(path.c_str());
-        auto t1=steady_clock::now(); lat_ns=duration_cast<nanoseconds>(t1-t0).count();
-        if(res && res->status>=200 && res->status<300) return true;
-        if(a<retries) std::this_thread::sleep_for(std::chrono::milliseconds(50*(1<<a)));
-    }
-    return false;
-}
-
-// Workload functions
-void run_get_all(WorkArgs w){
-    auto end=w.end; auto cli=w.cli;
-    while(!stop_flag.load() && steady_clock::now()<end){
-        std::string key=key_global();
-        uint64_t lat; bool ok=attempt_op(cli,"GET","/kv/"+key,"",w.retries,lat);
-        total_requests.fetch_add(1, std::memory_order_relaxed);
-        if(ok){total_success.fetch_add(1, std::memory_order_relaxed); total_latency_ns.fetch_add(lat, std::memory_order_relaxed);} else total_errors.fetch_add(1, std::memory_order_relaxed);
-    }
-}
-
-void run_put_all(WorkArgs w){
-    int tid=w.tid; auto end=w.end; auto cli=w.cli; uint64_t seq=0;
-    while(!stop_flag.load() && steady_clock::now()<end){
-        std::string key=key_thread(tid,seq++,w.keyspace);
-        std::string type=(seq%2?"PUT":"DELETE");
-        json j; j["value"]="v"+std::to_string(seq);
-        uint64_t lat; bool ok=attempt_op(cli,type,"/kv/"+key,j.dump(),w.retries,lat);
-        total_requests.fetch_add(1, std::memory_order_relaxed);
-        if(ok){total_success.fetch_add(1, std::memory_order_relaxed); total_latency_ns.fetch_add(lat, std::memory_order_relaxed);} else total_errors.fetch_add(1, std::memory_order_relaxed);
-    }
-}
-
-void run_get_popular(WorkArgs w){
-    int tid=w.tid; auto end=w.end; auto cli=w.cli;
-    std::vector<std::string> keys;
-    for(uint64_t i=0;i<w.popular_size;i++) keys.push_back("popular-"+std::to_string(i));
-    std::mt19937_64 rng(tid+1234);
-    std::uniform_int_distribution<int> dist(0,(int)w.popular_size-1);
-    while(!stop_flag.load() && steady_clock::now()<end){
-        std::string key=keys[dist(rng)]; uint64_t lat;
-        bool ok=attempt_op(cli,"GET","/kv/"+key,"",w.retries,lat);
-        total_requests.fetch_add(1, std::memory_order_relaxed);
-        if(ok){total_success.fetch_add(1, std::memory_order_relaxed); total_latency_ns.fetch_add(lat, std::memory_order_relaxed);} else total_errors.fetch_add(1, std::memory_order_relaxed);
-    }
-}
-
-void run_mix(WorkArgs w){
-    int tid=w.tid; auto end=w.end; auto cli=w.cli; uint64_t seq=0;
-    std::mt19937_64 rng(tid+999);
-    std::uniform_real_distribution<double> ud(0.0,1.0);
-    while(!stop_flag.load() && steady_clock::now()<end){
-        double r=ud(rng); std::string type;
-        if(r<0.05) type="DELETE"; else type=(r<0.7?"GET":"PUT");
-        std::string key=key_thread(tid,seq++,w.keyspace);
-        json j; j["value"]="v"+std::to_string(seq);
-        uint64_t lat; bool ok=attempt_op(cli,type,"/kv/"+key,j.dump(),w.retries,lat);
-        total_requests.fetch_add(1, std::memory_order_relaxed);
-        if(ok){total_success.fetch_add(1, std::memory_order_relaxed); total_latency_ns.fetch_add(lat, std::memory_order_relaxed);} else total_errors.fetch_add(1, std::memory_order_relaxed);
-    }
-}
-
-
-int main(int argc,char**argv){
-    if(argc<6){
-        std::cout<<"Usage: ./loadgen_new <ip> <port> <clients> <duration> <workload>\n";
-        return 1;
-    }
-    std::string ip=argv[1];
-    int port=std::stoi(argv[2]);
-    int clients=std::stoi(argv[3]);
-    int duration=std::stoi(argv[4]);
-    std::string workload=argv[5];
-
-    std::signal(SIGINT,signal_handler);
-    std::signal(SIGTERM,signal_handler);
-
-    std::vector<std::thread> th;
-    th.reserve(clients);
-
-    auto end=steady_clock::now()+seconds(duration);
-
-    for(int i=0;i<clients;i++){
-        auto cli=new httplib::Client(ip,port);
-        cli->set_read_timeout(5,0);
-        cli->set_write_timeout(5,0);
-        WorkArgs w{i,cli,end,100000,100,2};
-        if(workload=="get_all") th.emplace_back(run_get_all,w);
-        else if(workload=="put_all") th.emplace_back(run_put_all,w);
-        else if(workload=="get_popular") th.emplace_back(run_get_popular,w);
-        else th.emplace_back(run_mix,w);
-    }
-
-    for(auto &t:th) if(t.joinable()) t.join();
-
-    double tp=(double)total_success.load()/duration;
-    double avg_ms=(total_success.load()>0? (double)total_latency_ns.load()/1e6/total_success.load():0);
-
-    std::cout<<"Total req: "<<total_requests.load()<<"\n";
-    std::cout<<"Success: "<<total_success.load()<<" Errors: "<<total_errors.load()<<"\n";
-    std::cout<<"Throughput: "<<tp<<" req/s\n";
-    std::cout<<"Avg Latency: "<<avg_ms<<" ms\n";
-
-    // Append results to CSV (clients, throughput, avg_latency_ms)
-    try {
-        const std::string fname = "results.csv";
-        bool write_header = true;
-        if (std::filesystem::exists(fname)) {
-            if (std::filesystem::file_size(fname) > 0) write_header = false;
-        }
-        std::ofstream fout(fname, std::ios::app);
-        if (!fout) {
-            std::cerr << "Failed to open " << fname << " for writing\n";
-            return 0;
-        }
-        if (write_header) {
-            fout << "clients,throughput,avg_latency_ms\n";
-        }
-        fout << clients << "," << tp << "," << avg_ms << "\n";
-        fout.close();
-        std::cout << "Appended results to " << fname << "\n";
-    } catch (const std::exception &e) {
-        std::cerr << "CSV write error: " << e.what() << "\n";
-    }
-
-    return 0;
-}
+// Command format: ./loadgen_new <ip> <port> <clients> <duration> <workload> [batch_size] [--option=value ...]
+
+#include "httplib.h"
+#include "json.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "histogram.h"
+#include "proc_stats.h"
+#include "workload.h"
+
+using json = nlohmann::json;
+using namespace std::chrono;
+
+// Shared Counters
+static std::atomic<bool> stop_flag{false};
+static std::atomic<uint64_t> total_success{0};
+static std::atomic<uint64_t> total_errors{0};
+static std::atomic<uint64_t> total_requests{0};
+static std::atomic<uint64_t> total_keys{0};   // keys moved by successful requests
+static std::atomic<uint64_t> total_retries{0};  // extra attempts
+static std::atomic<uint64_t> total_retried{0};  // requests that needed at least one
+// latency of requests that succeeded on the first try (lock-free, shared by
+// all client threads), and of those that needed retries
+static LatencyHistogram latency_hist;
+static LatencyHistogram retry_hist;
+
+// CTRL+C
+void signal_handler(int){ stop_flag.store(true);} 
+
+struct WorkArgs{
+    int tid;
+    int nthreads;                    // threads sharing the workload (trace replay strides by it)
+    httplib::Client* cli;
+    steady_clock::time_point end;    // end time
+    int retries;
+    const WorkloadSpec* spec;
+    std::shared_ptr<const ZipfGenerator> zipf;
+};
+
+static void record_result(bool ok, int attempts, int keys, uint64_t lat_ns){
+    total_requests.fetch_add(1, std::memory_order_relaxed);
+    if(attempts>1){ total_retries.fetch_add(attempts-1, std::memory_order_relaxed); total_retried.fetch_add(1, std::memory_order_relaxed); }
+    if(!ok){ total_errors.fetch_add(1, std::memory_order_relaxed); return; }
+    total_success.fetch_add(1, std::memory_order_relaxed);
+    total_keys.fetch_add(keys, std::memory_order_relaxed);
+    (attempts>1 ? retry_hist : latency_hist).record(lat_ns);
+}
+
+// Closed loop: send, wait for the answer, retry with exponential backoff.
+// A request that needed retries is timed from its first attempt, backoff
+// included, and recorded apart from first-try successes.
+static bool attempt_op(httplib::Client* cli, const Op& op, int retries, int &attempts, uint64_t &lat_ns){
+    auto t0=steady_clock::now();
+    for(int a=0;a<=retries;a++){
+        attempts=a+1;
+        httplib::Result res;
+        std::string type=op.method;
+        if(type=="GET") res=cli->Get(op.path.c_str());
+        else if(type=="PUT") res=cli->Put(op.path.c_str(),op.body,"application/json");
+        else if(type=="DELETE") res=op.body.empty()? cli->Delete(op.path.c_str()) : cli->Delete(op.path.c_str(),op.body,"application/json");
+        else if(type=="POST") res=cli->Post(op.path.c_str(),op.body,"application/json");
+        lat_ns=duration_cast<nanoseconds>(steady_clock::now()-t0).count();
+        if(res && res->status>=200 && res->status<300) return true;
+        if(a<retries) std::this_thread::sleep_for(std::chrono::milliseconds(50*(1<<a)));
+    }
+    return false;
+}
+
+void run_closed(WorkArgs w){
+    OpGen gen(*w.spec,w.tid,w.nthreads,w.zipf);
+    while(!stop_flag.load() && steady_clock::now()<w.end){
+        Op op=gen.next();
+        int attempts=0; uint64_t lat=0;
+        bool ok=attempt_op(w.cli,op,w.retries,attempts,lat);
+        record_result(ok,attempts,op.keys,lat);
+    }
+}
+
+// ---- open loop ----
+//
+// Requests arrive on a schedule (constant gaps or Poisson) regardless of how
+// fast the server answers. Each thread runs an epoll loop over its own
+// keep-alive connections, one request in flight per connection; arrivals
+// that find no idle connection wait in a FIFO. Latency is measured from the
+// scheduled arrival, so queueing behind a slow server counts (no coordinated
+// omission); the send-to-response time is kept separately as service time.
+// A failed attempt goes back to the front of the queue at once, up to
+// `retries` times.
+
+struct OpenLoopOptions{
+    double rate=0;             // requests per second, all threads together
+    bool poisson=true;
+    int threads=0;             // 0 = one per core
+    int connections=1;
+    int timeout_ms=5000;
+    size_t max_backlog=1000000;
+};
+
+static std::atomic<uint64_t> unfinished{0};       // still queued or in flight at the end
+static std::atomic<uint64_t> backlog_dropped{0};  // arrivals that found the queue full
+static std::atomic<uint64_t> max_backlog_seen{0};
+static LatencyHistogram service_hist;             // send to response, first attempts
+
+class OpenLoopWorker{
+public:
+    OpenLoopWorker(const WorkArgs& w, const OpenLoopOptions& o, const std::string& ip, int port, double rate, int conns)
+        : w_(w), o_(o), gen_(*w.spec,w.tid,w.nthreads,w.zipf), rng_(w.tid*7919+17), rate_(rate) {
+        addrinfo hints{}, *res=nullptr;
+        hints.ai_family=AF_INET; hints.ai_socktype=SOCK_STREAM;
+        if(getaddrinfo(ip.c_str(),nullptr,&hints,&res)==0 && res){
+            addr_=*reinterpret_cast<sockaddr_in*>(res->ai_addr);
+            freeaddrinfo(res);
+        }
+        addr_.sin_family=AF_INET;
+        addr_.sin_port=htons(port);
+        host_="Host: "+ip+":"+std::to_string(port)+"\r\n";
+        conns_.resize(conns);
+    }
+
+    void run(){
+        ep_=epoll_create1(EPOLL_CLOEXEC);
+        timer_=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+        epoll_event tev{}; tev.events=EPOLLIN; tev.data.u64=UINT64_MAX;
+        epoll_ctl(ep_,EPOLL_CTL_ADD,timer_,&tev);
+        for(size_t i=0;i<conns_.size();i++) open_conn(i);
+
+        auto start=steady_clock::now();
+        next_arrival_=start;
+        bool arriving=true;
+        steady_clock::time_point drain_until=w_.end+milliseconds(o_.timeout_ms);
+        epoll_event evs[64];
+        for(;;){
+            auto now=steady_clock::now();
+            if(arriving && (now>=w_.end || stop_flag.load())) arriving=false;
+            if(arriving){
+                while(next_arrival_<=now && next_arrival_<w_.end){
+                    if(queue_.size()>=o_.max_backlog) backlog_dropped.fetch_add(1,std::memory_order_relaxed);
+                    else queue_.push_back(Pending{gen_.next(),next_arrival_,0});
+                    next_arrival_+=gap();
+                }
+                uint64_t q=queue_.size();
+                if(q>max_backlog_seen.load(std::memory_order_relaxed)) max_backlog_seen.store(q,std::memory_order_relaxed);
+            }
+            reopen_and_expire(now);
+            dispatch(now);
+            if(!arriving && (busy_==0 && queue_.empty())) break;
+            if(!arriving && (now>=drain_until || stop_flag.load())) break;
+
+            arm_timer(arriving ? next_arrival_ : now+milliseconds(10));
+            int n=epoll_wait(ep_,evs,64,100);
+            for(int i=0;i<n;i++){
+                if(evs[i].data.u64==UINT64_MAX){ uint64_t x; (void)!read(timer_,&x,sizeof(x)); continue; }
+                handle(evs[i].data.u64,evs[i].events);
+            }
+        }
+        uint64_t left=queue_.size()+busy_;
+        unfinished.fetch_add(left,std::memory_order_relaxed);
+        for(size_t i=0;i<conns_.size();i++) if(conns_[i].fd>=0) ::close(conns_[i].fd);
+        ::close(timer_); ::close(ep_);
+    }
+
+private:
+    struct Pending{
+        Op op;
+        steady_clock::time_point scheduled;
+        int attempts;
+    };
+    enum class State{ DOWN, CONNECTING, IDLE, BUSY };
+    struct Conn{
+        int fd=-1;
+        State state=State::DOWN;
+        steady_clock::time_point retry_at{};   // DOWN: when to reconnect
+        steady_clock::time_point sent{};       // BUSY: when the request went out
+        std::string out; size_t out_off=0;
+        std::string in;
+        Pending req;
+        bool has_req=false;
+    };
+
+    WorkArgs w_;
+    OpenLoopOptions o_;
+    OpGen gen_;
+    std::mt19937_64 rng_;
+    double rate_;
+    sockaddr_in addr_{};
+    std::string host_;
+    int ep_=-1, timer_=-1;
+    std::vector<Conn> conns_;
+    std::deque<Pending> queue_;
+    size_t busy_=0;
+    steady_clock::time_point next_arrival_;
+
+    steady_clock::duration gap(){
+        double mean_ns=1e9/rate_;
+        double ns=o_.poisson ? std::exponential_distribution<double>(1.0/mean_ns)(rng_) : mean_ns;
+        return duration_cast<steady_clock::duration>(std::chrono::duration<double,std::nano>(ns));
+    }
+
+    void arm_timer(steady_clock::time_point t){
+        auto ns=duration_cast<nanoseconds>(t.time_since_epoch()).count();
+        if(ns<=0) ns=1;
+        itimerspec its{};
+        its.it_value.tv_sec=ns/1000000000; its.it_value.tv_nsec=ns%1000000000;
+        timerfd_settime(timer_,TFD_TIMER_ABSTIME,&its,nullptr);
+    }
+
+    void open_conn(size_t i){
+        Conn& c=conns_[i];
+        c.fd=socket(AF_INET,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+        int one=1; setsockopt(c.fd,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+        int r=connect(c.fd,(sockaddr*)&addr_,sizeof(addr_));
+        if(r<0 && errno!=EINPROGRESS){ ::close(c.fd); c.fd=-1; c.state=State::DOWN; c.retry_at=steady_clock::now()+milliseconds(100); return; }
+        c.state=State::CONNECTING;
+        c.in.clear();
+        epoll_event ev{}; ev.events=EPOLLIN|EPOLLOUT|EPOLLET|EPOLLRDHUP; ev.data.u64=i;
+        epoll_ctl(ep_,EPOLL_CTL_ADD,c.fd,&ev);
+    }
+
+    // Drop a connection; its request (if any) counts as a failed attempt
+    void fail_conn(size_t i){
+        Conn& c=conns_[i];
+        if(c.fd>=0){ epoll_ctl(ep_,EPOLL_CTL_DEL,c.fd,nullptr); ::close(c.fd); }
+        c.fd=-1;
+        bool was_busy=c.state==State::BUSY;
+        c.state=State::DOWN;
+        c.retry_at=steady_clock::now()+milliseconds(100);
+        if(was_busy){ busy_--; finish_attempt(c,false); }
+    }
+
+    void reopen_and_expire(steady_clock::time_point now){
+        for(size_t i=0;i<conns_.size();i++){
+            Conn& c=conns_[i];
+            if(c.state==State::DOWN && now>=c.retry_at) open_conn(i);
+            else if(c.state==State::BUSY && now-c.sent>milliseconds(o_.timeout_ms)) fail_conn(i);
+        }
+    }
+
+    void dispatch(steady_clock::time_point now){
+        for(size_t i=0;i<conns_.size() && !queue_.empty();i++){
+            Conn& c=conns_[i];
+            if(c.state!=State::IDLE) continue;
+            c.req=std::move(queue_.front()); queue_.pop_front();
+            c.req.attempts++;
+            c.has_req=true;
+            const Op& op=c.req.op;
+            c.out.clear(); c.out_off=0;
+            c.out.append(op.method).append(" ").append(op.path).append(" HTTP/1.1\r\n").append(host_);
+            if(!op.body.empty()) c.out.append("Content-Type: application/json\r\n");
+            c.out.append("Content-Length: ").append(std::to_string(op.body.size())).append("\r\n\r\n").append(op.body);
+            c.state=State::BUSY; c.sent=now; busy_++;
+            flush(i);
+        }
+    }
+
+    void flush(size_t i){
+        Conn& c=conns_[i];
+        while(c.out_off<c.out.size()){
+            ssize_t n=::send(c.fd,c.out.data()+c.out_off,c.out.size()-c.out_off,MSG_NOSIGNAL);
+            if(n>0){ c.out_off+=n; continue; }
+            if(n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) return;   // EPOLLOUT resumes
+            fail_conn(i); return;
+        }
+    }
+
+    void handle(size_t i, uint32_t events){
+        Conn& c=conns_[i];
+        if(c.fd<0) return;
+        if(c.state==State::CONNECTING){
+            int err=0; socklen_t len=sizeof(err);
+            getsockopt(c.fd,SOL_SOCKET,SO_ERROR,&err,&len);
+            if(err || (events&(EPOLLERR|EPOLLHUP))){ fail_conn(i); return; }
+            c.state=State::IDLE;
+            return;
+        }
+        if(events&EPOLLOUT && c.state==State::BUSY) flush(i);
+        if(c.fd<0) return;
+        if(events&(EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR)) read_all(i);
+    }
+
+    void read_all(size_t i){
+        Conn& c=conns_[i];
+        char buf[16384];
+        bool eof=false;
+        for(;;){
+            ssize_t n=::recv(c.fd,buf,sizeof(buf),0);
+            if(n>0){ c.in.append(buf,n); continue; }
+            if(n<0 && (errno==EAGAIN || errno==EWOULDBLOCK)) break;
+            eof=true;
+            break;
+        }
+        bool close_after=false;
+        parse(i,close_after);
+        if(!eof && !close_after) return;
+        // a request still in flight on a closed connection is lost
+        if(c.state==State::BUSY){ fail_conn(i); return; }
+        epoll_ctl(ep_,EPOLL_CTL_DEL,c.fd,nullptr); ::close(c.fd); c.fd=-1;
+        open_conn(i);
+    }
+
+    // Consume the response if it is complete; `close_after` is set when the
+    // server ends the connection after it
+    void parse(size_t i, bool &close_after){
+        Conn& c=conns_[i];
+        if(c.state!=State::BUSY) return;
+        size_t hend=c.in.find("\r\n\r\n");
+        if(hend==std::string::npos) return;
+        int status=0;
+        size_t sp=c.in.find(' ');
+        if(sp!=std::string::npos && sp<hend) status=std::atoi(c.in.c_str()+sp+1);
+        size_t clen=0;
+        for(size_t p=c.in.find("\r\n")+2;p<hend;){
+            size_t e=c.in.find("\r\n",p);
+            std::string line=c.in.substr(p,e-p);
+            std::transform(line.begin(),line.end(),line.begin(),[](unsigned char ch){ return std::tolower(ch); });
+            if(line.rfind("content-length:",0)==0) clen=std::strtoull(line.c_str()+15,nullptr,10);
+            else if(line.rfind("connection:",0)==0 && line.find("close")!=std::string::npos) close_after=true;
+            p=e+2;
+        }
+        if(c.in.size()<hend+4+clen){ close_after=false; return; }
+        c.in.erase(0,hend+4+clen);
+        c.state=State::IDLE; busy_--;
+        finish_attempt(c,status>=200 && status<300);
+    }
+
+    void finish_attempt(Conn& c, bool ok){
+        if(!c.has_req) return;
+        c.has_req=false;
+        auto now=steady_clock::now();
+        if(c.req.attempts==1 && ok) service_hist.record(duration_cast<nanoseconds>(now-c.sent).count());
+        if(!ok && c.req.attempts<=w_.retries){ queue_.push_front(std::move(c.req)); return; }
+        record_result(ok,c.req.attempts,c.req.op.keys,duration_cast<nanoseconds>(now-c.req.scheduled).count());
+    }
+};
+
+// ---- sweeps and resource sampling ----
+//
+// A run can be repeated over a list of client counts (closed loop) or
+// target rates (open loop), each step with its own warm-up. Once a second,
+// the sampler records the loadgen's completions and CPU, the server's
+// /metrics, and /proc figures for the server process (when it runs on this
+// host) and the machine. Measured-phase samples are averaged per step; the
+// sweep summary points at the step where throughput stops following the
+// load and at the busiest resource there.
+
+static void reset_counters(){
+    for(auto* c : {&total_success,&total_errors,&total_requests,&total_keys,&total_retries,&total_retried,
+                   &backlog_dropped,&max_backlog_seen}) c->store(0);
+    latency_hist.reset(); retry_hist.reset(); service_hist.reset();
+}
+
+static bool is_local_host(const std::string& ip){
+    return ip=="localhost" || ip.rfind("127.",0)==0 || ip=="::1" || ip=="0.0.0.0";
+}
+
+// "1,2,4,8", "1..64" (doubling), or a mix such as "1..8,12,16"
+static bool parse_sweep(const std::string& s, std::vector<double>& out){
+    std::stringstream in(s);
+    std::string part;
+    try {
+        while(std::getline(in,part,',')){
+            size_t dd=part.find("..");
+            if(dd==std::string::npos){ out.push_back(std::stod(part)); continue; }
+            double a=std::stod(part.substr(0,dd)), b=std::stod(part.substr(dd+2));
+            if(a<=0 || b<a) return false;
+            for(double v=a;v<=b*(1+1e-9);v*=2) out.push_back(v);
+        }
+    } catch(const std::exception&){ return false; }
+    for(double v : out) if(!(v>0)) return false;
+    return !out.empty();
+}
+
+class ResourceSampler{
+public:
+    ResourceSampler(const std::string& ip, int port, pid_t server_pid) : cli_(ip,port), pid_(server_pid) {
+        cli_.set_connection_timeout(1,0);
+        cli_.set_read_timeout(1,0);
+    }
+
+    // Rates since the previous call (empty sections on the first), plus the
+    // server's /metrics as it is now
+    json sample(){
+        auto now=steady_clock::now();
+        ProcSnapshot self=read_proc(getpid());
+        ProcSnapshot srv=pid_>0 ? read_proc(pid_) : ProcSnapshot{};
+        SystemSnapshot sys=read_system();
+        uint64_t req=total_requests.load(), ok=total_success.load(), err=total_errors.load();
+        json j;
+        double dt=duration_cast<std::chrono::duration<double>>(now-prev_t_).count();
+        if(primed_ && dt>0){
+            j["loadgen"]=proc_rates(self_,self,dt);
+            j["loadgen"]["requests_per_s"]=(double)(req-req_)/dt;
+            j["loadgen"]["success_per_s"]=(double)(ok-ok_)/dt;
+            j["loadgen"]["errors_per_s"]=(double)(err-err_)/dt;
+            if(pid_>0) j["server"]=proc_rates(srv_,srv,dt);
+            j["system"]=system_rates(sys_,sys,dt);
+        }
+        auto r=cli_.Get("/metrics");
+        if(r && r->status==200){
+            json m=json::parse(r->body,nullptr,false);
+            if(m.is_object()) j["metrics"]=std::move(m);
+        }
+        primed_=true; prev_t_=now;
+        self_=self; srv_=srv; sys_=sys;
+        req_=req; ok_=ok; err_=err;
+        return j;
+    }
+
+    // after reset_counters()
+    void rebase(){ req_=ok_=err_=0; }
+
+private:
+    httplib::Client cli_;
+    pid_t pid_;
+    bool primed_=false;
+    steady_clock::time_point prev_t_;
+    ProcSnapshot self_, srv_;
+    SystemSnapshot sys_;
+    uint64_t req_=0, ok_=0, err_=0;
+};
+
+struct StepResult{
+    int clients=0;
+    double rate=0;
+    double tp=0, keys_tp=0, avg_ms=0, p50=0, p90=0, p99=0, p999=0, max_ms=0;
+    uint64_t retried=0;
+    json usage;       // means over the measured samples
+};
+
+static const json* find_path(const json& j, const std::vector<const char*>& path){
+    const json* p=&j;
+    for(const char* k : path){
+        if(!p->is_object()) return nullptr;
+        auto it=p->find(k);
+        if(it==p->end()) return nullptr;
+        p=&*it;
+    }
+    return p->is_number() ? p : nullptr;
+}
+
+// Means of the figures used for the bottleneck hint (and CSV), over the
+// measured phase
+static json summarize_samples(const std::vector<json>& samples){
+    struct Field{ const char* name; std::vector<const char*> path; };
+    static const std::vector<Field> fields={
+        {"loadgen_cpu_pct",{"loadgen","cpu_pct"}},
+        {"server_cpu_pct",{"server","cpu_pct"}},
+        {"server_ctxt_per_s",{"server","voluntary_ctxt_per_s"}},
+        {"server_nvctxt_per_s",{"server","nonvoluntary_ctxt_per_s"}},
+        {"server_rss_kb",{"server","rss_kb"}},
+        {"server_read_bytes_per_s",{"server","read_bytes_per_s"}},
+        {"server_write_bytes_per_s",{"server","write_bytes_per_s"}},
+        {"system_cpu_pct",{"system","cpu_pct"}},
+        {"iowait_pct",{"system","iowait_pct"}},
+        {"disk_util_pct",{"system","disk_util_pct"}},
+        {"db_pool_in_use",{"metrics","db_pool","in_use"}},
+    };
+    json out=json::object();
+    for(auto& f : fields){
+        double sum=0; int n=0;
+        for(auto& s : samples){
+            if(s.value("phase","")!="measure") continue;
+            if(const json* v=find_path(s,f.path)){ sum+=v->get<double>(); n++; }
+        }
+        if(n) out[f.name]=sum/n;
+    }
+    for(auto it=samples.rbegin();it!=samples.rend();++it){
+        if(const json* v=find_path(*it,{"metrics","db_pool","size"})){ out["db_pool_size"]=*v; break; }
+    }
+    for(auto it=samples.rbegin();it!=samples.rend();++it){
+        auto d=it->find("system");
+        if(d!=it->end() && d->contains("disk")){ out["disk"]=(*d)["disk"]; break; }
+    }
+    if(!samples.empty() && samples.front().contains("system")) out["cpus"]=samples.front()["system"].value("cpus",proc_cpu_count());
+    else out["cpus"]=proc_cpu_count();
+    return out;
+}
+
+// Resources by utilization (0..1), highest first
+static std::vector<std::pair<double,std::string>> utilizations(const json& u){
+    std::vector<std::pair<double,std::string>> out;
+    double cpus=u.value("cpus",1.0);
+    auto pct=[](double v){ std::ostringstream o; o.precision(0); o<<std::fixed<<v; return o.str(); };
+    if(u.contains("server_cpu_pct")){
+        double v=u["server_cpu_pct"].get<double>();
+        out.emplace_back(v/(100*cpus),"server CPU "+pct(v)+"% of "+pct(cpus)+" cores");
+    }
+    if(u.contains("system_cpu_pct")){
+        double v=u["system_cpu_pct"].get<double>();
+        out.emplace_back(v/100,"host CPU "+pct(v)+"%");
+    }
+    if(u.contains("loadgen_cpu_pct")){
+        double v=u["loadgen_cpu_pct"].get<double>();
+        out.emplace_back(v/(100*cpus),"loadgen CPU "+pct(v)+"%");
+    }
+    if(u.contains("disk_util_pct")){
+        double v=u["disk_util_pct"].get<double>();
+        out.emplace_back(v/100,"disk "+u.value("disk",std::string("?"))+" "+pct(v)+"% busy");
+    }
+    if(u.contains("db_pool_in_use") && u.value("db_pool_size",0.0)>0){
+        double v=u["db_pool_in_use"].get<double>(), n=u["db_pool_size"].get<double>();
+        out.emplace_back(v/n,"db pool "+pct(100*v/n)+"% in use");
+    }
+    std::sort(out.begin(),out.end(),[](const auto& a, const auto& b){ return a.first>b.first; });
+    return out;
+}
+
+static std::string usage_line(const json& u){
+    std::string s;
+    for(auto& r : utilizations(u)) s+=(s.empty()?" ":", ")+r.second;
+    if(u.contains("server_ctxt_per_s")) s+=", server "+std::to_string((long long)(u["server_ctxt_per_s"].get<double>()
+                                            +u.value("server_nvctxt_per_s",0.0)))+" ctx switches/s";
+    if(u.contains("server_rss_kb")) s+=", server RSS "+std::to_string((long long)(u["server_rss_kb"].get<double>()/1024))+" MB";
+    return s.empty() ? " no samples" : s;
+}
+
+// Append one row to results.csv (clients, throughput, avg/percentile latencies in ms, server engine,
+// closed/open loop, target rate, requests that needed retries, mean resource figures; blank if unknown)
+static void append_csv(const StepResult& r, const std::string& engine, bool open_loop){
+    try {
+        const std::string fname = "results.csv";
+        const std::string header = "clients,throughput,avg_latency_ms,p50_ms,p90_ms,p99_ms,p999_ms,max_ms,keys_per_sec,engine,"
+                                   "mode,target_rate,retried,server_cpu_pct,system_cpu_pct,iowait_pct,disk_util_pct,"
+                                   "server_ctxt_per_s,server_rss_mb";
+        bool write_header = true;
+        if (std::filesystem::exists(fname)) {
+            if (std::filesystem::file_size(fname) > 0) {
+                write_header = false;
+                std::ifstream fin(fname);
+                std::string first;
+                std::getline(fin, first);
+                if (first != header) std::cerr << "Warning: " << fname << " has an older header; columns are now: " << header << "\n";
+            }
+        }
+        std::ofstream fout(fname, std::ios::app);
+        if (!fout) {
+            std::cerr << "Failed to open " << fname << " for writing\n";
+            return;
+        }
+        if (write_header) {
+            fout << header << "\n";
+        }
+        auto col=[&](const char* k, double scale=1){
+            fout << ",";
+            if (r.usage.contains(k)) fout << r.usage[k].get<double>()*scale;
+        };
+        fout << r.clients << "," << r.tp << "," << r.avg_ms << "," << r.p50 << "," << r.p90 << ","
+             << r.p99 << "," << r.p999 << "," << r.max_ms << "," << r.keys_tp << "," << engine << ","
+             << (open_loop ? "open" : "closed") << "," << r.rate << "," << r.retried;
+        col("server_cpu_pct"); col("system_cpu_pct"); col("iowait_pct"); col("disk_util_pct");
+        fout << ",";
+        if (r.usage.contains("server_ctxt_per_s"))
+            fout << r.usage["server_ctxt_per_s"].get<double>() + r.usage.value("server_nvctxt_per_s", 0.0);
+        col("server_rss_kb", 1.0/1024);
+        fout << "\n";
+        fout.close();
+        std::cout << "Appended results to " << fname << "\n";
+    } catch (const std::exception &e) {
+        std::cerr << "CSV write error: " << e.what() << "\n";
+    }
+}
+
+// The knee is the last step before one where throughput grew by less than
+// half the relative load increase
+static void print_sweep(const std::vector<StepResult>& steps, bool open_loop){
+    std::cout<<"\n== Sweep summary\n";
+    std::cout<<(open_loop?"    rate":" clients")<<"  throughput     p99_ms  busiest resources\n";
+    for(auto& r : steps){
+        char line[96];
+        snprintf(line,sizeof(line),"%8g %11.0f %10.3f ",open_loop?r.rate:(double)r.clients,r.tp,r.p99);
+        auto u=utilizations(r.usage);
+        std::string res;
+        for(size_t i=0;i<u.size() && i<2;i++) res+=(i?", ":" ")+u[i].second;
+        std::cout<<line<<res<<"\n";
+    }
+    auto load=[&](const StepResult& r){ return open_loop?r.rate:(double)r.clients; };
+    for(size_t i=1;i<steps.size();i++){
+        double dl=load(steps[i])/load(steps[i-1])-1;
+        if(dl<=0 || steps[i-1].tp<=0) continue;
+        double gain=(steps[i].tp/steps[i-1].tp-1)/dl;
+        if(gain>=0.5) continue;
+        std::cout<<"Knee: throughput stops scaling after "<<load(steps[i-1])<<(open_loop?" req/s":" clients")
+                 <<" ("<<steps[i-1].tp<<" req/s; the next step turned "<<std::max(0.0,gain*100)<<"% of its extra load into throughput)\n";
+        auto u=utilizations(steps[i].usage);
+        if(!u.empty()) std::cout<<"Busiest at "<<load(steps[i])<<(open_loop?" req/s":" clients")<<": "<<u[0].second
+                                <<(u[0].first<0.8?" (nothing near saturation: look for a lock, a single busy thread or the network)":"")<<"\n";
+        return;
+    }
+    std::cout<<"No knee: throughput still follows the load at the last step\n";
+}
+
+int main(int argc,char**argv){
+    std::vector<std::string> pos;
+    OpenLoopOptions ol;
+    int retries=2;
+    std::vector<std::pair<std::string,std::string>> spec_opts;   // applied over the workload's preset
+    std::string sweep, samples_path;
+    int warmup=-1;
+    pid_t server_pid=0;
+    for(int i=1;i<argc;i++){
+        std::string a=argv[i];
+        if(a.rfind("--",0)!=0){ pos.push_back(a); continue; }
+        auto eq=a.find('=');
+        std::string name=a.substr(2,eq==std::string::npos?std::string::npos:eq-2);
+        std::string val=eq==std::string::npos?"":a.substr(eq+1);
+        if(name=="rate") ol.rate=std::stod(val);
+        else if(name=="arrival"){
+            if(val!="poisson" && val!="constant"){ std::cerr<<"Unknown arrival process: "<<val<<"\n"; return 1; }
+            ol.poisson=val=="poisson";
+        }
+        else if(name=="threads") ol.threads=std::max(1,std::stoi(val));
+        else if(name=="retries") retries=std::max(0,std::stoi(val));
+        else if(name=="timeout-ms") ol.timeout_ms=std::max(1,std::stoi(val));
+        else if(name=="sweep") sweep=val;
+        else if(name=="warmup") warmup=std::max(0,std::stoi(val));
+        else if(name=="samples") samples_path=val;
+        else if(name=="server-pid") server_pid=std::stoi(val);
+        else if(name=="keyspace" || name=="key-dist" || name=="zipf-theta" || name=="hotspot" || name=="ratios"
+                || name=="value-size" || name=="value-max" || name=="trace") spec_opts.emplace_back(name,val);
+        else { std::cerr<<"Unknown option: "<<a<<"\n"; return 1; }
+    }
+    if(pos.size()<5){
+        std::cout<<"Usage: ./loadgen_new <ip> <port> <clients> <duration> <workload> [batch_size] [--option=value ...]\n";
+        std::cout<<"  workload: get_all | put_all | get_popular | mix | batch (batch_size keys per request, default 16)\n";
+        std::cout<<"            | zipf (90% GET, Zipfian keys) | trace (replay --trace)\n";
+        std::cout<<"  --keyspace=N       keys to draw from (default 100000; get_popular 100)\n";
+        std::cout<<"  --key-dist=D       sequential (per-thread keys) | uniform | zipf | hotspot | fresh (never-written keys)\n";
+        std::cout<<"  --zipf-theta=T     Zipfian skew, 0 < T < 1 (default 0.99)\n";
+        std::cout<<"  --hotspot=K:O      hotspot: fraction K of the keys gets fraction O of requests (default 0.2:0.8)\n";
+        std::cout<<"  --ratios=R:W:D     read:write:delete weights (batch: multi-get:multi-put:multi-delete)\n";
+        std::cout<<"  --value-size=S     N | fixed:N | uniform:MIN:MAX | lognormal:MEDIAN:SIGMA bytes (default tiny \"v<seq>\")\n";
+        std::cout<<"  --value-max=N      cap on generated value sizes (default 1048576)\n";
+        std::cout<<"  --trace=PATH       JSON lines of {\"op\":\"GET|PUT|DELETE\",\"key\":...,[\"value\"|\"size\"]} to replay\n";
+        std::cout<<"  --rate=R           open loop: R requests/s in total, clients = connections (default: closed loop)\n";
+        std::cout<<"  --arrival=A        open loop: poisson (default) or constant gaps between requests\n";
+        std::cout<<"  --threads=N        open loop: event-loop threads (default min(cores, clients))\n";
+        std::cout<<"  --retries=N        extra attempts per failed request (default 2)\n";
+        std::cout<<"  --timeout-ms=N     open loop: response timeout, also the drain time after the run (default 5000)\n";
+        std::cout<<"  --sweep=LIST       one run per value: client counts, or rates with --rate; e.g. 1,2,4 or 1..64 (doubling)\n";
+        std::cout<<"  --warmup=SEC       unmeasured warm-up before each run (default 0; 5 in a sweep)\n";
+        std::cout<<"  --samples=PATH     append per-second resource samples as JSON lines (sweep default: samples.jsonl)\n";
+        std::cout<<"  --server-pid=N     server process to sample in /proc (default: the pid in /metrics, if local)\n";
+        return 1;
+    }
+    std::string ip=pos[0];
+    int port=std::stoi(pos[1]);
+    int clients=std::max(1,std::stoi(pos[2]));
+    int duration=std::stoi(pos[3]);
+    std::string workload=pos[4];
+    bool open_loop=ol.rate>0;
+
+    WorkloadSpec spec;
+    if(!workload_preset(workload,spec)){ std::cerr<<"Unknown workload: "<<workload<<"\n"; return 1; }
+    if(pos.size()>5 && spec.batch_size>0) spec.batch_size=std::max(1,std::stoi(pos[5]));
+    for(auto& o : spec_opts){
+        const std::string& name=o.first; const std::string& val=o.second;
+        bool ok=true;
+        if(name=="keyspace"){ spec.keyspace=std::stoull(val); ok=spec.keyspace>0; }
+        else if(name=="key-dist") ok=parse_key_dist(val,spec.dist);
+        else if(name=="zipf-theta"){ spec.zipf_theta=std::stod(val); ok=spec.zipf_theta>0 && spec.zipf_theta<1; }
+        else if(name=="hotspot"){
+            char c=0; std::istringstream in(val);
+            ok=(bool)(in>>spec.hot_keys>>c>>spec.hot_ops) && c==':' && spec.hot_keys>0 && spec.hot_keys<=1 && spec.hot_ops>=0 && spec.hot_ops<=1;
+        }
+        else if(name=="ratios") ok=parse_ratios(val,spec);
+        else if(name=="value-size") ok=parse_value_size(val,spec.value);
+        else if(name=="value-max"){ spec.value.max=std::stoull(val); }
+        else if(name=="trace"){
+            auto ops=std::make_shared<std::vector<TraceOp>>();
+            size_t skipped=0;
+            if(!load_trace(val,*ops,skipped)){ std::cerr<<"Cannot read trace: "<<val<<"\n"; return 1; }
+            if(ops->empty()){ std::cerr<<"No usable requests in trace: "<<val<<"\n"; return 1; }
+            std::cout<<"Trace: "<<ops->size()<<" requests"<<(skipped?", "+std::to_string(skipped)+" lines skipped":"")<<"\n";
+            spec.trace=ops;
+        }
+        if(!ok){ std::cerr<<"Invalid --"<<name<<": "<<val<<"\n"; return 1; }
+    }
+    if(workload=="trace" && !spec.trace){ std::cerr<<"The trace workload needs --trace=PATH\n"; return 1; }
+    // zeta(keyspace) is summed once for all threads
+    std::shared_ptr<const ZipfGenerator> zipf;
+    if(spec.dist==KeyDist::ZIPF) zipf=std::make_shared<ZipfGenerator>(spec.keyspace,spec.zipf_theta);
+
+    std::signal(SIGINT,signal_handler);
+    std::signal(SIGTERM,signal_handler);
+
+    // the server's /health names its front end, recorded with the results;
+    // /metrics has its pid
+    std::string engine="unknown";
+    pid_t metrics_pid=0;
+    {
+        httplib::Client probe(ip,port);
+        probe.set_read_timeout(2,0);
+        auto r=probe.Get("/health");
+        if(r && r->status==200){
+            json h=json::parse(r->body,nullptr,false);
+            if(h.is_object() && h.contains("engine") && h["engine"].is_string()) engine=h["engine"].get<std::string>();
+        }
+        r=probe.Get("/metrics");
+        if(r && r->status==200){
+            json m=json::parse(r->body,nullptr,false);
+            if(m.is_object() && m.contains("pid") && m["pid"].is_number_integer()) metrics_pid=m["pid"].get<pid_t>();
+        }
+    }
+
+    // -1: not given (0, or 5 s per step in a sweep)
+    if(warmup<0) warmup=sweep.empty()?0:5;
+    std::vector<double> loads;
+    if(sweep.empty()) loads.push_back(open_loop?ol.rate:clients);
+    else if(!parse_sweep(sweep,loads)){ std::cerr<<"Invalid --sweep: "<<sweep<<"\n"; return 1; }
+    if(samples_path.empty() && !sweep.empty()) samples_path="samples.jsonl";
+    std::ofstream samples_out;
+    if(!samples_path.empty()){
+        samples_out.open(samples_path,std::ios::app);
+        if(!samples_out){ std::cerr<<"Failed to open "<<samples_path<<" for writing\n"; return 1; }
+    }
+
+    // /proc of the server is only meaningful when it runs on this host
+    if(server_pid<=0 && metrics_pid>0 && is_local_host(ip) && proc_alive(metrics_pid)) server_pid=metrics_pid;
+    if(server_pid>0) std::cout<<"Sampling server process "<<server_pid<<"\n";
+    else std::cout<<"Server process not sampled (remote, or pass --server-pid); system figures are this host's\n";
+
+    std::vector<StepResult> steps;
+    for(size_t step=0;step<loads.size() && !stop_flag.load();step++){
+        int step_clients=open_loop?clients:std::max(1,(int)std::lround(loads[step]));
+        double step_rate=open_loop?loads[step]:0;
+        if(!sweep.empty()){
+            std::cout<<"\n== Step "<<step+1<<"/"<<loads.size()<<": ";
+            if(open_loop) std::cout<<step_rate<<" req/s";
+            else std::cout<<step_clients<<" clients";
+            std::cout<<" ("<<warmup<<" s warm-up, "<<duration<<" s measured)\n";
+        }
+        reset_counters();
+        unfinished.store(0);
+
+        std::vector<std::thread> th;
+        std::vector<std::unique_ptr<httplib::Client>> clis;
+        auto start=steady_clock::now();
+        auto end=start+seconds(warmup+duration);
+        OpenLoopOptions sol=ol;
+
+        if(open_loop){
+            // connections and rate split evenly over the event-loop threads
+            int threads=ol.threads>0 ? ol.threads : (int)std::max(1u,std::thread::hardware_concurrency());
+            threads=std::min(threads,clients);
+            sol.threads=threads;
+            sol.connections=clients;
+            sol.rate=step_rate;
+            for(int i=0;i<threads;i++){
+                WorkArgs w{i,threads,nullptr,end,retries,&spec,zipf};
+                int conns=clients/threads+(i<clients%threads?1:0);
+                th.emplace_back([=]{ OpenLoopWorker(w,sol,ip,port,sol.rate/threads,conns).run(); });
+            }
+        } else {
+            for(int i=0;i<step_clients;i++){
+                clis.emplace_back(new httplib::Client(ip,port));
+                auto cli=clis.back().get();
+                cli->set_read_timeout(5,0);
+                cli->set_write_timeout(5,0);
+                // reuse connections, so each client holds one open socket like a real caller
+                cli->set_keep_alive(true);
+                WorkArgs w{i,step_clients,cli,end,retries,&spec,zipf};
+                th.emplace_back(run_closed,w);
+            }
+        }
+
+        // one sample per second; the warm-up's last sample is followed by a
+        // counter reset, so the results cover the measured phase only
+        std::atomic<bool> done{false};
+        steady_clock::time_point measure_start=start;
+        std::vector<json> samples;
+        std::thread sampler_th([&]{
+            ResourceSampler sampler(ip,port,server_pid);
+            sampler.sample();
+            for(int t=1;;t++){
+                auto wake=start+seconds(t);
+                // the tick that coincides with the end of the run is still taken
+                while(steady_clock::now()<wake){
+                    if(done.load() && wake-steady_clock::now()>milliseconds(200)) break;
+                    std::this_thread::sleep_for(milliseconds(20));
+                }
+                if(steady_clock::now()<wake) break;
+                json j=sampler.sample();
+                j["step"]=step+1; j["clients"]=step_clients; j["target_rate"]=step_rate; j["t"]=t;
+                j["phase"]=t<=warmup?"warmup":(t<=warmup+duration?"measure":"drain");
+                if(t==warmup){
+                    // workers keep recording meanwhile; a few samples may straddle the reset
+                    reset_counters();
+                    measure_start=steady_clock::now();
+                    sampler.rebase();
+                }
+                if(samples_out.is_open()) samples_out<<j.dump()<<"\n";
+                samples.push_back(std::move(j));
+                if(done.load()) break;
+            }
+        });
+
+        for(auto &t:th) if(t.joinable()) t.join();
+        done.store(true);
+        sampler_th.join();
+        if(samples_out.is_open()) samples_out.flush();
+
+        // an open-loop run may drain past `duration`; rates use the real span
+        StepResult r;
+        r.clients=step_clients; r.rate=step_rate;
+        double elapsed=std::max(1e-3,duration_cast<std::chrono::duration<double>>(steady_clock::now()-measure_start).count());
+        r.tp=(double)total_success.load()/elapsed;
+        r.keys_tp=(double)total_keys.load()/elapsed;
+        r.avg_ms=latency_hist.mean()/1e6;
+        r.p50=latency_hist.percentile_ms(0.50); r.p90=latency_hist.percentile_ms(0.90);
+        r.p99=latency_hist.percentile_ms(0.99); r.p999=latency_hist.percentile_ms(0.999);
+        r.max_ms=(double)latency_hist.max()/1e6;
+        r.retried=total_retried.load();
+        r.usage=summarize_samples(samples);
+
+        std::cout<<"Engine: "<<engine<<"\n";
+        if(open_loop){
+            std::cout<<"Mode: open loop, target "<<sol.rate<<" req/s ("<<(sol.poisson?"poisson":"constant")<<" arrivals), "
+                     <<sol.connections<<" connections on "<<sol.threads<<" threads\n";
+        } else {
+            std::cout<<"Mode: closed loop, "<<step_clients<<" clients\n";
+        }
+        if(spec.trace) std::cout<<"Workload: "<<workload<<", replaying "<<spec.trace->size()<<" requests\n";
+        else std::cout<<"Workload: "<<workload<<", "<<key_dist_name(spec.dist)<<" keys over "<<spec.keyspace
+                       <<", read:write:delete "<<spec.read<<":"<<spec.write<<":"<<spec.del
+                       <<(spec.batch_size>0?", "+std::to_string(spec.batch_size)+" keys per batch":"")<<"\n";
+        std::cout<<"Total req: "<<total_requests.load()<<"\n";
+        std::cout<<"Success: "<<total_success.load()<<" Errors: "<<total_errors.load()<<"\n";
+        std::cout<<"Throughput: "<<r.tp<<" req/s ("<<r.keys_tp<<" keys/s)\n";
+        std::cout<<"Avg Latency: "<<r.avg_ms<<" ms\n";
+        std::cout<<"Latency p50: "<<r.p50<<" ms  p90: "<<r.p90<<" ms  p99: "<<r.p99<<" ms  p99.9: "<<r.p999<<" ms  max: "<<r.max_ms<<" ms"
+                 <<(open_loop?"  (from scheduled send, first-try successes)":"  (first-try successes)")<<"\n";
+        if(open_loop){
+            std::cout<<"Service time p50: "<<service_hist.percentile_ms(0.50)<<" ms  p99: "<<service_hist.percentile_ms(0.99)
+                     <<" ms  p99.9: "<<service_hist.percentile_ms(0.999)<<" ms  (send to response)\n";
+            std::cout<<"Backlog: max "<<max_backlog_seen.load()<<" queued, "<<backlog_dropped.load()<<" dropped, "
+                     <<unfinished.load()<<" unfinished at the end\n";
+        }
+        std::cout<<"Retried: "<<total_retried.load()<<" requests, "<<total_retries.load()<<" extra attempts";
+        if(retry_hist.count()) std::cout<<"  p50: "<<retry_hist.percentile_ms(0.50)<<" ms  p99: "<<retry_hist.percentile_ms(0.99)<<" ms";
+        std::cout<<"\n";
+        std::cout<<"Resources:"<<usage_line(r.usage)<<"\n";
+
+        append_csv(r,engine,open_loop);
+        steps.push_back(std::move(r));
+    }
+    if(!samples_path.empty()) std::cout<<"Samples written to "<<samples_path<<"\n";
+    if(steps.size()>1) print_sweep(steps,open_loop);
+
+    return 0;
+}
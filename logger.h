@@ -0,0 +1,223 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Asynchronous logger. Each producing thread owns a lock-free single-producer
+// ring of fixed-size records; one background writer drains every ring,
+// formats timestamps and writes to stdout with one flush per batch. A full
+// ring drops the message and counts it instead of blocking the request.
+//
+// Use the LOG_* macros: they check the runtime level before building the
+// message, so disabled per-request lines cost one relaxed load.
+enum class LogLevel : uint8_t { DEBUG = 0, INFO = 1, WARN = 2, ERROR = 3, OFF = 4 };
+
+inline const char* log_level_name(LogLevel l) {
+    switch (l) {
+        case LogLevel::DEBUG: return "debug";
+        case LogLevel::INFO: return "info";
+        case LogLevel::WARN: return "warn";
+        case LogLevel::ERROR: return "error";
+        default: return "off";
+    }
+}
+
+// Parse "debug" / "info" / "warn" / "error" / "off"; returns false otherwise
+inline bool parse_log_level(const std::string &s, LogLevel &out) {
+    static const LogLevel all[] = {LogLevel::DEBUG, LogLevel::INFO, LogLevel::WARN, LogLevel::ERROR, LogLevel::OFF};
+    for (LogLevel l : all) {
+        if (s == log_level_name(l)) { out = l; return true; }
+    }
+    return false;
+}
+
+class AsyncLogger {
+public:
+    static constexpr size_t kRingSize = 512;     // records per thread, power of two
+    static constexpr size_t kMaxMsg = 240;       // longer messages are truncated
+
+    static AsyncLogger& instance() {
+        static AsyncLogger logger;
+        return logger;
+    }
+
+    bool enabled(LogLevel l) const noexcept {
+        return static_cast<uint8_t>(l) >= level_.load(std::memory_order_relaxed);
+    }
+    void set_level(LogLevel l) noexcept { level_.store(static_cast<uint8_t>(l), std::memory_order_relaxed); }
+    LogLevel level() const noexcept { return static_cast<LogLevel>(level_.load(std::memory_order_relaxed)); }
+
+    // Enqueue one line from the calling thread; never blocks
+    void write(LogLevel l, const std::string &msg) {
+        Ring *r = local_ring();
+        size_t head = r->head.load(std::memory_order_relaxed);
+        size_t tail = r->tail.load(std::memory_order_acquire);
+        if (head - tail >= kRingSize) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        Record &rec = r->records[head & (kRingSize - 1)];
+        rec.ts_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count();
+        rec.level = l;
+        rec.len = static_cast<uint16_t>(msg.size() < kMaxMsg ? msg.size() : kMaxMsg);
+        std::memcpy(rec.text, msg.data(), rec.len);
+        r->head.store(head + 1, std::memory_order_release);
+        if (!started_.load(std::memory_order_acquire)) start();
+    }
+
+    // Drain everything queued so far and stop the writer thread
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(start_mtx_);
+            if (!started_.load()) return;
+            stopping_.store(true);
+        }
+        if (writer_.joinable()) writer_.join();
+        started_.store(false);
+        stopping_.store(false);
+    }
+
+    uint64_t dropped() const noexcept { return dropped_.load(std::memory_order_relaxed); }
+    uint64_t written() const noexcept { return written_.load(std::memory_order_relaxed); }
+
+    ~AsyncLogger() { stop(); }
+
+private:
+    struct Record {
+        int64_t ts_ns;
+        LogLevel level;
+        uint16_t len;
+        char text[kMaxMsg];
+    };
+
+    struct Ring {
+        alignas(64) std::atomic<size_t> head{0};   // written by the owner thread
+        alignas(64) std::atomic<size_t> tail{0};   // written by the writer thread
+        std::atomic<bool> closed{false};           // owner thread has exited
+        Record records[kRingSize];
+    };
+
+    // Marks the ring closed when its thread exits so the writer can reclaim it
+    struct LocalRing {
+        std::shared_ptr<Ring> ring;
+        ~LocalRing() { if (ring) ring->closed.store(true, std::memory_order_release); }
+    };
+
+    std::atomic<uint8_t> level_{static_cast<uint8_t>(LogLevel::INFO)};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint64_t> written_{0};
+
+    static constexpr int kMaxIdleMs = 50;
+    std::mutex rings_mtx_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+
+    std::mutex start_mtx_;
+    std::atomic<bool> started_{false};
+    std::atomic<bool> stopping_{false};
+    std::thread writer_;
+
+    AsyncLogger() = default;
+
+    Ring* local_ring() {
+        static thread_local LocalRing local;
+        if (!local.ring) {
+            local.ring = std::make_shared<Ring>();
+            std::lock_guard<std::mutex> lk(rings_mtx_);
+            rings_.push_back(local.ring);
+        }
+        return local.ring.get();
+    }
+
+    void start() {
+        std::lock_guard<std::mutex> lk(start_mtx_);
+        if (started_.load()) return;
+        writer_ = std::thread([this]{ run(); });
+        started_.store(true, std::memory_order_release);
+    }
+
+    void run() {
+        std::string buf;
+        buf.reserve(64 * 1024);
+        time_t cached_sec = 0;
+        char cached_prefix[32] = {0};
+        // idle polls back off from 1 to kMaxIdleMs, so a quiet process
+        // isn't woken a thousand times a second; any output resets it
+        int idle_ms = 1;
+        for (;;) {
+            bool stopping = stopping_.load();
+            size_t n = 0;
+            {
+                std::lock_guard<std::mutex> lk(rings_mtx_);
+                for (size_t i = 0; i < rings_.size();) {
+                    Ring &r = *rings_[i];
+                    size_t tail = r.tail.load(std::memory_order_relaxed);
+                    size_t head = r.head.load(std::memory_order_acquire);
+                    for (; tail != head; tail++, n++) {
+                        const Record &rec = r.records[tail & (kRingSize - 1)];
+                        time_t sec = static_cast<time_t>(rec.ts_ns / 1000000000);
+                        if (sec != cached_sec) {
+                            struct tm tmv;
+                            localtime_r(&sec, &tmv);
+                            std::strftime(cached_prefix, sizeof(cached_prefix), "%F %T", &tmv);
+                            cached_sec = sec;
+                        }
+                        char ms[8];
+                        std::snprintf(ms, sizeof(ms), ".%03d", static_cast<int>((rec.ts_ns / 1000000) % 1000));
+                        buf += '[';
+                        buf += cached_prefix;
+                        buf += ms;
+                        buf += "] ";
+                        buf.append(rec.text, rec.len);
+                        buf += '\n';
+                    }
+                    r.tail.store(tail, std::memory_order_release);
+                    // closed and drained: the owner can never write again
+                    if (r.closed.load(std::memory_order_acquire) && r.head.load(std::memory_order_acquire) == tail) {
+                        rings_.erase(rings_.begin() + i);
+                    } else {
+                        i++;
+                    }
+                }
+            }
+            if (!buf.empty()) {
+                std::fwrite(buf.data(), 1, buf.size(), stdout);
+                std::fflush(stdout);
+                buf.clear();
+                written_.fetch_add(n, std::memory_order_relaxed);
+            }
+            if (stopping) return;
+            if (n > 0) {
+                idle_ms = 1;
+            } else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(idle_ms));
+                idle_ms = std::min(idle_ms * 2, kMaxIdleMs);
+            }
+        }
+    }
+};
+
+#define KV_LOG(lvl, expr)                                                \
+    do {                                                                 \
+        if (AsyncLogger::instance().enabled(lvl)) {                      \
+            std::ostringstream kv_log_ss_;                               \
+            kv_log_ss_ << expr;                                          \
+            AsyncLogger::instance().write(lvl, kv_log_ss_.str());        \
+        }                                                                \
+    } while (0)
+
+#define LOG_DEBUG(expr) KV_LOG(LogLevel::DEBUG, expr)
+#define LOG_INFO(expr) KV_LOG(LogLevel::INFO, expr)
+#define LOG_WARN(expr) KV_LOG(LogLevel::WARN, expr)
+#define LOG_ERROR(expr) KV_LOG(LogLevel::ERROR, expr)
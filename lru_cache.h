@@ -1,93 +1,229 @@
+#pragma once
+
 #include <atomic>
 #include <list>
 #include <mutex>
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
+
+#include "cache_shard.h"
 
-class LRUCache {
+// Exact LRU: every hit moves the entry to the front of the recency list, so
+// get() needs the exclusive lock.
+class LRUCache : public CacheShard {
 public:
-    explicit LRUCache(size_t capacity = 1000) : capacity_(capacity), hit_count_(0), miss_count_(0) {}
+    explicit LRUCache(size_t capacity = 1000, CapacityMode mode = CapacityMode::ENTRIES)
+        : capacity_(capacity), mode_(mode), hit_count_(0), miss_count_(0),
+          bytes_(0), peak_bytes_(0), evictions_(0), expirations_(0), sweep_bucket_(0) {}
 
     // Non-copyable
     LRUCache(const LRUCache&) = delete;
     LRUCache& operator=(const LRUCache&) = delete;
 
-    bool get(const std::string &key, std::string &value) {
-        std::lock_guard<std::mutex> lk(mtx_);
+    // list node (two links + key string + value handle + deadline) and the shared value
+    // buffer, plus the unordered_map node (next link, duplicate key,
+    // iterator, cached hash) and its bucket slot
+    static constexpr size_t kEntryOverhead = 2 * sizeof(void*) + sizeof(std::string) + sizeof(CacheValue) + sizeof(uint64_t)
+                                           + kCacheValueOverhead
+                                           + sizeof(void*) + sizeof(std::string) + sizeof(void*) + sizeof(size_t)
+                                           + sizeof(void*);
+
+    // Bytes charged for one entry; the key is stored twice (list and map)
+    static size_t entry_bytes(const std::string &key, const std::string &value) noexcept {
+        return 2 * key.size() + value.size() + kEntryOverhead;
+    }
+
+    using CacheShard::get;
+    using CacheShard::put;
+
+    bool get(const std::string &key, CacheValue &value) override {
+        TracedLock<std::lock_guard<std::mutex>> lk(mtx_);
         auto it = map_.find(key);
         if (it == map_.end()) {
             miss_count_.fetch_add(1, std::memory_order_relaxed);
             return false;
         }
+        if (it->second->expires_at && cache_expired(it->second->expires_at, cache_clock_ms())) {
+            erase_locked(it);
+            expirations_.fetch_add(1, std::memory_order_relaxed);
+            miss_count_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
         // Move node to front (most-recently-used)
         nodes_.splice(nodes_.begin(), nodes_, it->second);
-        value = it->second->second;
+        value = it->second->value;
         hit_count_.fetch_add(1, std::memory_order_relaxed);
         return true;
     }
 
     // Put or update
-    void put(const std::string &key, const std::string &value) {
-        std::lock_guard<std::mutex> lk(mtx_);
-        auto it = map_.find(key);
-        if (it != map_.end()) {
-            // update existing node and move to front
-            it->second->second = value;
-            nodes_.splice(nodes_.begin(), nodes_, it->second);
-            return;
-        }
-
-        // Evict last node if needed
-        if (nodes_.size() >= capacity_) {
-            auto last = nodes_.back();
-            map_.erase(last.first);
-            nodes_.pop_back();
-        }
+    void put(const std::string &key, CacheValue value, uint64_t expires_at_ms) override {
+        TracedLock<std::lock_guard<std::mutex>> lk(mtx_);
+        put_locked(key, std::move(value), expires_at_ms);
+    }
 
-        nodes_.emplace_front(key, value);
-        map_[key] = nodes_.begin();
+    bool put_if_absent(const std::string &key, CacheValue value, uint64_t expires_at_ms) override {
+        TracedLock<std::lock_guard<std::mutex>> lk(mtx_);
+        auto it = map_.find(key);
+        if (it != map_.end() && !(it->second->expires_at && cache_expired(it->second->expires_at, cache_clock_ms()))) return false;
+        put_locked(key, std::move(value), expires_at_ms);
+        return true;
     }
 
     // Erase key if present
-    void erase(const std::string &key) {
-        std::lock_guard<std::mutex> lk(mtx_);
+    void erase(const std::string &key) override {
+        TracedLock<std::lock_guard<std::mutex>> lk(mtx_);
         auto it = map_.find(key);
         if (it == map_.end()) return;
-        nodes_.erase(it->second);
-        map_.erase(it);
+        erase_locked(it);
     }
 
     // Clear all entries
-    void clear() {
+    void clear() override {
         std::lock_guard<std::mutex> lk(mtx_);
         nodes_.clear();
         map_.clear();
         hit_count_.store(0, std::memory_order_relaxed);
         miss_count_.store(0, std::memory_order_relaxed);
+        bytes_.store(0, std::memory_order_relaxed);
+    }
+
+    // Walks the hash buckets, so a sweep position survives inserts and
+    // recency moves (a rehash only shifts which keys the next steps see)
+    size_t expire(uint64_t now_ms, size_t max_scan) override {
+        std::lock_guard<std::mutex> lk(mtx_);
+        std::vector<decltype(nodes_.begin())> dead;
+        for (size_t scanned = 0; scanned < max_scan && !map_.empty();) {
+            size_t b = sweep_bucket_++ % map_.bucket_count();
+            scanned++;
+            for (auto it = map_.begin(b); it != map_.end(b); ++it, ++scanned) {
+                if (cache_expired(it->second->expires_at, now_ms)) dead.push_back(it->second);
+            }
+        }
+        for (auto node : dead) {
+            sub_bytes(entry_bytes(node->key, *node->value));
+            map_.erase(node->key);
+            nodes_.erase(node);
+        }
+        expirations_.fetch_add(dead.size(), std::memory_order_relaxed);
+        return dead.size();
+    }
+
+    // Most recently used first
+    void hot_entries(size_t max, std::vector<std::pair<std::string, CacheValue>> &out) const override {
+        std::lock_guard<std::mutex> lk(mtx_);
+        uint64_t now = cache_clock_ms();
+        for (auto it = nodes_.begin(); it != nodes_.end() && max > 0; ++it) {
+            if (cache_expired(it->expires_at, now)) continue;
+            out.emplace_back(it->key, it->value);
+            max--;
+        }
     }
 
     // Current #elements
-    size_t size() const {
+    size_t size() const override {
         std::lock_guard<std::mutex> lk(mtx_);
         return nodes_.size();
     }
-    
-    size_t capacity() const noexcept {
+
+    // Entry count or byte budget, depending on mode()
+    size_t capacity() const noexcept override {
         return capacity_;
     }
+    CapacityMode mode() const noexcept { return mode_; }
 
     // hit/miss counters
-    uint64_t hits() const noexcept { return hit_count_.load(std::memory_order_relaxed); }
-    uint64_t misses() const noexcept { return miss_count_.load(std::memory_order_relaxed); }
+    uint64_t hits() const noexcept override { return hit_count_.load(std::memory_order_relaxed); }
+    uint64_t misses() const noexcept override { return miss_count_.load(std::memory_order_relaxed); }
+
+    // memory accounting
+    uint64_t bytes() const noexcept override { return bytes_.load(std::memory_order_relaxed); }
+    uint64_t peak_bytes() const noexcept override { return peak_bytes_.load(std::memory_order_relaxed); }
+    uint64_t evictions() const noexcept override { return evictions_.load(std::memory_order_relaxed); }
+    uint64_t expirations() const noexcept override { return expirations_.load(std::memory_order_relaxed); }
 
 private:
+    struct Node {
+        std::string key;
+        CacheValue value;
+        uint64_t expires_at;    // 0 = never
+    };
+
     size_t capacity_;
-    // list of (key, value)
-    std::list<std::pair<std::string, std::string>> nodes_;
+    CapacityMode mode_;
+    std::list<Node> nodes_;
     std::unordered_map<std::string, decltype(nodes_.begin())> map_;
     mutable std::mutex mtx_;
-    
+
     std::atomic<uint64_t> hit_count_;
     std::atomic<uint64_t> miss_count_;
+
+    // written under mtx_, atomic so metrics can read without locking
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> peak_bytes_;
+    std::atomic<uint64_t> evictions_;
+    std::atomic<uint64_t> expirations_;
+    size_t sweep_bucket_;
+
+    void put_locked(const std::string &key, CacheValue value, uint64_t expires_at_ms) {
+        size_t charge = entry_bytes(key, *value);
+        auto it = map_.find(key);
+
+        // Too big to ever fit: make sure no stale copy survives either
+        if (capacity_ == 0 || (mode_ == CapacityMode::BYTES && charge > capacity_)) {
+            if (it != map_.end()) erase_locked(it);
+            return;
+        }
+
+        if (it != map_.end()) {
+            // update existing node and move to front
+            sub_bytes(entry_bytes(key, *it->second->value));
+            it->second->value = std::move(value);
+            it->second->expires_at = expires_at_ms;
+            add_bytes(charge);
+            nodes_.splice(nodes_.begin(), nodes_, it->second);
+            // the front node fits on its own, so this never evicts it
+            while (mode_ == CapacityMode::BYTES && bytes_.load(std::memory_order_relaxed) > capacity_) evict_back_locked();
+            return;
+        }
+
+        // Evict from the tail until the new entry fits
+        while (!nodes_.empty() && !fits_locked(charge)) evict_back_locked();
+
+        nodes_.push_front(Node{key, std::move(value), expires_at_ms});
+        map_[key] = nodes_.begin();
+        add_bytes(charge);
+    }
+
+    bool fits_locked(size_t charge) const {
+        if (mode_ == CapacityMode::BYTES) return bytes_.load(std::memory_order_relaxed) + charge <= capacity_;
+        return nodes_.size() < capacity_;
+    }
+
+    void add_bytes(size_t n) {
+        uint64_t b = bytes_.load(std::memory_order_relaxed) + n;
+        bytes_.store(b, std::memory_order_relaxed);
+        if (b > peak_bytes_.load(std::memory_order_relaxed)) peak_bytes_.store(b, std::memory_order_relaxed);
+    }
+    void sub_bytes(size_t n) {
+        bytes_.store(bytes_.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+    }
+
+    void erase_locked(decltype(map_.begin()) it) {
+        sub_bytes(entry_bytes(it->first, *it->second->value));
+        nodes_.erase(it->second);
+        map_.erase(it);
+    }
+
+    // An expired tail entry counts as an expiration, not an eviction
+    void evict_back_locked() {
+        auto &last = nodes_.back();
+        bool expired = last.expires_at && cache_expired(last.expires_at, cache_clock_ms());
+        sub_bytes(entry_bytes(last.key, *last.value));
+        map_.erase(last.key);
+        nodes_.pop_back();
+        (expired ? expirations_ : evictions_).fetch_add(1, std::memory_order_relaxed);
+    }
 };
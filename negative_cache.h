@@ -0,0 +1,128 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "sharded_cache.h"
+
+// Bounded cache of keys known to be absent from kv_store, so repeated lookups
+// of missing keys get a 404 without a Postgres round trip. Entries live in
+// their own ShardedCache (LRU, empty values) with a TTL, which bounds how
+// long a key inserted behind the server's back keeps looking absent.
+//
+// A lookup that found nothing races with a concurrent PUT of the same key.
+// Writers bump a per-stripe generation before invalidate() erases the entry;
+// a reader takes a ticket (the generation) before querying Postgres, inserts,
+// then re-reads the generation and takes the entry back out if it moved.
+// Either the writer's erase comes after the insert or the reader sees the
+// bump, so a write through this server is never hidden by a stale entry.
+//
+// Every verify_every-th hit is still checked against Postgres (the caller
+// does the query and reports back); the share of checks that found the key
+// is the measured false-positive rate.
+class NegativeCache {
+public:
+    NegativeCache(size_t capacity, size_t shards, uint64_t ttl_ms, uint64_t verify_every)
+        : entries_(capacity, shards, CachePolicy::LRU), ttl_ms_(ttl_ms), verify_every_(verify_every),
+          hits_(0), inserts_(0), raced_(0), invalidations_(0), verified_(0), false_positives_(0) {
+        entries_.set_default_ttl_ms(ttl_ms);
+        for (auto &g : gen_) g.store(0, std::memory_order_relaxed);
+    }
+
+    // Non-copyable
+    NegativeCache(const NegativeCache&) = delete;
+    NegativeCache& operator=(const NegativeCache&) = delete;
+
+    enum class Lookup { UNKNOWN, ABSENT, VERIFY };
+
+    // ABSENT: answer 404. VERIFY: a sampled hit; query Postgres anyway and
+    // call verified() with the outcome.
+    Lookup lookup(const std::string &key) {
+        CacheValue v;
+        if (!entries_.get(key, v)) return Lookup::UNKNOWN;
+        uint64_t n = hits_.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (verify_every_ && n % verify_every_ == 0) return Lookup::VERIFY;
+        return Lookup::ABSENT;
+    }
+
+    void verified(const std::string &key, bool present) {
+        verified_.fetch_add(1, std::memory_order_relaxed);
+        if (!present) return;
+        false_positives_.fetch_add(1, std::memory_order_relaxed);
+        entries_.erase(key);
+    }
+
+    // Taken before the Postgres lookup whose "not found" may be recorded
+    uint64_t ticket(const std::string &key) const {
+        return gen_for(key).load(std::memory_order_seq_cst);
+    }
+
+    void insert(const std::string &key, uint64_t ticket) {
+        entries_.put(key, empty_value());
+        if (gen_for(key).load(std::memory_order_seq_cst) != ticket) {
+            entries_.erase(key);
+            raced_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        inserts_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // After a write of `key` reached Postgres or the write-behind queue
+    void invalidate(const std::string &key) {
+        gen_for(key).fetch_add(1, std::memory_order_seq_cst);
+        entries_.erase(key);
+        invalidations_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Forget every key, as if each had been written
+    void clear() {
+        for (auto &g : gen_) g.fetch_add(1, std::memory_order_seq_cst);
+        entries_.clear();
+        invalidations_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // background TTL sweep step
+    size_t expire(size_t max_scan) { return entries_.expire(max_scan); }
+
+    size_t size() const { return entries_.size(); }
+    size_t capacity() const noexcept { return entries_.capacity(); }
+    uint64_t ttl_ms() const noexcept { return ttl_ms_; }
+    uint64_t verify_every() const noexcept { return verify_every_; }
+    uint64_t hits() const noexcept { return hits_.load(std::memory_order_relaxed); }
+    uint64_t inserts() const noexcept { return inserts_.load(std::memory_order_relaxed); }
+    uint64_t raced() const noexcept { return raced_.load(std::memory_order_relaxed); }
+    uint64_t invalidations() const noexcept { return invalidations_.load(std::memory_order_relaxed); }
+    uint64_t evictions() const noexcept { return entries_.evictions(); }
+    uint64_t expirations() const noexcept { return entries_.expirations(); }
+    uint64_t verified() const noexcept { return verified_.load(std::memory_order_relaxed); }
+    uint64_t false_positives() const noexcept { return false_positives_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t kStripes = 1024;
+
+    ShardedCache entries_;
+    uint64_t ttl_ms_;
+    uint64_t verify_every_;
+    std::atomic<uint64_t> gen_[kStripes];
+
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> inserts_;
+    std::atomic<uint64_t> raced_;
+    std::atomic<uint64_t> invalidations_;
+    std::atomic<uint64_t> verified_;
+    std::atomic<uint64_t> false_positives_;
+
+    static const CacheValue& empty_value() {
+        static const CacheValue v = make_cache_value(std::string());
+        return v;
+    }
+
+    const std::atomic<uint64_t>& gen_for(const std::string &key) const {
+        return gen_[std::hash<std::string>{}(key) % kStripes];
+    }
+    std::atomic<uint64_t>& gen_for(const std::string &key) {
+        return gen_[std::hash<std::string>{}(key) % kStripes];
+    }
+};
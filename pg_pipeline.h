@@ -0,0 +1,391 @@
+#pragma once
+
+#include <libpq-fe.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Asynchronous Postgres executor on a few connections in libpq pipeline mode.
+// Instead of one connection per waiting caller (PQexecPrepared blocks for the
+// whole round trip), each connection has a dispatcher thread that keeps
+// sending queued statements without waiting for earlier results and hands
+// every result to its completion callback as it arrives. Dozens of queries
+// are in flight on one connection, so the pool no longer caps the miss path.
+//
+// This removes the connection limit, not the thread one: the HTTP handlers
+// are synchronous and call exec(), which parks the worker until its result
+// arrives. Concurrent misses are still bounded by the worker count; only
+// submit() callers that return right away (none in the server yet) avoid it.
+//
+// Each statement is followed by its own sync point, so it runs as its own
+// implicit transaction and a failure only affects that statement (the same
+// semantics as autocommit PQexecPrepared). Multi-statement transactions
+// don't belong here; keep them on ordinary connections.
+class PGPipeline {
+public:
+    // A prepared statement every pipeline connection creates on connect
+    struct Statement {
+        const char *name;
+        const char *sql;
+        int nparams;
+        Oid types[2];
+    };
+
+    // Gets the result (caller must PQclear) or nullptr with `err` set
+    using Callback = std::function<void(PGresult *res, const std::string &err)>;
+
+    static constexpr size_t kMaxInFlight = 256;   // per connection
+
+    PGPipeline(std::string conninfo, size_t connections, std::vector<Statement> stmts)
+        : conninfo_(std::move(conninfo)), stmts_(std::move(stmts)), stop_(false),
+          in_flight_(0), max_in_flight_(0), submitted_(0), failed_(0), reconnects_(0), next_(0) {
+        if (connections == 0) connections = 1;
+        for (size_t i = 0; i < connections; i++) conns_.emplace_back(new Conn());
+    }
+
+    ~PGPipeline() { stop(); }
+
+    // Non-copyable
+    PGPipeline(const PGPipeline&) = delete;
+    PGPipeline& operator=(const PGPipeline&) = delete;
+
+    // Open every connection and start the dispatchers. False (with `err`)
+    // when a connection cannot be opened or prepared.
+    bool start(std::string &err) {
+        for (auto &c : conns_) {
+            c->efd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (c->efd < 0 || !open(*c, err)) return false;
+        }
+        for (auto &c : conns_) {
+            Conn *cp = c.get();
+            cp->th = std::thread([this, cp]{ run(*cp); });
+        }
+        return true;
+    }
+
+    // Let in-flight statements finish, fail what is still queued, and join
+    void stop() {
+        if (stop_.exchange(true)) return;
+        for (auto &c : conns_) {
+            wake(*c);
+            if (c->th.joinable()) c->th.join();
+            fail_all(*c, "db pipeline stopped");
+            if (c->pg) PQfinish(c->pg);
+            c->pg = nullptr;
+            if (c->efd >= 0) ::close(c->efd);
+            c->efd = -1;
+        }
+    }
+
+    // Queue a prepared statement (binary params and results). The parameter
+    // buffers must stay valid until `done` runs, which happens on a
+    // dispatcher thread and must not block.
+    void submit(const char *stmt, int n, const char *const *vals, const int *lens, Callback done) {
+        if (stop_.load(std::memory_order_relaxed)) { done(nullptr, "db pipeline stopped"); return; }
+        Op op;
+        op.stmt = stmt;
+        op.n = n;
+        for (int i = 0; i < n && i < 2; i++) { op.vals[i] = vals[i]; op.lens[i] = lens[i]; }
+        op.done = std::move(done);
+        Conn &c = *conns_[next_.fetch_add(1, std::memory_order_relaxed) % conns_.size()];
+        {
+            std::lock_guard<std::mutex> lk(c.mtx);
+            c.submitted.push_back(std::move(op));
+        }
+        submitted_.fetch_add(1, std::memory_order_relaxed);
+        uint64_t f = in_flight_.fetch_add(1, std::memory_order_relaxed) + 1;
+        uint64_t prev = max_in_flight_.load(std::memory_order_relaxed);
+        while (f > prev && !max_in_flight_.compare_exchange_weak(prev, f, std::memory_order_relaxed)) {}
+        wake(c);
+    }
+
+    // Submit and wait for the result (caller must PQclear); nullptr with
+    // `err` set on failure. The calling thread blocks until then, but holds
+    // no connection.
+    PGresult* exec(const char *stmt, int n, const char *const *vals, const int *lens, std::string &err) {
+        struct Wait {
+            std::mutex m;
+            std::condition_variable cv;
+            bool done = false;
+            PGresult *res = nullptr;
+            std::string err;
+        } w;
+        submit(stmt, n, vals, lens, [&w](PGresult *res, const std::string &e) {
+            std::lock_guard<std::mutex> lk(w.m);
+            w.res = res;
+            w.err = e;
+            w.done = true;
+            w.cv.notify_one();
+        });
+        std::unique_lock<std::mutex> lk(w.m);
+        w.cv.wait(lk, [&w]{ return w.done; });
+        if (!w.res) err = w.err;
+        return w.res;
+    }
+
+    // Statistics (for metrics)
+    size_t connections() const noexcept { return conns_.size(); }
+    uint64_t in_flight() const noexcept { return in_flight_.load(std::memory_order_relaxed); }
+    uint64_t max_in_flight() const noexcept { return max_in_flight_.load(std::memory_order_relaxed); }
+    uint64_t submitted() const noexcept { return submitted_.load(std::memory_order_relaxed); }
+    uint64_t failed() const noexcept { return failed_.load(std::memory_order_relaxed); }
+    uint64_t reconnects() const noexcept { return reconnects_.load(std::memory_order_relaxed); }
+
+    // Server process IDs of the open connections
+    void backend_pids(std::vector<int> &out) const {
+        for (auto &c : conns_) {
+            int pid = c->pid.load(std::memory_order_relaxed);
+            if (pid) out.push_back(pid);
+        }
+    }
+
+private:
+    struct Op {
+        const char *stmt = nullptr;
+        int n = 0;
+        const char *vals[2] = {nullptr, nullptr};
+        int lens[2] = {0, 0};
+        int fmts[2] = {1, 1};
+        Callback done;
+        PGresult *res = nullptr;    // first result received for the statement
+        bool ended = false;         // its NULL terminator seen, waiting for the sync
+    };
+
+    struct Conn {
+        PGconn *pg = nullptr;
+        std::atomic<int> pid{0};    // backend of `pg`, readable from other threads
+        int efd = -1;
+        std::thread th;
+        std::mutex mtx;
+        std::deque<Op> submitted;   // guarded by mtx
+        std::deque<Op> sent;        // dispatcher only, in result order
+    };
+
+    std::string conninfo_;
+    std::vector<Statement> stmts_;
+    std::vector<std::unique_ptr<Conn>> conns_;
+    std::atomic<bool> stop_;
+
+    std::atomic<uint64_t> in_flight_;
+    std::atomic<uint64_t> max_in_flight_;
+    std::atomic<uint64_t> submitted_;
+    std::atomic<uint64_t> failed_;
+    std::atomic<uint64_t> reconnects_;
+    std::atomic<uint64_t> next_;
+
+    static void wake(Conn &c) {
+        uint64_t one = 1;
+        if (c.efd >= 0 && ::write(c.efd, &one, sizeof(one)) < 0) {}
+    }
+
+    // Connect, prepare the statements (still blocking), then switch the
+    // connection to nonblocking pipeline mode. On failure c.pg is left null.
+    bool open(Conn &c, std::string &err) {
+        if (c.pg) PQfinish(c.pg);
+        c.pid.store(0, std::memory_order_relaxed);
+        c.pg = PQconnectdb(conninfo_.c_str());
+        if (!open_prepared(c.pg, err)) {
+            if (c.pg) PQfinish(c.pg);
+            c.pg = nullptr;
+            return false;
+        }
+        c.pid.store(PQbackendPID(c.pg), std::memory_order_relaxed);
+        return true;
+    }
+
+    bool open_prepared(PGconn *pg, std::string &err) {
+        if (!pg || PQstatus(pg) != CONNECTION_OK) {
+            err = pg ? PQerrorMessage(pg) : "out of memory allocating PGconn";
+            return false;
+        }
+        PGresult *r = PQexec(pg, "SET client_min_messages = WARNING;");
+        if (r) PQclear(r);
+        for (const Statement &s : stmts_) {
+            r = PQprepare(pg, s.name, s.sql, s.nparams, s.types);
+            bool ok = r && PQresultStatus(r) == PGRES_COMMAND_OK;
+            if (!ok) err = r ? PQresultErrorMessage(r) : "no result from PQprepare";
+            if (r) PQclear(r);
+            if (!ok) return false;
+        }
+        if (PQsetnonblocking(pg, 1) != 0 || PQenterPipelineMode(pg) != 1) {
+            err = PQerrorMessage(pg);
+            return false;
+        }
+        return true;
+    }
+
+    void finish(Op &op, PGresult *res, const std::string &err) {
+        if (!res) failed_.fetch_add(1, std::memory_order_relaxed);
+        in_flight_.fetch_sub(1, std::memory_order_relaxed);
+        op.done(res, err);
+    }
+
+    // Fail everything sent or queued on this connection
+    void fail_all(Conn &c, const std::string &err) {
+        std::deque<Op> queued;
+        {
+            std::lock_guard<std::mutex> lk(c.mtx);
+            queued.swap(c.submitted);
+        }
+        for (auto &op : c.sent) {
+            if (op.res) PQclear(op.res);
+            finish(op, nullptr, err);
+        }
+        c.sent.clear();
+        for (auto &op : queued) finish(op, nullptr, err);
+    }
+
+    // A send or receive failed. The connection may still report
+    // CONNECTION_OK, but its protocol state is unknown: fail what was on it
+    // and drop it, so the loop above reconnects instead of retrying it.
+    void broken(Conn &c) {
+        std::string err = PQerrorMessage(c.pg);
+        fail_all(c, err.empty() ? "db pipeline I/O error" : err);
+        PQfinish(c.pg);
+        c.pg = nullptr;
+        c.pid.store(0, std::memory_order_relaxed);
+    }
+
+    void run(Conn &c) {
+        bool want_write = false;
+        auto last_attempt = std::chrono::steady_clock::now();
+        for (;;) {
+            bool stopping = stop_.load(std::memory_order_relaxed);
+            bool up = c.pg && PQstatus(c.pg) == CONNECTION_OK;
+            if (stopping) {
+                bool idle;
+                {
+                    std::lock_guard<std::mutex> lk(c.mtx);
+                    idle = c.submitted.empty();
+                }
+                if (!up || (idle && c.sent.empty())) {
+                    fail_all(c, "db pipeline stopped");
+                    return;
+                }
+            }
+
+            // lost connection: fail its statements and reconnect, at most
+            // every 200 ms; statements queued meanwhile fail fast
+            if (!up) {
+                fail_all(c, "db pipeline connection lost");
+                auto now = std::chrono::steady_clock::now();
+                if (now - last_attempt >= std::chrono::milliseconds(200)) {
+                    last_attempt = now;
+                    std::string err;
+                    if (open(c, err)) reconnects_.fetch_add(1, std::memory_order_relaxed);
+                }
+                wait_for(c, -1, false, 50);
+                continue;
+            }
+
+            if (!send_queued(c)) continue;
+            int f = PQflush(c.pg);
+            if (f < 0) { broken(c); continue; }
+            want_write = f == 1;
+
+            // wait for results, room to write, or new statements
+            short ev = wait_for(c, PQsocket(c.pg), want_write, 100);
+            if (ev & (POLLIN | POLLERR | POLLHUP)) {
+                if (!PQconsumeInput(c.pg)) { broken(c); continue; }
+                read_results(c);
+            }
+        }
+    }
+
+    // poll the eventfd and (if >= 0) the socket; returns the socket's revents
+    static short wait_for(Conn &c, int sock, bool want_write, int timeout_ms) {
+        pollfd fds[2];
+        fds[0].fd = c.efd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = sock;
+        fds[1].events = static_cast<short>(POLLIN | (want_write ? POLLOUT : 0));
+        fds[1].revents = 0;
+        int n = ::poll(fds, sock >= 0 ? 2 : 1, timeout_ms);
+        if (n > 0 && (fds[0].revents & POLLIN)) {
+            uint64_t v;
+            while (::read(c.efd, &v, sizeof(v)) > 0) {}
+        }
+        return n > 0 && sock >= 0 ? fds[1].revents : 0;
+    }
+
+    // Send queued statements, each with its own sync, up to kMaxInFlight.
+    // False when a send failed and the connection was dropped.
+    bool send_queued(Conn &c) {
+        std::deque<Op> batch;
+        {
+            std::lock_guard<std::mutex> lk(c.mtx);
+            while (!c.submitted.empty() && c.sent.size() + batch.size() < kMaxInFlight) {
+                batch.push_back(std::move(c.submitted.front()));
+                c.submitted.pop_front();
+            }
+        }
+        while (!batch.empty()) {
+            Op &op = batch.front();
+            bool ok = PQsendQueryPrepared(c.pg, op.stmt, op.n, op.vals, op.lens, op.fmts, 1) && PQpipelineSync(c.pg);
+            c.sent.push_back(std::move(op));
+            batch.pop_front();
+            if (ok) continue;
+            // a query may be in the pipeline without its sync, and every later
+            // result would be matched to the wrong statement: fail this one,
+            // the rest of the batch and everything on the connection
+            {
+                std::lock_guard<std::mutex> lk(c.mtx);
+                c.submitted.insert(c.submitted.begin(), std::make_move_iterator(batch.begin()),
+                                   std::make_move_iterator(batch.end()));
+            }
+            broken(c);
+            return false;
+        }
+        return true;
+    }
+
+    // Per statement libpq returns its result(s), a NULL, then the sync
+    // result; the statement completes on the sync
+    void read_results(Conn &c) {
+        while (!c.sent.empty() && !PQisBusy(c.pg)) {
+            Op &op = c.sent.front();
+            PGresult *r = PQgetResult(c.pg);
+            if (!r) {
+                if (!op.res || op.ended) break;    // nothing more buffered
+                op.ended = true;
+                continue;
+            }
+            if (PQresultStatus(r) == PGRES_PIPELINE_SYNC) {
+                PQclear(r);
+                Op done = std::move(op);
+                c.sent.pop_front();
+                if (!done.res) finish(done, nullptr, "no result");
+                else deliver(done);
+                continue;
+            }
+            if (!op.res) op.res = r;
+            else PQclear(r);
+        }
+    }
+
+    void deliver(Op &op) {
+        ExecStatusType st = PQresultStatus(op.res);
+        if (st == PGRES_PIPELINE_ABORTED) {
+            PQclear(op.res);
+            finish(op, nullptr, "statement aborted in pipeline");
+            return;
+        }
+        // errors are handed over like PQexecPrepared's, for the caller to inspect
+        finish(op, op.res, std::string());
+    }
+};
@@ -1,26 +1,151 @@
+#pragma once
+
 #include <libpq-fe.h>
+#include <algorithm>
 #include <string>
 #include <sstream>
+#include <thread>
 #include <iostream>
 #include <mutex>
+#include <condition_variable>
 #include <cstdlib>
+#include <functional>
 #include <atomic>
 #include <chrono>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "histogram.h"
+#include "logger.h"
+#include "pg_pipeline.h"
+#include "request_trace.h"
 
+// PostgreSQL-backed store. Owns a pool of N libpq connections so concurrent
+// callers can run their round trips in parallel; every operation checks a
+// connection out for the duration of one statement and returns it afterwards.
+// Optionally single-statement operations (get, get_many, put, del) go through
+// a PGPipeline instead, many of them in flight on a few pipelined
+// connections; transactions (write_batch) always use the pool.
+//
+// Read replicas (add_replica) take the single-key and batch gets: each is a
+// PGStore of its own, with its own pool, picked round-robin among those a
+// background check finds reachable and within max_lag_ms of the primary.
+// Keys this store wrote within the guard window are read from the primary,
+// so a client sees its own writes; so are all reads when no replica is
+// healthy, and a read that fails on a replica is retried there.
 class PGStore {
+    // One pooled connection and whether our statements are prepared on it
+    struct PooledConn {
+        PGconn *pg = nullptr;
+        bool prepared = false;
+        std::atomic<int> pid{0};    // backend of `pg`, readable without a lease
+    };
+
 public:
-    PGStore(): conn(nullptr),
+    // A read replica and what the health check last saw of it
+    class ReadReplica {
+    public:
+        const std::string& name() const noexcept { return name_; }
+        const PGStore& store() const noexcept { return *db_; }
+        bool healthy() const noexcept { return healthy_.load(std::memory_order_relaxed); }
+        // replay lag at the last successful check, -1 before the first
+        int64_t lag_ms() const noexcept { return lag_ms_.load(std::memory_order_relaxed); }
+        uint64_t checks() const noexcept { return checks_.load(std::memory_order_relaxed); }
+        uint64_t check_failures() const noexcept { return check_failures_.load(std::memory_order_relaxed); }
+        // reads that failed here and went to the primary instead
+        uint64_t fallbacks() const noexcept { return fallbacks_.load(std::memory_order_relaxed); }
+
+    private:
+        friend class PGStore;
+        std::string conninfo_;
+        std::string name_;           // host:port, for metrics (conninfo may hold a password)
+        std::unique_ptr<PGStore> db_;
+        std::atomic<bool> healthy_{false};
+        std::atomic<int64_t> lag_ms_{-1};
+        std::atomic<uint64_t> checks_{0};
+        std::atomic<uint64_t> check_failures_{0};
+        std::atomic<uint64_t> fallbacks_{0};
+    };
+
+    // RAII handle for a checked-out connection. Converts to false when the
+    // checkout timed out or the pool is not connected.
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(PGStore *store, PooledConn *conn) : store_(store), conn_(conn) {}
+        ~Lease() { release(); }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        Lease(Lease &&o) noexcept : store_(o.store_), conn_(o.conn_) { o.store_ = nullptr; o.conn_ = nullptr; }
+        Lease& operator=(Lease &&o) noexcept {
+            if (this != &o) {
+                release();
+                store_ = o.store_; conn_ = o.conn_;
+                o.store_ = nullptr; o.conn_ = nullptr;
+            }
+            return *this;
+        }
+
+        PGconn* get() const noexcept { return conn_ ? conn_->pg : nullptr; }
+        PooledConn* pooled() const noexcept { return conn_; }
+        explicit operator bool() const noexcept { return conn_ != nullptr; }
+
+        void release() {
+            if (store_ && conn_) store_->checkin(conn_);
+            store_ = nullptr;
+            conn_ = nullptr;
+        }
+
+    private:
+        PGStore *store_ = nullptr;
+        PooledConn *conn_ = nullptr;
+    };
+
+    PGStore(): pool_size_(1), checkout_timeout_ms_(1000),
                get_queries_(0), put_queries_(0),
-               total_db_ns_(0) {}
+               total_db_ns_(0),
+               in_use_(0), checkouts_(0), checkout_timeouts_(0),
+               total_wait_ns_(0), max_wait_ns_(0) {}
 
     ~PGStore(){ disconnect(); }
 
-    // Connect using libpq conninfo string
+    // Pool sizing; takes effect on the next connect()
+    void set_pool_size(size_t n) { pool_size_ = n > 0 ? n : 1; }
+    size_t pool_size() const noexcept { return pool_size_; }
+
+    // Pipelined connections for single-statement operations (0 = off, every
+    // operation uses the pool). They prepare their statements up front, so
+    // they are opened by ensure_table() once the table exists.
+    void set_pipeline_connections(size_t n) { pipeline_conns_ = n; }
+    size_t pipeline_connections() const noexcept { return pipeline_conns_; }
+    // null unless connected with pipeline connections
+    const PGPipeline* pipeline() const noexcept { return pipe_.get(); }
+
+    // How long checkout() waits for a free connection before giving up
+    void set_checkout_timeout_ms(int ms) { checkout_timeout_ms_ = ms; }
+    int checkout_timeout_ms() const noexcept { return checkout_timeout_ms_; }
+
+    // Connect using libpq conninfo string; opens pool_size() connections
     bool connect(const std::string &conninfo) {
-        std::lock_guard<std::mutex> lk(mtx);
-        if (conn) PQfinish(conn);
-        conn = PQconnectdb(conninfo.c_str());
-        return check_conn_locked();
+        disconnect();
+        std::vector<std::unique_ptr<PooledConn>> opened;
+        for (size_t i = 0; i < pool_size_; i++) {
+            PGconn *c = PQconnectdb(conninfo.c_str());
+            if (!check_conn(c)) {
+                for (auto &o : opened) PQfinish(o->pg);
+                return false;
+            }
+            opened.emplace_back(new PooledConn{c, false, {PQbackendPID(c)}});
+        }
+        conninfo_ = conninfo;
+        std::lock_guard<std::mutex> lk(pool_mtx_);
+        all_ = std::move(opened);
+        for (auto &pc : all_) idle_.push_back(pc.get());
+        return true;
     }
 
     // Build conninfo from environment variables if present and connect
@@ -41,149 +166,475 @@ public:
         return connect(ss.str());
     }
 
+    // What connect() was given
+    const std::string& conninfo() const noexcept { return conninfo_; }
+
+    bool connected() {
+        std::lock_guard<std::mutex> lk(pool_mtx_);
+        return !all_.empty();
+    }
+
+    // Replica routing; takes effect on the next add_replica(). A replica
+    // more than max_lag_ms behind is skipped. Keys written here are read from
+    // the primary for guard_ms afterwards (-1: max_lag_ms + check_ms, the
+    // most a replica that passed its last check can be behind).
+    void set_replica_options(int max_lag_ms, int check_ms, int guard_ms) {
+        replica_max_lag_ms_ = max_lag_ms;
+        replica_check_ms_ = check_ms > 0 ? check_ms : 1;
+        guard_ms_ = guard_ms >= 0 ? guard_ms : max_lag_ms + replica_check_ms_;
+    }
+    int replica_max_lag_ms() const noexcept { return replica_max_lag_ms_; }
+    int replica_check_ms() const noexcept { return replica_check_ms_; }
+    int read_guard_ms() const noexcept { return guard_ms_; }
+
+    // Send gets to a read replica as well, once connect() has succeeded and
+    // before requests are served. Its pool has pool_size() connections.
+    // False (with last_error()) if it can't be reached or lags too far now;
+    // it is kept, and used once a health check passes.
+    bool add_replica(const std::string &conninfo) {
+        std::unique_ptr<ReadReplica> r(new ReadReplica);
+        r->conninfo_ = conninfo;
+        r->name_ = replica_name(conninfo, replicas_.size());
+        r->db_.reset(new PGStore);
+        r->db_->set_pool_size(pool_size_);
+        r->db_->set_checkout_timeout_ms(checkout_timeout_ms_);
+        if (!guard_) {
+            guard_.reset(new std::atomic<int64_t>[kGuardSlots]);
+            for (size_t i = 0; i < kGuardSlots; i++) guard_[i].store(0, std::memory_order_relaxed);
+        }
+        std::string lsn;
+        if (!current_wal_lsn(lsn)) lsn.clear();
+        check_replica(*r, lsn);
+        bool ok = r->healthy();
+        if (ok) clear_error();
+        else if (tls_last_err().empty()) set_error("replica lags by " + std::to_string(r->lag_ms()) + " ms");
+        {
+            std::lock_guard<std::mutex> lk(health_mtx_);
+            replicas_.push_back(std::move(r));
+        }
+        if (!health_th_.joinable()) {
+            health_stop_ = false;
+            health_th_ = std::thread([this]{ health_loop(); });
+        }
+        return ok;
+    }
+
+    size_t replica_count() const noexcept { return replicas_.size(); }
+    const ReadReplica& replica(size_t i) const noexcept { return *replicas_[i]; }
+    // reads sent to the primary because their key was written recently, or
+    // because no replica was healthy
+    uint64_t stats_guarded_reads() const noexcept { return guarded_reads_.load(std::memory_order_relaxed); }
+    uint64_t stats_unrouted_reads() const noexcept { return unrouted_reads_.load(std::memory_order_relaxed); }
+
+    // Read `key` from the primary for the guard window. Writes through this
+    // store do so themselves; this is for writes made elsewhere, e.g. an
+    // invalidation from another server. note_write_all() covers every key.
+    void note_write(const std::string &key) {
+        if (guard_) guard_[std::hash<std::string>{}(key) % kGuardSlots].store(steady_ms(), std::memory_order_relaxed);
+    }
+    void note_write_all() {
+        if (guard_) guard_all_.store(steady_ms(), std::memory_order_relaxed);
+    }
+
+    // The primary's current WAL write position, e.g. "0/3000148"
+    bool current_wal_lsn(std::string &out) {
+        clear_error();
+        Lease l = checkout();
+        if (!l) return false;
+        PGresult *r = PQexec(l.get(), "SELECT pg_current_wal_lsn()");
+        bool ok = r && PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) == 1;
+        if (ok) out = PQgetvalue(r, 0, 0);
+        else set_error(r ? PQresultErrorMessage(r) : "no result");
+        if (r) PQclear(r);
+        return ok;
+    }
+
+    // On a standby, how far replay is behind `primary_lsn` (from
+    // current_wal_lsn() on the primary), in ms: 0 once replay has reached it,
+    // else the time since the last replayed transaction. Comparing with the
+    // primary, not with what the standby has received, catches a standby
+    // whose WAL stream has stopped. An empty `primary_lsn` falls back to the
+    // received position. 0 when not a standby.
+    bool standby_lag_ms(const std::string &primary_lsn, int64_t &out) {
+        clear_error();
+        Lease l = checkout();
+        if (!l) return false;
+        const char *vals[1] = {primary_lsn.empty() ? nullptr : primary_lsn.c_str()};
+        PGresult *r = PQexecParams(l.get(),
+            "SELECT COALESCE(CASE WHEN pg_wal_lsn_diff(COALESCE($1::pg_lsn, pg_last_wal_receive_lsn()), "
+            "pg_last_wal_replay_lsn()) <= 0 THEN 0 "
+            "ELSE (extract(epoch from now() - pg_last_xact_replay_timestamp()) * 1000)::int8 END, 0)",
+            1, nullptr, vals, nullptr, nullptr, 0);
+        bool ok = r && PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) == 1;
+        if (ok) out = std::strtoll(PQgetvalue(r, 0, 0), nullptr, 10);
+        else set_error(r ? PQresultErrorMessage(r) : "no result");
+        if (r) PQclear(r);
+        return ok;
+    }
+
+    // Server process IDs of the pooled and pipelined connections, as reported
+    // with the notifications they send
+    std::vector<int> backend_pids() {
+        std::vector<int> out;
+        {
+            std::lock_guard<std::mutex> lk(pool_mtx_);
+            for (auto &pc : all_) out.push_back(pc->pid.load(std::memory_order_relaxed));
+        }
+        if (pipe_) pipe_->backend_pids(out);
+        return out;
+    }
+
+    // Close every pooled connection, and the replicas. Callers must not hold
+    // leases.
     void disconnect() {
-        std::lock_guard<std::mutex> lk(mtx);
-        if (conn) {
-            PQfinish(conn);
-            conn = nullptr;
+        if (health_th_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lk(health_mtx_);
+                health_stop_ = true;
+            }
+            health_cv_.notify_all();
+            health_th_.join();
+        }
+        replicas_.clear();
+        pipe_.reset();
+        std::lock_guard<std::mutex> lk(pool_mtx_);
+        for (auto &pc : all_) PQfinish(pc->pg);
+        all_.clear();
+        idle_.clear();
+    }
+
+    // Borrow a connection, waiting up to checkout_timeout_ms() for one to
+    // become free. An empty lease means timeout (or no pool).
+    Lease checkout() {
+        auto t0 = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lk(pool_mtx_);
+        if (all_.empty()) { set_error("not connected"); return Lease(); }
+        bool got = pool_cv_.wait_for(lk, std::chrono::milliseconds(checkout_timeout_ms_),
+                                     [&]{ return !idle_.empty() || all_.empty(); });
+        if (!got || idle_.empty()) {
+            lk.unlock();
+            checkout_timeouts_.fetch_add(1, std::memory_order_relaxed);
+            record_wait(t0);
+            set_error(all_.empty() ? "not connected" : "db pool checkout timeout");
+            return Lease();
         }
+        PooledConn *c = idle_.back();
+        idle_.pop_back();
+        lk.unlock();
+
+        in_use_.fetch_add(1, std::memory_order_relaxed);
+        checkouts_.fetch_add(1, std::memory_order_relaxed);
+        record_wait(t0);
+
+        // Transparently recover connections that dropped while idle; the new
+        // backend has none of our prepared statements
+        if (PQstatus(c->pg) != CONNECTION_OK) {
+            PQreset(c->pg);
+            c->prepared = false;
+            c->pid.store(PQbackendPID(c->pg), std::memory_order_relaxed);
+            if (PQstatus(c->pg) == CONNECTION_OK) PQexec_discard(c->pg, "SET client_min_messages = WARNING;");
+        }
+        return Lease(this, c);
     }
 
-    // Ensure table exists
+    // Ensure table exists. updated_at (last write time) lets a restored
+    // cache snapshot find the rows that changed after it was taken; tables
+    // from before it get the column added.
     bool ensure_table() {
-        std::lock_guard<std::mutex> lk(mtx);
-        if (!conn) { last_err = "not connected"; return false; }
-        const char* q = "CREATE TABLE IF NOT EXISTS kv_store (key TEXT PRIMARY KEY, value BYTEA);";
-        PGresult* r = PQexec(conn, q);
-        if (!r) { last_err = "no result from CREATE TABLE"; return false; }
+        clear_error();
+        Lease l = checkout();
+        if (!l) return false;
+        // ALTER TABLE takes an ACCESS EXCLUSIVE lock even when the column
+        // exists, stalling every other server's reads and writes: only run it
+        // on a table from before updated_at
+        const char* q = "CREATE TABLE IF NOT EXISTS kv_store (key TEXT PRIMARY KEY, value BYTEA, "
+                        "updated_at TIMESTAMPTZ NOT NULL DEFAULT now());"
+                        "DO $d$ BEGIN\n"
+                        "  IF NOT EXISTS (SELECT 1 FROM pg_attribute WHERE attrelid = 'kv_store'::regclass\n"
+                        "                 AND attname = 'updated_at' AND NOT attisdropped) THEN\n"
+                        "    ALTER TABLE kv_store ADD COLUMN IF NOT EXISTS updated_at TIMESTAMPTZ NOT NULL DEFAULT now();\n"
+                        "  END IF;\n"
+                        "END $d$;";
+        PGresult* r = PQexec(l.get(), q);
+        if (!r) { set_error("no result from CREATE TABLE"); return false; }
         bool ok = (PQresultStatus(r) == PGRES_COMMAND_OK);
-        if (!ok) last_err = PQresultErrorMessage(r);
+        if (!ok) set_error(PQresultErrorMessage(r));
         PQclear(r);
+        l.release();
+        if (ok && pipeline_conns_ > 0 && !pipe_) {
+            std::unique_ptr<PGPipeline> p(new PGPipeline(conninfo_, pipeline_conns_, statement_defs()));
+            std::string err;
+            if (!p->start(err)) { set_error(err); return false; }
+            pipe_ = std::move(p);
+        }
         return ok;
     }
 
+    // Have every committed write to kv_store NOTIFY channel `channel` with
+    // the key (DELETE: the old key). NOTIFY payloads are capped at 8000 bytes;
+    // longer keys, and TRUNCATE, send an empty payload, meaning "everything".
+    // The trigger stays installed for all writers until dropped.
+    bool ensure_notify_trigger(const char *channel) {
+        clear_error();
+        Lease l = checkout();
+        if (!l) return false;
+        std::string q =
+            "CREATE OR REPLACE FUNCTION kv_store_notify() RETURNS trigger LANGUAGE plpgsql AS $f$\n"
+            "DECLARE k text := '';\n"
+            "BEGIN\n"
+            "  IF TG_LEVEL = 'ROW' THEN\n"
+            "    IF TG_OP = 'DELETE' THEN k := OLD.key; ELSE k := NEW.key; END IF;\n"
+            "    IF octet_length(k) > 7900 THEN k := ''; END IF;\n"
+            "  END IF;\n"
+            "  PERFORM pg_notify(TG_ARGV[0], k);\n"
+            "  RETURN NULL;\n"
+            "END $f$;\n"
+            "DO $d$ BEGIN\n"
+            "  IF NOT EXISTS (SELECT 1 FROM pg_trigger WHERE tgname = 'kv_store_invalidate' AND tgrelid = 'kv_store'::regclass) THEN\n"
+            "    CREATE TRIGGER kv_store_invalidate AFTER INSERT OR UPDATE OR DELETE ON kv_store\n"
+            "      FOR EACH ROW EXECUTE FUNCTION kv_store_notify('" + std::string(channel) + "');\n"
+            "  END IF;\n"
+            "  IF NOT EXISTS (SELECT 1 FROM pg_trigger WHERE tgname = 'kv_store_invalidate_truncate' AND tgrelid = 'kv_store'::regclass) THEN\n"
+            "    CREATE TRIGGER kv_store_invalidate_truncate AFTER TRUNCATE ON kv_store\n"
+            "      FOR EACH STATEMENT EXECUTE FUNCTION kv_store_notify('" + std::string(channel) + "');\n"
+            "  END IF;\n"
+            "END $d$;";
+        return exec_command(l.get(), q.c_str());
+    }
+
     // Get value for key
     bool get(const std::string &key, std::string &value) {
+        if (replicas_.empty()) return get_direct(key, value);
+        if (ReadReplica *r = read_target(&key)) {
+            if (r->db_->get(key, value)) return true;
+            if (tls_last_err().empty()) return false;   // not there
+            replica_failed(*r);
+        }
+        return get_direct(key, value);
+    }
+
+    // Fetch many keys with one SELECT ... WHERE key = ANY($1::text[]). Keys
+    // that exist are added to `out`; missing ones are simply absent.
+    bool get_many(const std::vector<std::string> &keys, std::unordered_map<std::string, std::string> &out) {
+        if (replicas_.empty()) return get_many_direct(keys, out);
+        // recently written keys go to the primary, the rest to a replica
+        size_t first = 0;
+        while (first < keys.size() && !guarded(keys[first])) first++;
+        std::vector<std::string> here, there;
+        if (first < keys.size()) {
+            guarded_reads_.fetch_add(1, std::memory_order_relaxed);
+            there.assign(keys.begin(), keys.begin() + first);
+            for (size_t i = first; i < keys.size(); i++) (guarded(keys[i]) ? here : there).push_back(keys[i]);
+        }
+        const std::vector<std::string> &remote = first < keys.size() ? there : keys;
+        if (!remote.empty()) {
+            ReadReplica *r = read_target(nullptr);
+            if (!r || !r->db_->get_many(remote, out)) {
+                if (r) replica_failed(*r);
+                if (first == keys.size()) return get_many_direct(keys, out);
+                here.insert(here.end(), remote.begin(), remote.end());
+            }
+        }
+        return here.empty() || get_many_direct(here, out);
+    }
+
+    // Insert/update key
+    bool put(const std::string &key, const std::string &value) {
         auto t0 = std::chrono::steady_clock::now();
+        clear_error();
 
-        std::lock_guard<std::mutex> lk(mtx);
-        if (!conn) { last_err = "not connected"; return false; }
-
-        const char* paramValues[1];
-        int paramLengths[1];
-        int paramFormats[1];
-        paramValues[0] = key.c_str();
-        paramLengths[0] = static_cast<int>(key.size());
-        paramFormats[0] = 0; // send param as text
-
-        // Request the value column as binary
-        PGresult* res = PQexecParams(conn,"SELECT value FROM kv_store WHERE key = $1",
-                                     1,          // nParams
-                                     nullptr,    // paramTypes
-                                     paramValues,
-                                     paramLengths,
-                                     paramFormats,
-                                     1);         // resultFormat: 1 => binary
-        if (!res) { last_err = "no result"; return false; }
+        const char* paramValues[2] = {key.data(), value.data()};
+        int paramLengths[2] = {static_cast<int>(key.size()), static_cast<int>(value.size())};
 
-        ExecStatusType st = PQresultStatus(res);
-        if (st != PGRES_TUPLES_OK) {
-            last_err = PQresultErrorMessage(res);
-            PQclear(res);
+        bool ok = command_ok(run_prepared(kStmtPut, 2, paramValues, paramLengths));
+        note_write(key);    // even on failure: it may have committed
+        if (!ok) {
+            stmt_failed(STMT_PUT);
             return false;
         }
-        if (PQntuples(res) == 0) {
-            PQclear(res);
-            record_db_time(t0);
-            // not found -> not an error, return false
+
+        put_queries_.fetch_add(1, std::memory_order_relaxed);
+        record_db_time(t0);
+        record_stmt(STMT_PUT, t0);
+        return true;
+    }
+
+    // Delete key
+    bool del(const std::string &key) {
+        auto t0 = std::chrono::steady_clock::now();
+        clear_error();
+
+        const char* paramValues[1] = {key.data()};
+        int paramLengths[1] = {static_cast<int>(key.size())};
+
+        bool ok = command_ok(run_prepared(kStmtDel, 1, paramValues, paramLengths));
+        note_write(key);
+        if (!ok) {
+            stmt_failed(STMT_DEL);
             return false;
         }
 
-        int len = PQgetlength(res, 0, 0);
-        const char* ptr = PQgetvalue(res, 0, 0);
-        if (ptr && len > 0) {
-            value.assign(ptr, ptr + len);
-        } else {
-            value.clear();
-        }
-        PQclear(res);
-
-        get_queries_.fetch_add(1, std::memory_order_relaxed);
+        put_queries_.fetch_add(1, std::memory_order_relaxed); // count deletes as writes
         record_db_time(t0);
+        record_stmt(STMT_DEL, t0);
         return true;
     }
 
-    // Insert/update key
-    bool put(const std::string &key, const std::string &value) {
+    // Apply many upserts and deletes in one transaction: one INSERT ... SELECT
+    // FROM unnest(text[], bytea[]) ON CONFLICT and one DELETE ... = ANY(text[]),
+    // with the arrays sent in binary. Keys must be unique across both lists
+    // (Postgres rejects an upsert touching a row twice).
+    bool write_batch(const std::vector<std::pair<std::string, std::string>> &puts,
+                     const std::vector<std::string> &dels) {
         auto t0 = std::chrono::steady_clock::now();
+        clear_error();
+        if (puts.empty() && dels.empty()) return true;
 
-        std::lock_guard<std::mutex> lk(mtx);
-        if (!conn) { last_err = "not connected"; return false; }
+        Lease l = checkout();
+        if (!l || !ensure_prepared(l)) return false;
+        PGconn *c = l.get();
 
-        const char* paramValues[2];
-        int paramLengths[2];
-        int paramFormats[2];
+        if (!exec_command(c, "BEGIN")) { stmt_failed(STMT_BATCH); return false; }
 
-        paramValues[0] = key.c_str();
-        paramLengths[0] = static_cast<int>(key.size());
-        paramFormats[0] = 0; // key as text
+        if (!puts.empty()) {
+            std::vector<const std::string*> keys, vals;
+            keys.reserve(puts.size());
+            vals.reserve(puts.size());
+            for (auto &kv : puts) { keys.push_back(&kv.first); vals.push_back(&kv.second); }
+            std::string karr = encode_array(kTextOid, keys);
+            std::string varr = encode_array(kByteaOid, vals);
+            const char* paramValues[2] = {karr.data(), varr.data()};
+            int paramLengths[2] = {static_cast<int>(karr.size()), static_cast<int>(varr.size())};
+            int paramFormats[2] = {1, 1};
+            if (!exec_prepared(c, kStmtBatchPut, 2, paramValues, paramLengths, paramFormats)) {
+                rollback(c);
+                stmt_failed(STMT_BATCH);
+                return false;
+            }
+        }
 
-        paramValues[1] = value.data();
-        paramLengths[1] = static_cast<int>(value.size());
-        paramFormats[1] = 1; // value as binary (bytea)
+        if (!dels.empty()) {
+            std::vector<const std::string*> keys;
+            keys.reserve(dels.size());
+            for (auto &k : dels) keys.push_back(&k);
+            std::string karr = encode_array(kTextOid, keys);
+            const char* paramValues[1] = {karr.data()};
+            int paramLengths[1] = {static_cast<int>(karr.size())};
+            int paramFormats[1] = {1};
+            if (!exec_prepared(c, kStmtBatchDel, 1, paramValues, paramLengths, paramFormats)) {
+                rollback(c);
+                stmt_failed(STMT_BATCH);
+                return false;
+            }
+        }
 
-        PGresult* res = PQexecParams(conn,
-                                     "INSERT INTO kv_store(key, value) VALUES($1, $2) "
-                                     "ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value",
-                                     2, nullptr, paramValues, paramLengths, paramFormats, 0); // resultFormat 0 (text)
-        if (!res) { last_err = "no result"; return false; }
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            last_err = PQresultErrorMessage(res);
-            PQclear(res);
-            return false;
+        bool committed = exec_command(c, "COMMIT");
+        if (guard_) {
+            for (auto &kv : puts) note_write(kv.first);
+            for (auto &k : dels) note_write(k);
         }
-        PQclear(res);
+        if (!committed) { rollback(c); stmt_failed(STMT_BATCH); return false; }
 
-        put_queries_.fetch_add(1, std::memory_order_relaxed);
+        put_queries_.fetch_add(puts.size() + dels.size(), std::memory_order_relaxed);
         record_db_time(t0);
+        record_stmt(STMT_BATCH, t0);
         return true;
     }
 
-    // Delete key
-    bool del(const std::string &key) {
+    // Stream up to `limit` rows of kv_store (0 = all, in storage order)
+    // through a server-side cursor, `chunk` rows per FETCH, calling
+    // fn(key, value) for each; fn returns false to stop early. Holds one
+    // pooled connection in a read-only transaction for the whole scan.
+    bool scan(size_t limit, size_t chunk, const std::function<bool(std::string&, std::string&)> &fn) {
         auto t0 = std::chrono::steady_clock::now();
+        clear_error();
+        Lease l = checkout();
+        if (!l) return false;
+        PGconn *c = l.get();
+
+        std::string decl = "DECLARE kv_scan NO SCROLL CURSOR FOR SELECT key, value FROM kv_store";
+        if (limit > 0) decl += " LIMIT " + std::to_string(limit);
+        if (!exec_command(c, "BEGIN READ ONLY")) { stmt_failed(STMT_SCAN); return false; }
+        if (!exec_command(c, decl.c_str())) { rollback(c); stmt_failed(STMT_SCAN); return false; }
 
-        std::lock_guard<std::mutex> lk(mtx);
-        if (!conn) { last_err = "not connected"; return false; }
+        const std::string fetch = "FETCH " + std::to_string(chunk > 0 ? chunk : 1000) + " FROM kv_scan";
+        bool more = true;
+        while (more) {
+            PGresult *r = PQexecParams(c, fetch.c_str(), 0, nullptr, nullptr, nullptr, nullptr, 1);
+            if (!r || PQresultStatus(r) != PGRES_TUPLES_OK) {
+                set_error(r ? PQresultErrorMessage(r) : "no result");
+                if (r) PQclear(r);
+                rollback(c);
+                stmt_failed(STMT_SCAN);
+                return false;
+            }
+            int rows = PQntuples(r);
+            for (int i = 0; i < rows && more; i++) {
+                std::string k(PQgetvalue(r, i, 0), PQgetlength(r, i, 0));
+                std::string v(PQgetvalue(r, i, 1), PQgetlength(r, i, 1));
+                more = fn(k, v);
+            }
+            PQclear(r);
+            if (rows == 0) more = false;
+        }
+        rollback(c);    // read-only: nothing to commit, closes the cursor
+
+        record_db_time(t0);
+        record_stmt(STMT_SCAN, t0);
+        return true;
+    }
+
+    // Current time on the Postgres server, in microseconds since the epoch;
+    // the clock updated_at is written with
+    bool now_us(int64_t &out) {
+        clear_error();
+        Lease l = checkout();
+        if (!l) return false;
+        PGresult *r = PQexec(l.get(), "SELECT (extract(epoch from clock_timestamp()) * 1000000)::int8");
+        bool ok = r && PQresultStatus(r) == PGRES_TUPLES_OK && PQntuples(r) == 1;
+        if (ok) out = std::strtoll(PQgetvalue(r, 0, 0), nullptr, 10);
+        else set_error(r ? PQresultErrorMessage(r) : "no result");
+        if (r) PQclear(r);
+        return ok;
+    }
 
-        const char* paramValues[1];
-        int paramLengths[1];
-        int paramFormats[1];
+    // Add to `out` those of `keys` that still exist and were last written at
+    // or before `since_us` (Postgres clock, see now_us())
+    bool unchanged_since(const std::vector<std::string> &keys, int64_t since_us, std::unordered_set<std::string> &out) {
+        auto t0 = std::chrono::steady_clock::now();
+        clear_error();
+        if (keys.empty()) return true;
 
-        paramValues[0] = key.c_str();
-        paramLengths[0] = static_cast<int>(key.size());
-        paramFormats[0] = 0; // text
+        std::vector<const std::string*> ptrs;
+        ptrs.reserve(keys.size());
+        for (auto &k : keys) ptrs.push_back(&k);
+        std::string karr = encode_array(kTextOid, ptrs);
+        char since[8];
+        for (int i = 0; i < 8; i++) since[i] = static_cast<char>(static_cast<uint64_t>(since_us) >> (56 - 8 * i));
+        const char* paramValues[2] = {karr.data(), since};
+        int paramLengths[2] = {static_cast<int>(karr.size()), 8};
 
-        PGresult* res = PQexecParams(conn,
-                                     "DELETE FROM kv_store WHERE key = $1",
-                                     1, nullptr, paramValues, paramLengths, paramFormats, 0);
-        if (!res) { last_err = "no result"; return false; }
-        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-            last_err = PQresultErrorMessage(res);
+        PGresult* res = run_prepared(kStmtUnchanged, 2, paramValues, paramLengths);
+        if (!res) { stmt_failed(STMT_UNCHANGED); return false; }
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            set_error(PQresultErrorMessage(res));
             PQclear(res);
+            stmt_failed(STMT_UNCHANGED);
             return false;
         }
+        int rows = PQntuples(res);
+        for (int i = 0; i < rows; i++) out.emplace(PQgetvalue(res, i, 0), PQgetlength(res, i, 0));
         PQclear(res);
 
-        put_queries_.fetch_add(1, std::memory_order_relaxed); // count deletes as writes
         record_db_time(t0);
+        record_stmt(STMT_UNCHANGED, t0);
         return true;
     }
 
-    // Thread-safe last error string
+    // Error from the most recent operation on the calling thread; empty when
+    // that operation succeeded or simply found nothing.
     std::string last_error() {
-        std::lock_guard<std::mutex> lk(mtx);
-        return last_err;
+        return tls_last_err();
     }
 
     // DB statistics (for metrics)
@@ -193,43 +644,442 @@ public:
     uint64_t stats_put_queries() const noexcept {
         return put_queries_.load(std::memory_order_relaxed);
     }
-    // average DB latency in milliseconds
+    // average DB latency in milliseconds, over every statement execution
     double stats_avg_db_latency_ms() const noexcept {
-        uint64_t cnt = get_queries_.load(std::memory_order_relaxed) + put_queries_.load(std::memory_order_relaxed);
+        uint64_t cnt = 0;
+        for (auto &st : stmt_stats_) cnt += st.count.load(std::memory_order_relaxed);
         if (cnt == 0) return 0.0;
         uint64_t total_ns = total_db_ns_.load(std::memory_order_relaxed);
         double avg_ms = (double)total_ns / 1e6 / (double)cnt;
         return avg_ms;
     }
 
+    // Per-statement statistics
+    enum Stmt { STMT_GET, STMT_PUT, STMT_DEL, STMT_BATCH, STMT_BATCH_GET, STMT_SCAN, STMT_UNCHANGED, STMT_COUNT };
+    static const char* stmt_name(Stmt s) {
+        static const char* names[STMT_COUNT] = {"get", "put", "del", "batch", "batch_get", "scan", "unchanged"};
+        return names[s];
+    }
+    uint64_t stats_stmt_count(Stmt s) const noexcept { return stmt_stats_[s].count.load(std::memory_order_relaxed); }
+    uint64_t stats_stmt_errors(Stmt s) const noexcept { return stmt_stats_[s].errors.load(std::memory_order_relaxed); }
+    double stats_stmt_avg_ms(Stmt s) const noexcept {
+        uint64_t cnt = stmt_stats_[s].count.load(std::memory_order_relaxed);
+        if (cnt == 0) return 0.0;
+        return (double)stmt_stats_[s].total_ns.load(std::memory_order_relaxed) / 1e6 / (double)cnt;
+    }
+    // latency distribution of successful executions
+    const LatencyHistogram& stats_stmt_latency(Stmt s) const noexcept { return stmt_stats_[s].latency; }
+    // times a connection had its statements (re-)prepared
+    uint64_t stats_prepares() const noexcept { return prepares_.load(std::memory_order_relaxed); }
+
+    // Pool statistics (for metrics)
+    uint64_t stats_pool_in_use() const noexcept { return in_use_.load(std::memory_order_relaxed); }
+    uint64_t stats_pool_checkouts() const noexcept { return checkouts_.load(std::memory_order_relaxed); }
+    uint64_t stats_pool_timeouts() const noexcept { return checkout_timeouts_.load(std::memory_order_relaxed); }
+    // average / max time spent waiting for a connection, in milliseconds
+    double stats_pool_avg_wait_ms() const noexcept {
+        uint64_t cnt = checkouts_.load(std::memory_order_relaxed) + checkout_timeouts_.load(std::memory_order_relaxed);
+        if (cnt == 0) return 0.0;
+        return (double)total_wait_ns_.load(std::memory_order_relaxed) / 1e6 / (double)cnt;
+    }
+    double stats_pool_max_wait_ms() const noexcept {
+        return (double)max_wait_ns_.load(std::memory_order_relaxed) / 1e6;
+    }
+
 private:
-    PGconn* conn;
-    mutable std::mutex mtx;
-    std::string last_err;
+    size_t pool_size_;
+    int checkout_timeout_ms_;
+    std::string conninfo_;
+    size_t pipeline_conns_ = 0;
+    std::unique_ptr<PGPipeline> pipe_;
+
+    // Read replicas; the list is fixed once requests are being served
+    static constexpr size_t kGuardSlots = 1 << 16;
+    std::vector<std::unique_ptr<ReadReplica>> replicas_;
+    std::atomic<uint64_t> next_replica_{0};
+    int replica_max_lag_ms_ = 1000;
+    int replica_check_ms_ = 1000;
+    int guard_ms_ = 2000;
+    // steady-clock ms of the last write to any key hashing to each slot;
+    // collisions only send more reads to the primary
+    std::unique_ptr<std::atomic<int64_t>[]> guard_;
+    std::atomic<int64_t> guard_all_{0};
+    std::atomic<uint64_t> guarded_reads_{0};
+    std::atomic<uint64_t> unrouted_reads_{0};
+    std::thread health_th_;
+    std::mutex health_mtx_;
+    std::condition_variable health_cv_;
+    bool health_stop_ = false;
+
+    // Pool: all_ owns every connection, idle_ holds the ones not leased out
+    std::mutex pool_mtx_;
+    std::condition_variable pool_cv_;
+    std::vector<std::unique_ptr<PooledConn>> all_;
+    std::vector<PooledConn*> idle_;
+
+    struct StmtStats {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> errors{0};
+        LatencyHistogram latency;
+    };
+    StmtStats stmt_stats_[STMT_COUNT];
+    std::atomic<uint64_t> prepares_{0};
 
     // DB stats
     std::atomic<uint64_t> get_queries_;
     std::atomic<uint64_t> put_queries_;
     std::atomic<uint64_t> total_db_ns_; // accumulated ns for read/write ops
 
-    // internal helper: check connection is OK
-    bool check_conn_locked() {
-        if (!conn) return false;
-        if (PQstatus(conn) != CONNECTION_OK) {
-            last_err = PQerrorMessage(conn);
-            PQfinish(conn);
-            conn = nullptr;
+    // Pool stats
+    std::atomic<uint64_t> in_use_;
+    std::atomic<uint64_t> checkouts_;
+    std::atomic<uint64_t> checkout_timeouts_;
+    std::atomic<uint64_t> total_wait_ns_;
+    std::atomic<uint64_t> max_wait_ns_;
+
+    // Errors are per calling thread so concurrent requests don't see each other's
+    static std::string& tls_last_err() {
+        static thread_local std::string err;
+        return err;
+    }
+    static void set_error(const std::string &e) { tls_last_err() = e; }
+    static void clear_error() { tls_last_err().clear(); }
+
+    static constexpr const char* kStmtGet = "kv_get";
+    static constexpr const char* kStmtPut = "kv_put";
+    static constexpr const char* kStmtDel = "kv_del";
+    static constexpr const char* kStmtBatchPut = "kv_batch_put";
+    static constexpr const char* kStmtBatchDel = "kv_batch_del";
+    static constexpr const char* kStmtBatchGet = "kv_batch_get";
+    static constexpr const char* kStmtUnchanged = "kv_unchanged";
+    static constexpr Oid kTextOid = 25;
+    static constexpr Oid kByteaOid = 17;
+    static constexpr Oid kInt8Oid = 20;
+    static constexpr Oid kTextArrayOid = 1009;
+    static constexpr Oid kByteaArrayOid = 1001;
+
+    // The statement set prepared on every connection (pooled or pipelined)
+    static std::vector<PGPipeline::Statement> statement_defs() {
+        return {
+            {kStmtGet, "SELECT value FROM kv_store WHERE key = $1", 1, {kTextOid, 0}},
+            {kStmtPut, "INSERT INTO kv_store(key, value) VALUES($1, $2) "
+                       "ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value, updated_at = now()", 2, {kTextOid, kByteaOid}},
+            {kStmtDel, "DELETE FROM kv_store WHERE key = $1", 1, {kTextOid, 0}},
+            {kStmtBatchPut, "INSERT INTO kv_store(key, value) SELECT * FROM unnest($1::text[], $2::bytea[]) "
+                            "ON CONFLICT (key) DO UPDATE SET value = EXCLUDED.value, updated_at = now()", 2, {kTextArrayOid, kByteaArrayOid}},
+            {kStmtBatchDel, "DELETE FROM kv_store WHERE key = ANY($1::text[])", 1, {kTextArrayOid, 0}},
+            {kStmtBatchGet, "SELECT key, value FROM kv_store WHERE key = ANY($1::text[])", 1, {kTextArrayOid, 0}},
+            {kStmtUnchanged, "SELECT key FROM kv_store WHERE key = ANY($1::text[]) "
+                             "AND updated_at <= 'epoch'::timestamptz + $2 * interval '1 microsecond'", 2, {kTextArrayOid, kInt8Oid}},
+        };
+    }
+
+    // Prepare the statement set on this connection if it hasn't been yet
+    // (fresh connection, or one that PQreset() has reconnected). Done lazily
+    // so the first preparation can happen after ensure_table().
+    bool ensure_prepared(Lease &l) {
+        PooledConn *pc = l.pooled();
+        if (pc->prepared) return true;
+        static const std::vector<PGPipeline::Statement> defs = statement_defs();
+        for (const PGPipeline::Statement &d : defs) {
+            PGresult *r = PQprepare(pc->pg, d.name, d.sql, d.nparams, d.types);
+            bool ok = r && PQresultStatus(r) == PGRES_COMMAND_OK;
+            if (!ok) {
+                set_error(r ? PQresultErrorMessage(r) : "no result from PQprepare");
+                if (r) PQclear(r);
+                // drop whatever did get prepared so the next attempt starts clean
+                PQexec_discard(pc->pg, "DEALLOCATE ALL");
+                return false;
+            }
+            PQclear(r);
+        }
+        pc->prepared = true;
+        prepares_.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Run one prepared statement (binary params and results) on the pipeline
+    // if there is one, else on a pooled connection. The caller owns the
+    // result; nullptr means no result at all, with the error recorded.
+    PGresult* run_prepared(const char *name, int n, const char *const *vals, const int *lens) {
+        KV_PROBE1(db__start, name);
+        if (pipe_) {
+            std::string err;
+            PGresult *r = pipe_->exec(name, n, vals, lens, err);
+            if (!r) set_error(err);
+            KV_PROBE2(db__done, name, r != nullptr);
+            return r;
+        }
+        Lease l = checkout();
+        if (!l || !ensure_prepared(l)) { KV_PROBE2(db__done, name, false); return nullptr; }
+        static const int fmts[2] = {1, 1};
+        PGresult *r = PQexecPrepared(l.get(), name, n, vals, lens, fmts, 1);
+        if (!r) set_error("no result");
+        KV_PROBE2(db__done, name, r != nullptr);
+        return r;
+    }
+
+    // get() and get_many() on this store's own connections
+    bool get_direct(const std::string &key, std::string &value) {
+        auto t0 = std::chrono::steady_clock::now();
+        clear_error();
+
+        // key sent in binary (text's binary form is its bytes), value comes back binary
+        const char* paramValues[1] = {key.data()};
+        int paramLengths[1] = {static_cast<int>(key.size())};
+
+        PGresult* res = run_prepared(kStmtGet, 1, paramValues, paramLengths);
+        if (!res) { stmt_failed(STMT_GET); return false; }
+
+        ExecStatusType st = PQresultStatus(res);
+        if (st != PGRES_TUPLES_OK) {
+            set_error(PQresultErrorMessage(res));
+            PQclear(res);
+            stmt_failed(STMT_GET);
             return false;
         }
-   
-        PQexec(conn, "SET client_min_messages = WARNING;");
+        if (PQntuples(res) == 0) {
+            PQclear(res);
+            record_db_time(t0);
+            record_stmt(STMT_GET, t0);
+            // not found -> not an error, return false
+            return false;
+        }
+
+        int len = PQgetlength(res, 0, 0);
+        const char* ptr = PQgetvalue(res, 0, 0);
+        if (ptr && len > 0) {
+            value.assign(ptr, ptr + len);
+        } else {
+            value.clear();
+        }
+        PQclear(res);
+
+        get_queries_.fetch_add(1, std::memory_order_relaxed);
+        record_db_time(t0);
+        record_stmt(STMT_GET, t0);
         return true;
     }
-   
-    
-    bool check_conn() {
-        std::lock_guard<std::mutex> lk(mtx);
-        return check_conn_locked();
+
+    bool get_many_direct(const std::vector<std::string> &keys, std::unordered_map<std::string, std::string> &out) {
+        auto t0 = std::chrono::steady_clock::now();
+        clear_error();
+        if (keys.empty()) return true;
+
+        std::vector<const std::string*> ptrs;
+        ptrs.reserve(keys.size());
+        for (auto &k : keys) ptrs.push_back(&k);
+        std::string karr = encode_array(kTextOid, ptrs);
+        const char* paramValues[1] = {karr.data()};
+        int paramLengths[1] = {static_cast<int>(karr.size())};
+
+        PGresult* res = run_prepared(kStmtBatchGet, 1, paramValues, paramLengths);
+        if (!res) { stmt_failed(STMT_BATCH_GET); return false; }
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            set_error(PQresultErrorMessage(res));
+            PQclear(res);
+            stmt_failed(STMT_BATCH_GET);
+            return false;
+        }
+        int rows = PQntuples(res);
+        for (int i = 0; i < rows; i++) {
+            std::string k(PQgetvalue(res, i, 0), PQgetlength(res, i, 0));
+            out[std::move(k)].assign(PQgetvalue(res, i, 1), PQgetlength(res, i, 1));
+        }
+        PQclear(res);
+
+        get_queries_.fetch_add(1, std::memory_order_relaxed);
+        record_db_time(t0);
+        record_stmt(STMT_BATCH_GET, t0);
+        return true;
+    }
+
+    static int64_t steady_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool guarded(const std::string &key) const {
+        int64_t t = std::max(guard_[std::hash<std::string>{}(key) % kGuardSlots].load(std::memory_order_relaxed),
+                             guard_all_.load(std::memory_order_relaxed));
+        return t && steady_ms() - t < guard_ms_;
+    }
+
+    // The replica to read `key` from (nullptr: a batch, already checked
+    // against the guard), or nullptr for the primary
+    ReadReplica* read_target(const std::string *key) {
+        if (key && guarded(*key)) {
+            guarded_reads_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        size_t n = replicas_.size();
+        uint64_t start = next_replica_.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < n; i++) {
+            ReadReplica *r = replicas_[(start + i) % n].get();
+            if (r->healthy()) return r;
+        }
+        unrouted_reads_.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    // Out of rotation until the next check passes
+    void replica_failed(ReadReplica &r) {
+        r.fallbacks_.fetch_add(1, std::memory_order_relaxed);
+        if (r.healthy_.exchange(false, std::memory_order_relaxed))
+            LOG_WARN("DB REPLICA DOWN name=" << r.name_ << " err=\"" << tls_last_err() << "\"");
+    }
+
+    // `primary_lsn`: current_wal_lsn() here, or empty if the primary
+    // couldn't be asked
+    void check_replica(ReadReplica &r, const std::string &primary_lsn) {
+        int64_t lag = 0;
+        bool ok = (r.db_->connected() || r.db_->connect(r.conninfo_)) && r.db_->standby_lag_ms(primary_lsn, lag);
+        r.checks_.fetch_add(1, std::memory_order_relaxed);
+        if (ok) r.lag_ms_.store(lag, std::memory_order_relaxed);
+        else r.check_failures_.fetch_add(1, std::memory_order_relaxed);
+        bool healthy = ok && lag <= replica_max_lag_ms_;
+        bool was = r.healthy_.exchange(healthy, std::memory_order_relaxed);
+        if (healthy && !was) LOG_INFO("DB REPLICA UP name=" << r.name_ << " lag_ms=" << lag);
+        else if (!healthy && was) {
+            if (ok) LOG_WARN("DB REPLICA LAGGING name=" << r.name_ << " lag_ms=" << lag);
+            else LOG_WARN("DB REPLICA DOWN name=" << r.name_ << " err=\"" << tls_last_err() << "\"");
+        }
+    }
+
+    void health_loop() {
+        std::unique_lock<std::mutex> lk(health_mtx_);
+        while (!health_cv_.wait_for(lk, std::chrono::milliseconds(replica_check_ms_), [this]{ return health_stop_; })) {
+            std::vector<ReadReplica*> rs;
+            for (auto &r : replicas_) rs.push_back(r.get());
+            lk.unlock();
+            // one primary position for the round; the replicas are compared to it
+            std::string lsn;
+            if (!current_wal_lsn(lsn)) lsn.clear();
+            for (ReadReplica *r : rs) check_replica(*r, lsn);
+            lk.lock();
+        }
+    }
+
+    // "host:port" from a conninfo string or URI, without anything else in it
+    static std::string replica_name(const std::string &conninfo, size_t index) {
+        std::string host, port;
+        if (PQconninfoOption *opts = PQconninfoParse(conninfo.c_str(), nullptr)) {
+            for (PQconninfoOption *o = opts; o->keyword; o++) {
+                if (!o->val) continue;
+                if (std::string(o->keyword) == "host") host = o->val;
+                else if (std::string(o->keyword) == "port") port = o->val;
+            }
+            PQconninfoFree(opts);
+        }
+        if (host.empty()) return "replica" + std::to_string(index);
+        return port.empty() ? host : host + ":" + port;
+    }
+
+    // Consume a command's result: true on PGRES_COMMAND_OK, else records the error
+    static bool command_ok(PGresult *r) {
+        if (!r) return false;
+        bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+        if (!ok) set_error(PQresultErrorMessage(r));
+        PQclear(r);
+        return ok;
+    }
+
+    // Execute a prepared command (no result rows), binary results
+    static bool exec_prepared(PGconn *c, const char *name, int n, const char *const *vals,
+                              const int *lens, const int *fmts) {
+        KV_PROBE1(db__start, name);
+        PGresult *r = PQexecPrepared(c, name, n, vals, lens, fmts, 1);
+        if (!r) { set_error("no result"); KV_PROBE2(db__done, name, false); return false; }
+        bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+        if (!ok) set_error(PQresultErrorMessage(r));
+        PQclear(r);
+        KV_PROBE2(db__done, name, ok);
+        return ok;
+    }
+
+    // Postgres binary array format: ndim, has-null flag, element oid, then for
+    // the single dimension its length and lower bound, then each element as
+    // int32 length + bytes. All integers big-endian.
+    static std::string encode_array(Oid elem, const std::vector<const std::string*> &items) {
+        size_t total = 20;
+        for (auto *it : items) total += 4 + it->size();
+        std::string out;
+        out.reserve(total);
+        auto put32 = [&out](uint32_t v) {
+            char b[4] = {(char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v};
+            out.append(b, 4);
+        };
+        put32(1);
+        put32(0);
+        put32(elem);
+        put32(static_cast<uint32_t>(items.size()));
+        put32(1);
+        for (auto *it : items) {
+            put32(static_cast<uint32_t>(it->size()));
+            out.append(*it);
+        }
+        return out;
+    }
+
+    void record_stmt(Stmt s, const std::chrono::steady_clock::time_point &t0) {
+        auto t1 = std::chrono::steady_clock::now();
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        stmt_stats_[s].count.fetch_add(1, std::memory_order_relaxed);
+        stmt_stats_[s].total_ns.fetch_add(ns, std::memory_order_relaxed);
+        stmt_stats_[s].latency.record(ns);
+    }
+    void stmt_failed(Stmt s) { stmt_stats_[s].errors.fetch_add(1, std::memory_order_relaxed); }
+
+    // Run a parameterless command, recording the error on failure
+    static bool exec_command(PGconn *c, const char *q) {
+        PGresult *r = PQexec(c, q);
+        if (!r) { set_error("no result"); return false; }
+        bool ok = PQresultStatus(r) == PGRES_COMMAND_OK;
+        if (!ok) set_error(PQresultErrorMessage(r));
+        PQclear(r);
+        return ok;
+    }
+
+    // Abort the open transaction, keeping the error that caused it
+    static void rollback(PGconn *c) {
+        PQexec_discard(c, "ROLLBACK");
+    }
+
+    static void PQexec_discard(PGconn *c, const char *q) {
+        PGresult *r = PQexec(c, q);
+        if (r) PQclear(r);
+    }
+
+    // internal helper: check a fresh connection is OK, freeing it if not
+    static bool check_conn(PGconn *c) {
+        if (!c) { set_error("out of memory allocating PGconn"); return false; }
+        if (PQstatus(c) != CONNECTION_OK) {
+            set_error(PQerrorMessage(c));
+            PQfinish(c);
+            return false;
+        }
+
+        PQexec_discard(c, "SET client_min_messages = WARNING;");
+        return true;
+    }
+
+    void checkin(PooledConn *c) {
+        {
+            std::lock_guard<std::mutex> lk(pool_mtx_);
+            idle_.push_back(c);
+        }
+        in_use_.fetch_sub(1, std::memory_order_relaxed);
+        pool_cv_.notify_one();
+    }
+
+    void record_wait(const std::chrono::steady_clock::time_point &t0) {
+        auto t1 = std::chrono::steady_clock::now();
+        uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+        total_wait_ns_.fetch_add(ns, std::memory_order_relaxed);
+        trace_add(TraceStage::DB_POOL_WAIT, ns);
+        uint64_t prev = max_wait_ns_.load(std::memory_order_relaxed);
+        while (ns > prev && !max_wait_ns_.compare_exchange_weak(prev, ns, std::memory_order_relaxed)) {}
     }
 
     // record elapsed time since t0 into total_db_ns_
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "json.hpp"
+
+// Raw /proc counters for loadgen's resource sampling: one process (the
+// server, when it runs on this host) and the machine as a whole. A reading
+// is a snapshot of cumulative counters; proc_rates() and system_rates() turn
+// two readings into utilizations and per-second figures. Fields that could
+// not be read stay at -1 and are left out of the rates.
+
+struct ProcSnapshot{
+    bool ok=false;
+    int64_t utime_ticks=-1, stime_ticks=-1;
+    int64_t voluntary_ctxt=-1, nonvoluntary_ctxt=-1;
+    int64_t rss_kb=-1, threads=-1;
+    int64_t read_bytes=-1, write_bytes=-1;   // /proc/<pid>/io: storage traffic (needs same user or root)
+};
+
+struct SystemSnapshot{
+    bool ok=false;
+    int64_t busy_ticks=0, iowait_ticks=0, total_ticks=0;
+    int64_t ctxt=0;
+    std::map<std::string,int64_t> disk_io_ms;   // per disk: time with I/O in flight
+    int64_t disk_read_sectors=0, disk_write_sectors=0;   // all disks
+};
+
+inline long proc_clock_ticks(){ static long t=sysconf(_SC_CLK_TCK); return t>0?t:100; }
+inline int proc_cpu_count(){ long n=sysconf(_SC_NPROCESSORS_ONLN); return n>0?(int)n:1; }
+
+inline bool proc_alive(pid_t pid){
+    std::ifstream f("/proc/"+std::to_string(pid)+"/stat");
+    return (bool)f;
+}
+
+inline ProcSnapshot read_proc(pid_t pid){
+    ProcSnapshot s;
+    std::string base="/proc/"+std::to_string(pid);
+    std::ifstream st(base+"/stat");
+    std::string line;
+    if(!std::getline(st,line)) return s;
+    // comm may contain spaces; fields resume after the last ')'
+    size_t rp=line.rfind(')');
+    if(rp==std::string::npos) return s;
+    std::istringstream in(line.substr(rp+2));
+    std::string f;
+    for(int i=3;i<=15 && in>>f;i++){
+        if(i==14) s.utime_ticks=std::stoll(f);
+        else if(i==15) s.stime_ticks=std::stoll(f);
+    }
+    s.ok=s.stime_ticks>=0;
+    std::ifstream status(base+"/status");
+    while(std::getline(status,line)){
+        std::istringstream ls(line);
+        std::string k; int64_t v=0;
+        if(!(ls>>k>>v)) continue;
+        if(k=="VmRSS:") s.rss_kb=v;
+        else if(k=="Threads:") s.threads=v;
+        else if(k=="voluntary_ctxt_switches:") s.voluntary_ctxt=v;
+        else if(k=="nonvoluntary_ctxt_switches:") s.nonvoluntary_ctxt=v;
+    }
+    std::ifstream io(base+"/io");
+    while(std::getline(io,line)){
+        std::istringstream ls(line);
+        std::string k; int64_t v=0;
+        if(!(ls>>k>>v)) continue;
+        if(k=="read_bytes:") s.read_bytes=v;
+        else if(k=="write_bytes:") s.write_bytes=v;
+    }
+    return s;
+}
+
+inline SystemSnapshot read_system(){
+    SystemSnapshot s;
+    std::ifstream st("/proc/stat");
+    std::string line;
+    while(std::getline(st,line)){
+        std::istringstream in(line);
+        std::string k; in>>k;
+        if(k=="cpu"){
+            // user nice system idle iowait irq softirq steal (guest time is already in user)
+            int64_t v[8]={0};
+            for(int i=0;i<8 && in>>v[i];i++){}
+            s.total_ticks=0;
+            for(int64_t x : v) s.total_ticks+=x;
+            s.iowait_ticks=v[4];
+            s.busy_ticks=s.total_ticks-v[3]-v[4];
+            s.ok=true;
+        } else if(k=="ctxt") in>>s.ctxt;
+    }
+    std::ifstream ds("/proc/diskstats");
+    while(std::getline(ds,line)){
+        std::istringstream in(line);
+        int64_t major=0, minor=0, v[10]={0};
+        std::string name;
+        if(!(in>>major>>minor>>name)) continue;
+        for(int i=0;i<10 && in>>v[i];i++){}
+        // whole devices only (partitions have no /sys/block entry); skip memory-backed ones
+        if(name.rfind("loop",0)==0 || name.rfind("ram",0)==0 || name.rfind("zram",0)==0) continue;
+        if(!std::ifstream("/sys/block/"+name+"/stat")) continue;
+        s.disk_read_sectors+=v[2];
+        s.disk_write_sectors+=v[6];
+        s.disk_io_ms[name]=v[9];
+    }
+    return s;
+}
+
+// CPU as % of one core (400 = four cores busy), context switches and storage
+// bytes per second, current RSS and thread count
+inline nlohmann::json proc_rates(const ProcSnapshot& a, const ProcSnapshot& b, double dt){
+    nlohmann::json j=nlohmann::json::object();
+    if(!a.ok || !b.ok || dt<=0) return j;
+    double tick=(double)proc_clock_ticks();
+    j["cpu_pct"]=100.0*(double)(b.utime_ticks+b.stime_ticks-a.utime_ticks-a.stime_ticks)/tick/dt;
+    j["user_pct"]=100.0*(double)(b.utime_ticks-a.utime_ticks)/tick/dt;
+    j["sys_pct"]=100.0*(double)(b.stime_ticks-a.stime_ticks)/tick/dt;
+    if(a.voluntary_ctxt>=0 && b.voluntary_ctxt>=0){
+        j["voluntary_ctxt_per_s"]=(double)(b.voluntary_ctxt-a.voluntary_ctxt)/dt;
+        j["nonvoluntary_ctxt_per_s"]=(double)(b.nonvoluntary_ctxt-a.nonvoluntary_ctxt)/dt;
+    }
+    if(b.rss_kb>=0) j["rss_kb"]=b.rss_kb;
+    if(b.threads>=0) j["threads"]=b.threads;
+    if(a.read_bytes>=0 && b.read_bytes>=0){
+        j["read_bytes_per_s"]=(double)(b.read_bytes-a.read_bytes)/dt;
+        j["write_bytes_per_s"]=(double)(b.write_bytes-a.write_bytes)/dt;
+    }
+    return j;
+}
+
+// CPU busy and iowait as % of all cores, context switches per second, and
+// the busiest disk's utilization (share of the interval with I/O in flight)
+inline nlohmann::json system_rates(const SystemSnapshot& a, const SystemSnapshot& b, double dt){
+    nlohmann::json j=nlohmann::json::object();
+    if(!a.ok || !b.ok || dt<=0) return j;
+    double total=(double)(b.total_ticks-a.total_ticks);
+    if(total>0){
+        j["cpu_pct"]=100.0*(double)(b.busy_ticks-a.busy_ticks)/total;
+        j["iowait_pct"]=100.0*(double)(b.iowait_ticks-a.iowait_ticks)/total;
+    }
+    j["cpus"]=proc_cpu_count();
+    j["ctxt_per_s"]=(double)(b.ctxt-a.ctxt)/dt;
+    double util=0; std::string disk;
+    for(auto& d : b.disk_io_ms){
+        auto it=a.disk_io_ms.find(d.first);
+        if(it==a.disk_io_ms.end()) continue;
+        double u=100.0*(double)(d.second-it->second)/(dt*1000.0);
+        if(disk.empty() || u>util){ util=u; disk=d.first; }
+    }
+    if(!disk.empty()){ j["disk_util_pct"]=std::min(100.0,util); j["disk"]=disk; }
+    j["disk_read_bytes_per_s"]=512.0*(double)(b.disk_read_sectors-a.disk_read_sectors)/dt;
+    j["disk_write_bytes_per_s"]=512.0*(double)(b.disk_write_sectors-a.disk_write_sectors)/dt;
+    return j;
+}
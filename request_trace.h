@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+// Per-request stage timing. A sampled request gets a RequestTrace that the
+// handling thread points current_trace() at; the code it runs through adds
+// the time spent in each stage (waiting for and holding a cache lock,
+// waiting on a coalesced miss, the Postgres call and the wait for a pooled
+// connection inside it, the write-behind enqueue, JSON serialization). A
+// thread that is not tracing pays one thread-local load per hook.
+//
+// Built with -DKV_USDT (make probes), the server also carries USDT probes in
+// the "kv" provider for perf/bpftrace: request__start(method, path),
+// request__done(method, path, status), db__start(statement) and
+// db__done(statement, ok).
+
+#ifdef KV_USDT
+#include <sys/sdt.h>
+#define KV_PROBE1(name, a) DTRACE_PROBE1(kv, name, a)
+#define KV_PROBE2(name, a, b) DTRACE_PROBE2(kv, name, a, b)
+#define KV_PROBE3(name, a, b, c) DTRACE_PROBE3(kv, name, a, b, c)
+#else
+#define KV_PROBE1(name, a) do {} while (0)
+#define KV_PROBE2(name, a, b) do {} while (0)
+#define KV_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+enum class TraceStage : int {
+    DISPATCH,          // arrival to handler start: body read and route matching
+    CACHE_LOCK_WAIT,
+    CACHE_LOCK_HOLD,
+    COALESCED_WAIT,    // waiting on another request's fetch of the same key
+    DB_CALL,           // whole Postgres call, DB_POOL_WAIT included
+    DB_POOL_WAIT,
+    WRITE_BEHIND,      // enqueue, including waiting for room
+    SERIALIZE,
+    COUNT
+};
+
+static constexpr size_t kTraceStages = static_cast<size_t>(TraceStage::COUNT);
+
+inline const char* trace_stage_name(TraceStage s) {
+    switch (s) {
+        case TraceStage::DISPATCH: return "dispatch";
+        case TraceStage::CACHE_LOCK_WAIT: return "cache_lock_wait";
+        case TraceStage::CACHE_LOCK_HOLD: return "cache_lock_hold";
+        case TraceStage::COALESCED_WAIT: return "coalesced_wait";
+        case TraceStage::DB_CALL: return "db_call";
+        case TraceStage::DB_POOL_WAIT: return "db_pool_wait";
+        case TraceStage::WRITE_BEHIND: return "write_behind";
+        case TraceStage::SERIALIZE: return "serialize";
+        default: return "unknown";
+    }
+}
+
+inline uint64_t trace_elapsed_ns(std::chrono::steady_clock::time_point t0,
+                                 std::chrono::steady_clock::time_point t1) {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+}
+
+struct RequestTrace {
+    std::chrono::steady_clock::time_point arrived;
+    uint64_t stage_ns[kTraceStages];
+    uint32_t stage_calls[kTraceStages];
+
+    void reset(std::chrono::steady_clock::time_point now) {
+        arrived = now;
+        for (size_t i = 0; i < kTraceStages; i++) { stage_ns[i] = 0; stage_calls[i] = 0; }
+    }
+    void add(TraceStage s, uint64_t ns) {
+        stage_ns[static_cast<size_t>(s)] += ns;
+        stage_calls[static_cast<size_t>(s)]++;
+    }
+};
+
+// The calling thread's trace, or nullptr when its request isn't sampled
+inline RequestTrace*& current_trace() noexcept {
+    static thread_local RequestTrace *t = nullptr;
+    return t;
+}
+
+inline void trace_add(TraceStage s, uint64_t ns) noexcept {
+    if (RequestTrace *t = current_trace()) t->add(s, ns);
+}
+
+// Charges the lifetime of the enclosing scope to a stage
+class TraceScope {
+public:
+    explicit TraceScope(TraceStage s) : t_(current_trace()), s_(s) {
+        if (t_) t0_ = std::chrono::steady_clock::now();
+    }
+    ~TraceScope() {
+        if (t_) t_->add(s_, trace_elapsed_ns(t0_, std::chrono::steady_clock::now()));
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    RequestTrace *t_;
+    TraceStage s_;
+    std::chrono::steady_clock::time_point t0_;
+};
+
+// ScopedLatency that also charges a trace stage
+class ScopedStage {
+public:
+    ScopedStage(LatencyHistogram &h, TraceStage s)
+        : h_(h), t_(current_trace()), s_(s), t0_(std::chrono::steady_clock::now()) {}
+    ~ScopedStage() {
+        uint64_t ns = trace_elapsed_ns(t0_, std::chrono::steady_clock::now());
+        h_.record(ns);
+        if (t_) t_->add(s_, ns);
+    }
+
+    ScopedStage(const ScopedStage&) = delete;
+    ScopedStage& operator=(const ScopedStage&) = delete;
+
+private:
+    LatencyHistogram &h_;
+    RequestTrace *t_;
+    TraceStage s_;
+    std::chrono::steady_clock::time_point t0_;
+};
+
+// A lock of type L (lock_guard, unique_lock, shared_lock) that, on a
+// traced request, charges the wait to acquire it and the time it was held
+template <class L>
+class TracedLock {
+public:
+    template <class Mutex>
+    explicit TracedLock(Mutex &m, TraceStage wait = TraceStage::CACHE_LOCK_WAIT,
+                        TraceStage hold = TraceStage::CACHE_LOCK_HOLD)
+        : t_(current_trace()), hold_(hold) {
+        if (!t_) { lock_.emplace(m); return; }
+        auto t0 = std::chrono::steady_clock::now();
+        lock_.emplace(m);
+        acquired_ = std::chrono::steady_clock::now();
+        t_->add(wait, trace_elapsed_ns(t0, acquired_));
+    }
+    // the lock itself is released after this, with the member
+    ~TracedLock() {
+        if (t_) t_->add(hold_, trace_elapsed_ns(acquired_, std::chrono::steady_clock::now()));
+    }
+
+    TracedLock(const TracedLock&) = delete;
+    TracedLock& operator=(const TracedLock&) = delete;
+
+private:
+    RequestTrace *t_;
+    TraceStage hold_;
+    std::chrono::steady_clock::time_point acquired_;
+    std::optional<L> lock_;
+};
+
+// A finished traced request that took at least the slow threshold
+struct SlowRequest {
+    int64_t unix_ms = 0;
+    std::string method;
+    std::string path;
+    int status = 0;
+    uint64_t total_ns = 0;
+    uint64_t stage_ns[kTraceStages];
+    uint32_t stage_calls[kTraceStages];
+};
+
+// Decides which requests are traced (one in sample_every per thread, 0 =
+// none), keeps per-stage histograms over the traced ones, and the last
+// ring_size slow ones in a ring
+class RequestTracer {
+public:
+    static constexpr size_t kMaxPathBytes = 256;
+
+    RequestTracer(uint64_t sample_every, uint64_t slow_ms, size_t ring_size)
+        : sample_every_(sample_every), slow_ns_(slow_ms * 1000000ULL), ring_(ring_size ? ring_size : 1),
+          next_(0), traced_(0), slow_(0) {}
+
+    // Non-copyable
+    RequestTracer(const RequestTracer&) = delete;
+    RequestTracer& operator=(const RequestTracer&) = delete;
+
+    // Before routing, on the thread that will run the handler. Also drops a
+    // trace left behind by a request that never reached a handler.
+    void arrive() noexcept {
+        RequestTrace *&cur = current_trace();
+        cur = nullptr;
+        if (!sample_every_) return;
+        static thread_local uint64_t n = 0;
+        static thread_local RequestTrace trace;
+        if (n++ % sample_every_) return;
+        trace.reset(std::chrono::steady_clock::now());
+        cur = &trace;
+    }
+
+    // The handler is about to run
+    static void start() noexcept {
+        if (RequestTrace *t = current_trace())
+            t->add(TraceStage::DISPATCH, trace_elapsed_ns(t->arrived, std::chrono::steady_clock::now()));
+    }
+
+    // The handler returned
+    void finish(const std::string &method, const std::string &path, int status) {
+        RequestTrace *&cur = current_trace();
+        RequestTrace *t = cur;
+        if (!t) return;
+        cur = nullptr;
+        uint64_t total = trace_elapsed_ns(t->arrived, std::chrono::steady_clock::now());
+        traced_.fetch_add(1, std::memory_order_relaxed);
+        total_hist_.record(total);
+        for (size_t i = 0; i < kTraceStages; i++)
+            if (t->stage_calls[i]) stage_hist_[i].record(t->stage_ns[i]);
+        if (total < slow_ns_) return;
+
+        SlowRequest r;
+        r.unix_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::system_clock::now().time_since_epoch()).count();
+        r.method = method;
+        r.path = path.size() > kMaxPathBytes ? path.substr(0, kMaxPathBytes) : path;
+        r.status = status;
+        r.total_ns = total;
+        for (size_t i = 0; i < kTraceStages; i++) { r.stage_ns[i] = t->stage_ns[i]; r.stage_calls[i] = t->stage_calls[i]; }
+        slow_.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lk(ring_mtx_);
+        ring_[next_ % ring_.size()] = std::move(r);
+        next_++;
+    }
+
+    // Up to `max` recorded slow requests, newest first
+    std::vector<SlowRequest> slow_requests(size_t max) const {
+        std::lock_guard<std::mutex> lk(ring_mtx_);
+        size_t n = std::min<size_t>(std::min<uint64_t>(next_, ring_.size()), max);
+        std::vector<SlowRequest> out;
+        out.reserve(n);
+        for (size_t i = 0; i < n; i++) out.push_back(ring_[(next_ - 1 - i) % ring_.size()]);
+        return out;
+    }
+
+    uint64_t sample_every() const noexcept { return sample_every_; }
+    uint64_t slow_ms() const noexcept { return slow_ns_ / 1000000ULL; }
+    size_t ring_size() const noexcept { return ring_.size(); }
+    uint64_t traced() const noexcept { return traced_.load(std::memory_order_relaxed); }
+    uint64_t slow() const noexcept { return slow_.load(std::memory_order_relaxed); }
+    const LatencyHistogram& total_latency() const noexcept { return total_hist_; }
+    const LatencyHistogram& stage_latency(TraceStage s) const noexcept { return stage_hist_[static_cast<size_t>(s)]; }
+
+private:
+    uint64_t sample_every_;
+    uint64_t slow_ns_;
+    mutable std::mutex ring_mtx_;
+    std::vector<SlowRequest> ring_;
+    uint64_t next_;                  // requests ever put in the ring
+    std::atomic<uint64_t> traced_;
+    std::atomic<uint64_t> slow_;
+    LatencyHistogram total_hist_;
+    LatencyHistogram stage_hist_[kTraceStages];   // per traced request that used the stage
+};
@@ -3,17 +3,41 @@
 #include "httplib.h"
 #include <libpq-fe.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <csignal>
+#include <cstdlib>
 #include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <mutex>
+#include <sstream>
 #include <string>
 #include <iomanip>
+#include <limits>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
-#include "lru_cache.h"
+#include "cluster.h"
+#include "epoll_server.h"
+#include "histogram.h"
+#include "hot_keys.h"
+#include "invalidation.h"
+#include "snapshot.h"
+#include "logger.h"
+#include "negative_cache.h"
+#include "sharded_cache.h"
+#include "single_flight.h"
+#include "worker_pool.h"
+#include "write_behind.h"
 #include "pg_store.h"
+#include "request_trace.h"
+#include "value_codec.h"
 
 #include "json.hpp"
 using json = nlohmann::json;
@@ -24,57 +48,453 @@ static volatile std::sig_atomic_t stop_flag = 0;
 void handle_signal(int) { stop_flag = 1; }
 
 // Forward declarations for metrics (defined in server_metrics_additions.cpp)
-#include <atomic>
-extern std::atomic<uint64_t> g_total_requests;
-extern std::atomic<uint64_t> g_total_success;
-extern std::atomic<uint64_t> g_total_errors;
-extern std::atomic<uint64_t> g_cache_hits;
-extern std::atomic<uint64_t> g_cache_misses;
-
-// register_metrics_endpoint defined in server_metrics_additions.cpp
-void register_metrics_endpoint(httplib::Server &svr, class PGStore *db = nullptr);
-
-// Logging helpers
-static std::mutex g_log_mtx;
-
-static std::string now_str() {
-    using namespace std::chrono;
-    auto t = system_clock::now();
-    auto tt = system_clock::to_time_t(t);
-    auto ms = duration_cast<milliseconds>(t.time_since_epoch()).count() % 1000;
-    std::ostringstream ss;
-    ss << std::put_time(std::localtime(&tt), "%F %T") << "." << std::setw(3) << std::setfill('0') << ms;
-    return ss.str();
+#include "sharded_counter.h"
+extern ShardedCounter g_total_requests;
+extern ShardedCounter g_total_success;
+extern ShardedCounter g_total_errors;
+extern ShardedCounter g_cache_hits;
+extern ShardedCounter g_cache_misses;
+extern LatencyHistogram g_lat_get;
+extern LatencyHistogram g_lat_put;
+extern LatencyHistogram g_lat_delete;
+extern LatencyHistogram g_lat_batch_get;
+extern LatencyHistogram g_lat_batch_put;
+extern LatencyHistogram g_lat_batch_delete;
+extern LatencyHistogram g_lat_cache_lookup;
+extern LatencyHistogram g_lat_db_call;
+extern LatencyHistogram g_lat_serialize;
+
+// metrics_handler / add_metrics_section defined in server_metrics_additions.cpp
+httplib::Server::Handler metrics_handler(class PGStore *db, class ShardedCache *cache);
+httplib::Server::Handler prometheus_handler(class PGStore *db, class ShardedCache *cache);
+int http_method_index(const std::string &method);
+void record_http_response(int method, int status);
+void add_metrics_section(const std::string &name, std::function<json()> fn);
+json latency_json(const LatencyHistogram &h);
+
+// Parse a byte size with optional K/M/G suffix (powers of 1024)
+static size_t parse_size(const std::string &s) {
+    size_t pos = 0;
+    unsigned long long n = std::stoull(s, &pos);
+    if (pos < s.size()) {
+        switch (s[pos]) {
+            case 'k': case 'K': n <<= 10; break;
+            case 'm': case 'M': n <<= 20; break;
+            case 'g': case 'G': n <<= 30; break;
+            default: throw std::invalid_argument("bad size suffix: " + s);
+        }
+    }
+    return static_cast<size_t>(n);
+}
+
+// Read the "keys" array of a batch request, dropping duplicates (first
+// occurrence wins). False with `err` set on a malformed or oversized body.
+static bool parse_batch_keys(const std::string &body, size_t max_keys, std::vector<string> &keys, string &err) {
+    json parsed = json::parse(body, nullptr, false);
+    if (parsed.is_discarded() || !parsed.is_object() || !parsed.contains("keys") || !parsed["keys"].is_array()) {
+        err = "expected {\"keys\": [...]}";
+        return false;
+    }
+    const json &arr = parsed["keys"];
+    if (arr.size() > max_keys) {
+        err = "too many keys (max " + std::to_string(max_keys) + ")";
+        return false;
+    }
+    std::unordered_set<string> seen;
+    for (const auto &k : arr) {
+        if (!k.is_string() || k.get_ref<const string&>().empty()) {
+            err = "keys must be non-empty strings";
+            return false;
+        }
+        if (seen.insert(k.get<string>()).second) keys.push_back(k.get<string>());
+    }
+    return true;
 }
 
-static void log_info(const std::string &msg) {
-    std::lock_guard<std::mutex> lk(g_log_mtx);
-    std::cout << "[" << now_str() << "] " << msg << std::endl;
+// Seconds (fractions allowed, 0 = never expire) to a cache TTL in ms
+static bool ttl_from_seconds(double sec, int64_t &ttl_ms) {
+    if (!std::isfinite(sec) || sec < 0 || sec > 1e9) return false;
+    ttl_ms = static_cast<int64_t>(sec * 1000);
+    if (ttl_ms == 0 && sec > 0) ttl_ms = 1;
+    return true;
 }
 
+// Cache TTL asked for by a write: the X-Cache-TTL header, else a "ttl" field
+// in the JSON body, else the server default. False if either is malformed.
+static bool request_ttl(const httplib::Request &req, const json &body_ttl, int64_t &ttl_ms) {
+    ttl_ms = ShardedCache::kDefaultTTL;
+    if (req.has_header("X-Cache-TTL")) {
+        string h = req.get_header_value("X-Cache-TTL");
+        char *end = nullptr;
+        double sec = std::strtod(h.c_str(), &end);
+        return !h.empty() && *end == '\0' && ttl_from_seconds(sec, ttl_ms);
+    }
+    if (body_ttl.is_null()) return true;
+    return body_ttl.is_number() && ttl_from_seconds(body_ttl.get<double>(), ttl_ms);
+}
 
+// Read a config file of "name=value" lines (the option names below, without
+// the leading --; blank lines and # comments ignored) as --name=value args
+static bool read_config_file(const string &path, std::vector<string> &out) {
+    std::ifstream in(path);
+    if (!in) return false;
+    string line;
+    while (std::getline(in, line)) {
+        size_t b = line.find_first_not_of(" \t");
+        if (b == string::npos || line[b] == '#') continue;
+        size_t e = line.find_last_not_of(" \t\r");
+        out.push_back("--" + line.substr(b, e - b + 1));
+    }
+    return true;
+}
+
+// Startup cache warm-up progress, reported on /health and /metrics
+struct WarmupState {
+    std::atomic<bool> ready{true};
+    std::atomic<uint64_t> keys_loaded{0};
+    std::atomic<uint64_t> duration_ms{0};
+    std::atomic<uint64_t> snapshot_stale{0};    // snapshot entries Postgres had newer rows for
+    std::atomic<const char*> source{"none"};
+    const Cluster *cluster = nullptr;           // if set, keys other nodes own are skipped
+    const CacheInvalidator *invalidator = nullptr;
+};
+
+// Cache one warmed row unless a write still queued for Postgres supersedes
+// it, or another server's write arrived after `ticket` (taken before the row
+// was read). False once the cache starts evicting: it is full and warming
+// further would only push out what was just loaded.
+static bool warm_put(ShardedCache &cache, WriteBehindQueue *wb, uint64_t evictions0,
+                     const string &key, string &value, WarmupState &st, uint64_t ticket) {
+    if (st.cluster && !st.cluster->owns(key)) return true;
+    if (wb) {
+        string queued;
+        WriteBehindQueue::Lookup q = wb->lookup(key, queued);
+        if (q == WriteBehindQueue::Lookup::DEL) return true;
+        if (q == WriteBehindQueue::Lookup::PUT) value = std::move(queued);
+    }
+    // a client PUT may have cached a newer value since the row was read
+    if (!cache.put_if_absent(key, make_cache_value(std::move(value)))) return true;
+    if (st.invalidator && st.invalidator->stale(key, ticket)) cache.erase(key);
+    st.keys_loaded.fetch_add(1, std::memory_order_relaxed);
+    return cache.evictions() == evictions0;
+}
+
+// Load a saved hot-key list (hottest first, so a warm-up cut short keeps the
+// most valuable keys) with one multi-key SELECT per `chunk` keys
+static void warm_from_keys(const std::vector<string> &keys, size_t chunk, ShardedCache &cache,
+                           PGStore &db, WriteBehindQueue *wb, WarmupState &st) {
+    uint64_t ev0 = cache.evictions();
+    for (size_t i = 0; i < keys.size() && !stop_flag; i += chunk) {
+        std::vector<string> part(keys.begin() + i, keys.begin() + std::min(keys.size(), i + chunk));
+        std::unordered_map<string, string> found;
+        uint64_t ticket = st.invalidator ? st.invalidator->ticket() : 0;
+        if (!db.get_many(part, found)) {
+            LOG_WARN("WARMUP DB ERROR keys=" << part.size() << " err=\"" << db.last_error() << "\"");
+            return;
+        }
+        for (auto &key : part) {
+            auto it = found.find(key);
+            if (it != found.end() && !warm_put(cache, wb, ev0, key, it->second, st, ticket)) return;
+        }
+    }
+}
+
+// Restore a cache snapshot. Postgres is asked, `chunk` keys at a time, which
+// entries are unchanged since it was taken; the rest are dropped. Entries go
+// in coldest first so the hottest end up most recently used. False (caller
+// falls back to another source) if the file is unusable or the check fails.
+static bool warm_from_snapshot(const string &path, size_t chunk, ShardedCache &cache,
+                               PGStore &db, WriteBehindQueue *wb, WarmupState &st) {
+    snapshot::Reader snap;
+    string err;
+    if (!snap.open(path, err)) {
+        LOG_WARN("SNAPSHOT UNUSABLE " << err);
+        return false;
+    }
+    const auto &recs = snap.records();
+    std::vector<bool> valid(recs.size(), false);
+    uint64_t ticket = st.invalidator ? st.invalidator->ticket() : 0;
+    for (size_t i = 0; i < recs.size() && !stop_flag; i += chunk) {
+        std::vector<string> keys;
+        for (size_t j = i; j < recs.size() && j < i + chunk; j++) keys.emplace_back(recs[j].key, recs[j].klen);
+        std::unordered_set<string> current;
+        if (!db.unchanged_since(keys, snap.taken_at_us(), current)) {
+            LOG_WARN("SNAPSHOT CHECK FAILED err=\"" << db.last_error() << "\"");
+            return false;
+        }
+        for (size_t j = 0; j < keys.size(); j++) valid[i + j] = current.count(keys[j]) > 0;
+    }
+    uint64_t ev0 = cache.evictions();
+    for (size_t i = recs.size(); i-- > 0 && !stop_flag;) {
+        if (!valid[i]) {
+            st.snapshot_stale.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        string key(recs[i].key, recs[i].klen);
+        string value(recs[i].value, recs[i].vlen);
+        warm_put(cache, wb, ev0, key, value, st, ticket);
+    }
+    return true;
+}
+
+// --cluster-nodes: comma-separated host:port list. `self` is this server's
+// entry; empty means the one entry whose port is `port`.
+static bool parse_cluster_nodes(const string &list, const string &self, int port,
+                                std::vector<string> &nodes, size_t &self_index, string &err) {
+    std::stringstream ss(list);
+    string addr;
+    std::unordered_set<string> seen;
+    while (std::getline(ss, addr, ',')) {
+        string host;
+        int p = 0;
+        if (addr.empty()) continue;
+        if (!Cluster::parse_addr(addr, host, p)) { err = "bad node address \"" + addr + "\" (expected host:port)"; return false; }
+        if (!seen.insert(addr).second) { err = "node " + addr + " listed twice"; return false; }
+        nodes.push_back(addr);
+    }
+    if (nodes.empty()) { err = "empty node list"; return false; }
+    size_t matches = 0;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        string host;
+        int p = 0;
+        Cluster::parse_addr(nodes[i], host, p);
+        if (self.empty() ? p == port : nodes[i] == self) { self_index = i; matches++; }
+    }
+    if (matches == 1) return true;
+    err = self.empty() ? "cannot tell which node this is; set --cluster-self"
+                       : "--cluster-self " + self + " is not in the node list";
+    return false;
+}
+
+// Serialize a JSON reply, timing it as the json_serialize stage
+static void send_json(httplib::Response &res, const json &j) {
+    ScopedStage t(g_lat_serialize, TraceStage::SERIALIZE);
+    res.set_content(j.dump() + "\n", "application/json");
+}
+
+
+// Usage: ./server [port] [cache_capacity] [pg_conninfo] [--option=value ...]
+// GET/PUT /kv/<key>?raw=1 (or Accept/Content-Type: application/octet-stream)
+// moves the value as plain bytes instead of JSON.
+//   --config=PATH              read options from PATH (name=value per line); command-line flags win
+//   --engine=E                 httplib (default; a worker per connection) or epoll (event loops, a worker per request)
+//   --event-loops=N            epoll engine: event loops / listening sockets (default one per core)
+//   --threads=N                HTTP worker threads (default: httplib's, max(8, cores - 1))
+//   --queue-depth=N            connections (epoll: requests) waiting for a worker before new ones get 503 (default 1024, 0 = unbounded)
+//   --keep-alive-max=N         requests per keep-alive connection (default 100)
+//   --keep-alive-timeout=SEC   idle time before a keep-alive connection is closed (default 5)
+//   --read-timeout-ms=N        socket read timeout (default 5000)
+//   --write-timeout-ms=N       socket write timeout (default 5000)
+//   --cache-bytes=SIZE         budget the cache by memory (e.g. 512M, 2G) instead of cache_capacity entries
+//   --cache-policy=P           lru (default), clock (hits under a shared lock) or compact (flat-storage LRU)
+//   --cache-shards=N           lock-striped cache segments (default 16)
+//   --cache-ttl=SEC            default lifetime of cached entries (default 0 = until evicted); PUTs may
+//                              override it per key with an X-Cache-TTL header or a "ttl" field
+//   --negative-cache=N         remember up to N keys Postgres reported missing and answer them 404 directly (default 0 = off)
+//   --negative-cache-ttl=SEC   how long a key stays known-absent (default 30)
+//   --negative-cache-verify=N  check every Nth known-absent answer against Postgres anyway (default 1000, 0 = never)
+//   --ttl-sweep-ms=N           interval of the background sweep that reclaims expired entries (default 100)
+//   --db-pool-size=N           number of pooled Postgres connections (default 8)
+//   --db-pool-timeout-ms=N     max wait for a free connection (default 1000)
+//   --db-pipeline=N            run single-key queries on N pipelined connections instead of the pool (default 0 = off)
+//   --db-replicas=LIST         ';'-separated conninfos of read replicas that take the cache-miss reads
+//   --db-replica-max-lag-ms=N  leave out replicas whose replay is more than N ms behind (default 1000)
+//   --db-replica-check-ms=N    replica health check interval (default 1000)
+//   --db-replica-guard-ms=N    read keys written here from the primary for N ms (default max lag + check interval)
+//   --write-behind             acknowledge PUT/DELETE once queued; a flusher batches them into Postgres
+//   --write-behind-batch=N     max rows per flush transaction (default 500)
+//   --write-behind-delay-ms=N  max time a write waits before being flushed (default 50)
+//   --write-behind-max-pending=N  distinct queued keys before writers block, then get 503 (default 100000)
+//   --write-behind-journal=PATH   append queued writes to PATH and replay it on restart
+//   --batch-max-keys=N         max keys per /kv/_batch request (default 1000)
+//   --compress-min-bytes=N     keep values of N bytes or more zlib-compressed in the cache and Postgres (default 0 = off)
+//   --compress-level=N         zlib level 1 (fastest) to 9 (default 1)
+//   --hot-keys-file=PATH       dump the hottest cached keys to PATH (periodically and on shutdown) and warm up from it
+//   --hot-keys-interval=SEC    seconds between hot-key dumps (default 60)
+//   --hot-keys-max=N           keys per dump (default 100000)
+//   --snapshot-file=PATH       checkpoint the cache to PATH (periodically and on shutdown) and restore it at startup
+//   --snapshot-interval=SEC    seconds between checkpoints (default 300, 0 = only on shutdown)
+//   --warmup-scan=N            without a hot-key list, warm up from the first N rows of kv_store (default 0 = off)
+//   --log-level=L              debug|info|warn|error|off (default info; per-request lines are debug)
+//   --trace-sample=N           time the stages of one request in N per worker thread (default 0 = off, 1 = all)
+//   --slow-ms=N                traced requests taking at least N ms are kept for /debug/slow (default 100)
+//   --slow-log-size=N          slow requests kept (default 128)
+//   --invalidation=M           none (default) or notify: a kv_store trigger NOTIFYs written keys and every
+//                              server LISTENs and drops them from its cache
+//   --invalidation-batch=N     max keys applied to the cache per invalidation batch (default 1000)
+//   --cluster-nodes=LIST       host:port of every node (this one included); each caches only the keys it owns
+//   --cluster-self=ADDR        this node's entry in the list (default: the one with this server's port)
+//   --cluster-mode=M           forward (default; proxy to the owner) or redirect (307 to the owner)
+//   --cluster-vnodes=N         hash-ring points per node (default 160)
+//   --cluster-timeout-ms=N     connect/read/write timeout towards other nodes (default 1000)
+//   --cluster-max-forwards=N   forwards in flight from this node before the rest get 503 (default threads/2)
 int main(int argc, char** argv) {
     int port = 8080;
     size_t cache_capacity = 1000;
+    size_t cache_shards = 16;
+    CachePolicy cache_policy = CachePolicy::LRU;
+    size_t cache_bytes = 0;         // 0 => entry-count mode
+    double cache_ttl_s = 0;         // 0 => entries never expire by default
+    int ttl_sweep_ms = 100;
+    size_t negative_capacity = 0;   // 0 => no negative cache
+    double negative_ttl_s = 30;
+    uint64_t negative_verify = 1000;
     string pg_conninfo;             // if empty, will use defaults or env
+    size_t db_pool_size = 8;
+    int db_pool_timeout_ms = 1000;
+    size_t db_pipeline = 0;         // 0 => single-key queries use the pool
+    string db_replicas;             // empty => every read goes to the primary
+    int db_replica_max_lag_ms = 1000;
+    int db_replica_check_ms = 1000;
+    int db_replica_guard_ms = -1;   // -1 => max lag + check interval
+    LogLevel log_level = LogLevel::INFO;
+    size_t batch_max_keys = 1000;
+    size_t http_threads = CPPHTTPLIB_THREAD_POOL_COUNT;
+    size_t http_queue_depth = 1024;
+    size_t keep_alive_max = CPPHTTPLIB_KEEPALIVE_MAX_COUNT;
+    int keep_alive_timeout_s = CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND;
+    int read_timeout_ms = 5000;
+    int write_timeout_ms = 5000;
+    bool write_behind = false;
+    WriteBehindQueue::Options wb_opt;
+    string hot_keys_file;
+    int hot_keys_interval_s = 60;
+    size_t hot_keys_max = 100000;
+    size_t warmup_scan = 0;
+    string snapshot_file;
+    int snapshot_interval_s = 300;
+    bool use_epoll = false;
+    int event_loops = 0;            // 0 => one per core
+    uint64_t trace_sample = 0;      // 0 => no request tracing
+    uint64_t slow_ms = 100;
+    size_t slow_log_size = 128;
+    size_t compress_min_bytes = 0;  // 0 => values are stored as sent
+    int compress_level = 1;
+    bool notify_invalidation = false;
+    size_t invalidation_batch = 1000;
+    string cluster_nodes;           // empty => single node
+    string cluster_self;
+    Cluster::Options cluster_opt;
+    long cluster_max_forwards = -1;     // -1 => half the HTTP threads
 
-    if (argc >= 2) port = atoi(argv[1]);
-    if (argc >= 3) cache_capacity = atol(argv[2]);
-    if (argc >= 4) pg_conninfo = argv[3];
+    // positional args keep their historical order; --flags may appear
+    // anywhere. Options from --config come first so the command line wins.
+    std::vector<string> args;
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        if (a.rfind("--config=", 0) == 0) {
+            if (!read_config_file(a.substr(9), args)) { cerr << "Cannot read config file: " << a.substr(9) << "\n"; return 1; }
+        }
+    }
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]).rfind("--config=", 0) != 0) args.push_back(argv[i]);
+    }
+    std::vector<string> positional;
+    for (const string &a : args) {
+        if (a.rfind("--", 0) != 0) { positional.push_back(a); continue; }
+        auto eq = a.find('=');
+        string name = a.substr(2, eq == string::npos ? string::npos : eq - 2);
+        string val = eq == string::npos ? "" : a.substr(eq + 1);
+        // std::stoul & co. throw on a non-numeric or out-of-range value
+        try {
+            if (name == "cache-shards") cache_shards = std::stoul(val);
+            else if (name == "cache-bytes") cache_bytes = parse_size(val);
+            else if (name == "cache-policy") {
+                if (!parse_cache_policy(val, cache_policy)) { cerr << "Unknown cache policy: " << val << "\n"; return 1; }
+            }
+            else if (name == "cache-ttl") cache_ttl_s = std::stod(val);
+            else if (name == "negative-cache") negative_capacity = std::stoul(val);
+            else if (name == "negative-cache-ttl") negative_ttl_s = std::stod(val);
+            else if (name == "negative-cache-verify") negative_verify = std::stoull(val);
+            else if (name == "ttl-sweep-ms") ttl_sweep_ms = std::max(1, std::stoi(val));
+            else if (name == "db-pool-size") db_pool_size = std::stoul(val);
+            else if (name == "db-pool-timeout-ms") db_pool_timeout_ms = std::stoi(val);
+            else if (name == "db-pipeline") db_pipeline = std::stoul(val);
+            else if (name == "db-replicas") db_replicas = val;
+            else if (name == "db-replica-max-lag-ms") db_replica_max_lag_ms = std::stoi(val);
+            else if (name == "db-replica-check-ms") db_replica_check_ms = std::stoi(val);
+            else if (name == "db-replica-guard-ms") db_replica_guard_ms = std::stoi(val);
+            else if (name == "write-behind") write_behind = true;
+            else if (name == "write-behind-batch") wb_opt.max_batch = std::stoul(val);
+            else if (name == "write-behind-delay-ms") wb_opt.max_delay_ms = std::stoi(val);
+            else if (name == "write-behind-max-pending") wb_opt.max_pending = std::stoul(val);
+            else if (name == "write-behind-journal") wb_opt.journal_path = val;
+            else if (name == "batch-max-keys") batch_max_keys = std::stoul(val);
+            else if (name == "hot-keys-file") hot_keys_file = val;
+            else if (name == "hot-keys-interval") hot_keys_interval_s = std::max(1, std::stoi(val));
+            else if (name == "hot-keys-max") hot_keys_max = std::stoul(val);
+            else if (name == "warmup-scan") warmup_scan = std::stoul(val);
+            else if (name == "snapshot-file") snapshot_file = val;
+            else if (name == "snapshot-interval") snapshot_interval_s = std::max(0, std::stoi(val));
+            else if (name == "threads") http_threads = std::max<size_t>(1, std::stoul(val));
+            else if (name == "queue-depth") http_queue_depth = std::stoul(val);
+            else if (name == "keep-alive-max") keep_alive_max = std::max<size_t>(1, std::stoul(val));
+            else if (name == "keep-alive-timeout") keep_alive_timeout_s = std::stoi(val);
+            else if (name == "read-timeout-ms") read_timeout_ms = std::stoi(val);
+            else if (name == "write-timeout-ms") write_timeout_ms = std::stoi(val);
+            else if (name == "engine") {
+                if (val != "httplib" && val != "epoll") { cerr << "Unknown engine: " << val << "\n"; return 1; }
+                use_epoll = val == "epoll";
+            }
+            else if (name == "event-loops") event_loops = std::stoi(val);
+            else if (name == "trace-sample") trace_sample = std::stoull(val);
+            else if (name == "compress-min-bytes") compress_min_bytes = std::stoul(val);
+            else if (name == "compress-level") compress_level = std::max(1, std::min(9, std::stoi(val)));
+            else if (name == "slow-ms") slow_ms = std::stoull(val);
+            else if (name == "slow-log-size") slow_log_size = std::max<size_t>(1, std::stoul(val));
+            else if (name == "invalidation") {
+                if (val != "none" && val != "notify") { cerr << "Unknown invalidation mode: " << val << "\n"; return 1; }
+                notify_invalidation = val == "notify";
+            }
+            else if (name == "invalidation-batch") invalidation_batch = std::max<size_t>(1, std::stoul(val));
+            else if (name == "cluster-nodes") cluster_nodes = val;
+            else if (name == "cluster-self") cluster_self = val;
+            else if (name == "cluster-mode") {
+                if (val != "forward" && val != "redirect") { cerr << "Unknown cluster mode: " << val << "\n"; return 1; }
+                cluster_opt.redirect = val == "redirect";
+            }
+            else if (name == "cluster-vnodes") cluster_opt.vnodes = std::max<size_t>(1, std::stoul(val));
+            else if (name == "cluster-timeout-ms") cluster_opt.timeout_ms = std::max(1, std::stoi(val));
+            else if (name == "cluster-max-forwards") cluster_max_forwards = std::max(1L, std::stol(val));
+            else if (name == "log-level") {
+                if (!parse_log_level(val, log_level)) { cerr << "Unknown log level: " << val << "\n"; return 1; }
+            }
+            else { cerr << "Unknown option: " << a << "\n"; return 1; }
+        } catch (const std::exception &) {
+            cerr << "Invalid value for --" << name << ": " << val << "\n";
+            return 1;
+        }
+    }
+    if (positional.size() >= 1) port = atoi(positional[0].c_str());
+    if (positional.size() >= 2) cache_capacity = atol(positional[1].c_str());
+    if (positional.size() >= 3) pg_conninfo = positional[2];
 
     cout << "Starting KV HTTP server (httplib + PostgreSQL) on port " << port << "\n";
-    cout << "Cache capacity: " << cache_capacity << "\n";
+    if (cache_bytes > 0) cout << "Cache capacity: " << cache_bytes << " bytes (" << cache_policy_name(cache_policy) << ")\n";
+    else cout << "Cache capacity: " << cache_capacity << " entries (" << cache_policy_name(cache_policy) << ")\n";
+    cout << "DB pool: " << db_pool_size << " connections, checkout timeout " << db_pool_timeout_ms << " ms\n";
+    if (db_pipeline > 0) cout << "DB pipeline: " << db_pipeline << " connections for single-key queries\n";
     if (!pg_conninfo.empty()) cout << "Using PG conninfo: " << pg_conninfo << "\n";
 
+    AsyncLogger::instance().set_level(log_level);
+
     signal(SIGINT, handle_signal);
     signal(SIGTERM, handle_signal);
 
-    // Thread-safe usage: protect cache and DB with mutexes
-    LRUCache cache(cache_capacity);
-    static std::mutex g_cache_mtx;
-    static std::mutex g_db_mtx;
+    // Both layers are internally synchronized: the cache locks one shard per
+    // call and the DB pool hands each request its own connection
+    ShardedCache cache(cache_bytes > 0 ? cache_bytes : cache_capacity, cache_shards, cache_policy,
+                       cache_bytes > 0 ? CapacityMode::BYTES : CapacityMode::ENTRIES);
+    cout << "Cache shards: " << cache.shard_count() << "\n";
+    int64_t default_ttl_ms;
+    if (!ttl_from_seconds(cache_ttl_s, default_ttl_ms)) { cerr << "Invalid cache TTL: " << cache_ttl_s << "\n"; return 1; }
+    cache.set_default_ttl_ms(default_ttl_ms);
+    if (default_ttl_ms > 0) cout << "Cache TTL: " << default_ttl_ms << " ms\n";
 
     PGStore db;
+    db.set_pool_size(db_pool_size);
+    db.set_checkout_timeout_ms(db_pool_timeout_ms);
+    db.set_pipeline_connections(db_pipeline);
     if (!pg_conninfo.empty()) {
         if (!db.connect(pg_conninfo)) {
             cerr << "Failed to connect to Postgres with provided conninfo\n";
@@ -87,15 +507,379 @@ int main(int argc, char** argv) {
         }
     }
     
+    // Replicas that fail their first check are still added: they start
+    // taking reads once a later one passes
+    if (!db_replicas.empty()) {
+        db.set_replica_options(db_replica_max_lag_ms, db_replica_check_ms, db_replica_guard_ms);
+        std::stringstream ss(db_replicas);
+        string ci;
+        while (std::getline(ss, ci, ';')) {
+            if (ci.find_first_not_of(' ') == string::npos) continue;
+            if (!db.add_replica(ci))
+                cerr << "Read replica " << db.replica(db.replica_count() - 1).name() << " not usable yet: " << db.last_error() << "\n";
+        }
+        cout << "DB replicas: " << db.replica_count() << ", max lag " << db.replica_max_lag_ms() << " ms, read-your-writes guard "
+             << db.read_guard_ms() << " ms\n";
+    }
+
     if (!db.ensure_table()) {
-        cerr << "Failed to ensure kv table exists\n";
+        cerr << "Failed to ensure kv table exists" << (db_pipeline > 0 ? " or open pipelined connections: " + db.last_error() : string()) << "\n";
         return 1;
     }
 
+    // optional write-behind queue; when set, PUT/DELETE don't wait for Postgres
+    std::unique_ptr<WriteBehindQueue> wb;
+    if (write_behind) {
+        wb.reset(new WriteBehindQueue(db, wb_opt));
+        if (!wb->start()) {
+            cerr << "Failed to start write-behind queue\n";
+            return 1;
+        }
+        cout << "Write-behind: batch " << wb_opt.max_batch << ", delay " << wb_opt.max_delay_ms << " ms"
+             << (wb_opt.journal_path.empty() ? "" : ", journal " + wb_opt.journal_path) << "\n";
+    }
+
+    // coalesces concurrent cache misses on the same key
+    SingleFlight flights;
+
+    // optional cache of keys Postgres doesn't have
+    std::unique_ptr<NegativeCache> negative;
+    if (negative_capacity > 0) {
+        int64_t ttl_ms;
+        if (!ttl_from_seconds(negative_ttl_s, ttl_ms) || ttl_ms == 0) {
+            cerr << "Invalid negative cache TTL: " << negative_ttl_s << "\n";
+            return 1;
+        }
+        negative.reset(new NegativeCache(negative_capacity, cache_shards, ttl_ms, negative_verify));
+        cout << "Negative cache: " << negative_capacity << " keys, TTL " << ttl_ms << " ms\n";
+    }
+
+    // optional invalidation of keys other servers write
+    std::unique_ptr<CacheInvalidator> invalidator;
+    if (notify_invalidation) {
+        string err;
+        if (!db.ensure_notify_trigger(CacheInvalidator::kChannel)) {
+            cerr << "Failed to install the kv_store invalidation trigger: " << db.last_error() << "\n";
+            return 1;
+        }
+        invalidator.reset(new CacheInvalidator(db.conninfo(), cache, negative.get(),
+                                               [&db]{ return db.backend_pids(); }, invalidation_batch));
+        // the replicas may not have replayed the write yet either
+        if (db.replica_count())
+            invalidator->set_on_invalidate([&db](const string *key){ if (key) db.note_write(*key); else db.note_write_all(); });
+        if (!invalidator->start(err)) {
+            cerr << "Failed to LISTEN for invalidations: " << err << "\n";
+            return 1;
+        }
+        cout << "Invalidation: LISTEN " << CacheInvalidator::kChannel << ", batches of up to " << invalidation_batch << " keys\n";
+    }
+
+    std::unique_ptr<Cluster> cluster;
+    if (!cluster_nodes.empty()) {
+        std::vector<string> nodes;
+        size_t self = 0;
+        string err;
+        if (!parse_cluster_nodes(cluster_nodes, cluster_self, port, nodes, self, err)) {
+            cerr << "Bad --cluster-nodes: " << err << "\n";
+            return 1;
+        }
+        // below the worker count, so some workers are always left to serve
+        // the requests other nodes forward here
+        cluster_opt.max_forwards = cluster_max_forwards > 0 ? static_cast<size_t>(cluster_max_forwards)
+                                                            : std::max<size_t>(1, http_threads / 2);
+        cluster.reset(new Cluster(nodes, self, cluster_opt));
+        cout << "Cluster: node " << nodes[self] << " (" << self + 1 << " of " << nodes.size() << "), "
+             << (cluster_opt.redirect ? "redirecting" : "forwarding") << " other nodes' keys\n";
+    }
+
+    ValueCompressor codec(compress_min_bytes, compress_level);
+    if (compress_min_bytes) cout << "Compression: values of " << compress_min_bytes << " bytes or more, zlib level " << compress_level << "\n";
+
+    RequestTracer tracer(trace_sample, slow_ms, slow_log_size);
+    if (trace_sample) cout << "Request tracing: 1 in " << trace_sample << " requests, slow threshold " << slow_ms << " ms\n";
+
     httplib::Server svr;
 
-    
-    register_metrics_endpoint(svr, &db);
+    // Worker pool with a bounded connection backlog; past it, connections are
+    // answered 503 by the pool's shedder thread
+    WorkerPoolStats pool_stats;
+    svr.new_task_queue = [&]{ return new WorkerPool(http_threads, http_queue_depth, pool_stats); };
+    svr.set_keep_alive_max_count(keep_alive_max);
+    svr.set_keep_alive_timeout(keep_alive_timeout_s);
+    svr.set_read_timeout(std::chrono::milliseconds(read_timeout_ms));
+    svr.set_write_timeout(std::chrono::milliseconds(write_timeout_ms));
+    auto overload_reply = [](const httplib::Request& req, httplib::Response& res){
+        g_total_requests.add();
+        g_total_errors.add();
+        record_http_response(http_method_index(req.method), 503);
+        json j;
+        j["status"] = "error";
+        j["error"] = "Server overloaded";
+        res.status = 503;
+        res.set_header("Retry-After", "1");
+        res.set_header("Connection", "close");
+        res.set_content(j.dump() + "\n", "application/json");
+    };
+    // Sampled requests are traced from here: headers are in, the body and
+    // route matching are next
+    svr.set_pre_routing_handler([&](const httplib::Request& req, httplib::Response& res){
+        tracer.arrive();
+        if (!WorkerPool::shedding()) return httplib::Server::HandlerResponse::Unhandled;
+        overload_reply(req, res);
+        return httplib::Server::HandlerResponse::Handled;
+    });
+
+    // epoll engine: the loops only do socket I/O and parsing, handlers run on
+    // the same kind of worker pool, one request at a time
+    EpollServer::Options ep_opt;
+    ep_opt.loops = event_loops;
+    ep_opt.keep_alive_max = keep_alive_max;
+    ep_opt.keep_alive_timeout_s = keep_alive_timeout_s;
+    EpollServer epoll(ep_opt);
+    epoll.set_overload_handler(overload_reply);
+    epoll.set_pre_dispatch([&tracer]{ tracer.arrive(); });
+
+    // Routes are registered with whichever engine serves them; each response
+    // is counted by method and status, and closes the request's trace
+    auto route = [&](const string &method, const string &pattern, httplib::Server::Handler inner){
+        int mi = http_method_index(method);
+        httplib::Server::Handler h = [mi, &tracer, inner = std::move(inner)](const httplib::Request& req, httplib::Response& res){
+            RequestTracer::start();
+            KV_PROBE2(request__start, req.method.c_str(), req.path.c_str());
+            inner(req, res);
+            // both engines send 200 for a handler that left the status unset
+            int status = res.status == -1 ? 200 : res.status;
+            tracer.finish(req.method, req.path, status);
+            KV_PROBE3(request__done, req.method.c_str(), req.path.c_str(), status);
+            record_http_response(mi, status);
+        };
+        if (use_epoll) epoll.route(method, pattern, std::move(h));
+        else if (method == "GET") svr.Get(pattern, std::move(h));
+        else if (method == "POST") svr.Post(pattern, std::move(h));
+        else if (method == "PUT") svr.Put(pattern, std::move(h));
+        else if (method == "DELETE") svr.Delete(pattern, std::move(h));
+    };
+
+    cout << "HTTP: " << (use_epoll ? "epoll engine, " + std::to_string(epoll.loop_count()) + " event loops, " : string("httplib engine, "))
+         << http_threads << " workers, queue depth "
+         << (http_queue_depth ? std::to_string(http_queue_depth) : string("unbounded"))
+         << ", keep-alive " << keep_alive_max << " req / " << keep_alive_timeout_s << " s\n";
+
+    route("GET", "/metrics", metrics_handler(&db, &cache));
+    route("GET", "/metrics/prometheus", prometheus_handler(&db, &cache));
+
+    // Recent slow traced requests, newest first, with where their time went
+    route("GET", "/debug/slow", [&tracer](const httplib::Request& req, httplib::Response& res){
+        size_t limit = tracer.ring_size();
+        if (req.has_param("limit")) {
+            try { limit = std::stoul(req.get_param_value("limit")); }
+            catch (const std::exception&) {
+                json j;
+                j["status"] = "error";
+                j["error"] = "limit must be a number";
+                res.status = 400;
+                send_json(res, j);
+                return;
+            }
+        }
+        json list = json::array();
+        for (const SlowRequest &r : tracer.slow_requests(limit)) {
+            json stages = json::object();
+            for (size_t i = 0; i < kTraceStages; i++) {
+                if (!r.stage_calls[i]) continue;
+                stages[trace_stage_name(static_cast<TraceStage>(i))] = {{"ms", r.stage_ns[i] / 1e6}, {"calls", r.stage_calls[i]}};
+            }
+            list.push_back({{"unix_ms", r.unix_ms}, {"method", r.method}, {"path", r.path}, {"status", r.status},
+                            {"total_ms", r.total_ns / 1e6}, {"stages", stages}});
+        }
+        json j;
+        j["sample_every"] = tracer.sample_every();
+        j["slow_ms"] = tracer.slow_ms();
+        j["ring_size"] = tracer.ring_size();
+        j["traced"] = tracer.traced();
+        j["slow"] = tracer.slow();
+        j["requests"] = list;
+        send_json(res, j);
+    });
+    add_metrics_section("tracing", [&tracer]{
+        json j;
+        j["sample_every"] = tracer.sample_every();
+        j["traced"] = tracer.traced();
+        j["slow"] = tracer.slow();
+        j["total"] = latency_json(tracer.total_latency());
+        json stages = json::object();
+        for (size_t i = 0; i < kTraceStages; i++) {
+            TraceStage st = static_cast<TraceStage>(i);
+            stages[trace_stage_name(st)] = latency_json(tracer.stage_latency(st));
+        }
+        j["stages"] = stages;
+        return j;
+    });
+    add_metrics_section("http", [&]{
+        json j;
+        j["threads"] = http_threads;
+        j["queue_limit"] = http_queue_depth;
+        j["queue_depth"] = pool_stats.queue_depth.load();
+        j["max_queue_depth"] = pool_stats.max_queue_depth.load();
+        j["busy_workers"] = pool_stats.busy.load();
+        j["connections_accepted"] = pool_stats.accepted.load();
+        j["connections_shed"] = pool_stats.shed.load();
+        j["connections_dropped"] = pool_stats.dropped.load();
+        j["queue_wait"] = latency_json(pool_stats.queue_wait);
+        return j;
+    });
+    if (use_epoll) {
+        add_metrics_section("epoll", [&epoll]{
+            json j;
+            j["event_loops"] = epoll.loop_count();
+            j["connections_open"] = epoll.connections_open();
+            j["connections_accepted"] = epoll.connections_accepted();
+            j["requests"] = epoll.requests();
+            j["bad_requests"] = epoll.bad_requests();
+            j["overloaded"] = epoll.overloaded();
+            return j;
+        });
+    }
+    if (negative) {
+        add_metrics_section("negative_cache", [&negative]{
+            json j;
+            uint64_t verified = negative->verified(), fp = negative->false_positives();
+            j["size"] = negative->size();
+            j["capacity"] = negative->capacity();
+            j["ttl_ms"] = negative->ttl_ms();
+            j["hits"] = negative->hits();
+            j["inserts"] = negative->inserts();
+            j["insert_races"] = negative->raced();
+            j["invalidations"] = negative->invalidations();
+            j["evictions"] = negative->evictions();
+            j["expirations"] = negative->expirations();
+            j["verify_every"] = negative->verify_every();
+            j["verified"] = verified;
+            j["false_positives"] = fp;
+            j["false_positive_rate"] = verified ? double(fp) / verified : 0.0;
+            return j;
+        });
+    }
+    if (cluster) {
+        add_metrics_section("cluster", [&cluster]{
+            json j;
+            j["nodes"] = cluster->size();
+            j["self"] = cluster->addr(cluster->self());
+            j["mode"] = cluster->options().redirect ? "redirect" : "forward";
+            j["vnodes"] = cluster->options().vnodes;
+            j["redirects"] = cluster->redirects();
+            j["received_forwarded"] = cluster->received();
+            j["max_forwards"] = cluster->options().max_forwards;
+            j["forwarding"] = cluster->forwarding();
+            j["forwards_shed"] = cluster->shed();
+            std::vector<double> shares = cluster->ring_shares();
+            json members = json::object();
+            for (size_t i = 0; i < cluster->size(); i++) {
+                json m;
+                m["ring_share"] = shares[i];
+                m["self"] = i == cluster->self();
+                if (const ClusterPeer *p = cluster->peer(i)) {
+                    m["forwarded"] = p->forwarded();
+                    m["failures"] = p->failures();
+                    m["connections_opened"] = p->connections_opened();
+                    m["idle_connections"] = p->idle_connections();
+                    m["latency"] = latency_json(p->latency());
+                }
+                members[cluster->addr(i)] = m;
+            }
+            j["members"] = members;
+            return j;
+        });
+    }
+    if (invalidator) {
+        add_metrics_section("invalidation", [&invalidator]{
+            json j;
+            j["connected"] = invalidator->connected();
+            j["notifications"] = invalidator->notifications();
+            j["own_writes_skipped"] = invalidator->own_skipped();
+            j["keys_invalidated"] = invalidator->keys_invalidated();
+            j["batches"] = invalidator->batches();
+            j["max_batch"] = invalidator->max_batch_seen();
+            j["full_flushes"] = invalidator->flushes();
+            j["reconnects"] = invalidator->reconnects();
+            return j;
+        });
+    }
+    if (db.replica_count()) {
+        add_metrics_section("db_replicas", [&db]{
+            json j;
+            j["max_lag_ms"] = db.replica_max_lag_ms();
+            j["guard_ms"] = db.read_guard_ms();
+            j["guarded_reads"] = db.stats_guarded_reads();
+            j["unrouted_reads"] = db.stats_unrouted_reads();
+            // per target, so the primary's latency can be set beside the replicas'
+            json targets;
+            json p;
+            p["get"] = latency_json(db.stats_stmt_latency(PGStore::STMT_GET));
+            p["get"]["errors"] = db.stats_stmt_errors(PGStore::STMT_GET);
+            p["batch_get"] = latency_json(db.stats_stmt_latency(PGStore::STMT_BATCH_GET));
+            p["batch_get"]["errors"] = db.stats_stmt_errors(PGStore::STMT_BATCH_GET);
+            targets["primary"] = p;
+            for (size_t i = 0; i < db.replica_count(); i++) {
+                const PGStore::ReadReplica &r = db.replica(i);
+                json t;
+                t["healthy"] = r.healthy();
+                t["lag_ms"] = r.lag_ms();
+                t["checks"] = r.checks();
+                t["check_failures"] = r.check_failures();
+                t["fallbacks"] = r.fallbacks();
+                t["get"] = latency_json(r.store().stats_stmt_latency(PGStore::STMT_GET));
+                t["get"]["errors"] = r.store().stats_stmt_errors(PGStore::STMT_GET);
+                t["batch_get"] = latency_json(r.store().stats_stmt_latency(PGStore::STMT_BATCH_GET));
+                t["batch_get"]["errors"] = r.store().stats_stmt_errors(PGStore::STMT_BATCH_GET);
+                t["pool_in_use"] = r.store().stats_pool_in_use();
+                targets[r.name()] = t;
+            }
+            j["targets"] = targets;
+            return j;
+        });
+    }
+    if (codec.min_bytes()) {
+        add_metrics_section("compression", [&codec]{
+            json j;
+            j["min_bytes"] = codec.min_bytes();
+            j["level"] = codec.level();
+            j["compressed"] = codec.compressed();
+            j["incompressible"] = codec.incompressible();
+            j["bytes_in"] = codec.bytes_in();
+            j["bytes_out"] = codec.bytes_out();
+            j["ratio"] = codec.bytes_in() ? (double)codec.bytes_out() / codec.bytes_in() : 0.0;
+            j["compress_cpu_ms"] = codec.compress_cpu_ns() / 1e6;
+            j["compress_mb_per_cpu_s"] = codec.compress_cpu_ns() ? codec.bytes_in() / 1e6 / (codec.compress_cpu_ns() / 1e9) : 0.0;
+            j["decompressed"] = codec.decompressed();
+            j["decompress_cpu_ms"] = codec.decompress_cpu_ns() / 1e6;
+            j["streamed"] = codec.streamed();
+            j["sent_deflated"] = codec.sent_deflated();
+            j["decode_errors"] = codec.decode_errors();
+            return j;
+        });
+    }
+    add_metrics_section("miss_coalescing", [&flights]{
+        json j;
+        j["db_fetches"] = flights.leaders();
+        j["coalesced_waits"] = flights.coalesced();
+        j["in_flight"] = flights.in_flight();
+        return j;
+    });
+    if (wb) {
+        add_metrics_section("write_behind", [&wb]{
+            json j;
+            j["depth"] = wb->depth();
+            j["max_depth"] = wb->max_depth();
+            j["enqueued"] = wb->enqueued();
+            j["coalesced"] = wb->coalesced();
+            j["batches"] = wb->batches();
+            j["rows_flushed"] = wb->rows_flushed();
+            j["flush_failures"] = wb->flush_failures();
+            j["rejected"] = wb->rejected();
+            return j;
+        });
+    }
 
     // prints cache hits/misses and basic counters every 30s
     std::thread metrics_logger([&](){
@@ -110,207 +894,658 @@ int main(int argc, char** argv) {
             uint64_t delta = total - last_total_requests;
             last_total_requests = total;
             double hit_rate = (hits + misses > 0) ? (100.0 * (double)hits / (double)(hits + misses)) : 0.0;
-            std::ostringstream ss;
-            ss << "[CACHE-METRICS] hits=" << hits
-               << " misses=" << misses
-               << " hit_rate=" << std::fixed << std::setprecision(2) << hit_rate << "%"
-               << " total_requests=" << total
-               << " (+ " << delta << " in last 30s)"
-               << " success=" << success
-               << " errors=" << errors;
-            log_info(ss.str());
+            LOG_INFO("[CACHE-METRICS] hits=" << hits
+                     << " misses=" << misses
+                     << " hit_rate=" << std::fixed << std::setprecision(2) << hit_rate << "%"
+                     << " total_requests=" << total
+                     << " (+ " << delta << " in last 30s)"
+                     << " success=" << success
+                     << " errors=" << errors
+                     << " get_p99_ms=" << g_lat_get.percentile_ms(0.99)
+                     << " put_p99_ms=" << g_lat_put.percentile_ms(0.99)
+                     << " log_dropped=" << AsyncLogger::instance().dropped());
         }
     });
     metrics_logger.detach();
 
-    // Read key (GET)
-    svr.Get(R"(/kv/(.+))", [&](const httplib::Request& req, httplib::Response& res){
-        g_total_requests.fetch_add(1);
+    // Cluster: a single-key request for a key another node owns is forwarded
+    // to it or redirected. True when `res` holds that answer.
+    auto send_to_owner = [&](const string &key, const httplib::Request &req, httplib::Response &res){
+        size_t owner = cluster->route(key, req);
+        if (owner == cluster->self()) return false;
+        if (cluster_opt.redirect) {
+            cluster->redirect(owner, req, res);
+            return true;
+        }
+        string err;
+        Cluster::Forward f = cluster->forward(owner, req, req.body, res, err);
+        if (f == Cluster::Forward::BUSY) {
+            json j;
+            j["status"] = "error";
+            j["error"] = "Too many requests forwarded to other nodes";
+            res.status = 503;
+            send_json(res, j);
+        } else if (f == Cluster::Forward::UNREACHABLE) {
+            LOG_WARN("CLUSTER FORWARD FAILED node=" << cluster->addr(owner) << " err=\"" << err << "\"");
+            json j;
+            j["status"] = "error";
+            j["error"] = "Owner node " + cluster->addr(owner) + " unreachable";
+            res.status = 502;
+            send_json(res, j);
+        }
+        return true;
+    };
+    // Batches are split instead (in either mode): the keys this node owns
+    // stay in `keys` and the rest go to their owners as batches of the same
+    // kind, with bodies made by `body`. Null unless some keys went out.
+    auto scatter = [&](std::vector<string> &keys, const httplib::Request &req,
+                       const std::function<string(const std::vector<string>&)> &body){
+        std::unique_ptr<BatchScatter> out;
+        if (!cluster || cluster->forwarded(req)) return out;
+        std::map<size_t, std::vector<string>> parts;
+        std::vector<string> mine;
+        for (auto &key : keys) {
+            size_t owner = cluster->owner(key);
+            if (owner == cluster->self()) mine.push_back(key);
+            else parts[owner].push_back(key);
+        }
+        if (parts.empty()) return out;
+        keys.swap(mine);
+        out.reset(new BatchScatter(*cluster, req));
+        for (auto &p : parts) {
+            string b = body(p.second);
+            out->send(p.first, std::move(p.second), std::move(b));
+        }
+        return out;
+    };
+    auto keys_body = [](const std::vector<string> &keys){ return json{{"keys", keys}}.dump(); };
 
-        string key = req.matches[1];
-        string val;
+    // A found value, decoded from its stored form: as a batch result (false
+    // if the stored envelope is corrupt) or as a GET reply (500 if it is)
+    auto value_result = [&codec](json &slot, const string &key, const string &stored) {
+        string tmp;
+        const string *v = codec.plain(stored, tmp);
+        if (v) {
+            slot = {{"status", "ok"}, {"value", *v}};
+            return true;
+        }
+        LOG_ERROR("CORRUPT STORED VALUE key=\"" << key << "\" len=" << stored.size());
+        slot = {{"status", "error"}, {"error", "Stored value is corrupt"}};
+        return false;
+    };
+    auto send_value = [&](const httplib::Request &req, httplib::Response &res, const string &key, CacheValue v, bool raw) {
         json j;
+        bool ok = raw ? codec.send(res, v, req) : value_result(j, key, *v);
+        if (ok && raw) {
+            g_total_success.add();
+            return;
+        }
+        if (!ok) {
+            if (raw) LOG_ERROR("CORRUPT STORED VALUE key=\"" << key << "\" len=" << v->size());
+            res.status = 500;
+            g_total_errors.add();
+        } else {
+            g_total_success.add();
+        }
+        send_json(res, j);
+    };
 
-        // Check cache under lock
-        {
-            std::lock_guard<std::mutex> lk(g_cache_mtx);
-            if (cache.get(key, val)) {
-                g_cache_hits.fetch_add(1);
-                // Log cache hit
-                {
-                    std::ostringstream ss;
-                    ss << "CACHE HIT key=\"" << key << "\"";
-                    log_info(ss.str());
+    // Multi-key operations; registered before /kv/(.+) so "_batch" is not
+    // taken as a key. Each reports a status per key:
+    //   POST   /kv/_batch  {"keys": [...]}              multi-get
+    //   PUT    /kv/_batch  {"items": {"key": "value"}}  multi-put
+    //   DELETE /kv/_batch  {"keys": [...]}              multi-delete
+    // Gets are answered from the cache first and every miss is fetched with
+    // one SELECT; writes go to Postgres in one transaction (or the write-behind
+    // queue). "status" is "partial" when some keys failed.
+    route("POST", "/kv/_batch", [&](const httplib::Request& req, httplib::Response& res){
+        g_total_requests.add();
+        ScopedLatency total_timer(g_lat_batch_get);
+
+        json j;
+        std::vector<string> keys;
+        string perr;
+        if (!parse_batch_keys(req.body, batch_max_keys, keys, perr)) {
+            j["status"] = "error";
+            j["error"] = perr;
+            res.status = 400;
+            send_json(res, j);
+            g_total_errors.add();
+            return;
+        }
+
+        std::unique_ptr<BatchScatter> remote = scatter(keys, req, keys_body);
+
+        json results = json::object();
+        size_t failed = 0;
+        std::vector<string> missing;
+        std::vector<uint64_t> neg_tickets;      // parallel to missing
+        std::unordered_set<string> verify;      // sampled known-absent keys
+        for (auto &key : keys) {
+            CacheValue val;
+            bool hit;
+            {
+                ScopedLatency t(g_lat_cache_lookup);
+                hit = cache.get(key, val);
+            }
+            if (hit) {
+                g_cache_hits.add();
+                if (!value_result(results[key], key, *val)) failed++;
+                continue;
+            }
+            g_cache_misses.add();
+            NegativeCache::Lookup nl = negative ? negative->lookup(key) : NegativeCache::Lookup::UNKNOWN;
+            if (nl == NegativeCache::Lookup::ABSENT) {
+                results[key] = {{"status", "not_found"}};
+                continue;
+            }
+            if (nl == NegativeCache::Lookup::VERIFY) verify.insert(key);
+            // before the queue lookup, so a write landing after it is seen
+            uint64_t ticket = negative ? negative->ticket(key) : 0;
+            // a write still queued for Postgres is newer than what the DB has
+            if (wb) {
+                string queued;
+                WriteBehindQueue::Lookup q = wb->lookup(key, queued);
+                if (q == WriteBehindQueue::Lookup::PUT) {
+                    if (!value_result(results[key], key, queued)) failed++;
+                    cache.put(key, make_cache_value(std::move(queued)));
+                    continue;
+                }
+                if (q == WriteBehindQueue::Lookup::DEL) {
+                    results[key] = {{"status", "not_found"}};
+                    continue;
                 }
+            }
+            missing.push_back(key);
+            neg_tickets.push_back(ticket);
+        }
 
-                j["status"] = "ok";
-                j["value"] = val;
-                res.set_content(j.dump() + "\n", "application/json");
-                g_total_success.fetch_add(1);
-                return;
+        if (!missing.empty()) {
+            std::unordered_map<string, string> found;
+            uint64_t inv_ticket = invalidator ? invalidator->ticket() : 0;
+            bool ok;
+            {
+                ScopedStage t(g_lat_db_call, TraceStage::DB_CALL);
+                ok = db.get_many(missing, found);
+            }
+            if (!ok) {
+                LOG_WARN("DB BATCH GET ERROR keys=" << missing.size() << " err=\"" << db.last_error() << "\"");
+                for (auto &key : missing) results[key] = {{"status", "error"}, {"error", "DB read failed"}};
+                failed = missing.size();
             } else {
-                g_cache_misses.fetch_add(1);
-                // Log cache miss
-                {
-                    std::ostringstream ss;
-                    ss << "CACHE MISS key=\"" << key << "\"";
-                    log_info(ss.str());
+                for (size_t i = 0; i < missing.size(); i++) {
+                    const string &key = missing[i];
+                    auto it = found.find(key);
+                    if (!verify.empty() && verify.count(key)) negative->verified(key, it != found.end());
+                    if (it == found.end()) {
+                        if (negative) negative->insert(key, neg_tickets[i]);
+                        results[key] = {{"status", "not_found"}};
+                        continue;
+                    }
+                    if (!value_result(results[key], key, it->second)) failed++;
+                    cache.put(key, make_cache_value(std::move(it->second)));
+                    if (invalidator && invalidator->stale(key, inv_ticket)) cache.erase(key);
                 }
             }
         }
+        if (remote) failed += remote->gather(results);
+        LOG_DEBUG("BATCH GET keys=" << keys.size() << " db_fetched=" << missing.size() << " failed=" << failed);
 
-        // Not in cache: fetch from DB (serialize DB calls to be safe)
-        {
-            std::lock_guard<std::mutex> lk(g_db_mtx);
-            if (db.get(key, val)) {
-                // log DB GET success
-                {
-                    std::ostringstream ss;
-                    ss << "DB GET key=\"" << key << "\" len=" << val.size();
-                    log_info(ss.str());
-                }
+        j["status"] = failed ? "partial" : "ok";
+        j["results"] = results;
+        send_json(res, j);
+        if (failed) g_total_errors.add();
+        else g_total_success.add();
+    });
+
+    route("PUT", "/kv/_batch", [&](const httplib::Request& req, httplib::Response& res){
+        g_total_requests.add();
+        ScopedLatency total_timer(g_lat_batch_put);
+
+        json j;
+        json parsed = json::parse(req.body, nullptr, false);
+        if (parsed.is_discarded() || !parsed.is_object() || !parsed.contains("items") || !parsed["items"].is_object()
+            || parsed["items"].size() > batch_max_keys) {
+            j["status"] = "error";
+            j["error"] = "expected {\"items\": {\"key\": \"value\", ...}} with at most "
+                         + std::to_string(batch_max_keys) + " keys";
+            res.status = 400;
+            send_json(res, j);
+            g_total_errors.add();
+            return;
+        }
+
+        int64_t ttl_ms;
+        if (!request_ttl(req, parsed.contains("ttl") ? parsed["ttl"] : json(), ttl_ms)) {
+            j["status"] = "error";
+            j["error"] = "\"ttl\" must be a non-negative number of seconds";
+            res.status = 400;
+            send_json(res, j);
+            g_total_errors.add();
+            return;
+        }
+
+        // string values are stored as-is, anything else as its JSON text (like single PUT)
+        std::vector<std::pair<string, string>> puts;
+        puts.reserve(parsed["items"].size());
+        json results = json::object();
+        size_t failed = 0;
+        for (auto &it : parsed["items"].items()) {
+            if (it.key().empty()) {
+                results[""] = {{"status", "error"}, {"error", "Empty key"}};
+                failed++;
+                continue;
+            }
+            puts.emplace_back(it.key(), it.value().is_string() ? it.value().get<string>() : it.value().dump());
+        }
+        std::vector<string> keys;
+        for (auto &kv : puts) keys.push_back(kv.first);
+        std::unique_ptr<BatchScatter> remote = scatter(keys, req, [&parsed](const std::vector<string> &part){
+            json items = json::object();
+            for (auto &k : part) items[k] = parsed["items"][k];
+            json b;
+            b["items"] = items;
+            if (parsed.contains("ttl")) b["ttl"] = parsed["ttl"];
+            return b.dump();
+        });
+        if (remote) {
+            std::unordered_set<string> mine(keys.begin(), keys.end());
+            puts.erase(std::remove_if(puts.begin(), puts.end(), [&](const std::pair<string, string> &kv){ return !mine.count(kv.first); }),
+                       puts.end());
+        }
+
+        // stored form, after the remote keys went out as sent
+        string encoded;
+        for (auto &kv : puts)
+            if (codec.encode(kv.second, encoded)) kv.second.swap(encoded);
+
+        // before the write: another server's write to one of these keys
+        // that lands after ours must not leave our value cached
+        uint64_t inv_ticket = invalidator ? invalidator->ticket() : 0;
+        if (wb) {
+            // the whole batch is queued or none of it
+            bool ok = wb->write_batch(puts, {});
+            if (!ok) {
+                LOG_WARN("WRITE-BEHIND QUEUE FULL batch rejected=" << puts.size());
+                failed += puts.size();
+            }
+            for (auto &kv : puts) {
+                if (ok && negative) negative->invalidate(kv.first);
+                if (ok) cache.put(kv.first, make_cache_value(std::move(kv.second)), ttl_ms);
+                if (ok && invalidator && invalidator->stale(kv.first, inv_ticket)) cache.erase(kv.first);
+                results[kv.first] = ok ? json{{"status", "ok"}} : json{{"status", "error"}, {"error", "Write queue full"}};
+            }
+        } else {
+            bool ok;
+            {
+                ScopedStage t(g_lat_db_call, TraceStage::DB_CALL);
+                ok = db.write_batch(puts, {});
+            }
+            if (!ok) {
+                LOG_WARN("DB BATCH PUT ERROR keys=" << puts.size() << " err=\"" << db.last_error() << "\"");
+                failed += puts.size();
+            }
+            for (auto &kv : puts) {
+                if (ok && negative) negative->invalidate(kv.first);
+                if (ok) cache.put(kv.first, make_cache_value(std::move(kv.second)), ttl_ms);
+                if (ok && invalidator && invalidator->stale(kv.first, inv_ticket)) cache.erase(kv.first);
+                results[kv.first] = ok ? json{{"status", "ok"}} : json{{"status", "error"}, {"error", "DB write failed"}};
+            }
+        }
+        size_t total = puts.size() + (parsed["items"].contains("") ? 1 : 0);
+        if (remote) {
+            total += remote->keys();
+            failed += remote->gather(results);
+        }
+        LOG_DEBUG("BATCH PUT keys=" << total << " failed=" << failed);
+
+        // nothing applied => error status; some keys applied => partial
+        if (failed && failed == total) res.status = wb ? 503 : 500;
+        else res.status = 201;
+        j["status"] = !failed ? "ok" : (failed == total ? "error" : "partial");
+        j["results"] = results;
+        send_json(res, j);
+        if (failed) g_total_errors.add();
+        else g_total_success.add();
+    });
+
+    route("DELETE", "/kv/_batch", [&](const httplib::Request& req, httplib::Response& res){
+        g_total_requests.add();
+        ScopedLatency total_timer(g_lat_batch_delete);
+
+        json j;
+        std::vector<string> keys;
+        string perr;
+        if (!parse_batch_keys(req.body, batch_max_keys, keys, perr)) {
+            j["status"] = "error";
+            j["error"] = perr;
+            res.status = 400;
+            send_json(res, j);
+            g_total_errors.add();
+            return;
+        }
 
-                // insert into cache under lock
+        std::unique_ptr<BatchScatter> remote = scatter(keys, req, keys_body);
+
+        json results = json::object();
+        size_t failed = 0;
+        if (wb) {
+            // only keys that exist somewhere are queued; the rest are
+            // reported not_found, as a GET would. The queue and the cache
+            // answer most of them, Postgres the remainder in one query.
+            std::vector<string> dels, ask;
+            std::unordered_set<string> absent;
+            for (auto &key : keys) {
+                string v;
+                WriteBehindQueue::Lookup q = wb->lookup(key, v);
+                if (q == WriteBehindQueue::Lookup::DEL) absent.insert(key);
+                else if (q == WriteBehindQueue::Lookup::PUT || cache.get(key, v)) dels.push_back(key);
+                else if (negative && negative->lookup(key) == NegativeCache::Lookup::ABSENT) absent.insert(key);
+                else ask.push_back(key);
+            }
+            if (!ask.empty()) {
+                std::unordered_map<string, string> found;
+                bool ok;
                 {
-                    std::lock_guard<std::mutex> lk2(g_cache_mtx);
-                    cache.put(key, val);
-                    // Log cache put
-                    std::ostringstream ss;
-                    ss << "CACHE PUT key=\"" << key << "\" (from DB)";
-                    log_info(ss.str());
+                    ScopedStage t(g_lat_db_call, TraceStage::DB_CALL);
+                    ok = db.get_many(ask, found);
+                }
+                // if Postgres can't tell, delete anyway
+                for (auto &key : ask) {
+                    if (!ok || found.count(key)) dels.push_back(key);
+                    else absent.insert(key);
+                }
+            }
+            bool ok = wb->write_batch({}, dels);
+            if (!ok) {
+                LOG_WARN("WRITE-BEHIND QUEUE FULL batch rejected=" << dels.size());
+                failed = dels.size();
+            }
+            for (auto &key : keys) {
+                if (absent.count(key)) {
+                    results[key] = {{"status", "not_found"}};
+                    continue;
                 }
+                if (ok) cache.erase(key);
+                results[key] = ok ? json{{"status", "ok"}} : json{{"status", "error"}, {"error", "Write queue full"}};
+            }
+        } else {
+            bool ok;
+            {
+                ScopedStage t(g_lat_db_call, TraceStage::DB_CALL);
+                ok = db.write_batch({}, keys);
+            }
+            if (!ok) {
+                LOG_WARN("DB BATCH DELETE ERROR keys=" << keys.size() << " err=\"" << db.last_error() << "\"");
+                failed = keys.size();
+            }
+            for (auto &key : keys) {
+                if (ok) cache.erase(key);
+                results[key] = ok ? json{{"status", "ok"}} : json{{"status", "error"}, {"error", "DB delete failed"}};
+            }
+        }
+        size_t total = keys.size();
+        if (remote) {
+            total += remote->keys();
+            failed += remote->gather(results);
+        }
+        LOG_DEBUG("BATCH DELETE keys=" << total << " failed=" << failed);
 
-                j["status"] = "ok";
-                j["value"] = val;
-                res.set_content(j.dump() + "\n", "application/json");
-                g_total_success.fetch_add(1);
+        if (failed && failed == total) res.status = wb ? 503 : 500;
+        j["status"] = !failed ? "ok" : (failed == total ? "error" : "partial");
+        j["results"] = results;
+        send_json(res, j);
+        if (failed) g_total_errors.add();
+        else g_total_success.add();
+    });
+
+    // Read key (GET)
+    route("GET", R"(/kv/(.+))", [&](const httplib::Request& req, httplib::Response& res){
+        if (cluster && send_to_owner(req.matches[1], req, res)) return;
+        g_total_requests.add();
+        ScopedLatency total_timer(g_lat_get);
+
+        string key = req.matches[1];
+        CacheValue val;
+        json j;
+        bool raw = wants_raw(req);
+
+        // Check cache (locks only the key's shard)
+        {
+            bool hit;
+            {
+                ScopedLatency t(g_lat_cache_lookup);
+                hit = cache.get(key, val);
+            }
+            if (hit) {
+                g_cache_hits.add();
+                // Log cache hit
+                LOG_DEBUG("CACHE HIT key=\"" << key << "\"");
+
+                send_value(req, res, key, std::move(val), raw);
                 return;
             } else {
-                // if db.get failed, log last_error if any
-                std::string dbe = db.last_error();
-                if (!dbe.empty()) {
-                    std::ostringstream ss;
-                    ss << "DB GET ERROR key=\"" << key << "\" err=\"" << dbe << "\"";
-                    log_info(ss.str());
-                } else {
-                    // not found - already will return 404
-                    std::ostringstream ss;
-                    ss << "DB GET NOTFOUND key=\"" << key << "\"";
-                    log_info(ss.str());
+                g_cache_misses.add();
+                // Log cache miss
+                LOG_DEBUG("CACHE MISS key=\"" << key << "\"");
+            }
+        }
+
+        // Known to be absent: answer without Postgres, except for the sampled
+        // hits that are checked to measure the false-positive rate
+        NegativeCache::Lookup nl = negative ? negative->lookup(key) : NegativeCache::Lookup::UNKNOWN;
+        if (nl == NegativeCache::Lookup::ABSENT) {
+            LOG_DEBUG("NEGATIVE HIT key=\"" << key << "\"");
+            j["status"] = "error";
+            j["error"] = "Key not found";
+            res.status = 404;
+            send_json(res, j);
+            g_total_errors.add();
+            return;
+        }
+
+        // Not in cache: fetch from DB on a pooled connection. Concurrent misses
+        // for the same key share one query and only the leader fills the cache.
+        SingleFlight::Result r = flights.run(key, [&](CacheValue &v, std::string &err){
+            string s;
+            uint64_t neg_ticket = negative ? negative->ticket(key) : 0;
+            // a write still queued for Postgres is newer than what the DB has
+            if (wb) {
+                WriteBehindQueue::Lookup q = wb->lookup(key, s);
+                if (q == WriteBehindQueue::Lookup::DEL) return false;
+                if (q == WriteBehindQueue::Lookup::PUT) {
+                    v = make_cache_value(std::move(s));
+                    cache.put(key, v);
+                    return true;
                 }
             }
+            uint64_t inv_ticket = invalidator ? invalidator->ticket() : 0;
+            bool found;
+            {
+                ScopedStage t(g_lat_db_call, TraceStage::DB_CALL);
+                found = db.get(key, s);
+            }
+            if (!found) {
+                err = db.last_error();
+                if (negative && err.empty()) negative->insert(key, neg_ticket);
+                return false;
+            }
+            LOG_DEBUG("DB GET key=\"" << key << "\" len=" << s.size());
+            // the cache and every coalesced response share this one buffer
+            v = make_cache_value(std::move(s));
+            cache.put(key, v);
+            // another server wrote it meanwhile: what was read may be older
+            if (invalidator && invalidator->stale(key, inv_ticket)) cache.erase(key);
+            LOG_DEBUG("CACHE PUT key=\"" << key << "\" (from DB)");
+            return true;
+        });
+        if (r.shared) LOG_DEBUG("COALESCED key=\"" << key << "\"");
+        if (nl == NegativeCache::Lookup::VERIFY && r.error.empty()) negative->verified(key, r.found);
+
+        if (r.found) {
+            send_value(req, res, key, std::move(r.value), raw);
+            return;
+        }
+        if (!r.error.empty()) {
+            LOG_WARN("DB GET ERROR key=\"" << key << "\" err=\"" << r.error << "\"");
+        } else {
+            // not found - already will return 404
+            LOG_DEBUG("DB GET NOTFOUND key=\"" << key << "\"");
         }
 
         // not found
         j["status"] = "error";
         j["error"] = "Key not found";
         res.status = 404;
-        res.set_content(j.dump() + "\n", "application/json");
-        g_total_errors.fetch_add(1);
+        send_json(res, j);
+        g_total_errors.add();
     });
 
     // Create or Update key-value pair (PUT)
-    svr.Put(R"(/kv/(.+))", [&](const httplib::Request& req, httplib::Response& res){
-        g_total_requests.fetch_add(1);
+    route("PUT", R"(/kv/(.+))", [&](const httplib::Request& req, httplib::Response& res){
+        if (cluster && send_to_owner(req.matches[1], req, res)) return;
+        g_total_requests.add();
+        ScopedLatency total_timer(g_lat_put);
 
         string key = req.matches[1];
-        string body = req.body;
         json j;
-        string value_to_store;
-        
-        try {
-            auto parsed = json::parse(body);
-            if (parsed.is_object() && parsed.contains("value")) {
-                value_to_store = parsed["value"].get<std::string>();
-            } else {
-                // store raw JSON string
-                value_to_store = body;
-            }
-        } catch (const std::exception &e) {
-            // not JSON: store raw body
-            value_to_store = body;
+
+        // raw mode takes the body untouched; otherwise {"value": "..."} is
+        // unwrapped and any other body is taken as sent
+        string unwrapped;
+        json body_ttl;
+        const string &value_sent =
+            (!sends_raw(req) && unwrap_json_value(req.body, unwrapped, body_ttl)) ? unwrapped : req.body;
+        int64_t ttl_ms;
+        if (!request_ttl(req, body_ttl, ttl_ms)) {
+            j["status"] = "error";
+            j["error"] = "TTL must be a non-negative number of seconds";
+            res.status = 400;
+            send_json(res, j);
+            g_total_errors.add();
+            return;
         }
 
         // Log incoming PUT
-        {
-            std::ostringstream ss;
-            ss << "REQ PUT key=\"" << key << "\" body_len=" << value_to_store.size();
-            log_info(ss.str());
+        LOG_DEBUG("REQ PUT key=\"" << key << "\" body_len=" << value_sent.size());
+        // the form kept in the cache and Postgres: compressed if large enough
+        string encoded;
+        const string &value_to_store = codec.encode(value_sent, encoded) ? encoded : value_sent;
+        // before the write, so another server's write landing after ours
+        // doesn't leave our value cached
+        uint64_t inv_ticket = invalidator ? invalidator->ticket() : 0;
+
+        if (wb) {
+            // write-behind: journal + queue, then answer without waiting for Postgres
+            if (!wb->put(key, value_to_store)) {
+                LOG_WARN("WRITE-BEHIND QUEUE FULL key=\"" << key << "\"");
+                j["status"] = "error";
+                j["error"] = "Write queue full";
+                res.status = 503;
+                send_json(res, j);
+                g_total_errors.add();
+                return;
+            }
+            if (negative) negative->invalidate(key);
+            cache.put(key, value_to_store, ttl_ms);
+            if (invalidator && invalidator->stale(key, inv_ticket)) cache.erase(key);
+            LOG_DEBUG("QUEUED PUT key=\"" << key << "\" len=" << value_to_store.size());
+            j["status"] = "ok";
+            res.status = 201;
+            send_json(res, j);
+            g_total_success.add();
+            return;
         }
 
-        // DB write (serialize DB calls)
+        // DB write on a pooled connection
         bool ok = false;
         {
-            std::lock_guard<std::mutex> lk(g_db_mtx);
-            ok = db.put(key, value_to_store);
+            {
+                ScopedStage t(g_lat_db_call, TraceStage::DB_CALL);
+                ok = db.put(key, value_to_store);
+            }
             if (ok) {
-                std::ostringstream ss;
-                ss << "DB PUT key=\"" << key << "\" len=" << value_to_store.size();
-                log_info(ss.str());
+                LOG_DEBUG("DB PUT key=\"" << key << "\" len=" << value_to_store.size());
             } else {
-                std::ostringstream ss;
-                ss << "DB PUT ERROR key=\"" << key << "\" err=\"" << db.last_error() << "\"";
-                log_info(ss.str());
+                LOG_WARN("DB PUT ERROR key=\"" << key << "\" err=\"" << db.last_error() << "\"");
             }
         }
         if (!ok) {
             j["status"] = "error";
             j["error"] = "DB write failed";
             res.status = 500;
-            res.set_content(j.dump() + "\n", "application/json");
-            g_total_errors.fetch_add(1);
+            send_json(res, j);
+            g_total_errors.add();
             return;
         }
 
-        // update cache under lock
+        // update cache
         {
-            std::lock_guard<std::mutex> lk(g_cache_mtx);
-            cache.put(key, value_to_store);
+            if (negative) negative->invalidate(key);
+            cache.put(key, value_to_store, ttl_ms);
+            if (invalidator && invalidator->stale(key, inv_ticket)) cache.erase(key);
             // Log cache put/update
-            std::ostringstream ss;
-            ss << "CACHE PUT key=\"" << key << "\" len=" << value_to_store.size();
-            log_info(ss.str());
+            LOG_DEBUG("CACHE PUT key=\"" << key << "\" len=" << value_to_store.size());
         }
 
         j["status"] = "ok";
         res.status = 201;
-        res.set_content(j.dump() + "\n", "application/json");
-        g_total_success.fetch_add(1);
+        send_json(res, j);
+        g_total_success.add();
     });
 
     // DELETE key-value pair
-    svr.Delete(R"(/kv/(.+))", [&](const httplib::Request& req, httplib::Response& res){
-        g_total_requests.fetch_add(1);
+    route("DELETE", R"(/kv/(.+))", [&](const httplib::Request& req, httplib::Response& res){
+        if (cluster && send_to_owner(req.matches[1], req, res)) return;
+        g_total_requests.add();
+        ScopedLatency total_timer(g_lat_delete);
 
         string key = req.matches[1];
         json j;
 
         // Log incoming DELETE
-        {
-            std::ostringstream ss;
-            ss << "REQ DELETE key=\"" << key << "\"";
-            log_info(ss.str());
-        }
+        LOG_DEBUG("REQ DELETE key=\"" << key << "\"");
 
         bool ok = false;
         std::string last_err;
-        {
-            std::lock_guard<std::mutex> lk(g_db_mtx);
-            ok = db.del(key);
+        if (wb) {
+            // queue it only if the key exists somewhere, so a miss is still a
+            // 404: the queue or the cache usually knows, else ask Postgres
+            // (and delete anyway if it can't tell)
+            string v;
+            WriteBehindQueue::Lookup q = wb->lookup(key, v);
+            bool exists = q == WriteBehindQueue::Lookup::PUT || (q == WriteBehindQueue::Lookup::NONE && cache.get(key, v));
+            if (q == WriteBehindQueue::Lookup::NONE && !exists
+                && !(negative && negative->lookup(key) == NegativeCache::Lookup::ABSENT)) {
+                ScopedStage t(g_lat_db_call, TraceStage::DB_CALL);
+                exists = db.get(key, v) || !db.last_error().empty();
+            }
+            if (!exists) {
+                LOG_DEBUG("QUEUED DELETE NOTFOUND key=\"" << key << "\"");
+            } else if (!(ok = wb->del(key))) {
+                LOG_WARN("WRITE-BEHIND QUEUE FULL key=\"" << key << "\"");
+                j["status"] = "error";
+                j["error"] = "Write queue full";
+                res.status = 503;
+                send_json(res, j);
+                g_total_errors.add();
+                return;
+            } else {
+                LOG_DEBUG("QUEUED DELETE key=\"" << key << "\"");
+            }
+        } else {
+            {
+                ScopedStage t(g_lat_db_call, TraceStage::DB_CALL);
+                ok = db.del(key);
+            }
             last_err = db.last_error();
             if (ok) {
-                std::ostringstream ss;
-                ss << "DB DELETE key=\"" << key << "\"";
-                log_info(ss.str());
+                LOG_DEBUG("DB DELETE key=\"" << key << "\"");
             } else if (!last_err.empty()) {
-                std::ostringstream ss;
-                ss << "DB DELETE ERROR key=\"" << key << "\" err=\"" << last_err << "\"";
-                log_info(ss.str());
+                LOG_WARN("DB DELETE ERROR key=\"" << key << "\" err=\"" << last_err << "\"");
             } else {
                 // delete returned false but no error -> likely not found
-                std::ostringstream ss;
-                ss << "DB DELETE NOTFOUND key=\"" << key << "\"";
-                log_info(ss.str());
+                LOG_DEBUG("DB DELETE NOTFOUND key=\"" << key << "\"");
             }
         }
 
@@ -319,54 +1554,211 @@ int main(int argc, char** argv) {
                 j["status"] = "error";
                 j["error"] = string("DB delete error: ") + last_err;
                 res.status = 500;
-                res.set_content(j.dump() + "\n", "application/json");
-                g_total_errors.fetch_add(1);
+                send_json(res, j);
+                g_total_errors.add();
                 return;
             } else {
                 // not found
                 j["status"] = "error";
                 j["error"] = "Key not found";
                 res.status = 404;
-                res.set_content(j.dump() + "\n", "application/json");
-                g_total_errors.fetch_add(1);
+                send_json(res, j);
+                g_total_errors.add();
                 return;
             }
         }
 
-        // remove from cache under lock
+        // remove from cache
         {
-            std::lock_guard<std::mutex> lk(g_cache_mtx);
             cache.erase(key);
-            std::ostringstream ss;
-            ss << "CACHE ERASE key=\"" << key << "\"";
-            log_info(ss.str());
+            LOG_DEBUG("CACHE ERASE key=\"" << key << "\"");
         }
 
         j["status"] = "ok";
         j["message"] = "Deleted";
         res.status = 200;
-        res.set_content(j.dump() + "\n", "application/json");
-        g_total_success.fetch_add(1);
+        send_json(res, j);
+        g_total_success.add();
     });
 
-    // Health check
-    svr.Get("/health", [&](const httplib::Request&, httplib::Response& res){
+    // Runtime log level: GET reports it, PUT with body "debug"/"info"/... changes it
+    route("GET", "/admin/log_level", [&](const httplib::Request&, httplib::Response& res){
         json j;
-        j["status"] = "ok";
-        res.set_content(j.dump() + "\n", "application/json");
+        j["level"] = log_level_name(AsyncLogger::instance().level());
+        send_json(res, j);
+    });
+    route("PUT", "/admin/log_level", [&](const httplib::Request& req, httplib::Response& res){
+        json j;
+        LogLevel l;
+        if (!parse_log_level(req.body, l)) {
+            j["status"] = "error";
+            j["error"] = "expected one of debug, info, warn, error, off";
+            res.status = 400;
+        } else {
+            AsyncLogger::instance().set_level(l);
+            j["status"] = "ok";
+            j["level"] = log_level_name(l);
+        }
+        send_json(res, j);
     });
 
+    // Health check; 503 until the cache warm-up has finished, so a load
+    // balancer holds traffic back while the working set reloads
+    WarmupState warm;
+    warm.cluster = cluster.get();
+    warm.invalidator = invalidator.get();
+    route("GET", "/health", [&](const httplib::Request&, httplib::Response& res){
+        json j;
+        if (warm.ready.load()) {
+            j["status"] = "ok";
+        } else {
+            j["status"] = "warming";
+            j["warmed_keys"] = warm.keys_loaded.load();
+            res.status = 503;
+        }
+        j["engine"] = use_epoll ? "epoll" : "httplib";
+        send_json(res, j);
+    });
+    add_metrics_section("warmup", [&warm]{
+        json j;
+        j["ready"] = warm.ready.load();
+        j["source"] = warm.source.load();
+        j["keys_loaded"] = warm.keys_loaded.load();
+        j["snapshot_stale"] = warm.snapshot_stale.load();
+        j["duration_ms"] = warm.duration_ms.load();
+        return j;
+    });
+
+    // Warm-up sources in order of preference: a cache snapshot, the saved
+    // hot-key list, a scan
+    std::vector<string> saved_hot_keys;
+    if (!hot_keys_file.empty()) hot_keys::load(hot_keys_file, hot_keys_max, saved_hot_keys);
+    bool have_snapshot = !snapshot_file.empty() && std::filesystem::exists(snapshot_file);
+    if (have_snapshot || !saved_hot_keys.empty() || warmup_scan > 0) warm.ready = false;
+
     // run server
-    std::thread server_thread([&](){
-        svr.listen("0.0.0.0", port);
+    std::unique_ptr<WorkerPool> epoll_workers;
+    std::thread server_thread;
+    if (use_epoll) {
+        epoll_workers.reset(new WorkerPool(http_threads, http_queue_depth, pool_stats));
+        if (!epoll.listen("0.0.0.0", port, *epoll_workers)) {
+            cerr << "Failed to listen on port " << port << "\n";
+            epoll.stop();
+            epoll_workers->shutdown();
+            return 1;
+        }
+    } else {
+        server_thread = std::thread([&](){
+            svr.listen("0.0.0.0", port);
+        });
+    }
+
+    // warm the cache while already answering (requests that miss go to
+    // Postgres as usual); /health reports ready once done
+    std::thread warmup_thread;
+    if (!warm.ready) {
+        warmup_thread = std::thread([&]{
+            auto t0 = std::chrono::steady_clock::now();
+            if (have_snapshot && warm_from_snapshot(snapshot_file, batch_max_keys, cache, db, wb.get(), warm)) {
+                warm.source = "snapshot";
+            } else if (!saved_hot_keys.empty()) {
+                warm.source = "hot_keys";
+                warm_from_keys(saved_hot_keys, batch_max_keys, cache, db, wb.get(), warm);
+            } else if (warmup_scan > 0) {
+                warm.source = "scan";
+                uint64_t ev0 = cache.evictions();
+                uint64_t ticket = invalidator ? invalidator->ticket() : 0;
+                bool ok = db.scan(warmup_scan, 1000, [&](string &key, string &value){
+                    return !stop_flag && warm_put(cache, wb.get(), ev0, key, value, warm, ticket);
+                });
+                if (!ok) LOG_WARN("WARMUP SCAN ERROR err=\"" << db.last_error() << "\"");
+            }
+            saved_hot_keys.clear();
+            saved_hot_keys.shrink_to_fit();
+            warm.duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+            warm.ready = true;
+            LOG_INFO("WARMUP DONE source=" << warm.source.load() << " keys=" << warm.keys_loaded.load()
+                     << " stale=" << warm.snapshot_stale.load() << " ms=" << warm.duration_ms.load());
+        });
+    }
+
+    // Periodic hot-key dumps and snapshots, skipped until warm so a
+    // half-loaded cache never replaces the previous copy
+    auto dump_hot_keys = [&]{
+        std::vector<string> keys = cache.hot_keys(hot_keys_max);
+        if (hot_keys::save(hot_keys_file, keys)) LOG_DEBUG("HOT KEYS SAVED keys=" << keys.size());
+        else LOG_WARN("HOT KEYS SAVE FAILED path=\"" << hot_keys_file << "\"");
+    };
+    // The Postgres clock is read before the cache is copied. `margin_us`
+    // covers write-through PUTs committed just before that reading whose
+    // cache update hadn't landed yet; such rows look changed on restore.
+    auto save_snapshot = [&](int64_t margin_us){
+        auto t0 = std::chrono::steady_clock::now();
+        int64_t taken_at;
+        if (!db.now_us(taken_at)) {
+            LOG_WARN("SNAPSHOT SAVE FAILED err=\"" << db.last_error() << "\"");
+            return;
+        }
+        auto entries = cache.hot_entries(std::numeric_limits<size_t>::max());
+        string err;
+        if (!snapshot::write(snapshot_file, entries, taken_at - margin_us, err)) {
+            LOG_WARN("SNAPSHOT SAVE FAILED " << err);
+            return;
+        }
+        LOG_INFO("SNAPSHOT SAVED entries=" << entries.size() << " ms="
+                 << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count());
+    };
+    // Background expiry: every --ttl-sweep-ms, each shard looks at a slice
+    // of its entries under its lock and drops the expired ones. Idle until
+    // some entry has a TTL.
+    std::thread ttl_sweeper([&]{
+        while (!stop_flag) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(ttl_sweep_ms));
+            size_t n = cache.ttl_used() ? cache.expire(256) : 0;
+            size_t neg = negative ? negative->expire(256) : 0;
+            if (n || neg) LOG_DEBUG("TTL SWEEP expired=" << n << " negative_expired=" << neg);
+        }
     });
 
+    std::thread checkpointer;
+    if (!hot_keys_file.empty() || (!snapshot_file.empty() && snapshot_interval_s > 0)) {
+        checkpointer = std::thread([&]{
+            auto next_hot = std::chrono::steady_clock::now() + std::chrono::seconds(hot_keys_interval_s);
+            auto next_snap = std::chrono::steady_clock::now() + std::chrono::seconds(snapshot_interval_s);
+            while (!stop_flag) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+                if (!warm.ready) continue;
+                auto now = std::chrono::steady_clock::now();
+                if (!hot_keys_file.empty() && now >= next_hot) {
+                    dump_hot_keys();
+                    next_hot = std::chrono::steady_clock::now() + std::chrono::seconds(hot_keys_interval_s);
+                }
+                if (!snapshot_file.empty() && snapshot_interval_s > 0 && now >= next_snap) {
+                    save_snapshot(5 * 1000000LL);
+                    next_snap = std::chrono::steady_clock::now() + std::chrono::seconds(snapshot_interval_s);
+                }
+            }
+        });
+    }
+
     // wait until signal
     while (!stop_flag) std::this_thread::sleep_for(std::chrono::milliseconds(200));
 
     cout << "Shutting down server...\n";
     svr.stop();
     if (server_thread.joinable()) server_thread.join();
+    // loops first: in-flight handlers still post their replies to them
+    epoll.stop();
+    if (epoll_workers) epoll_workers->shutdown();
+    if (warmup_thread.joinable()) warmup_thread.join();
+    if (checkpointer.joinable()) checkpointer.join();
+    ttl_sweeper.join();
+    if (!hot_keys_file.empty() && warm.ready) dump_hot_keys();
+    if (wb) wb->stop();   // flushes what is still queued
+    // nothing is writing any more and Postgres has every write: no margin
+    if (!snapshot_file.empty() && warm.ready) save_snapshot(0);
+    if (invalidator) invalidator->stop();
     db.disconnect();
+    AsyncLogger::instance().stop();
     return 0;
 }
@@ -1,38 +1,386 @@
 #include "httplib.h"
+#include "histogram.h"
 #include "json.hpp"
+#include "logger.h"
+#include "pg_store.h"
+#include "sharded_cache.h"
+#include "sharded_counter.h"
 #include <atomic>
+#include <cctype>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
+#include <unistd.h>
 
 using json = nlohmann::json;
 
-// Global atomic counters
-std::atomic<uint64_t> g_total_requests{0};
-std::atomic<uint64_t> g_total_success{0};
-std::atomic<uint64_t> g_total_errors{0};
-std::atomic<uint64_t> g_cache_hits{0};
-std::atomic<uint64_t> g_cache_misses{0};
-
-
-void register_metrics_endpoint(httplib::Server &svr, class PGStore *db /*=nullptr*/) {
-    // capture server start time for uptime calculation
-    static auto start_time = std::chrono::steady_clock::now();
-
-    svr.Get("/metrics", [&](const httplib::Request & /*req*/, httplib::Response &res) {
-        json m;
-        m["total_requests"] = g_total_requests.load();
-        m["total_success"] = g_total_success.load();
-        m["total_errors"] = g_total_errors.load();
-        m["cache_hits"] = g_cache_hits.load();
-        m["cache_misses"] = g_cache_misses.load();
-
-        // uptime
-        auto now = std::chrono::steady_clock::now();
-        auto uptime_s = std::chrono::duration_cast<std::chrono::seconds>(now - start_time).count();
-        m["uptime_seconds"] = uptime_s;
-        m["timestamp_ms"] = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
-
-        res.set_content(m.dump(), "application/json");
+// Global request counters, sharded per thread and summed on scrape
+ShardedCounter g_total_requests;
+ShardedCounter g_total_success;
+ShardedCounter g_total_errors;
+ShardedCounter g_cache_hits;
+ShardedCounter g_cache_misses;
+
+// Responses by route method and status code; codes outside the table are
+// counted as "other"
+static const char *const kHttpMethods[] = {"GET", "PUT", "DELETE", "POST"};
+static const int kHttpStatuses[] = {200, 201, 204, 307, 400, 404, 405, 408, 413, 429, 431, 500, 501, 502, 503, 505};
+static constexpr size_t kMethodCount = sizeof(kHttpMethods) / sizeof(kHttpMethods[0]);
+static constexpr size_t kStatusCount = sizeof(kHttpStatuses) / sizeof(kHttpStatuses[0]) + 1;
+static ShardedCounters<kMethodCount * kStatusCount> g_http_responses;
+
+int http_method_index(const std::string &method) {
+    for (size_t i = 0; i < kMethodCount; i++)
+        if (method == kHttpMethods[i]) return static_cast<int>(i);
+    return -1;
+}
+
+void record_http_response(int method, int status) {
+    if (method < 0) return;
+    size_t s = kStatusCount - 1;
+    for (size_t i = 0; i + 1 < kStatusCount; i++) {
+        if (kHttpStatuses[i] == status) { s = i; break; }
+    }
+    g_http_responses.add(static_cast<size_t>(method) * kStatusCount + s);
+}
+
+static std::string status_label(size_t s) {
+    return s + 1 < kStatusCount ? std::to_string(kHttpStatuses[s]) : std::string("other");
+}
+
+// Latency histograms: whole handler per endpoint, and the stages inside it
+LatencyHistogram g_lat_get;
+LatencyHistogram g_lat_put;
+LatencyHistogram g_lat_delete;
+LatencyHistogram g_lat_batch_get;
+LatencyHistogram g_lat_batch_put;
+LatencyHistogram g_lat_batch_delete;
+LatencyHistogram g_lat_cache_lookup;
+LatencyHistogram g_lat_db_call;        // includes waiting for a pooled connection
+LatencyHistogram g_lat_serialize;
+
+json latency_json(const LatencyHistogram &h) {
+    json j;
+    j["count"] = h.count();
+    j["mean_ms"] = h.mean() / 1e6;
+    j["p50_ms"] = h.percentile_ms(0.50);
+    j["p90_ms"] = h.percentile_ms(0.90);
+    j["p99_ms"] = h.percentile_ms(0.99);
+    j["p999_ms"] = h.percentile_ms(0.999);
+    j["max_ms"] = (double)h.max() / 1e6;
+    return j;
+}
+
+// Extra sections contributed by other subsystems, rendered on every scrape
+static std::mutex g_sections_mtx;
+static std::vector<std::pair<std::string, std::function<json()>>> g_sections;
+
+void add_metrics_section(const std::string &name, std::function<json()> fn) {
+    std::lock_guard<std::mutex> lk(g_sections_mtx);
+    g_sections.emplace_back(name, std::move(fn));
+}
+
+// capture server start time for uptime calculation
+static const auto start_time = std::chrono::steady_clock::now();
+
+static json metrics_json(PGStore *db, ShardedCache *cache) {
+    json m;
+    m["total_requests"] = g_total_requests.load();
+    m["total_success"] = g_total_success.load();
+    m["total_errors"] = g_total_errors.load();
+    m["cache_hits"] = g_cache_hits.load();
+    m["cache_misses"] = g_cache_misses.load();
+
+    json responses = json::object();
+    for (size_t mi = 0; mi < kMethodCount; mi++) {
+        for (size_t si = 0; si < kStatusCount; si++) {
+            uint64_t n = g_http_responses.load(mi * kStatusCount + si);
+            if (n) responses[kHttpMethods[mi]][status_label(si)] = n;
+        }
+    }
+    m["http_responses"] = responses;
+
+    json lat;
+    lat["endpoints"] = {{"get", latency_json(g_lat_get)},
+                        {"put", latency_json(g_lat_put)},
+                        {"delete", latency_json(g_lat_delete)},
+                        {"batch_get", latency_json(g_lat_batch_get)},
+                        {"batch_put", latency_json(g_lat_batch_put)},
+                        {"batch_delete", latency_json(g_lat_batch_delete)}};
+    lat["stages"] = {{"cache_lookup", latency_json(g_lat_cache_lookup)},
+                     {"db_call", latency_json(g_lat_db_call)},
+                     {"json_serialize", latency_json(g_lat_serialize)}};
+    m["latency"] = lat;
+
+    if (cache) {
+        json c;
+        c["size"] = cache->size();
+        c["capacity"] = cache->capacity();
+        c["capacity_mode"] = cache->mode() == CapacityMode::BYTES ? "bytes" : "entries";
+        c["policy"] = cache_policy_name(cache->policy());
+        c["bytes"] = cache->bytes();
+        c["peak_bytes"] = cache->peak_bytes();
+        c["evictions"] = cache->evictions();
+        c["expirations"] = cache->expirations();
+        c["default_ttl_ms"] = cache->default_ttl_ms();
+        json shards = json::array();
+        for (size_t i = 0; i < cache->shard_count(); i++) {
+            const CacheShard &s = cache->shard(i);
+            shards.push_back({{"size", s.size()}, {"hits", s.hits()}, {"misses", s.misses()},
+                              {"bytes", s.bytes()}, {"peak_bytes", s.peak_bytes()}, {"evictions", s.evictions()},
+                              {"expirations", s.expirations()}});
+        }
+        c["shards"] = shards;
+        m["cache"] = c;
+    }
+
+    if (db) {
+        json p;
+        p["size"] = db->pool_size();
+        p["in_use"] = db->stats_pool_in_use();
+        p["checkouts"] = db->stats_pool_checkouts();
+        p["checkout_timeouts"] = db->stats_pool_timeouts();
+        p["avg_wait_ms"] = db->stats_pool_avg_wait_ms();
+        p["max_wait_ms"] = db->stats_pool_max_wait_ms();
+        m["db_pool"] = p;
+
+        if (const PGPipeline *pl = db->pipeline()) {
+            json q;
+            q["connections"] = pl->connections();
+            q["in_flight"] = pl->in_flight();
+            q["max_in_flight"] = pl->max_in_flight();
+            q["submitted"] = pl->submitted();
+            q["failed"] = pl->failed();
+            q["reconnects"] = pl->reconnects();
+            m["db_pipeline"] = q;
+        }
+
+        json d;
+        d["get_queries"] = db->stats_get_queries();
+        d["put_queries"] = db->stats_put_queries();
+        d["avg_latency_ms"] = db->stats_avg_db_latency_ms();
+        d["prepares"] = db->stats_prepares();
+        json st;
+        for (int i = 0; i < PGStore::STMT_COUNT; i++) {
+            auto k = static_cast<PGStore::Stmt>(i);
+            json sj = latency_json(db->stats_stmt_latency(k));
+            sj["count"] = db->stats_stmt_count(k);
+            sj["errors"] = db->stats_stmt_errors(k);
+            sj["avg_ms"] = db->stats_stmt_avg_ms(k);
+            st[PGStore::stmt_name(k)] = sj;
+        }
+        d["statements"] = st;
+        m["db"] = d;
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(g_sections_mtx);
+        for (auto &s : g_sections) m[s.first] = s.second();
+    }
+
+    json lg;
+    lg["level"] = log_level_name(AsyncLogger::instance().level());
+    lg["written"] = AsyncLogger::instance().written();
+    lg["dropped"] = AsyncLogger::instance().dropped();
+    m["log"] = lg;
+
+    // uptime
+    auto now = std::chrono::steady_clock::now();
+    auto uptime_s = std::chrono::duration_cast<std::chrono::seconds>(now - start_time).count();
+    m["uptime_seconds"] = uptime_s;
+    // lets a loadgen on the same host sample this process in /proc
+    m["pid"] = static_cast<int64_t>(getpid());
+    m["timestamp_ms"] = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+    return m;
+}
+
+// The /metrics handler on its own, for front ends other than httplib::Server
+httplib::Server::Handler metrics_handler(class PGStore *db, class ShardedCache *cache) {
+    return [db, cache](const httplib::Request & /*req*/, httplib::Response &res) {
+        res.set_content(metrics_json(db, cache).dump(), "application/json");
+        res.status = 200;
+    };
+}
+
+// ---- Prometheus text exposition (format 0.0.4) ----
+
+class PromWriter {
+public:
+    void family(const std::string &name, const char *type, const char *help) {
+        out_ += "# HELP kv_" + name + " " + help + "\n# TYPE kv_" + name + " " + type + "\n";
+    }
+    void sample(const std::string &name, const std::string &labels, uint64_t v) {
+        line(name, labels);
+        out_ += std::to_string(v) + "\n";
+    }
+    void sample(const std::string &name, const std::string &labels, double v) {
+        line(name, labels);
+        char buf[32];
+        if (std::isnan(v)) snprintf(buf, sizeof(buf), "NaN");
+        else snprintf(buf, sizeof(buf), "%.9g", v);
+        out_ += buf;
+        out_ += "\n";
+    }
+    // one single-sample family
+    template <class T>
+    void metric(const std::string &name, const char *type, const char *help, T v) {
+        family(name, type, help);
+        sample(name, "", v);
+    }
+    // latency histogram as a summary in seconds; quantiles of an empty one
+    // are NaN, as Prometheus client libraries report them
+    void summary(const std::string &name, const std::string &labels, const LatencyHistogram &h) {
+        static const char *const qs[] = {"0.5", "0.9", "0.99", "0.999"};
+        for (const char *q : qs) {
+            double v = h.count() ? (double)h.percentile(std::stod(q)) / 1e9 : std::nan("");
+            sample(name, labels + ",quantile=\"" + q + "\"", v);
+        }
+        sample(name + "_sum", labels, (double)h.sum() / 1e9);
+        sample(name + "_count", labels, h.count());
+    }
+    std::string take() { return std::move(out_); }
+
+    static std::string label(const char *k, const std::string &v) {
+        std::string s = std::string(k) + "=\"";
+        for (char c : v) {
+            if (c == '\n') { s += "\\n"; continue; }
+            if (c == '\\' || c == '"') s += '\\';
+            s += c;
+        }
+        return s + "\"";
+    }
+
+private:
+    std::string out_;
+
+    void line(const std::string &name, const std::string &labels) {
+        out_ += "kv_" + name;
+        if (!labels.empty()) out_ += "{" + labels + "}";
+        out_ += " ";
+    }
+};
+
+static std::string prom_name(const std::string &s) {
+    std::string out;
+    for (char c : s) out += (isalnum(static_cast<unsigned char>(c)) || c == '_') ? c : '_';
+    return out;
+}
+
+// Numeric leaves of a contributed section, as untyped kv_<section>_<path>
+static void prom_flatten(PromWriter &w, const std::string &name, const json &j) {
+    if (j.is_object()) {
+        for (auto it = j.begin(); it != j.end(); ++it) prom_flatten(w, name + "_" + prom_name(it.key()), it.value());
+    } else if (j.is_number_unsigned() || j.is_boolean()) {
+        w.metric(name, "untyped", "From the JSON /metrics section.", j.is_boolean() ? (uint64_t)j.get<bool>() : j.get<uint64_t>());
+    } else if (j.is_number()) {
+        w.metric(name, "untyped", "From the JSON /metrics section.", j.get<double>());
+    }
+}
+
+static std::string metrics_prometheus(PGStore *db, ShardedCache *cache) {
+    PromWriter w;
+    w.metric("requests_total", "counter", "KV requests handled.", g_total_requests.load());
+    w.metric("requests_success_total", "counter", "KV requests that succeeded.", g_total_success.load());
+    w.metric("requests_errors_total", "counter", "KV requests that failed.", g_total_errors.load());
+    w.metric("cache_hits_total", "counter", "Key lookups answered from the cache.", g_cache_hits.load());
+    w.metric("cache_misses_total", "counter", "Key lookups that missed the cache.", g_cache_misses.load());
+
+    w.family("http_responses_total", "counter", "HTTP responses by method and status code.");
+    for (size_t mi = 0; mi < kMethodCount; mi++) {
+        for (size_t si = 0; si < kStatusCount; si++) {
+            uint64_t n = g_http_responses.load(mi * kStatusCount + si);
+            if (n) w.sample("http_responses_total", PromWriter::label("method", kHttpMethods[mi]) + "," +
+                            PromWriter::label("code", status_label(si)), n);
+        }
+    }
+
+    const std::pair<const char *, const LatencyHistogram *> endpoints[] = {
+        {"get", &g_lat_get}, {"put", &g_lat_put}, {"delete", &g_lat_delete},
+        {"batch_get", &g_lat_batch_get}, {"batch_put", &g_lat_batch_put}, {"batch_delete", &g_lat_batch_delete}};
+    w.family("request_duration_seconds", "summary", "Handler latency by endpoint.");
+    for (auto &e : endpoints) w.summary("request_duration_seconds", PromWriter::label("endpoint", e.first), *e.second);
+    const std::pair<const char *, const LatencyHistogram *> stages[] = {
+        {"cache_lookup", &g_lat_cache_lookup}, {"db_call", &g_lat_db_call}, {"json_serialize", &g_lat_serialize}};
+    w.family("stage_duration_seconds", "summary", "Latency of the stages inside the handlers.");
+    for (auto &e : stages) w.summary("stage_duration_seconds", PromWriter::label("stage", e.first), *e.second);
+
+    if (cache) {
+        w.metric("cache_entries", "gauge", "Entries in the cache.", (uint64_t)cache->size());
+        w.metric("cache_capacity", "gauge", "Cache capacity, in entries or bytes (see cache_capacity_in_bytes).",
+                 (uint64_t)cache->capacity());
+        w.metric("cache_capacity_in_bytes", "gauge", "1 if the cache capacity is a byte budget.",
+                 (uint64_t)(cache->mode() == CapacityMode::BYTES));
+        w.metric("cache_bytes", "gauge", "Bytes charged to cached entries.", cache->bytes());
+        w.metric("cache_peak_bytes", "gauge", "Sum of the shards' peak byte usage.", cache->peak_bytes());
+        w.metric("cache_evictions_total", "counter", "Entries evicted for space.", cache->evictions());
+        w.metric("cache_expirations_total", "counter", "Entries removed once their TTL passed.", cache->expirations());
+        w.family("cache_shard_entries", "gauge", "Entries per cache shard.");
+        for (size_t i = 0; i < cache->shard_count(); i++)
+            w.sample("cache_shard_entries", PromWriter::label("shard", std::to_string(i)), (uint64_t)cache->shard(i).size());
+        w.family("cache_shard_hits_total", "counter", "Cache hits per shard.");
+        for (size_t i = 0; i < cache->shard_count(); i++)
+            w.sample("cache_shard_hits_total", PromWriter::label("shard", std::to_string(i)), cache->shard(i).hits());
+        w.family("cache_shard_misses_total", "counter", "Cache misses per shard.");
+        for (size_t i = 0; i < cache->shard_count(); i++)
+            w.sample("cache_shard_misses_total", PromWriter::label("shard", std::to_string(i)), cache->shard(i).misses());
+    }
+
+    if (db) {
+        w.metric("db_pool_size", "gauge", "Postgres connections in the pool.", (uint64_t)db->pool_size());
+        w.metric("db_pool_in_use", "gauge", "Pooled connections checked out.", db->stats_pool_in_use());
+        w.metric("db_pool_checkouts_total", "counter", "Pool checkouts.", db->stats_pool_checkouts());
+        w.metric("db_pool_checkout_timeouts_total", "counter", "Checkouts that timed out.", db->stats_pool_timeouts());
+        w.metric("db_pool_max_wait_seconds", "gauge", "Longest wait for a pooled connection.", db->stats_pool_max_wait_ms() / 1e3);
+        if (const PGPipeline *pl = db->pipeline()) {
+            w.metric("db_pipeline_connections", "gauge", "Pipelined Postgres connections.", (uint64_t)pl->connections());
+            w.metric("db_pipeline_in_flight", "gauge", "Statements in flight on the pipeline.", (uint64_t)pl->in_flight());
+            w.metric("db_pipeline_submitted_total", "counter", "Statements submitted to the pipeline.", (uint64_t)pl->submitted());
+            w.metric("db_pipeline_failed_total", "counter", "Pipelined statements that failed.", (uint64_t)pl->failed());
+            w.metric("db_pipeline_reconnects_total", "counter", "Pipeline reconnections.", (uint64_t)pl->reconnects());
+        }
+        w.metric("db_get_queries_total", "counter", "Read queries.", db->stats_get_queries());
+        w.metric("db_put_queries_total", "counter", "Write queries.", db->stats_put_queries());
+        w.metric("db_prepares_total", "counter", "Statements prepared on a connection.", db->stats_prepares());
+        w.family("db_statement_duration_seconds", "summary", "Latency per prepared statement.");
+        for (int i = 0; i < PGStore::STMT_COUNT; i++) {
+            auto k = static_cast<PGStore::Stmt>(i);
+            w.summary("db_statement_duration_seconds", PromWriter::label("statement", PGStore::stmt_name(k)),
+                      db->stats_stmt_latency(k));
+        }
+        w.family("db_statement_errors_total", "counter", "Failed executions per prepared statement.");
+        for (int i = 0; i < PGStore::STMT_COUNT; i++) {
+            auto k = static_cast<PGStore::Stmt>(i);
+            w.sample("db_statement_errors_total", PromWriter::label("statement", PGStore::stmt_name(k)), db->stats_stmt_errors(k));
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lk(g_sections_mtx);
+        for (auto &s : g_sections) prom_flatten(w, prom_name(s.first), s.second());
+    }
+
+    w.metric("log_written_total", "counter", "Log lines written.", AsyncLogger::instance().written());
+    w.metric("log_dropped_total", "counter", "Log lines dropped on a full ring.", AsyncLogger::instance().dropped());
+    w.metric("uptime_seconds", "gauge", "Seconds since the server started.",
+             (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - start_time).count());
+    return w.take();
+}
+
+// The same figures in Prometheus text format, for scrapers
+httplib::Server::Handler prometheus_handler(class PGStore *db, class ShardedCache *cache) {
+    return [db, cache](const httplib::Request & /*req*/, httplib::Response &res) {
+        res.set_content(metrics_prometheus(db, cache), "text/plain; version=0.0.4; charset=utf-8");
         res.status = 200;
-    });
+    };
 }
+
+void register_metrics_endpoint(httplib::Server &svr, class PGStore *db /*=nullptr*/, class ShardedCache *cache /*=nullptr*/) {
+    svr.Get("/metrics", metrics_handler(db, cache));
+    svr.Get("/metrics/prometheus", prometheus_handler(db, cache));
+}
+
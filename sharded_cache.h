@@ -0,0 +1,211 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cache_shard.h"
+#include "clock_cache.h"
+#include "compact_cache.h"
+#include "lru_cache.h"
+
+// Eviction policy used by every shard
+enum class CachePolicy { LRU, CLOCK, COMPACT };
+
+inline const char* cache_policy_name(CachePolicy p) {
+    switch (p) {
+        case CachePolicy::CLOCK: return "clock";
+        case CachePolicy::COMPACT: return "compact";
+        default: return "lru";
+    }
+}
+
+// Parse "lru" / "clock" / "compact"; returns false for anything else
+inline bool parse_cache_policy(const std::string &s, CachePolicy &out) {
+    if (s == "lru") { out = CachePolicy::LRU; return true; }
+    if (s == "clock") { out = CachePolicy::CLOCK; return true; }
+    if (s == "compact") { out = CachePolicy::COMPACT; return true; }
+    return false;
+}
+
+// Lock-striped cache: N independent segments, each with its own lock,
+// selected by key hash. Same get/put/erase/size interface as a CacheShard,
+// so callers need no outer lock. Capacity (entries or bytes) is split evenly
+// across the shards.
+//
+// Entries can expire: put() takes a TTL in milliseconds, or uses the cache's
+// default TTL (set_default_ttl_ms, 0 = entries never expire). expire() is the
+// background sweep step.
+class ShardedCache {
+public:
+    static constexpr int64_t kDefaultTTL = -1;    // put(): use default_ttl_ms()
+
+    explicit ShardedCache(size_t capacity = 1000, size_t shards = 16, CachePolicy policy = CachePolicy::LRU,
+                          CapacityMode mode = CapacityMode::ENTRIES)
+        : capacity_(capacity), policy_(policy), mode_(mode) {
+        // power of two so shard selection is a mask; never more shards than
+        // entries, otherwise small caches would hold less than requested
+        size_t n = 1;
+        while (n * 2 <= shards && (capacity == 0 || n * 2 <= capacity)) n *= 2;
+        mask_ = n - 1;
+        shards_.reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            size_t cap = capacity / n + (i < capacity % n ? 1 : 0);
+            if (policy == CachePolicy::CLOCK) shards_.emplace_back(new ClockCache(cap, mode));
+            else if (policy == CachePolicy::COMPACT) shards_.emplace_back(new CompactLRUCache(cap, mode));
+            else shards_.emplace_back(new LRUCache(cap, mode));
+        }
+    }
+
+    // Non-copyable
+    ShardedCache(const ShardedCache&) = delete;
+    ShardedCache& operator=(const ShardedCache&) = delete;
+
+    bool get(const std::string &key, CacheValue &value) { return shard_for(key).get(key, value); }
+    // ttl_ms: kDefaultTTL, 0 (never expires) or a lifetime in milliseconds
+    void put(const std::string &key, CacheValue value, int64_t ttl_ms = kDefaultTTL) {
+        shard_for(key).put(key, std::move(value), deadline(ttl_ms));
+    }
+    // For fills from a read (warm-up): never replaces an entry a write put there
+    bool put_if_absent(const std::string &key, CacheValue value, int64_t ttl_ms = kDefaultTTL) {
+        return shard_for(key).put_if_absent(key, std::move(value), deadline(ttl_ms));
+    }
+    // copying conveniences
+    bool get(const std::string &key, std::string &value) { return shard_for(key).get(key, value); }
+    void put(const std::string &key, const std::string &value, int64_t ttl_ms = kDefaultTTL) {
+        put(key, make_cache_value(value), ttl_ms);
+    }
+    void erase(const std::string &key) { shard_for(key).erase(key); }
+
+    void clear() {
+        for (auto &s : shards_) s->clear();
+    }
+
+    void set_default_ttl_ms(uint64_t ms) noexcept {
+        default_ttl_ms_ = ms;
+        if (ms) ttl_used_.store(true, std::memory_order_relaxed);
+    }
+    uint64_t default_ttl_ms() const noexcept { return default_ttl_ms_; }
+    // false until some entry has been given a deadline; the sweeper idles
+    bool ttl_used() const noexcept { return ttl_used_.load(std::memory_order_relaxed); }
+
+    // One sweep step: each shard examines `max_scan` entries under its lock,
+    // and again (up to `max_rounds` times) while more than a quarter of them
+    // had expired, so a backlog drains quickly but no lock is held for long.
+    // Returns the number of entries removed.
+    size_t expire(size_t max_scan, int max_rounds = 16) {
+        size_t removed = 0;
+        for (auto &s : shards_) {
+            for (int round = 0; round < max_rounds; round++) {
+                size_t n = s->expire(cache_clock_ms(), max_scan);
+                removed += n;
+                if (n * 4 <= max_scan) break;
+            }
+        }
+        return removed;
+    }
+
+    // Up to `max` entries, hottest first: each shard's hot list, interleaved
+    // by rank so no shard's tail goes before another's head
+    std::vector<std::pair<std::string, CacheValue>> hot_entries(size_t max) const {
+        size_t per = max / shards_.size() + (max % shards_.size() != 0);
+        std::vector<std::vector<std::pair<std::string, CacheValue>>> lists(shards_.size());
+        for (size_t i = 0; i < shards_.size(); i++) shards_[i]->hot_entries(per, lists[i]);
+        std::vector<std::pair<std::string, CacheValue>> out;
+        size_t total = 0;
+        for (auto &l : lists) total += l.size();
+        out.reserve(std::min(max, total));
+        for (size_t rank = 0; rank < per && out.size() < max; rank++) {
+            for (auto &l : lists) {
+                if (rank < l.size() && out.size() < max) out.push_back(std::move(l[rank]));
+            }
+        }
+        return out;
+    }
+
+    std::vector<std::string> hot_keys(size_t max) const {
+        std::vector<std::string> keys;
+        for (auto &e : hot_entries(max)) keys.push_back(std::move(e.first));
+        return keys;
+    }
+
+    // Sum over shards; each shard is locked briefly in turn, so the total is
+    // not an atomic snapshot under concurrent writes
+    size_t size() const {
+        size_t n = 0;
+        for (auto &s : shards_) n += s->size();
+        return n;
+    }
+
+    size_t capacity() const noexcept { return capacity_; }
+    CachePolicy policy() const noexcept { return policy_; }
+    CapacityMode mode() const noexcept { return mode_; }
+
+    uint64_t hits() const noexcept {
+        uint64_t n = 0;
+        for (auto &s : shards_) n += s->hits();
+        return n;
+    }
+    uint64_t misses() const noexcept {
+        uint64_t n = 0;
+        for (auto &s : shards_) n += s->misses();
+        return n;
+    }
+
+    uint64_t bytes() const noexcept {
+        uint64_t n = 0;
+        for (auto &s : shards_) n += s->bytes();
+        return n;
+    }
+    // Sum of per-shard peaks: an upper bound on the true whole-cache peak,
+    // since shards don't peak at the same instant
+    uint64_t peak_bytes() const noexcept {
+        uint64_t n = 0;
+        for (auto &s : shards_) n += s->peak_bytes();
+        return n;
+    }
+    uint64_t evictions() const noexcept {
+        uint64_t n = 0;
+        for (auto &s : shards_) n += s->evictions();
+        return n;
+    }
+    uint64_t expirations() const noexcept {
+        uint64_t n = 0;
+        for (auto &s : shards_) n += s->expirations();
+        return n;
+    }
+
+    // Per-shard access for metrics
+    size_t shard_count() const noexcept { return shards_.size(); }
+    const CacheShard& shard(size_t i) const { return *shards_[i]; }
+
+private:
+    size_t capacity_;
+    CachePolicy policy_;
+    CapacityMode mode_;
+    size_t mask_;
+    std::vector<std::unique_ptr<CacheShard>> shards_;
+    uint64_t default_ttl_ms_ = 0;           // set before serving
+    std::atomic<bool> ttl_used_{false};
+
+    uint64_t deadline(int64_t ttl_ms) {
+        uint64_t ttl = ttl_ms == kDefaultTTL ? default_ttl_ms_ : static_cast<uint64_t>(ttl_ms);
+        if (ttl == 0) return 0;
+        if (!ttl_used_.load(std::memory_order_relaxed)) ttl_used_.store(true, std::memory_order_relaxed);
+        return cache_clock_ms() + ttl;
+    }
+
+    CacheShard& shard_for(const std::string &key) {
+        // std::hash<std::string> leaves low bits weakly mixed for short keys
+        uint64_t h = std::hash<std::string>{}(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return *shards_[h & mask_];
+    }
+};
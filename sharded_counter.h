@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Counters that many threads bump on every request. A single shared atomic
+// bounces its cache line between cores on each increment; here every
+// counter is split into kCounterSlots cache-line-sized slots, a thread
+// always adds to the same slot (assigned round-robin on its first use), and
+// reads sum the slots. With no more threads than slots each slot has a
+// single writer, so an increment stays in that core's cache. Reads are not
+// atomic across slots, which is fine for monotonic counters read at scrape
+// time.
+
+static constexpr size_t kCounterSlots = 32;
+
+inline size_t counter_slot() noexcept {
+    static std::atomic<size_t> next{0};
+    static thread_local size_t slot = next.fetch_add(1, std::memory_order_relaxed) % kCounterSlots;
+    return slot;
+}
+
+// N related counters sharded together: a thread's slot holds all N, so a
+// group such as requests by method and status costs one slot per thread
+// rather than one per counter
+template <size_t N>
+class ShardedCounters {
+public:
+    ShardedCounters() noexcept {
+        for (auto &s : slots_)
+            for (auto &v : s.v) v.store(0, std::memory_order_relaxed);
+    }
+
+    // Non-copyable (atomics)
+    ShardedCounters(const ShardedCounters&) = delete;
+    ShardedCounters& operator=(const ShardedCounters&) = delete;
+
+    void add(size_t i, uint64_t n = 1) noexcept {
+        slots_[counter_slot()].v[i].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t load(size_t i) const noexcept {
+        uint64_t sum = 0;
+        for (auto &s : slots_) sum += s.v[i].load(std::memory_order_relaxed);
+        return sum;
+    }
+
+    static constexpr size_t size() noexcept { return N; }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> v[N];
+    };
+    Slot slots_[kCounterSlots];
+};
+
+class ShardedCounter {
+public:
+    void add(uint64_t n = 1) noexcept { c_.add(0, n); }
+    uint64_t load() const noexcept { return c_.load(0); }
+
+private:
+    ShardedCounters<1> c_;
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "request_trace.h"
+
+// Request coalescing for cache misses. The first caller for a key becomes the
+// leader and runs the fetch; callers that arrive for the same key while it is
+// in flight wait for the leader's result instead of issuing their own query.
+// The value is a shared immutable buffer, so followers don't copy it.
+class SingleFlight {
+public:
+    struct Result {
+        bool found = false;
+        std::shared_ptr<const std::string> value;
+        std::string error;     // non-empty when the fetch failed
+        bool shared = false;   // true for followers that reused a leader's result
+    };
+
+    // fetch(value, error) -> found. Runs at most once per key at a time.
+    using Fetch = std::function<bool(std::shared_ptr<const std::string> &value, std::string &error)>;
+
+    SingleFlight() : leaders_(0), coalesced_(0) {}
+
+    // Non-copyable
+    SingleFlight(const SingleFlight&) = delete;
+    SingleFlight& operator=(const SingleFlight&) = delete;
+
+    Result run(const std::string &key, const Fetch &fetch) {
+        std::shared_ptr<Call> call;
+        bool leader = false;
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            auto it = calls_.find(key);
+            if (it != calls_.end()) {
+                call = it->second;
+            } else {
+                call = std::make_shared<Call>();
+                calls_.emplace(key, call);
+                leader = true;
+            }
+        }
+
+        if (!leader) {
+            coalesced_.fetch_add(1, std::memory_order_relaxed);
+            TraceScope wait(TraceStage::COALESCED_WAIT);
+            std::unique_lock<std::mutex> lk(call->m);
+            call->cv.wait(lk, [&]{ return call->done; });
+            Result r = call->result;
+            r.shared = true;
+            return r;
+        }
+
+        leaders_.fetch_add(1, std::memory_order_relaxed);
+        Result r;
+        try {
+            r.found = fetch(r.value, r.error);
+        } catch (const std::exception &e) {
+            r.found = false;
+            r.error = e.what();
+        }
+
+        // Unpublish before waking followers so later misses start a fresh fetch
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            calls_.erase(key);
+        }
+        {
+            std::lock_guard<std::mutex> lk(call->m);
+            call->result = r;
+            call->done = true;
+        }
+        call->cv.notify_all();
+        return r;
+    }
+
+    // Number of keys currently being fetched
+    size_t in_flight() const {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return calls_.size();
+    }
+
+    // fetches actually executed / callers that waited on someone else's fetch
+    uint64_t leaders() const noexcept { return leaders_.load(std::memory_order_relaxed); }
+    uint64_t coalesced() const noexcept { return coalesced_.load(std::memory_order_relaxed); }
+
+private:
+    struct Call {
+        std::mutex m;
+        std::condition_variable cv;
+        bool done = false;
+        Result result;
+    };
+
+    mutable std::mutex mtx_;
+    std::unordered_map<std::string, std::shared_ptr<Call>> calls_;
+
+    std::atomic<uint64_t> leaders_;
+    std::atomic<uint64_t> coalesced_;
+};
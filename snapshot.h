@@ -0,0 +1,178 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cache_shard.h"
+
+// On-disk cache checkpoint, memory-mapped at startup so a restarted server
+// refills its cache from local disk instead of Postgres.
+//
+// Layout (host byte order; a snapshot is only read back on the machine that
+// wrote it):
+//   header   magic "KVSNAP\0\0", u32 version, u32 reserved, u64 count,
+//            u64 log_bytes, i64 taken_at_us, u64 checksum
+//   log      per entry, hottest first: u32 klen, u32 vlen, key, value
+// taken_at_us is a Postgres clock reading: rows whose updated_at is later
+// have changed since and are dropped on load. checksum is FNV-1a 64 over the
+// log; the header is written last, so a torn write fails the check.
+namespace snapshot {
+
+static constexpr char kMagic[8] = {'K', 'V', 'S', 'N', 'A', 'P', 0, 0};
+static constexpr uint32_t kVersion = 1;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t log_bytes;
+    int64_t taken_at_us;
+    uint64_t checksum;
+};
+static_assert(sizeof(Header) == 48, "snapshot header layout");
+
+inline uint64_t fnv1a(uint64_t h, const void *data, size_t n) {
+    const unsigned char *p = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < n; i++) { h ^= p[i]; h *= 0x100000001b3ULL; }
+    return h;
+}
+static constexpr uint64_t kFnvBasis = 0xcbf29ce484222325ULL;
+
+// Write entries (hottest first) to `path` via a temp file, fsync'd and
+// renamed into place. False with `err` set on I/O failure.
+inline bool write(const std::string &path, const std::vector<std::pair<std::string, CacheValue>> &entries,
+                  int64_t taken_at_us, std::string &err) {
+    const std::string tmp = path + ".tmp";
+    FILE *f = std::fopen(tmp.c_str(), "wb");
+    if (!f) { err = "cannot create " + tmp + ": " + std::strerror(errno); return false; }
+    std::vector<char> buf(1 << 20);
+    std::setvbuf(f, buf.data(), _IOFBF, buf.size());
+
+    Header h;
+    std::memset(&h, 0, sizeof(h));
+    bool ok = std::fwrite(&h, sizeof(h), 1, f) == 1;    // placeholder until the checksum is known
+    uint64_t sum = kFnvBasis, log_bytes = 0;
+    for (size_t i = 0; i < entries.size() && ok; i++) {
+        const std::string &k = entries[i].first;
+        const std::string &v = *entries[i].second;
+        uint32_t lens[2] = {static_cast<uint32_t>(k.size()), static_cast<uint32_t>(v.size())};
+        ok = std::fwrite(lens, sizeof(lens), 1, f) == 1
+             && std::fwrite(k.data(), 1, k.size(), f) == k.size()
+             && std::fwrite(v.data(), 1, v.size(), f) == v.size();
+        sum = fnv1a(sum, lens, sizeof(lens));
+        sum = fnv1a(sum, k.data(), k.size());
+        sum = fnv1a(sum, v.data(), v.size());
+        log_bytes += sizeof(lens) + k.size() + v.size();
+    }
+    std::memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.version = kVersion;
+    h.count = entries.size();
+    h.log_bytes = log_bytes;
+    h.taken_at_us = taken_at_us;
+    h.checksum = sum;
+    ok = ok && std::fflush(f) == 0
+         && std::fseek(f, 0, SEEK_SET) == 0 && std::fwrite(&h, sizeof(h), 1, f) == 1
+         && std::fflush(f) == 0 && ::fsync(fileno(f)) == 0;
+    if (!ok) err = "write " + tmp + ": " + std::strerror(errno);
+    if (std::fclose(f) != 0 && ok) { err = "close " + tmp + ": " + std::strerror(errno); ok = false; }
+    if (ok && std::rename(tmp.c_str(), path.c_str()) != 0) { err = "rename " + tmp + ": " + std::strerror(errno); ok = false; }
+    if (!ok) std::remove(tmp.c_str());
+    return ok;
+}
+
+// A verified, read-only mapping of a snapshot file
+class Reader {
+public:
+    struct Record {
+        const char *key;
+        uint32_t klen;
+        const char *value;
+        uint32_t vlen;
+    };
+
+    Reader() = default;
+    ~Reader() { close(); }
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    // Map and verify `path`. False with `err` set when it is missing, from
+    // another format version, truncated or fails its checksum.
+    bool open(const std::string &path, std::string &err) {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) { err = "cannot open " + path + ": " + std::strerror(errno); return false; }
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+            ::close(fd);
+            err = path + ": too short for a snapshot";
+            return false;
+        }
+        size_ = static_cast<size_t>(st.st_size);
+        void *m = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (m == MAP_FAILED) { size_ = 0; err = "mmap " + path + ": " + std::strerror(errno); return false; }
+        base_ = static_cast<const char*>(m);
+        ::madvise(m, size_, MADV_SEQUENTIAL);
+
+        Header h;
+        std::memcpy(&h, base_, sizeof(h));
+        if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0) return fail(path + ": not a cache snapshot", err);
+        if (h.version != kVersion) return fail(path + ": unsupported snapshot version " + std::to_string(h.version), err);
+        if (h.log_bytes != size_ - sizeof(Header)) return fail(path + ": truncated snapshot", err);
+
+        const char *p = base_ + sizeof(Header), *end = base_ + size_;
+        records_.reserve(std::min<uint64_t>(h.count, h.log_bytes / 8));    // 8 = smallest record
+        for (uint64_t i = 0; i < h.count; i++) {
+            uint32_t lens[2];
+            if (static_cast<size_t>(end - p) < sizeof(lens)) return fail(path + ": truncated snapshot", err);
+            std::memcpy(lens, p, sizeof(lens));
+            p += sizeof(lens);
+            if (static_cast<uint64_t>(end - p) < static_cast<uint64_t>(lens[0]) + lens[1]) return fail(path + ": truncated snapshot", err);
+            records_.push_back(Record{p, lens[0], p + lens[0], lens[1]});
+            p += lens[0] + lens[1];
+        }
+        if (p != end || fnv1a(kFnvBasis, base_ + sizeof(Header), h.log_bytes) != h.checksum) {
+            return fail(path + ": snapshot checksum mismatch", err);
+        }
+        taken_at_us_ = h.taken_at_us;
+        return true;
+    }
+
+    void close() {
+        if (base_) ::munmap(const_cast<char*>(base_), size_);
+        base_ = nullptr;
+        size_ = 0;
+        records_.clear();
+    }
+
+    // hottest first; pointers are valid until close()
+    const std::vector<Record>& records() const noexcept { return records_; }
+    int64_t taken_at_us() const noexcept { return taken_at_us_; }
+
+private:
+    const char *base_ = nullptr;
+    size_t size_ = 0;
+    std::vector<Record> records_;
+    int64_t taken_at_us_ = 0;
+
+    bool fail(const std::string &msg, std::string &err) {
+        err = msg;
+        close();
+        return false;
+    }
+};
+
+} // namespace snapshot
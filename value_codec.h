@@ -0,0 +1,275 @@
+#pragma once
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+
+#include "cache_shard.h"
+#include "httplib.h"
+#include "json.hpp"
+
+// Value encodings of the /kv endpoints, JSON-wrapped or raw bytes, and the
+// compressed form values are stored in. Shared by server.cpp and bench.cpp.
+
+// Raw mode: values travel as the stored bytes (application/octet-stream)
+// instead of inside a JSON document. Chosen with ?raw=1, or by Accept on GET
+// and Content-Type on PUT.
+inline bool raw_flag(const httplib::Request &req) {
+    return req.has_param("raw") && req.get_param_value("raw") != "0";
+}
+inline bool wants_raw(const httplib::Request &req) {
+    return raw_flag(req) || req.get_header_value("Accept").find("application/octet-stream") != std::string::npos;
+}
+inline bool sends_raw(const httplib::Request &req) {
+    return raw_flag(req) || req.get_header_value("Content-Type").rfind("application/octet-stream", 0) == 0;
+}
+
+// Reply with a value's bytes as-is, from byte `skip` on. httplib streams
+// straight from the shared buffer, so the value isn't copied into the
+// response body.
+inline void send_raw(httplib::Response &res, CacheValue buf, size_t skip = 0) {
+    size_t n = buf->size() - skip;
+    res.set_content_provider(n, "application/octet-stream",
+        [buf, n, skip](size_t offset, size_t length, httplib::DataSink &sink) {
+            return sink.write(buf->data() + skip + offset, std::min(length, n - offset));
+        });
+}
+
+// True if Accept-Encoding lists `coding` without q=0
+inline bool accepts_encoding(const httplib::Request &req, const char *coding) {
+    const std::string ae = req.get_header_value("Accept-Encoding");
+    size_t want = std::strlen(coding);
+    for (size_t i = 0; i < ae.size();) {
+        size_t end = std::min(ae.find(',', i), ae.size());
+        size_t b = ae.find_first_not_of(" \t", i);
+        if (b < end) {
+            size_t semi = std::min(ae.find(';', b), end);
+            size_t e = ae.find_last_not_of(" \t", semi - 1) + 1;
+            if (e - b == want && httplib::detail::case_ignore::equal(ae.substr(b, e - b), coding)) {
+                size_t q = ae.find("q=", semi);
+                return q >= end || std::strtod(ae.c_str() + q + 2, nullptr) > 0;
+            }
+        }
+        i = end + 1;
+    }
+    return false;
+}
+
+// Values of min_bytes or more are kept compressed, in the cache and in
+// Postgres alike, as an envelope: kMagic, a method byte, the original length
+// (big-endian uint32), then a zlib stream. Only replies decode it, so
+// write-behind, snapshots, warm-up and the replicas all carry the smaller
+// form. A value that starts with kMagic itself is wrapped as STORED, so it
+// reads back unchanged even with compression off. An envelope that doesn't
+// decode is reported as an error, never served as the value.
+class ValueCompressor {
+public:
+    static constexpr char kMagic[4] = {'\xff', 'K', 'V', 'z'};
+    static constexpr size_t kHeader = 9;
+    static constexpr size_t kStreamChunk = 64 * 1024;
+    // deflate never does better than about 1032:1, so a header claiming more
+    // than this many bytes per compressed byte is corrupt
+    static constexpr uint64_t kMaxRatio = 1032;
+    enum Method : uint8_t { STORED = 0, ZLIB = 1 };
+
+    // min_bytes 0: never compress; envelopes are still read
+    explicit ValueCompressor(size_t min_bytes = 0, int level = Z_BEST_SPEED)
+        : min_bytes_(min_bytes), level_(level) {}
+
+    // Non-copyable
+    ValueCompressor(const ValueCompressor&) = delete;
+    ValueCompressor& operator=(const ValueCompressor&) = delete;
+
+    size_t min_bytes() const noexcept { return min_bytes_; }
+    int level() const noexcept { return level_; }
+
+    static bool encoded(const std::string &v) noexcept {
+        return v.size() >= kHeader && std::memcmp(v.data(), kMagic, 4) == 0 &&
+               (static_cast<uint8_t>(v[4]) == STORED || static_cast<uint8_t>(v[4]) == ZLIB);
+    }
+
+    // Put the stored form of `value` in `out`. False when that is `value`
+    // itself: below min_bytes, or compressing saved less than 1/16.
+    bool encode(const std::string &value, std::string &out) {
+        bool magic = value.size() >= 4 && std::memcmp(value.data(), kMagic, 4) == 0;
+        if (min_bytes_ && value.size() >= min_bytes_ && value.size() <= UINT32_MAX) {
+            int64_t c0 = thread_cpu_ns();
+            uLongf n = compressBound(value.size());
+            out.resize(kHeader + n);
+            int rc = compress2(reinterpret_cast<Bytef*>(&out[kHeader]), &n,
+                               reinterpret_cast<const Bytef*>(value.data()), value.size(), level_);
+            compress_ns_.fetch_add(thread_cpu_ns() - c0, std::memory_order_relaxed);
+            if (rc == Z_OK && n < value.size() - value.size() / 16) {
+                out.resize(kHeader + n);
+                put_header(out, ZLIB, value.size());
+                compressed_.fetch_add(1, std::memory_order_relaxed);
+                bytes_in_.fetch_add(value.size(), std::memory_order_relaxed);
+                bytes_out_.fetch_add(out.size(), std::memory_order_relaxed);
+                return true;
+            }
+            incompressible_.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (!magic) return false;
+        out.resize(kHeader);
+        put_header(out, STORED, value.size());
+        out += value;
+        return true;
+    }
+
+    // The original bytes of stored value `v`: `v` itself unless it is an
+    // envelope, else decoded into `tmp`. nullptr if the envelope is corrupt.
+    const std::string* plain(const std::string &v, std::string &tmp) {
+        if (!encoded(v)) return &v;
+        if (static_cast<uint8_t>(v[4]) == STORED) { tmp.assign(v, kHeader, std::string::npos); return &tmp; }
+        if (!plausible(v)) {
+            decode_errors_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        int64_t c0 = thread_cpu_ns();
+        uLongf n = original_size(v);
+        tmp.resize(n);
+        int rc = uncompress(reinterpret_cast<Bytef*>(&tmp[0]), &n,
+                            reinterpret_cast<const Bytef*>(v.data() + kHeader), v.size() - kHeader);
+        decompress_ns_.fetch_add(thread_cpu_ns() - c0, std::memory_order_relaxed);
+        if (rc != Z_OK || n != tmp.size()) {
+            decode_errors_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        decompressed_.fetch_add(1, std::memory_order_relaxed);
+        return &tmp;
+    }
+
+    // Raw reply for a stored value. A compressed one goes out as is, with
+    // Content-Encoding: deflate, to clients that accept it, and otherwise is
+    // inflated kStreamChunk bytes at a time into a chunked response, so no
+    // buffer of the whole value is built. False (and `res` untouched) if
+    // the envelope is corrupt.
+    bool send(httplib::Response &res, CacheValue v, const httplib::Request &req) {
+        if (!encoded(*v)) { send_raw(res, std::move(v)); return true; }
+        if (static_cast<uint8_t>((*v)[4]) == STORED) { send_raw(res, std::move(v), kHeader); return true; }
+        if (!plausible(*v)) {
+            decode_errors_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (accepts_encoding(req, "deflate")) {
+            sent_deflated_.fetch_add(1, std::memory_order_relaxed);
+            res.set_header("Vary", "Accept-Encoding");
+            res.set_header("Content-Encoding", "deflate");
+            send_raw(res, std::move(v), kHeader);
+            return true;
+        }
+        auto st = std::make_shared<InflateStream>(std::move(v));
+        if (!st->ok) {
+            decode_errors_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        // either way the reply depends on the request's Accept-Encoding
+        res.set_header("Vary", "Accept-Encoding");
+        streamed_.fetch_add(1, std::memory_order_relaxed);
+        res.set_chunked_content_provider("application/octet-stream", [st, this](size_t, httplib::DataSink &sink){
+            int64_t c0 = thread_cpu_ns();
+            st->chunk.resize(kStreamChunk);
+            st->zs.next_out = reinterpret_cast<Bytef*>(&st->chunk[0]);
+            st->zs.avail_out = kStreamChunk;
+            int rc = inflate(&st->zs, Z_NO_FLUSH);
+            decompress_ns_.fetch_add(thread_cpu_ns() - c0, std::memory_order_relaxed);
+            if (rc != Z_OK && rc != Z_STREAM_END) {
+                decode_errors_.fetch_add(1, std::memory_order_relaxed);
+                return false;    // headers are out: drop the connection
+            }
+            size_t got = kStreamChunk - st->zs.avail_out;
+            if (got && !sink.write(st->chunk.data(), got)) return false;
+            if (rc == Z_STREAM_END) {
+                decompressed_.fetch_add(1, std::memory_order_relaxed);
+                sink.done();
+            }
+            return true;
+        });
+        return true;
+    }
+
+    // Statistics. Sizes count the envelope; CPU time is the calling
+    // threads' own (CLOCK_THREAD_CPUTIME_ID).
+    uint64_t compressed() const noexcept { return compressed_.load(std::memory_order_relaxed); }
+    uint64_t incompressible() const noexcept { return incompressible_.load(std::memory_order_relaxed); }
+    uint64_t bytes_in() const noexcept { return bytes_in_.load(std::memory_order_relaxed); }
+    uint64_t bytes_out() const noexcept { return bytes_out_.load(std::memory_order_relaxed); }
+    uint64_t compress_cpu_ns() const noexcept { return compress_ns_.load(std::memory_order_relaxed); }
+    uint64_t decompressed() const noexcept { return decompressed_.load(std::memory_order_relaxed); }
+    uint64_t decompress_cpu_ns() const noexcept { return decompress_ns_.load(std::memory_order_relaxed); }
+    uint64_t streamed() const noexcept { return streamed_.load(std::memory_order_relaxed); }
+    uint64_t sent_deflated() const noexcept { return sent_deflated_.load(std::memory_order_relaxed); }
+    uint64_t decode_errors() const noexcept { return decode_errors_.load(std::memory_order_relaxed); }
+
+private:
+    // A zlib inflater over one shared stored value
+    struct InflateStream {
+        CacheValue buf;
+        z_stream zs{};
+        std::string chunk;
+        bool ok;
+        explicit InflateStream(CacheValue v) : buf(std::move(v)) {
+            zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(buf->data() + kHeader));
+            zs.avail_in = static_cast<uInt>(buf->size() - kHeader);
+            ok = inflateInit(&zs) == Z_OK;
+        }
+        ~InflateStream() { if (ok) inflateEnd(&zs); }
+        InflateStream(const InflateStream&) = delete;
+        InflateStream& operator=(const InflateStream&) = delete;
+    };
+
+    size_t min_bytes_;
+    int level_;
+    std::atomic<uint64_t> compressed_{0};
+    std::atomic<uint64_t> incompressible_{0};
+    std::atomic<uint64_t> bytes_in_{0};
+    std::atomic<uint64_t> bytes_out_{0};
+    std::atomic<uint64_t> compress_ns_{0};
+    std::atomic<uint64_t> decompressed_{0};
+    std::atomic<uint64_t> decompress_ns_{0};
+    std::atomic<uint64_t> streamed_{0};
+    std::atomic<uint64_t> sent_deflated_{0};
+    std::atomic<uint64_t> decode_errors_{0};
+
+    static void put_header(std::string &out, Method m, size_t n) {
+        std::memcpy(&out[0], kMagic, 4);
+        out[4] = static_cast<char>(m);
+        for (int i = 0; i < 4; i++) out[5 + i] = static_cast<char>(static_cast<uint32_t>(n) >> (24 - 8 * i));
+    }
+    static uint32_t original_size(const std::string &v) {
+        uint32_t n = 0;
+        for (int i = 0; i < 4; i++) n = (n << 8) | static_cast<uint8_t>(v[5 + i]);
+        return n;
+    }
+    // A ZLIB envelope's length could have come from its payload
+    static bool plausible(const std::string &v) {
+        return original_size(v) <= (v.size() - kHeader) * kMaxRatio;
+    }
+    static int64_t thread_cpu_ns() {
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+};
+
+// Pull the string out of a {"value": "..."} body, and its "ttl" field if
+// any. False (body stored as sent) for anything else; only bodies that look
+// like an object are parsed.
+inline bool unwrap_json_value(const std::string &body, std::string &out, nlohmann::json &ttl) {
+    size_t i = body.find_first_not_of(" \t\r\n");
+    if (i == std::string::npos || body[i] != '{') return false;
+    nlohmann::json parsed = nlohmann::json::parse(body, nullptr, false);
+    if (parsed.is_discarded() || !parsed.is_object()) return false;
+    auto it = parsed.find("value");
+    if (it == parsed.end() || !it->is_string()) return false;
+    out = std::move(it->get_ref<std::string&>());
+    if (parsed.contains("ttl")) ttl = parsed["ttl"];
+    return true;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "httplib.h"
+#include "histogram.h"
+
+// Counters shared between a WorkerPool and the metrics endpoint. httplib
+// creates and destroys the task queue inside listen(), so the stats live
+// outside it.
+struct WorkerPoolStats {
+    std::atomic<uint64_t> queue_depth{0};
+    std::atomic<uint64_t> max_queue_depth{0};
+    std::atomic<uint64_t> busy{0};
+    std::atomic<uint64_t> accepted{0};   // connections handed to a worker
+    std::atomic<uint64_t> shed{0};       // connections answered with 503
+    std::atomic<uint64_t> dropped{0};    // connections closed without a reply
+    LatencyHistogram queue_wait;         // accept -> worker pickup
+};
+
+// httplib task queue with a bounded backlog. httplib enqueues one task per
+// accepted connection and the worker keeps it for the connection's
+// keep-alive life. Once max_queued connections are waiting, new ones go to a
+// single shedder thread that answers their request with 503 (see shedding())
+// instead of letting the backlog and latency grow. If the shedder falls
+// behind too, the connection is closed.
+class WorkerPool final : public httplib::TaskQueue {
+public:
+    static constexpr size_t kMaxShedQueue = 1024;
+
+    WorkerPool(size_t threads, size_t max_queued, WorkerPoolStats &stats)
+        : max_queued_(max_queued), stats_(stats), shutdown_(false) {
+        for (size_t i = 0; i < threads; i++) workers_.emplace_back([this]{ work(); });
+        shedder_ = std::thread([this]{ shed(); });
+    }
+
+    ~WorkerPool() override = default;
+
+    // Non-copyable
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    bool enqueue(std::function<void()> fn) override {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            if (max_queued_ == 0 || jobs_.size() < max_queued_) {
+                jobs_.emplace_back(std::move(fn), std::chrono::steady_clock::now());
+                uint64_t d = jobs_.size();
+                stats_.queue_depth.store(d, std::memory_order_relaxed);
+                if (d > stats_.max_queue_depth.load(std::memory_order_relaxed)) {
+                    stats_.max_queue_depth.store(d, std::memory_order_relaxed);
+                }
+                cv_.notify_one();
+                return true;
+            }
+            if (shed_jobs_.size() < kMaxShedQueue) {
+                shed_jobs_.push_back(std::move(fn));
+                stats_.shed.fetch_add(1, std::memory_order_relaxed);
+                shed_cv_.notify_one();
+                return true;
+            }
+        }
+        // httplib closes the socket
+        stats_.dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void shutdown() override {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            shutdown_ = true;
+        }
+        cv_.notify_all();
+        shed_cv_.notify_all();
+        for (auto &t : workers_) t.join();
+        shedder_.join();
+    }
+
+    // True on the shedder thread: a pre-routing handler should answer 503
+    static bool shedding() noexcept { return shedding_flag(); }
+
+private:
+    size_t max_queued_;
+    WorkerPoolStats &stats_;
+
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::condition_variable shed_cv_;
+    std::deque<std::pair<std::function<void()>, std::chrono::steady_clock::time_point>> jobs_;
+    std::deque<std::function<void()>> shed_jobs_;
+    bool shutdown_;
+    std::vector<std::thread> workers_;
+    std::thread shedder_;
+
+    static bool& shedding_flag() noexcept {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    void work() {
+        for (;;) {
+            std::function<void()> fn;
+            {
+                std::unique_lock<std::mutex> lk(mtx_);
+                cv_.wait(lk, [this]{ return !jobs_.empty() || shutdown_; });
+                if (jobs_.empty()) return;
+                fn = std::move(jobs_.front().first);
+                stats_.queue_wait.record_since(jobs_.front().second);
+                jobs_.pop_front();
+                stats_.queue_depth.store(jobs_.size(), std::memory_order_relaxed);
+            }
+            stats_.accepted.fetch_add(1, std::memory_order_relaxed);
+            stats_.busy.fetch_add(1, std::memory_order_relaxed);
+            fn();
+            stats_.busy.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    void shed() {
+        shedding_flag() = true;
+        for (;;) {
+            std::function<void()> fn;
+            {
+                std::unique_lock<std::mutex> lk(mtx_);
+                shed_cv_.wait(lk, [this]{ return !shed_jobs_.empty() || shutdown_; });
+                if (shed_jobs_.empty()) return;
+                fn = std::move(shed_jobs_.front());
+                shed_jobs_.pop_front();
+            }
+            fn();
+        }
+    }
+};
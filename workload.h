@@ -0,0 +1,320 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+// Request streams for loadgen. A WorkloadSpec says what to send (operation
+// mix, which keys, how big the values are); each client thread turns it into
+// requests with its own OpGen. The named workloads are presets that the
+// --options refine, and "trace" replays a recorded request log.
+
+// One request
+struct Op{
+    const char* method;
+    std::string path;
+    std::string body;
+    int keys;        // keys moved if it succeeds
+};
+
+enum class KeyDist { SEQUENTIAL, UNIFORM, ZIPF, HOTSPOT, FRESH };
+
+// Value length in bytes: fixed, uniform in [a, b], or lognormal with median
+// a and shape sigma, capped at max
+struct ValueSizeDist{
+    enum Kind { FIXED, UNIFORM, LOGNORMAL } kind=FIXED;
+    double a=0, b=0;     // FIXED: 0 keeps the historical "v<seq>" values
+    size_t max=1<<20;
+};
+
+struct TraceOp{
+    std::string method;  // GET, PUT or DELETE
+    std::string key;
+    std::string value;   // PUT: the value, if the trace recorded it
+    size_t size=0;       // PUT without value: pad to this many bytes
+};
+
+struct WorkloadSpec{
+    std::string name;
+    double read=0.65, write=0.30, del=0.05;    // normalized by OpGen
+    KeyDist dist=KeyDist::SEQUENTIAL;
+    uint64_t keyspace=100000;
+    std::string key_prefix="k";
+    double zipf_theta=0.99;
+    double hot_keys=0.2, hot_ops=0.8;          // HOTSPOT: hot_keys of the keyspace get hot_ops of requests
+    ValueSizeDist value;
+    int batch_size=0;                          // >0: /kv/_batch requests of this many keys
+    std::shared_ptr<const std::vector<TraceOp>> trace;
+};
+
+inline const char* key_dist_name(KeyDist d){
+    switch(d){
+        case KeyDist::UNIFORM: return "uniform";
+        case KeyDist::ZIPF: return "zipf";
+        case KeyDist::HOTSPOT: return "hotspot";
+        case KeyDist::FRESH: return "fresh";
+        default: return "sequential";
+    }
+}
+
+inline bool parse_key_dist(const std::string& s, KeyDist& out){
+    if(s=="sequential") out=KeyDist::SEQUENTIAL;
+    else if(s=="uniform") out=KeyDist::UNIFORM;
+    else if(s=="zipf") out=KeyDist::ZIPF;
+    else if(s=="hotspot") out=KeyDist::HOTSPOT;
+    else if(s=="fresh") out=KeyDist::FRESH;
+    else return false;
+    return true;
+}
+
+// Fill `spec` with a named preset; false for an unknown name
+//   get_all      GET of keys never written (g<seq>), so every lookup misses
+//   put_all      PUT and DELETE, half each, over each thread's own keys
+//   get_popular  GET of 100 popular-<n> keys, uniformly
+//   mix          65% GET, 30% PUT, 5% DELETE over each thread's own keys
+//   batch        /kv/_batch: 70% multi-get, 25% multi-put, 5% multi-delete
+//   zipf         90% GET, 10% PUT over a shared keyspace, Zipfian (theta 0.99)
+//   trace        replay of --trace=PATH
+inline bool workload_preset(const std::string& name, WorkloadSpec& spec){
+    spec=WorkloadSpec{};
+    spec.name=name;
+    if(name=="get_all"){ spec.read=1; spec.write=spec.del=0; spec.dist=KeyDist::FRESH; }
+    else if(name=="put_all"){ spec.read=0; spec.write=spec.del=0.5; }
+    else if(name=="get_popular"){ spec.read=1; spec.write=spec.del=0; spec.dist=KeyDist::UNIFORM; spec.keyspace=100; spec.key_prefix="popular-"; }
+    else if(name=="mix"){}
+    else if(name=="batch"){ spec.read=0.70; spec.write=0.25; spec.del=0.05; spec.batch_size=16; }
+    else if(name=="zipf"){ spec.read=0.9; spec.write=0.1; spec.del=0; spec.dist=KeyDist::ZIPF; }
+    else if(name=="trace"){}
+    else return false;
+    return true;
+}
+
+// "R:W:D" weights, e.g. 90:10:0
+inline bool parse_ratios(const std::string& s, WorkloadSpec& spec){
+    double r, w, d;
+    char c1, c2;
+    std::istringstream in(s);
+    if(!(in>>r>>c1>>w>>c2>>d) || c1!=':' || c2!=':' || r<0 || w<0 || d<0 || r+w+d<=0) return false;
+    spec.read=r; spec.write=w; spec.del=d;
+    return true;
+}
+
+// "N", "fixed:N", "uniform:MIN:MAX" or "lognormal:MEDIAN:SIGMA"
+inline bool parse_value_size(const std::string& s, ValueSizeDist& v){
+    std::vector<std::string> parts;
+    size_t p=0;
+    for(;;){
+        size_t c=s.find(':',p);
+        parts.push_back(s.substr(p,c==std::string::npos?std::string::npos:c-p));
+        if(c==std::string::npos) break;
+        p=c+1;
+    }
+    try{
+        if(parts.size()==1){ v.kind=ValueSizeDist::FIXED; v.a=std::stod(parts[0]); }
+        else if(parts[0]=="fixed" && parts.size()==2){ v.kind=ValueSizeDist::FIXED; v.a=std::stod(parts[1]); }
+        else if(parts[0]=="uniform" && parts.size()==3){ v.kind=ValueSizeDist::UNIFORM; v.a=std::stod(parts[1]); v.b=std::stod(parts[2]); }
+        else if(parts[0]=="lognormal" && parts.size()==3){ v.kind=ValueSizeDist::LOGNORMAL; v.a=std::stod(parts[1]); v.b=std::stod(parts[2]); }
+        else return false;
+    } catch(const std::exception&){ return false; }
+    if(v.a<0 || v.b<0 || (v.kind==ValueSizeDist::UNIFORM && v.b<v.a) || (v.kind==ValueSizeDist::LOGNORMAL && (v.a<=0 || v.b<=0))) return false;
+    return true;
+}
+
+// JSON lines, one request each:
+//   {"op": "GET", "key": "user:42"}
+//   {"op": "PUT", "key": "user:42", "value": "..."}    or    "size": 512
+//   {"op": "DELETE", "key": "user:42"}
+// "method" is accepted for "op". Unusable lines are skipped and counted.
+inline bool load_trace(const std::string& path, std::vector<TraceOp>& out, size_t& skipped){
+    std::ifstream in(path);
+    if(!in) return false;
+    std::string line;
+    skipped=0;
+    while(std::getline(in,line)){
+        if(line.find_first_not_of(" \t\r")==std::string::npos) continue;
+        nlohmann::json j=nlohmann::json::parse(line,nullptr,false);
+        if(j.is_discarded() || !j.is_object()){ skipped++; continue; }
+        TraceOp t;
+        auto op=j.find("op");
+        if(op==j.end()) op=j.find("method");
+        auto key=j.find("key");
+        if(op==j.end() || !op->is_string() || key==j.end() || !key->is_string()){ skipped++; continue; }
+        t.method=op->get<std::string>();
+        std::transform(t.method.begin(),t.method.end(),t.method.begin(),[](unsigned char c){ return std::toupper(c); });
+        if(t.method!="GET" && t.method!="PUT" && t.method!="DELETE"){ skipped++; continue; }
+        t.key=key->get<std::string>();
+        if(t.key.empty()){ skipped++; continue; }
+        if(j.contains("value") && j["value"].is_string()) t.value=j["value"].get<std::string>();
+        else if(j.contains("size") && j["size"].is_number_unsigned()) t.size=j["size"].get<size_t>();
+        out.push_back(std::move(t));
+    }
+    return true;
+}
+
+// Zipfian ranks over [0, n) after Gray et al. ("Quickly generating
+// billion-record synthetic databases"), as in YCSB: zeta(n) is summed once,
+// then each draw is O(1). Ranks are scrambled by a hash so the hot keys are
+// spread over the keyspace (and the server's cache shards) rather than being
+// k0, k1, ...
+class ZipfGenerator{
+public:
+    ZipfGenerator(uint64_t n, double theta): n_(std::max<uint64_t>(n,1)), theta_(theta) {
+        zetan_=zeta(n_,theta_);
+        double zeta2=zeta(2,theta_);
+        alpha_=1.0/(1.0-theta_);
+        eta_=(1-std::pow(2.0/n_,1-theta_))/(1-zeta2/zetan_);
+    }
+
+    template <class Rng>
+    uint64_t next(Rng& rng) const {
+        double u=std::uniform_real_distribution<double>(0.0,1.0)(rng);
+        double uz=u*zetan_;
+        uint64_t rank;
+        if(uz<1.0) rank=0;
+        else if(uz<1.0+std::pow(0.5,theta_)) rank=1;
+        else rank=(uint64_t)((double)n_*std::pow(eta_*u-eta_+1,alpha_));
+        if(rank>=n_) rank=n_-1;
+        return scramble(rank)%n_;
+    }
+
+private:
+    uint64_t n_;
+    double theta_, zetan_, alpha_, eta_;
+
+    static double zeta(uint64_t n, double theta){
+        double s=0;
+        for(uint64_t i=1;i<=n;i++) s+=1.0/std::pow((double)i,theta);
+        return s;
+    }
+    static uint64_t scramble(uint64_t v){
+        // FNV-1a over the rank's bytes
+        uint64_t h=0xcbf29ce484222325ULL;
+        for(int i=0;i<8;i++){ h^=(v>>(i*8))&0xff; h*=0x100000001b3ULL; }
+        return h;
+    }
+};
+
+// Per-thread request stream of one WorkloadSpec
+class OpGen{
+public:
+    // zeta(n) is shared by every thread's generator: it costs O(keyspace)
+    OpGen(const WorkloadSpec& spec, int tid, int nthreads, std::shared_ptr<const ZipfGenerator> zipf)
+        : s_(spec), tid_(tid), nthreads_(std::max(1,nthreads)), zipf_(std::move(zipf)), rng_(tid*1000003ULL+999),
+          trace_pos_(tid) {
+        double sum=s_.read+s_.write+s_.del;
+        read_=s_.read/sum; write_=s_.write/sum;
+    }
+
+    Op next(){
+        if(s_.trace) return next_trace();
+        double r=ud_(rng_);
+        int kind=r<read_ ? 0 : (r<read_+write_ ? 1 : 2);    // read, write, delete
+        if(s_.batch_size>0) return next_batch(kind);
+        std::string key=next_key();
+        if(kind==0) return {"GET","/kv/"+key,"",1};
+        if(kind==2) return {"DELETE","/kv/"+key,"",1};
+        return {"PUT","/kv/"+key,value_body(),1};
+    }
+
+private:
+    WorkloadSpec s_;
+    int tid_, nthreads_;
+    std::shared_ptr<const ZipfGenerator> zipf_;
+    std::mt19937_64 rng_;
+    std::uniform_real_distribution<double> ud_{0.0,1.0};
+    double read_, write_;
+    uint64_t seq_=0;
+    uint64_t values_=0;    // values made, so each one differs whatever the key distribution
+    size_t trace_pos_;
+
+    static std::atomic<uint64_t>& fresh_seq(){ static std::atomic<uint64_t> n{0}; return n; }
+
+    std::string next_key(){
+        switch(s_.dist){
+            case KeyDist::FRESH: return "g"+std::to_string(fresh_seq().fetch_add(1));
+            case KeyDist::UNIFORM: return s_.key_prefix+std::to_string(std::uniform_int_distribution<uint64_t>(0,s_.keyspace-1)(rng_));
+            case KeyDist::ZIPF: return s_.key_prefix+std::to_string(zipf_->next(rng_));
+            case KeyDist::HOTSPOT: {
+                uint64_t hot=std::min(s_.keyspace,std::max<uint64_t>(1,(uint64_t)(s_.hot_keys*(double)s_.keyspace)));
+                bool in_hot=ud_(rng_)<s_.hot_ops || hot>=s_.keyspace;
+                uint64_t k=in_hot ? std::uniform_int_distribution<uint64_t>(0,hot-1)(rng_)
+                                  : std::uniform_int_distribution<uint64_t>(hot,s_.keyspace-1)(rng_);
+                return s_.key_prefix+std::to_string(k);
+            }
+            default: {
+                // each thread walks its own keys
+                uint64_t v=((uint64_t)tid_*1000003ULL+seq_++)%s_.keyspace;
+                return "t"+std::to_string(tid_)+"-k"+std::to_string(v);
+            }
+        }
+    }
+
+    size_t value_size(){
+        double n=s_.value.a;
+        if(s_.value.kind==ValueSizeDist::UNIFORM) n=std::uniform_real_distribution<double>(s_.value.a,s_.value.b)(rng_);
+        else if(s_.value.kind==ValueSizeDist::LOGNORMAL) n=std::lognormal_distribution<double>(std::log(s_.value.a),s_.value.b)(rng_);
+        return std::min(s_.value.max,(size_t)std::llround(std::max(0.0,n)));
+    }
+
+    // Payload bytes: printable and JSON-safe, so no escaping is needed
+    std::string value_of(size_t n){
+        uint64_t id=values_++;
+        if(s_.value.kind==ValueSizeDist::FIXED && s_.value.a==0) return "v"+std::to_string(id);
+        std::string v(n,'x');
+        for(size_t i=0;i<n;i+=64) v[i]=(char)('a'+(id+i)%26);
+        return v;
+    }
+
+    std::string value_body(){
+        return "{\"value\":\""+value_of(value_size())+"\"}";
+    }
+
+    Op next_batch(int kind){
+        nlohmann::json j;
+        if(kind==1){
+            nlohmann::json items=nlohmann::json::object();
+            for(int i=0;i<s_.batch_size;i++){ std::string k=next_key(); items[k]=value_of(value_size()); }
+            j["items"]=items;
+        } else {
+            nlohmann::json keys=nlohmann::json::array();
+            for(int i=0;i<s_.batch_size;i++) keys.push_back(next_key());
+            j["keys"]=keys;
+        }
+        return {kind==0?"POST":(kind==1?"PUT":"DELETE"),"/kv/_batch",j.dump(),s_.batch_size};
+    }
+
+    // Recorded keys may hold any byte; the request line needs them escaped
+    static std::string escape_path(const std::string& key){
+        static const char* hex="0123456789ABCDEF";
+        std::string out;
+        for(unsigned char c : key){
+            if(std::isalnum(c) || c=='-' || c=='_' || c=='.' || c=='~' || c==':') out+=(char)c;
+            else { out+='%'; out+=hex[c>>4]; out+=hex[c&15]; }
+        }
+        return out;
+    }
+
+    // Threads take lines tid, tid + nthreads, ... and start over at the end
+    Op next_trace(){
+        const std::vector<TraceOp>& t=*s_.trace;
+        const TraceOp& op=t[trace_pos_%t.size()];
+        trace_pos_+=nthreads_;
+        seq_++;
+        std::string path="/kv/"+escape_path(op.key);
+        if(op.method=="GET") return {"GET",path,"",1};
+        if(op.method=="DELETE") return {"DELETE",path,"",1};
+        nlohmann::json j;
+        j["value"]=op.value.empty() ? value_of(op.size ? op.size : value_size()) : op.value;
+        return {"PUT",path,j.dump(),1};
+    }
+};
@@ -0,0 +1,385 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "logger.h"
+#include "pg_store.h"
+#include "request_trace.h"
+
+// Write-behind (write-back) queue in front of PGStore. PUT/DELETE record the
+// latest operation per key and return; a background flusher drains the queue
+// in transactions of at most max_batch rows once max_delay has passed since
+// the oldest pending write or a full batch is waiting. Repeated writes to the
+// same key coalesce into one row.
+//
+// With a journal path configured every accepted operation is appended to an
+// on-disk log before it is acknowledged. The flusher fsyncs it ahead of each
+// flush, rotates it while a flush is running, and replays whatever is left at
+// start-up, so a crash loses at most the writes since the last fsync.
+class WriteBehindQueue {
+public:
+    struct Options {
+        size_t max_batch = 500;
+        int max_delay_ms = 50;
+        size_t max_pending = 100000;  // distinct keys queued before writers block
+        int enqueue_timeout_ms = 1000;
+        std::string journal_path;     // empty => memory only
+    };
+
+    // What the queue knows about a key that hasn't reached Postgres yet
+    enum class Lookup { NONE, PUT, DEL };
+
+    WriteBehindQueue(PGStore &db, const Options &opt)
+        : db_(db), opt_(opt), journal_fd_(-1), jseq_(0), jwritten_(0), jwriting_(false), stop_(false),
+          enqueued_(0), coalesced_(0), batches_(0), rows_flushed_(0),
+          flush_failures_(0), rejected_(0), max_depth_(0) {}
+
+    ~WriteBehindQueue() { stop(); }
+
+    // Non-copyable
+    WriteBehindQueue(const WriteBehindQueue&) = delete;
+    WriteBehindQueue& operator=(const WriteBehindQueue&) = delete;
+
+    // Replay any journal left by a previous run and start the flusher
+    bool start() {
+        if (!opt_.journal_path.empty()) {
+            // a leftover .flushing file holds older writes than the live one
+            replay(opt_.journal_path + ".flushing");
+            replay(opt_.journal_path);
+            // consolidate both into one fresh journal
+            ::unlink((opt_.journal_path + ".flushing").c_str());
+            journal_fd_ = ::open(opt_.journal_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+            if (journal_fd_ < 0) {
+                LOG_ERROR("WRITE-BEHIND cannot open journal " << opt_.journal_path);
+                return false;
+            }
+            std::unique_lock<std::mutex> lk(mtx_);
+            for (auto &kv : pending_) journal_append(kv.first, kv.second);
+            journal_drain_locked(lk);
+            ::fdatasync(journal_fd_);
+            if (!pending_.empty()) LOG_INFO("WRITE-BEHIND replayed " << pending_.size() << " pending writes from journal");
+        }
+        flusher_ = std::thread([this]{ run(); });
+        return true;
+    }
+
+    // Flush everything still queued and stop the flusher
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            if (stop_) return;
+            stop_ = true;
+        }
+        cv_.notify_all();
+        space_cv_.notify_all();    // writers waiting for room are refused
+        if (flusher_.joinable()) flusher_.join();
+        std::unique_lock<std::mutex> lk(mtx_);
+        journal_drain_locked(lk);
+        if (journal_fd_ >= 0) { ::close(journal_fd_); journal_fd_ = -1; }
+    }
+
+    // Queue an upsert / delete. False if the queue stayed full for
+    // enqueue_timeout_ms (the caller should shed the request).
+    bool put(const std::string &key, const std::string &value) {
+        Write w{&key, Op{false, value}};
+        return enqueue(&w, 1);
+    }
+    bool del(const std::string &key) {
+        Write w{&key, Op{true, std::string()}};
+        return enqueue(&w, 1);
+    }
+    // All of a batch or none of it, with at most one enqueue_timeout_ms wait
+    bool write_batch(const std::vector<std::pair<std::string, std::string>> &puts,
+                     const std::vector<std::string> &dels) {
+        std::vector<Write> ws;
+        ws.reserve(puts.size() + dels.size());
+        for (auto &kv : puts) ws.push_back(Write{&kv.first, Op{false, kv.second}});
+        for (auto &k : dels) ws.push_back(Write{&k, Op{true, std::string()}});
+        return ws.empty() || enqueue(ws.data(), ws.size());
+    }
+
+    // Serve reads for keys whose latest write is still queued or being flushed
+    Lookup lookup(const std::string &key, std::string &value) const {
+        std::lock_guard<std::mutex> lk(mtx_);
+        auto it = pending_.find(key);
+        if (it == pending_.end()) {
+            it = flushing_.find(key);
+            if (it == flushing_.end()) return Lookup::NONE;
+        }
+        if (it->second.del) return Lookup::DEL;
+        value = it->second.value;
+        return Lookup::PUT;
+    }
+
+    // Statistics (for metrics)
+    size_t depth() const {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return pending_.size() + flushing_.size();
+    }
+    uint64_t max_depth() const noexcept { return max_depth_.load(std::memory_order_relaxed); }
+    uint64_t enqueued() const noexcept { return enqueued_.load(std::memory_order_relaxed); }
+    uint64_t coalesced() const noexcept { return coalesced_.load(std::memory_order_relaxed); }
+    uint64_t batches() const noexcept { return batches_.load(std::memory_order_relaxed); }
+    uint64_t rows_flushed() const noexcept { return rows_flushed_.load(std::memory_order_relaxed); }
+    uint64_t flush_failures() const noexcept { return flush_failures_.load(std::memory_order_relaxed); }
+    uint64_t rejected() const noexcept { return rejected_.load(std::memory_order_relaxed); }
+    const Options& options() const noexcept { return opt_; }
+
+private:
+    struct Op {
+        bool del;
+        std::string value;
+    };
+    using OpMap = std::unordered_map<std::string, Op>;
+    struct Write {
+        const std::string *key;
+        Op op;
+    };
+
+    PGStore &db_;
+    Options opt_;
+
+    mutable std::mutex mtx_;
+    std::condition_variable cv_;        // wakes the flusher
+    std::condition_variable space_cv_;  // wakes writers blocked on a full queue
+    OpMap pending_;                     // accepted, not yet picked up
+    OpMap flushing_;                    // picked up by the running flush
+    std::chrono::steady_clock::time_point oldest_;
+    int journal_fd_;
+    // Journal records are appended to jbuf_ under mtx_, in the order their
+    // ops are applied, and written out by one writer at a time without it
+    std::string jbuf_;
+    std::string jout_;                  // the buffer being written
+    uint64_t jseq_;                     // enqueue() calls that journaled
+    uint64_t jwritten_;                 // ... and whose records are written
+    bool jwriting_;
+    std::condition_variable jcv_;       // a journal write finished
+    bool stop_;
+    std::thread flusher_;
+
+    std::atomic<uint64_t> enqueued_;
+    std::atomic<uint64_t> coalesced_;
+    std::atomic<uint64_t> batches_;
+    std::atomic<uint64_t> rows_flushed_;
+    std::atomic<uint64_t> flush_failures_;
+    std::atomic<uint64_t> rejected_;
+    std::atomic<uint64_t> max_depth_;
+
+    bool enqueue(Write *ws, size_t n) {
+        TraceScope traced(TraceStage::WRITE_BEHIND);
+        std::unique_lock<std::mutex> lk(mtx_);
+        // after stop() nothing journals or flushes it: refuse rather than drop
+        if (stop_) {
+            rejected_.fetch_add(n, std::memory_order_relaxed);
+            return false;
+        }
+        // distinct keys this batch would add; recounted after each wake-up,
+        // since the flusher may have taken some of them meanwhile
+        auto fresh = [&]{
+            size_t f = 0;
+            for (size_t i = 0; i < n; i++) f += !pending_.count(*ws[i].key);
+            return f;
+        };
+        size_t need = fresh();
+        if (need && pending_.size() + need > opt_.max_pending) {
+            bool room = need <= opt_.max_pending &&
+                        space_cv_.wait_for(lk, std::chrono::milliseconds(opt_.enqueue_timeout_ms),
+                                           [&]{ return stop_ || pending_.size() + fresh() <= opt_.max_pending; });
+            if (!room || stop_) {
+                rejected_.fetch_add(n, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        for (size_t i = 0; i < n; i++) {
+            const std::string &key = *ws[i].key;
+            journal_append(key, ws[i].op);
+            auto it = pending_.find(key);
+            if (it == pending_.end()) {
+                if (pending_.empty()) oldest_ = std::chrono::steady_clock::now();
+                pending_.emplace(key, std::move(ws[i].op));
+            } else {
+                it->second = std::move(ws[i].op);
+                coalesced_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        enqueued_.fetch_add(n, std::memory_order_relaxed);
+        uint64_t d = pending_.size() + flushing_.size();
+        if (d > max_depth_.load(std::memory_order_relaxed)) max_depth_.store(d, std::memory_order_relaxed);
+        // wake the flusher to arm its delay timer, or to flush a full batch
+        if (pending_.size() <= n || pending_.size() >= opt_.max_batch) cv_.notify_one();
+        if (journal_fd_ >= 0) journal_commit(lk, ++jseq_);
+        return true;
+    }
+
+    void run() {
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lk(mtx_);
+                while (!stop_) {
+                    if (pending_.size() >= opt_.max_batch) break;
+                    if (!pending_.empty()) {
+                        auto due = oldest_ + std::chrono::milliseconds(opt_.max_delay_ms);
+                        if (std::chrono::steady_clock::now() >= due) break;
+                        cv_.wait_until(lk, due);
+                    } else {
+                        cv_.wait(lk);
+                    }
+                }
+                if (pending_.empty()) {
+                    if (stop_) return;
+                    continue;
+                }
+                journal_drain_locked(lk);
+                flushing_.swap(pending_);
+                rotate_journal_locked();
+            }
+            space_cv_.notify_all();
+
+            bool ok = flush(flushing_);
+
+            {
+                std::unique_lock<std::mutex> lk(mtx_);
+                if (!ok) {
+                    // keep newer writes; put the rest back and re-journal them
+                    flush_failures_.fetch_add(1, std::memory_order_relaxed);
+                    if (pending_.empty()) oldest_ = std::chrono::steady_clock::now();
+                    for (auto &kv : flushing_) {
+                        if (pending_.count(kv.first)) continue;
+                        journal_append(kv.first, kv.second);
+                        pending_.emplace(kv.first, std::move(kv.second));
+                    }
+                    // durable again before the .flushing copy goes away
+                    journal_drain_locked(lk);
+                    if (journal_fd_ >= 0) ::fdatasync(journal_fd_);
+                }
+                flushing_.clear();
+                if (journal_fd_ >= 0) ::unlink((opt_.journal_path + ".flushing").c_str());
+                if (!ok && stop_) {
+                    LOG_ERROR("WRITE-BEHIND giving up on " << pending_.size() << " writes at shutdown"
+                              << (journal_fd_ >= 0 ? " (kept in journal)" : ""));
+                    return;
+                }
+            }
+            // back off before retrying so a down database isn't hammered
+            if (!ok) std::this_thread::sleep_for(std::chrono::milliseconds(std::max(opt_.max_delay_ms, 100)));
+        }
+    }
+
+    // Write `ops` in transactions of at most max_batch rows; not under mtx_
+    bool flush(const OpMap &ops) {
+        std::vector<std::pair<std::string, std::string>> puts;
+        std::vector<std::string> dels;
+        auto send = [&]() {
+            if (puts.empty() && dels.empty()) return true;
+            if (!db_.write_batch(puts, dels)) {
+                LOG_WARN("WRITE-BEHIND flush failed rows=" << puts.size() + dels.size() << " err=\"" << db_.last_error() << "\"");
+                return false;
+            }
+            batches_.fetch_add(1, std::memory_order_relaxed);
+            rows_flushed_.fetch_add(puts.size() + dels.size(), std::memory_order_relaxed);
+            LOG_DEBUG("WRITE-BEHIND flushed puts=" << puts.size() << " dels=" << dels.size());
+            puts.clear();
+            dels.clear();
+            return true;
+        };
+        for (auto &kv : ops) {
+            if (kv.second.del) dels.push_back(kv.first);
+            else puts.emplace_back(kv.first, kv.second.value);
+            if (puts.size() + dels.size() >= opt_.max_batch && !send()) return false;
+        }
+        return send();
+    }
+
+    // --- journal ---
+    // record: u8 op (0 put, 1 del) | u32 key_len | u32 value_len | key | value
+
+    // Add a record to jbuf_ (under mtx_); journal_commit() or
+    // journal_drain_locked() writes it
+    void journal_append(const std::string &key, const Op &op) {
+        if (journal_fd_ < 0) return;
+        jbuf_.push_back(op.del ? 1 : 0);
+        uint32_t kl = static_cast<uint32_t>(key.size()), vl = static_cast<uint32_t>(op.value.size());
+        jbuf_.append(reinterpret_cast<const char*>(&kl), 4);
+        jbuf_.append(reinterpret_cast<const char*>(&vl), 4);
+        jbuf_ += key;
+        jbuf_ += op.value;
+    }
+
+    // Return once this writer's records (`seq`) are written. The first one
+    // to find no write running takes everything buffered, its own and that
+    // of writers queued behind it, and writes it with mtx_ released; the
+    // rest wait for that write.
+    void journal_commit(std::unique_lock<std::mutex> &lk, uint64_t seq) {
+        while (jwritten_ < seq) {
+            if (jwriting_) { jcv_.wait(lk); continue; }
+            jout_.clear();
+            jout_.swap(jbuf_);
+            uint64_t upto = jseq_;
+            int fd = journal_fd_;
+            jwriting_ = true;
+            lk.unlock();
+            journal_write(fd, jout_);
+            lk.lock();
+            jwriting_ = false;
+            jwritten_ = upto;
+            jcv_.notify_all();
+        }
+    }
+
+    // Write what is buffered while holding mtx_, after any running write:
+    // before the journal is rotated, synced or closed
+    void journal_drain_locked(std::unique_lock<std::mutex> &lk) {
+        jcv_.wait(lk, [this]{ return !jwriting_; });
+        if (!jbuf_.empty()) journal_write(journal_fd_, jbuf_);
+        jbuf_.clear();
+        jwritten_ = jseq_;
+        jcv_.notify_all();
+    }
+
+    static void journal_write(int fd, const std::string &buf) {
+        if (fd < 0 || buf.empty()) return;
+        if (::write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+            LOG_ERROR("WRITE-BEHIND journal write failed bytes=" << buf.size());
+        }
+    }
+
+    // Make the live journal durable and move it aside for the flush that is
+    // about to start; new writes go to a fresh file
+    void rotate_journal_locked() {
+        if (journal_fd_ < 0) return;
+        ::fdatasync(journal_fd_);
+        ::close(journal_fd_);
+        ::rename(opt_.journal_path.c_str(), (opt_.journal_path + ".flushing").c_str());
+        journal_fd_ = ::open(opt_.journal_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (journal_fd_ < 0) LOG_ERROR("WRITE-BEHIND cannot reopen journal " << opt_.journal_path);
+    }
+
+    void replay(const std::string &path) {
+        FILE *f = std::fopen(path.c_str(), "rb");
+        if (!f) return;
+        for (;;) {
+            unsigned char op;
+            uint32_t kl, vl;
+            if (std::fread(&op, 1, 1, f) != 1 || std::fread(&kl, 4, 1, f) != 1 || std::fread(&vl, 4, 1, f) != 1) break;
+            std::string key(kl, '\0'), value(vl, '\0');
+            // a torn tail record from a crash mid-append is ignored
+            if ((kl && std::fread(&key[0], 1, kl, f) != kl) || (vl && std::fread(&value[0], 1, vl, f) != vl)) break;
+            if (pending_.empty()) oldest_ = std::chrono::steady_clock::now();
+            pending_[key] = Op{op == 1, std::move(value)};
+        }
+        std::fclose(f);
+    }
+};